@@ -0,0 +1,41 @@
+#ifndef ADPCM_CODEC_H
+#define ADPCM_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 音声データのコーデック(バイナリフレームのcodecフィールドと共通)
+enum AudioCodec : uint8_t {
+  AUDIO_CODEC_PCM16 = 0,    // 16bit リニアPCM (リトルエンディアン)
+  AUDIO_CODEC_IMA_ADPCM = 1 // IMA-ADPCM (AdpcmCodecのブロック形式)
+};
+
+// IMA-ADPCM (4bit/サンプル) のブロック単位エンコーダ/デコーダ
+// ブロック形式はWAVのIMA-ADPCMと同じ:
+//   ヘッダ4バイト(先頭サンプル int16, ステップインデックス uint8, 予約 uint8)
+//   + 残りのサンプルを1バイトに2つずつ(下位ニブルが先)
+// 各ブロックは単独でデコードできるため、途中のブロックが欠けても復帰できる
+// Arduinoに依存しないため、ホストでもビルドできる(ベンチマークは実機のみ)
+class AdpcmCodec {
+public:
+  static const size_t BLOCK_HEADER_SIZE = 4;
+  static const size_t RESPONSE_BLOCK_SIZE = 256; // 応答音声のブロックサイズ(505サンプル)
+
+  // エンコーダの状態(ブロックをまたいでステップインデックスを引き継ぐ)
+  struct EncoderState {
+    uint8_t index;
+  };
+
+  // samplesは奇数が望ましい(先頭1サンプル + ニブルの組)
+  // 偶数の場合は最後のニブルが詰め物になり、デコード結果が1サンプル増える
+  static size_t encodedSize(size_t samples);
+  static size_t decodedSamples(size_t bytes);
+
+  static size_t encodeBlock(const int16_t* pcm, size_t samples, uint8_t* out, EncoderState& state);
+  static size_t decodeBlock(const uint8_t* in, size_t bytes, int16_t* pcm);
+
+  // エンコード/デコードの1サンプルあたりのサイクル数を計測してシリアルに出力(実機のみ)
+  static void benchmark();
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef AUDIO_CAPTURE_SERVICE_H
+#define AUDIO_CAPTURE_SERVICE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <driver/i2s.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "SpscQueue.h"
+#include "AudioDsp.h"
+
+// マイクから読み出した1フレーム(AudioCaptureServiceのプールから貸し出す)
+// 複数の利用者で共有するため、受け取った側は内容を書き換えないこと
+struct CaptureFrame {
+  int16_t* samples;
+  size_t length;             // サンプル数
+  uint32_t sequence;         // 取り込み順の通し番号(欠落検出用)
+  std::atomic<uint8_t> refs; // 未解放の利用者数(0ならプールに戻っている)
+};
+
+// フレームの受け取り手(ウェイクワード検出、録音、音量計など)
+// 受け取りは1タスクから行うこと
+class CaptureConsumer {
+  friend class AudioCaptureService;
+
+private:
+  static const size_t QUEUE_DEPTH = 8;
+
+  const char* name;
+  SpscQueue<CaptureFrame*, QUEUE_DEPTH> queue;
+  std::atomic<bool> active;
+  std::atomic<TaskHandle_t> waiter; // receive()で待っているタスク
+  uint32_t droppedFrames;           // キューが満杯で受け取れなかったフレーム数
+
+public:
+  explicit CaptureConsumer(const char* consumerName);
+
+  // 受け取りの開始/停止。キューに残っているフレームは解放する
+  void activate();
+  void deactivate();
+  bool isActive() const;
+
+  // フレームを1つ受け取る。timeoutまでに届かなければnullptr
+  CaptureFrame* receive(TickType_t timeout);
+  void release(CaptureFrame* frame);
+
+  const char* getName() const;
+  uint32_t getDroppedFrames() const;
+
+private:
+  void drain();
+};
+
+// PDMマイクを常時所有し、DMAから読み出したフレームを登録済みの利用者へ配る
+// 利用者の切り替えはactivate()/deactivate()だけで行い、I2Sドライバは再初期化しない
+// (スピーカーとI2S_NUM_0を共有しているため、再生中だけはstop()で解放する)
+class AudioCaptureService {
+private:
+  static const int SAMPLE_RATE = 16000;
+  static const int POOL_SIZE = 16;
+  static const int MAX_CONSUMERS = 4;
+
+  CaptureFrame pool[POOL_SIZE];
+  int16_t* poolMemory;
+  int16_t* scratchFrame; // プールが空いていない場合の読み捨て先
+  size_t frameLength;
+  int nextFrame;
+
+  CaptureConsumer* consumers[MAX_CONSUMERS];
+  int consumerCount;
+
+  volatile bool running;
+  TaskHandle_t captureTaskHandle;
+  uint32_t sequence;
+  uint32_t overrunFrames; // プールに空きがなく読み捨てたフレーム数
+  AudioDsp::DcState dcState;
+
+  // I2S設定
+  i2s_config_t i2sConfig;
+  i2s_pin_config_t pinConfig;
+
+public:
+  AudioCaptureService();
+  ~AudioCaptureService();
+
+  bool init(size_t samplesPerFrame);
+  bool addConsumer(CaptureConsumer* consumer);
+
+  bool start();
+  void stop();
+  bool isRunning() const;
+
+  size_t getFrameLength() const;
+  uint32_t getOverrunFrames() const;
+
+  void captureTask();
+
+private:
+  CaptureFrame* acquireFrame();
+  void distribute(CaptureFrame* frame);
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef AUDIO_DSP_H
+#define AUDIO_DSP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 16bit PCMフレーム用の固定小数点カーネル(飽和演算)
+// Arduinoに依存しないため、ホストでもビルドできる
+class AudioDsp {
+public:
+  // ゲインはQ8(256 = 1.0倍)で表す
+  static constexpr int32_t gainQ8(double gain) {
+    return (int32_t)(gain * 256 + 0.5);
+  }
+
+  static inline int16_t saturate(int32_t value) {
+    return (value > 32767) ? 32767 : (value < -32768) ? -32768 : (int16_t)value;
+  }
+
+  // ゲイン適用。コンパイル時にゲインが決まる場合は2のべき乗ならシフトになる
+  template <int32_t GainQ8>
+  static void applyGain(int16_t* samples, size_t count) {
+    GainKernel<GainQ8, isPowerOfTwo(GainQ8) && GainQ8 >= 256>::apply(samples, count);
+  }
+  static void applyGain(int16_t* samples, size_t count, int32_t gainQ8);
+
+  // 直流成分除去(1次IIRハイパス)。フレームをまたいで状態を引き継ぐ
+  struct DcState {
+    int32_t prevInput;
+    int32_t prevOutput; // 小数部8bit
+  };
+  static void removeDc(int16_t* samples, size_t count, DcState& state);
+
+  static int32_t mean(const int16_t* samples, size_t count);
+  // offsetを引いた後の絶対値平均(offsetに平均を渡せば直流成分を除いた音量になる)
+  static uint32_t meanAbs(const int16_t* samples, size_t count, int32_t offset = 0);
+  static uint32_t rms(const int16_t* samples, size_t count);
+
+  // ピーク値(絶対値)と、フルスケールに張り付いたサンプル数
+  struct PeakInfo {
+    uint16_t peak;
+    uint32_t clipped;
+  };
+  static PeakInfo peak(const int16_t* samples, size_t count);
+
+  // 512サンプル1フレームあたりのサイクル数を計測して表示する(実機のみ)
+  static void benchmark();
+
+private:
+  static constexpr bool isPowerOfTwo(int32_t value) {
+    return value > 0 && (value & (value - 1)) == 0;
+  }
+
+  static constexpr int shiftOf(int32_t gainQ8) {
+    return (gainQ8 <= 256) ? 0 : 1 + shiftOf(gainQ8 >> 1);
+  }
+
+  template <int32_t GainQ8, bool PowerOfTwo>
+  struct GainKernel {
+    static void apply(int16_t* samples, size_t count) {
+      for (size_t i = 0; i < count; i++) {
+        samples[i] = saturate(((int32_t)samples[i] * GainQ8 + 128) >> 8);
+      }
+    }
+  };
+
+  template <int32_t GainQ8>
+  struct GainKernel<GainQ8, true> {
+    static void apply(int16_t* samples, size_t count) {
+      const int32_t factor = (int32_t)1 << shiftOf(GainQ8); // 乗算はシフトに展開される
+      if (factor == 1) return; // 1.0倍
+      for (size_t i = 0; i < count; i++) {
+        samples[i] = saturate((int32_t)samples[i] * factor);
+      }
+    }
+  };
+};
+
+#endif
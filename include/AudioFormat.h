@@ -0,0 +1,32 @@
+#ifndef AUDIO_FORMAT_H
+#define AUDIO_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "AdpcmCodec.h"
+
+// 応答音声の形式(モノラルのみ)
+struct AudioFormat {
+  uint32_t sampleRate;
+  AudioCodec codec;
+};
+
+// 応答の先頭に付くWAVヘッダ(RIFF/WAVE)の解析
+// fmtチャンクから形式を読み、dataチャンクの中身が始まる位置をヘッダの長さとして返す
+// ストリーミング応答ではRIFFとdataのサイズが不定(0や0xFFFFFFFF)のことがあるため、サイズは見ない
+// 対応する形式: 16bit PCM, IMA-ADPCM(ブロックサイズがAdpcmCodec::RESPONSE_BLOCK_SIZEのもの)
+class WavHeader {
+public:
+  enum Result {
+    WAV_NEED_MORE,   // 判定にはもっと先まで必要
+    WAV_OK,
+    WAV_NOT_WAV,     // WAVではない(ヘッダなしの音声)
+    WAV_UNSUPPORTED, // WAVだが再生できない形式
+  };
+
+  static const size_t MAX_HEADER_SIZE = 512; // dataチャンクまでがこれより長いヘッダは扱わない
+
+  static Result parse(const uint8_t* data, size_t length, AudioFormat& format, size_t& headerSize);
+};
+
+#endif
@@ -3,6 +3,22 @@
 
 #include <Arduino.h>
 #include <driver/i2s.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include "AudioRingBuffer.h"
+#include "AdpcmCodec.h"
+#include "AudioFormat.h"
+#include "PolyphaseResampler.h"
+#include "PlaybackEngine.h"
+#include "AudioCaptureService.h"
+#include "BufferPool.h"
+
+// 録音タスクが公開する録音済み位置
+// recordBufferは先頭から連続して書き込まれるため、終端位置だけを通知すれば足りる
+struct RecordedBlock {
+  size_t end;   // recordBuffer先頭からの録音済みバイト数
+  bool last;    // 録音終了(これ以降データは増えない)
+};
 
 class AudioManager {
 private:
@@ -12,36 +28,99 @@ private:
   static const int BUFFER_SIZE = 1024;
   static const int MAX_RECORD_SIZE = SAMPLE_RATE * 10 * 2; // 10秒分のバッファ
   
-  uint8_t* recordBuffer;
+  uint8_t* recordBuffer; // バッファプールから起動時に借りる連続領域
+  size_t recordSegments;
+  BufferPool* bufferPool;
   size_t recordedSize;
   size_t currentRecordPos;
-  bool isRecording;
-  bool isPlayingAudio;
+  volatile bool isRecording;
+  volatile bool isPlayingAudio;
+  
+  // マイク入力(録音中だけ受け取る)
+  AudioCaptureService* capture;
+  CaptureConsumer recorderConsumer;
+  TaskHandle_t recordingTaskHandle;
+  
+  // プリロール(待機中に直近の音声を保持するリング。録音開始時に先頭へ付け足す)
+  volatile bool preRollActive;
+  uint8_t* preRollBuffer;
+  size_t preRollCapacity;
+  size_t preRollPos;    // 次に書き込む位置
+  size_t preRollFilled; // 保持しているバイト数
+  
+  // 終話検出(録音バッファ内の位置で管理する)
+  size_t liveStartPos;       // プリロールを除いた録音の開始位置
+  size_t lastSpeechPos;      // 最後に発話と判定したフレームの終端
+  bool speechHeard;
+  volatile bool utteranceEnded;
+  TaskHandle_t playbackTaskHandle;
+  
+  // 録音済みブロックの通知キュー(長さ1、常に最新の位置で上書き)
+  QueueHandle_t blockQueue;
+  
+  // ストリーミング再生用(ネットワーク受信タスクが書き込む)
+  AudioRingBuffer playbackRing;
+  AudioCodec playbackCodec;
+  PolyphaseResampler resampler; // 応答のレートからPLAYBACK_SAMPLE_RATEへの変換
+  uint32_t underrunCount;       // 受信が間に合わず無音を挿入した回数
+  unsigned long firstAudioTime; // 最初の音声をI2Sに書き込んだ時刻(millis)
+  
+  // スピーカーへの出力(I2S書き込みタスク)
+  PlaybackEngine engine;
+  bool tracePlayback; // 応答の再生(イヤコンやつなぎの言葉はターンの記録に含めない)
   
-  // I2S設定
-  i2s_config_t i2sConfig;
-  i2s_pin_config_t pinConfig;
+  // 口パク用の音量(再生タスクがチャンクごとに、スピーカーから出る予定の時刻と一緒に書く)
+  struct LevelPoint {
+    unsigned long playAt; // millis
+    uint16_t level;       // 平均振幅
+  };
+  static const size_t LEVEL_POINTS = 16;
+  LevelPoint levelPoints[LEVEL_POINTS];
+  volatile uint32_t levelWritten; // 書いた点の数(次に書く位置)
   
 public:
   AudioManager();
   ~AudioManager();
   
-  bool init();
+  bool init(AudioCaptureService& captureService, BufferPool& pool);
+  void startPreRoll();
   void startRecording();
   size_t stopRecording();
   uint8_t* getRecordedData();
   size_t getRecordedSize();
+  bool isUtteranceEnded();
+  QueueHandle_t getBlockQueue();
   
-  void startPlayback(uint8_t* data, size_t size, int sampleRate = 16000);
+  void startPlayback(const SegmentChain* data, const AudioFormat& format);
+  // 形式はリングに書き込まれた応答から読む
+  void startStreamingPlayback();
+  // 手元のクリップ(連続した領域)を再生する。dataは再生が終わるまで保持すること
+  // traced: 応答として再生する(ターンの記録に再生の時刻と統計を残す)
+  void startClipPlayback(const uint8_t* data, size_t size, const AudioFormat& format, bool traced);
   void stopPlayback();
   bool isPlaying();
+  AudioRingBuffer* getPlaybackRing();
+  uint32_t getUnderrunCount();
+  PlaybackStats getPlaybackStats();
+  unsigned long getFirstAudioTime();
+  // 今スピーカーから出ている音の音量(平均振幅。再生していなければ0)
+  uint16_t getOutputLevel();
   
   void recordingTask();
-  void playbackTask(uint8_t* data, size_t size);
+  void playbackTask(const SegmentChain* data, const uint8_t* clip, size_t clipSize);
+  void streamingPlaybackTask();
 
 private:
-  void configureI2SForRecording();
-  void configureI2SForPlayback(int sampleRate = 16000);
+  void publishBlock(bool last);
+  void appendPreRoll(const uint8_t* data, size_t size);
+  void flushPreRoll();
+  void updateEndpoint(const int16_t* samples, size_t count);
+  bool writeToI2S(const uint8_t* data, size_t size);
+  bool playSpan(const uint8_t* data, size_t size);
+  void publishLevel(const int16_t* samples, size_t count);
+  bool startEngine();
+  void finishEngine();
+  bool configureFormat(const AudioFormat& format);
 };
 
 #endif
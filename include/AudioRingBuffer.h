@@ -0,0 +1,51 @@
+#ifndef AUDIO_RING_BUFFER_H
+#define AUDIO_RING_BUFFER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "AudioFormat.h"
+
+// 書き込み側1タスク・読み出し側1タスク専用のリングバッファ
+// ネットワーク受信タスクが書き込み、再生タスクがI2Sへ読み出す
+class AudioRingBuffer {
+private:
+  uint8_t* buffer;
+  size_t capacity;
+  std::atomic<size_t> head; // 書き込み位置(累計バイト数)
+  std::atomic<size_t> tail; // 読み出し位置(累計バイト数)
+  std::atomic<bool> finished; // 書き込み側の終了通知
+  std::atomic<bool> aborted;  // 読み出し側の中断通知
+  AudioFormat format;         // 書き込まれる音声の形式
+
+public:
+  AudioRingBuffer();
+  ~AudioRingBuffer();
+
+  bool init(size_t size);
+  void reset();
+
+  // 空きができるまで待って書き込む。中断された場合は書き込めたバイト数を返す
+  size_t write(const uint8_t* data, size_t size);
+  // 書き込み側が直接書き込める連続した空き領域(待たない)。空きがなければnullptr
+  // 書き込んだらcommit()で確定する(受信データをコピーせずに置くため)
+  uint8_t* writeSpan(size_t& length);
+  void commit(size_t length);
+  // 読み出せるだけ読み出す(待たない)
+  size_t read(uint8_t* dst, size_t size);
+
+  // 書き込み側は最初のデータを書き込む前に形式を設定する
+  // 読み出し側はavailable()が0でなくなるか終了通知を受けてから読む
+  void setFormat(const AudioFormat& audioFormat);
+  AudioFormat getFormat() const;
+
+  size_t available() const;
+  size_t getCapacity() const;
+  const uint8_t* getBuffer() const;
+
+  void finish();
+  bool isFinished() const;
+  void abort();
+  bool isAborted() const;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef AUDIO_UPLOAD_STREAM_H
+#define AUDIO_UPLOAD_STREAM_H
+
+#include <Arduino.h>
+#include <Stream.h>
+#include "AudioManager.h"
+#include "AdpcmCodec.h"
+
+// アップロード形式
+enum UploadFormat {
+  UPLOAD_FORMAT_JSON,   // {"audio":"<base64>"} (application/json)
+  UPLOAD_FORMAT_BINARY  // 長さ付きバイナリフレームの列 (application/octet-stream)
+};
+
+// バイナリ形式のフレームヘッダ(リトルエンディアン、16バイト)
+// ボディは「ヘッダ + ペイロード」の繰り返しで、payloadLength が0のフレームで終わる
+struct __attribute__((packed)) AudioFrameHeader {
+  char magic[4];          // "TBAF"
+  uint32_t payloadLength; // 後続するペイロードのバイト数
+  uint32_t sampleRate;
+  uint8_t channels;
+  uint8_t codec;          // AudioCodec
+  uint16_t sequence;      // フレーム番号(0からの連番)
+};
+
+// 録音データをアップロード用のリクエストボディに変換しながら送出するStream
+// HTTPClient::sendRequest() から固定サイズのブロック単位で読み出されるため、
+// 録音時間に関係なくボディ全体をメモリ上に展開しない
+//
+// パイプラインモードでは録音中のバッファを読み出し元とし、AudioManagerの
+// ブロックキューで通知された位置までを送出する。全体長が不明なため
+// Transfer-Encoding: chunked で送る
+class AudioUploadStream : public Stream {
+private:
+  static const size_t BLOCK_SIZE = 1024;                // 送出ブロックのバイト数(4の倍数)
+  static const size_t RAW_BLOCK_SIZE = BLOCK_SIZE / 4 * 3; // 1ブロック分の元データ(3の倍数)
+  static const size_t CHUNK_HEADER_RESERVE = 8;          // チャンクヘッダ("400\r\n")用の予約領域
+  static const size_t CHUNK_TRAILER_SIZE = 2;            // チャンク終端の"\r\n"
+  static const size_t FRAME_PAYLOAD_SIZE = BLOCK_SIZE - sizeof(AudioFrameHeader); // バイナリ1フレームのペイロード
+  static const size_t FRAME_ADPCM_SAMPLES = (FRAME_PAYLOAD_SIZE - AdpcmCodec::BLOCK_HEADER_SIZE) * 2 + 1; // ADPCM1フレームのサンプル数
+  static const uint32_t SAMPLE_RATE = 16000;
+  static const uint8_t CHANNELS = 1;
+
+  enum Phase {
+    PHASE_PREFIX,
+    PHASE_BODY,
+    PHASE_SUFFIX,
+    PHASE_LAST_CHUNK, // chunked の終端チャンク
+    PHASE_DONE
+  };
+
+  const uint8_t* sourceData;
+  size_t sourceSize;
+  size_t sourcePos;
+  bool sourceFinished;
+  QueueHandle_t sourceQueue; // パイプラインモードのみ
+  bool chunked;
+  UploadFormat format;
+  AudioCodec codec; // バイナリ形式のみ
+  AdpcmCodec::EncoderState adpcmState;
+  uint16_t frameSequence;
+  Phase phase;
+
+  char block[CHUNK_HEADER_RESERVE + BLOCK_SIZE + CHUNK_TRAILER_SIZE];
+  size_t blockLen; // 有効データの終端位置
+  size_t blockPos;
+
+  uint32_t encodeMicros; // エンコードに費やした時間(計測用)
+
+public:
+  AudioUploadStream();
+
+  void begin(const uint8_t* data, size_t size, UploadFormat bodyFormat = UPLOAD_FORMAT_JSON,
+             AudioCodec bodyCodec = AUDIO_CODEC_PCM16);
+  void beginPipelined(const uint8_t* data, QueueHandle_t blockQueue, UploadFormat bodyFormat = UPLOAD_FORMAT_JSON,
+                      AudioCodec bodyCodec = AUDIO_CODEC_PCM16);
+  bool rewind(UploadFormat bodyFormat);
+  bool isUntouched() const; // まだ1バイトも読み出されていない(rewindせずに送り直せる)
+  bool isChunked() const;
+  UploadFormat getFormat() const;
+  const char* contentType() const;
+  size_t contentLength() const; // chunked の場合は0
+  uint32_t getEncodeMicros() const;
+
+  // Stream
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char* buffer, size_t length) override;
+  size_t write(uint8_t) override;
+  void flush() override;
+
+private:
+  bool fillBlock();
+  size_t fillPayload(char* dst);
+  size_t fillJson(char* dst);
+  size_t fillBinary(char* dst);
+  size_t fillFramePayload(char* dst, size_t& consumed);
+  size_t writeFrameHeader(char* dst, uint32_t payloadLength);
+  void pollSource();
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 標準のBase64エンコーダ(パディングあり、改行なし)
+// Arduinoに依存しないため、ホストでもビルドできる
+class Base64 {
+public:
+  // lengthバイトをエンコードしたときの文字数(パディングを含む)
+  static size_t encodedLength(size_t length);
+  // dstにはencodedLength(length)文字分の領域が必要。終端の'\0'は書かない
+  static size_t encode(const uint8_t* src, size_t length, char* dst);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+
+// 起動時にPSRAMから一括で確保し、固定サイズのセグメントに分けて貸し出すプール
+// 録音バッファ(連続したセグメントの並び)と応答バッファ(セグメントのチェーン)が共有する
+// 会話のたびにmalloc/reallocしないため、長時間動かしてもヒープが断片化しない
+class BufferPool {
+private:
+  static const size_t MAX_SEGMENTS = 128;
+
+  uint8_t* arena;
+  size_t segmentSize;
+  size_t segmentCount;
+  bool used[MAX_SEGMENTS];
+  size_t inUse;
+  size_t highWater;    // 同時に貸し出したセグメント数の最大値
+  uint32_t failures;   // 空きがなく貸し出せなかった回数
+  portMUX_TYPE lock;
+
+public:
+  BufferPool();
+  ~BufferPool();
+
+  bool init(size_t bytesPerSegment, size_t segments);
+
+  // 連続したcount個のセグメントを貸し出す。空きがなければnullptr
+  uint8_t* acquire(size_t count = 1);
+  void release(uint8_t* segment, size_t count = 1);
+
+  size_t getSegmentSize() const;
+  size_t getSegmentCount() const;
+  size_t getInUse() const;
+  size_t getHighWater() const;
+  uint32_t getFailures() const;
+  bool contains(const void* ptr) const;
+  void printStats(const char* label) const;
+};
+
+// プールのセグメントをつないだ可変長バッファ
+// 伸長時は末尾にセグメントを足すだけで、既存データのコピーは発生しない
+// 書き込み側1タスクのみ。読み出しは書き込み完了後に行う
+class SegmentChain {
+private:
+  static const size_t MAX_CHAIN = 64;
+
+  BufferPool* pool;
+  uint8_t* segments[MAX_CHAIN];
+  size_t count;
+  size_t size;
+
+public:
+  SegmentChain();
+  ~SegmentChain();
+
+  void setPool(BufferPool* bufferPool);
+
+  // 末尾に追加する。プールが尽きた場合は追加できたバイト数を返す
+  size_t append(const uint8_t* data, size_t length);
+  // 末尾の空き領域(埋まっていればセグメントを足す)。プールが尽きたらnullptr
+  // 直接書き込んでからcommit()で確定する
+  uint8_t* writeSpan(size_t& length);
+  void commit(size_t length);
+  // 合計totalバイト分のセグメントを先に確保する(長さが分かっている応答用)。確保しきれなければfalse
+  bool reserve(size_t total);
+  // セグメントをすべてプールへ返す
+  void clear();
+
+  size_t getSize() const;
+  size_t getSegmentCount() const;
+  const uint8_t* getSegment(size_t index) const;
+  size_t getSegmentLength(size_t index) const; // 最後のセグメントだけ端数になる(reserve()した残りは0)
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef CLIP_CACHE_H
+#define CLIP_CACHE_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <mbedtls/md.h>
+#include "AudioFormat.h"
+
+// 手元から再生する音声(データは読み込んだ側が保持する)
+struct Clip {
+  const uint8_t* data;
+  size_t size;
+  AudioFormat format;
+};
+
+// 手元に置いて即座に再生する短い音声
+// 1. クリップパック: 起動時にSPIFFSのCLIP_PACK_PATHをPSRAMへ読み込み、名前で引く(イヤコン・つなぎの言葉)
+//    形式: "TBCP", version(u16), 個数(u16), 項目(名前16バイト, offset, length, sampleRate(u32), codec(u8), 予約3バイト)...
+//    tools/make_clip_pack.pyで作る
+// 2. 応答キャッシュ: サーバがX-Audio-Cache-Keyを付けた応答の本文を受信しながら取り込み、
+//    キー(本文のSHA-256の先頭8バイトの16進)と一致すればフラッシュに保存する
+//    次のリクエストから保存済みのキーを通知し、サーバがX-Audio-Cache-Hitで返したら手元から再生する
+// フラッシュへの書き込みは待機中にpoll()から少しずつ行う(書き込み中は両コアのキャッシュが止まるため)
+// 取り込み(capture系)は受信タスク、それ以外はメインループから呼ぶ
+class ClipCache {
+public:
+  static const size_t KEY_LENGTH = 16;
+
+private:
+  static const size_t MAX_PACK_CLIPS = 16;
+  static const size_t NAME_LENGTH = 16;
+  static const size_t MAX_ENTRIES = 16; // 保存する応答の数(超えたら最も長く使っていないものから消す)
+
+  struct PackClip {
+    char name[NAME_LENGTH + 1];
+    Clip clip;
+  };
+
+  struct CacheEntry {
+    char key[KEY_LENGTH + 1];
+  };
+
+  // 作業領域の状態(応答の取り込み -> 保存待ち -> 書き込み中、またはキャッシュからの読み込み済み)
+  enum WorkState {
+    WORK_IDLE,
+    WORK_CAPTURING,
+    WORK_PENDING,
+    WORK_WRITING,
+    WORK_LOADED,
+  };
+
+  PackClip packClips[MAX_PACK_CLIPS];
+  size_t packCount;
+  uint8_t* packMemory;
+
+  CacheEntry entries[MAX_ENTRIES]; // 最近使った順
+  size_t entryCount;
+  bool indexDirty; // 使った順が変わったが、まだ保存していない
+
+  uint8_t* work; // 応答の取り込みと、キャッシュからの読み込みで共有する(PSRAM)
+  size_t workSize;
+  volatile WorkState workState;
+  char workKey[KEY_LENGTH + 1];
+  AudioFormat workFormat;
+  size_t workHeaderSize; // 本文先頭のWAVヘッダの長さ
+  bool workOverflow;
+  mbedtls_md_context_t sha;
+  File writeFile;
+  size_t writePos;
+
+  uint32_t hits;
+  uint32_t stored;
+  uint32_t rejected; // 大きすぎる・途中で切れた・キーと中身が一致しない
+
+public:
+  ClipCache();
+  ~ClipCache();
+
+  // SPIFFSを開始してから呼ぶ。パックやキャッシュがなくても動作は続ける
+  bool init();
+
+  // パックのクリップを名前で探す
+  bool find(const char* name, Clip& clip) const;
+
+  // 保存済みのキーをカンマ区切りで返す(リクエストヘッダ用)
+  String advertisedKeys() const;
+  bool contains(const char* key) const;
+  // 保存済みの応答を作業領域へ読み込む。次の取り込みまで有効
+  bool load(const char* key, Clip& clip);
+
+  // 受信タスクから: 応答本文の取り込み
+  void beginCapture(const char* key);
+  void capture(const uint8_t* data, size_t length);
+  void endCapture(bool complete, const AudioFormat& format, size_t headerSize);
+
+  // 待機中にメインループから呼ぶ。保存待ちの応答を少しずつフラッシュへ書き込む
+  void poll();
+  // 会話の開始時に呼ぶ。書きかけの保存を取りやめる
+  void cancelPending();
+
+  void printStats() const;
+
+private:
+  bool loadPack();
+  void loadIndex();
+  void saveIndex() const;
+  void touch(size_t index);
+  void evictUntilFits(size_t bytes);
+  void removeEntry(size_t index);
+  static bool isValidKey(const char* key);
+  static String pathFor(const char* key);
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CONNECTION_MANAGER_H
+#define CONNECTION_MANAGER_H
+
+#include <WiFi.h>
+#include "TlsClient.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// サーバへのTCP接続を1本保持し、リクエスト間で使い回す(HTTP keep-alive)
+// 録音開始時にwarm()で接続を開いておけば、話し終えてからDNS・TCP接続を待たずに済む
+// サーバ側で閉じられていた接続はacquire()で検出して張り直す
+// SERVER_URLがhttpsならTLSで接続する(張り直しはTLSセッションの再開で済ませる)
+class ConnectionManager {
+private:
+  WiFiClient plainClient;
+  TlsClient secureClient;
+  WiFiClient* client; // plainClientかsecureClient
+  bool secure;
+  String host;
+  uint16_t port;
+  SemaphoreHandle_t lock; // 接続を使えるのは同時に1タスク(送信タスクか接続準備タスク)
+  TaskHandle_t warmTaskHandle;
+  uint32_t connectCount;
+  uint32_t reuseCount;
+  uint32_t failureCount;
+  uint32_t lastSetupMicros; // 直近のacquire()で接続の確認・確立にかかった時間
+  bool lastReused;
+
+public:
+  ConnectionManager();
+  ~ConnectionManager();
+
+  // baseUrl(SERVER_URL)から接続先を決める
+  bool init(const char* baseUrl);
+
+  // 接続を借りる(他のタスクが使用中なら空くまで待つ)。接続できなければnullptr
+  // 戻り値に関わらず、使い終わったらrelease()を呼ぶ
+  WiFiClient* acquire();
+  void release();
+  // 保持している接続を閉じる(応答を読み切れなかった接続を使い回さない)
+  // acquire()からrelease()までの間に呼ぶ
+  void drop();
+
+  // 別タスクで接続を開いておく(使用中・準備中なら何もしない)
+  void warm();
+
+  bool wasReused() const;
+  bool isSecure() const;
+  // 直近のacquire()で接続を開いた場合、TLSセッションを再開できたか
+  bool wasTlsResumed() const;
+  uint32_t getSetupMicros() const;
+  void printStats() const;
+
+  void warmTask();
+
+private:
+  bool ensureConnected(bool& reused);
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef DTW_MATCHER_H
+#define DTW_MATCHER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "simplevox.h"
+
+// Thresholded DTW for wake word matching.
+//
+// Computes the same normalized distance as simplevox::calcDTW (Euclidean frame
+// distance, symmetric step pattern, total cost divided by n + m), but only needs
+// to decide "distance < threshold", which allows three shortcuts:
+//   1. an LB_Keogh lower bound over the band, checked before any DTW cell;
+//   2. a Sakoe-Chiba band around the (length-scaled) diagonal;
+//   3. early abandoning once a row's best cost plus the lower bound of the
+//      remaining rows reaches the threshold.
+// Cells are 32-bit integers.
+class DtwMatcher {
+public:
+    static constexpr uint32_t kRejected = UINT32_MAX;
+
+    // Which step decided the last match (for instrumentation)
+    enum class Stage : uint8_t {
+        LowerBound, // rejected by LB_Keogh, no DTW cells evaluated
+        Abandoned,  // rejected part way through the DTW rows
+        Full,       // all rows evaluated; distance is exact within the band
+        Cancelled   // stopped because another matcher already accepted
+    };
+
+    struct Stats {
+        Stage stage;
+        uint32_t cells;      // DTW cells evaluated
+        uint32_t totalCells; // cells an unbanded DTW would evaluate
+        uint32_t bound;      // normalized distance when Full, else the lower bound that
+                             // decided the rejection (kRejected if cancelled)
+    };
+
+    explicit DtwMatcher(int bandPercent = 30);
+
+    // Returns the normalized distance if it is below threshold, kRejected otherwise.
+    // If cancel is given, it is polled once per row and the match gives up when set.
+    uint32_t match(const simplevox::MfccFeature& reference,
+                   const simplevox::MfccFeature& query,
+                   uint32_t threshold,
+                   const std::atomic<bool>* cancel = nullptr);
+
+    const Stats& lastStats() const { return stats; }
+
+private:
+    int bandPercent;
+    Stats stats;
+
+    // Scratch buffers, grown on demand and reused between matches
+    std::vector<uint32_t> prevRow;
+    std::vector<uint32_t> currRow;
+    std::vector<uint32_t> lowerBound;  // per query frame, then suffix sums
+    std::vector<uint16_t> maxQueue;    // monotonic deques for the envelope
+    std::vector<uint16_t> minQueue;
+    std::vector<uint64_t> excess;      // squared distance to the envelope per query frame
+
+    void bandWindow(int row, int rows, int cols, int radius, int& lo, int& hi) const;
+    uint32_t computeLowerBound(const simplevox::MfccFeature& reference,
+                               const simplevox::MfccFeature& query, int radius);
+    static uint32_t frameDistance(const int16_t* a, const int16_t* b, int coefs);
+};
+
+#endif // DTW_MATCHER_H
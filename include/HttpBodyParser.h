@@ -0,0 +1,76 @@
+#ifndef HTTP_BODY_PARSER_H
+#define HTTP_BODY_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HTTP応答ボディの区切りを追う状態機械(chunked / Content-Length / 切断まで)
+// 入力を溜め込まず、本文の位置ではpayloadWanted()が続けて読める本文のバイト数を返すので、
+// 呼び出し側は受信バッファやリングへ直接読み込める。チャンクサイズ行などの区切りは1バイトずつfeed()に渡す
+// ヒープは使わない(Arduinoにも依存しないのでホストでも動く)
+class HttpBodyParser {
+public:
+  enum Error {
+    ERROR_NONE,
+    ERROR_MALFORMED, // チャンクの書式が不正
+    ERROR_TRUNCATED, // 終わる前に接続が閉じた
+    ERROR_TIMEOUT,
+  };
+
+private:
+  enum State {
+    STATE_SIZE,        // チャンクサイズの16進数
+    STATE_EXTENSION,   // ";ext"などサイズの後ろ(読み捨て)
+    STATE_SIZE_LF,
+    STATE_DATA,
+    STATE_DATA_CR,     // チャンク末尾のCRLF
+    STATE_DATA_LF,
+    STATE_TRAILER,     // トレーラ行の先頭(空行なら終わり)
+    STATE_TRAILER_LINE,
+    STATE_FINAL_LF,
+    STATE_DONE,
+    STATE_ERROR,
+  };
+
+  State state;
+  bool chunked;
+  bool untilClose;      // 長さの指定がなく、切断で終わる
+  size_t remaining;     // 現在のチャンク(または本文全体)の残り
+  size_t chunkSize;     // 読み取り中のチャンクサイズ
+  int sizeDigits;
+  size_t payloadBytes;
+  Error error;
+
+public:
+  HttpBodyParser();
+
+  void beginChunked();
+  void beginFixed(size_t length);
+  void beginUntilClose();
+
+  // 続けて読める本文のバイト数。0なら次のバイトは区切りなのでfeed()に渡す
+  size_t payloadWanted() const;
+  // 本文をlengthバイト読んだ(payloadWanted()以下)
+  void payloadRead(size_t length);
+  // 区切りのバイトを1つ処理する。不正な書式ならfalse(以後hasError())
+  bool feed(uint8_t c);
+
+  // 接続が閉じた。切断で終わる本文なら完了、それ以外で途中なら切り詰め
+  void endOfStream();
+  void timedOut();
+
+  bool isDone() const;
+  bool hasError() const;
+  Error getError() const;
+  const char* errorString() const;
+  // 完了していて、接続を次のリクエストに使える
+  bool isReusable() const;
+  size_t getPayloadBytes() const;
+
+private:
+  bool endSizeLine();
+  bool endChunk();
+  void fail(Error reason);
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef MEMORY_MONITOR_H
+#define MEMORY_MONITOR_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "BufferPool.h"
+
+// ヒープ・PSRAM・タスクスタックの使用状況を集めてシリアルへ出力する
+// 出力は1行のJSON("MEM "で始まる)。定期出力のほか、シリアルに"mem"と送ればいつでも出力する
+// 断片化(空き容量に対して最大空きブロックが小さい)でクラッシュする前に気付けるようにする
+class MemoryMonitor {
+public:
+  // バッファプールを登録する(プール内の領域に付けた名前はヒープとは別に集計する)
+  static void init(const BufferPool* pool);
+
+  // タスク自身が開始直後に呼ぶ(名前は生成時のタスク名、stackSizeは生成時のスタックサイズ)
+  static void taskStarted(uint32_t stackSize);
+  // タスク自身が終了(vTaskDelete(NULL))の直前に呼ぶ。スタック余裕の最小値は次回以降も残る
+  static void taskExiting();
+  // 他のタスクからvTaskDeleteする前に呼ぶ
+  static void forgetTask(TaskHandle_t handle);
+
+  // 確保した領域に名前を付ける(同じ名前は上書き)。bytesが0なら名前を外す
+  static void tag(const char* name, const void* ptr, size_t bytes);
+  static void untag(const char* name);
+
+  // loop()から呼ぶ。定期出力・警告とシリアルコマンドの処理
+  static void poll();
+  static void printReport(const char* reason = "request");
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef MFCC_STREAM_H
+#define MFCC_STREAM_H
+
+#include <stdint.h>
+#include <vector>
+#include "simplevox.h"
+
+// Streaming MFCC extractor.
+//
+// Samples are pushed as they arrive from the microphone; every hop (10 ms) a
+// feature frame is computed and appended to a ring that holds the most recent
+// kMaxFrames frames. When VAD closes a segment, its features are already there
+// and extract() only copies them into a simplevox::MfccFeature, so no raw audio
+// has to be kept for the wake word path.
+//
+// Front end: pre-emphasis, Hamming window, 512-point FFT, log mel filterbank,
+// DCT. c0 (frame energy) is dropped so that loudness does not dominate the DTW
+// distance; the remaining coefficients are stored as int16 in kScale units.
+class MfccStream {
+public:
+    static constexpr int kFrameLength = 400; // 25 ms at 16 kHz
+    static constexpr int kHop = 160;         // 10 ms at 16 kHz
+    static constexpr int kFftSize = 512;
+    static constexpr int kMelBands = 26;
+    static constexpr int kCoefs = 12;        // c1..c12
+    static constexpr int kScale = 64;        // int16 units per cepstral unit
+
+    explicit MfccStream(int sampleRate, int maxFrames);
+
+    // Drops buffered samples; the frame counter keeps running
+    void reset();
+
+    // Feeds samples; returns the number of feature frames completed
+    int push(const int16_t* samples, int count);
+
+    // Frames are numbered from 0 since construction. The ring keeps
+    // [produced() - available(), produced()).
+    uint32_t produced() const { return frameCount; }
+    uint32_t available() const { return frameCount < (uint32_t)maxFrames ? frameCount : (uint32_t)maxFrames; }
+
+    // Copies frames [first, last) into a new feature (nullptr if no longer in the ring)
+    simplevox::MfccFeature* extract(uint32_t first, uint32_t last) const;
+
+    // Ring, tables and scratch (for the memory report)
+    size_t memoryBytes() const;
+    const int16_t* ringData() const { return ring.data(); }
+
+private:
+    int maxFrames;
+    uint32_t frameCount;
+
+    std::vector<int16_t> pending; // samples not yet consumed by a full frame
+    int pendingCount;
+    std::vector<int16_t> ring;    // maxFrames * kCoefs
+
+    // Precomputed tables
+    std::vector<float> window;
+    std::vector<float> cosTable;  // FFT twiddles
+    std::vector<float> sinTable;
+    std::vector<uint16_t> bitReverse;
+    std::vector<float> melEdges;  // kMelBands + 2 FFT bin positions
+    std::vector<float> dctTable;  // kCoefs * kMelBands
+
+    // Scratch
+    std::vector<float> re;
+    std::vector<float> im;
+    std::vector<float> mel;
+
+    void computeFrame(const int16_t* frame, int16_t* out);
+    void fft();
+};
+
+#endif // MFCC_STREAM_H
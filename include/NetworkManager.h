@@ -4,20 +4,44 @@
 #include <WiFi.h>
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
+#include "AudioUploadStream.h"
+#include "AudioRingBuffer.h"
+#include "BufferPool.h"
+#include "ConnectionManager.h"
+#include "ClipCache.h"
 
 class NetworkManager {
 private:
   HTTPClient http;
-  uint8_t* responseBuffer;
+  ConnectionManager connection; // リクエスト間で使い回すサーバへの接続
+  SegmentChain responseChain; // 応答全体(バッファプールのセグメントをつないで伸ばす)
+  BufferPool* bufferPool;
   size_t responseSize;
-  size_t responseCapacity;
-  bool responseReady;
+  bool responseTruncated; // プールが尽きて応答の一部を捨てた
+  volatile bool responseReady;
+  volatile bool responseStarted; // ステータス200を受信し、ボディを受信中
   int responseCode;
-  bool hasErrorFlag;
+  AudioCodec responseCodec; // 応答音声のコーデック(X-Audio-Codecヘッダ。WAVヘッダのない応答で使う)
+  AudioFormat responseFormat; // 応答音声の形式(WAVヘッダから。再生できない形式ならsampleRateが0)
+  volatile bool hasErrorFlag;
+  unsigned long requestCompleteTime; // レスポンス受信完了時刻(millis)
+  size_t responseHeaderSize; // 応答本文先頭のWAVヘッダの長さ
   
-  // チャンクデータ処理用
-  String currentChunk;
-  bool isReceivingChunks;
+  // 応答キャッシュ(nullptrなら使わない)
+  ClipCache* clipCache;
+  char cachedResponseKey[ClipCache::KEY_LENGTH + 1]; // サーバが手元のキャッシュを使うよう返したキー(なければ空)
+  
+  // アップロード用ストリーム(ボディをブロック単位で生成する)
+  AudioUploadStream uploadStream;
+  
+  // ストリーミング再生用の書き込み先(nullptrならresponseChainに全体を受信)
+  AudioRingBuffer* responseRing;
+  
+  // 送信タスク
+  TaskHandle_t uploadTaskHandle;
+  String uploadUrl;
+  volatile bool uploadCancelled;
+  bool binaryRejected; // サーバがバイナリ形式を拒否した(以後JSON形式で送る)
   
 public:
   NetworkManager();
@@ -25,19 +49,40 @@ public:
   
   bool connectWiFi(const char* ssid, const char* password);
   bool sendAudioData(uint8_t* audioData, size_t dataSize, const char* endpoint);
+  bool beginStreamingUpload(const uint8_t* recordBuffer, QueueHandle_t blockQueue, const char* endpoint);
+  void cancelStreamingUpload();
+  bool isUploading();
+  void setResponseRing(AudioRingBuffer* ring);
+  void setBufferPool(BufferPool* pool);
+  void setClipCache(ClipCache* cache);
   bool isResponseReady();
-  uint8_t* getResponseData();
+  bool isResponseStarted();
+  const SegmentChain* getResponseData();
   size_t getResponseSize();
+  AudioFormat getResponseFormat();
+  // 応答の代わりに再生するキャッシュのキー(応答を受信していれば空文字列)
+  const char* getCachedResponseKey();
+  unsigned long getRequestCompleteTime();
   void initConversation();
+  void prewarmConnection(); // 録音開始時に呼ぶ。送信時に接続済みの状態にしておく
   bool hasError();
   void clearError();
   
+  void uploadTask();
+  
 private:
-  bool sendPOSTRequest(const String& url, const String& jsonPayload);
-  void processChunkedResponse();
-  String encodeBase64(const uint8_t* data, size_t length);
-  void allocateResponseBuffer(size_t size);
-  void appendToResponseBuffer(const uint8_t* data, size_t size);
+  UploadFormat uploadFormatFor(const char* endpoint);
+  AudioCodec uploadCodecFor(const char* endpoint);
+  bool startUploadTask(const char* endpoint);
+  void resetResponse();
+  bool sendPOSTRequest(const String& url, AudioUploadStream& body);
+  int startRequest(const String& url, AudioUploadStream& body);
+  void finishRequest(bool reusable);
+  // 応答ボディ(chunked / Content-Length)を受信する。最後まで読めて接続を使い回せるならtrue
+  bool processResponseBody();
+  // 応答の先頭から形式を決める。決まったらヘッダの後ろの音声を受信先へ書いてtrue(続きが必要ならfalse)
+  bool detectResponseFormat(const uint8_t* data, size_t length, bool final);
+  void storeResponse(const uint8_t* data, size_t size);
 };
 
 #endif
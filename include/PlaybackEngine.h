@@ -0,0 +1,83 @@
+#ifndef PLAYBACK_ENGINE_H
+#define PLAYBACK_ENGINE_H
+
+#include <Arduino.h>
+#include <driver/i2s.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+// 再生の統計(start()ごとにリセット)
+struct PlaybackStats {
+  uint32_t underruns;      // DMAが空になってから次のブロックを書き込んだ回数(音が途切れた回数)
+  uint32_t maxWriteMicros; // i2s_write 1回の最長時間(DMAの空き待ちと横取りされていた時間を含む)
+  uint32_t blocksWritten;
+  size_t dmaFill;          // DMAに積まれている未再生のサンプル数
+  size_t minDmaFill;       // 再生中のdmaFillの最小値(余裕の目安)
+  size_t dmaCapacity;      // DMAバッファ全体のサンプル数
+  size_t queuedBlocks;     // 書き込みタスクへの受け渡しを待つブロック数
+};
+
+// スピーカー(I2S_NUM_0のTX)への書き込みを専用タスクで行う再生エンジン
+// 生産側(デコード・リサンプル)はwrite()でブロックに詰め、埋まったブロックをキューで書き込みタスクへ渡す
+// 書き込みタスクは生産側より高い優先度でi2s_writeだけを行い、スリープせずにDMAを満たし続ける
+// DMAの消費はI2SドライバのTX_DONEイベントで数え、DMAが空になった回数と残量を統計に出す
+// (スピーカーとマイクはI2S_NUM_0を共有しているため、start()の前に取り込みを止めておくこと)
+class PlaybackEngine {
+private:
+  static const size_t MAX_BLOCKS = 8;
+
+  int16_t* blockMemory;
+  int16_t* blocks[MAX_BLOCKS];
+  size_t blockLength[MAX_BLOCKS];
+  size_t blockSamples; // ブロック1つのサンプル数(DMAバッファと同じ長さ)
+  size_t blockCount;
+
+  QueueHandle_t freeBlocks;  // 空きブロックの番号
+  QueueHandle_t readyBlocks; // 書き込み待ちブロックの番号
+  QueueHandle_t i2sEvents;   // I2SドライバのTX_DONEイベント
+  int fillBlock;             // 生産側が詰めているブロック(-1: なし)
+  size_t fillPos;
+
+  volatile bool running;
+  bool primed;           // 最初のブロックを書き込んだ(それまでの無音はアンダーランに数えない)
+  int skipEvents;        // 数えずに読み飛ばすTX_DONE(書き込む前から再生していた無音のバッファの分)
+  TaskHandle_t writerTaskHandle;
+  PlaybackStats stats;   // 書き込みタスクだけが更新する
+
+  // I2S設定
+  i2s_config_t i2sConfig;
+  i2s_pin_config_t pinConfig;
+
+public:
+  PlaybackEngine();
+  ~PlaybackEngine();
+
+  bool init(uint32_t sampleRate);
+
+  // I2Sドライバを入れて書き込みタスクを起動する
+  bool start();
+  // drain: 渡し済みのデータを再生しきってから止める(falseなら即座に止める)
+  void stop(bool drain);
+  bool isRunning() const;
+
+  // サンプルを書き込む。空きブロックがなければ書き込みタスクが空けるまで待つ
+  // 停止された場合は書き込めた分を返す
+  size_t write(const int16_t* samples, size_t count);
+  // 詰めかけのブロックを書き込みタスクへ渡す
+  void flush();
+  // 渡したがまだスピーカーから出ていないサンプル数(DMA・受け渡し待ち・詰めかけ)。生産側から呼ぶ
+  size_t bufferedSamples() const;
+
+  PlaybackStats getStats() const;
+  void printStats() const;
+
+  void writerTask();
+
+private:
+  bool acquireBlock();
+  void submitBlock();
+  void handleEvents();
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef POLYPHASE_RESAMPLER_H
+#define POLYPHASE_RESAMPLER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 16bit PCMの有理数比サンプリングレート変換(固定小数点のポリフェーズFIR)
+// 出力/入力 = L/M として、L倍に補間するフィルタをL個の位相に分け、出力1サンプルにつき1位相分(TAPS回)だけ積和する
+// 係数はconfigure()で窓関数付きsincから作る(同じ比なら作り直さない)。ブロックをまたいで状態を引き継ぐ
+// Arduinoに依存しないため、ホストでもビルドできる
+class PolyphaseResampler {
+public:
+  static const int TAPS = 16;          // 1位相あたりのタップ数
+  static const uint32_t MAX_PHASES = 320; // 係数表は最大 MAX_PHASES * TAPS * 2 バイト(10KB)
+
+private:
+  int16_t* coefficients; // 位相ごとにTAPS個(Q14)
+  uint32_t phases;       // L
+  uint32_t step;         // M
+  uint32_t phase;        // 次の出力の位相(0..L-1)
+  bool passthrough;      // 入力と出力のレートが同じ
+  int16_t history[TAPS * 2]; // 直近TAPSサンプル(同じ内容を2回並べ、連続した窓として読む)
+  int historyPos;
+
+public:
+  PolyphaseResampler();
+  ~PolyphaseResampler();
+
+  // 変換比を設定し、履歴を消す。対応できない比(Lが大きすぎる)や係数表を確保できなければfalse
+  bool configure(uint32_t inputRate, uint32_t outputRate);
+  void reset();
+  bool isPassthrough() const;
+
+  // 入力をできるだけ変換する。consumedに使った入力サンプル数を返す
+  // 出力が入りきらない分の入力は使わないので、残りを次の呼び出しで渡す
+  size_t process(const int16_t* input, size_t count, size_t& consumed, int16_t* output, size_t capacity);
+
+  // 8/16kHz -> 24kHzの変換速度を計測してシリアルに出力
+  static void benchmark();
+
+private:
+  void push(int16_t sample);
+  int16_t filter(uint32_t phaseIndex) const;
+};
+
+#endif
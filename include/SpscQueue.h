@@ -0,0 +1,46 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+// 書き込み側1タスク・読み出し側1タスク専用のロックフリーキュー
+// Capacityは2のべき乗にすること
+template <typename T, size_t Capacity>
+class SpscQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+  T items[Capacity];
+  std::atomic<size_t> head; // 書き込み位置(累計)
+  std::atomic<size_t> tail; // 読み出し位置(累計)
+
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  bool push(const T& item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= Capacity) {
+      return false; // 満杯
+    }
+    items[h & (Capacity - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+      return false; // 空
+    }
+    item = items[t & (Capacity - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <WiFi.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+
+// mbedTLSで直接組んだTLSクライアント。WiFiClientとしてHTTPClientに渡せる
+// WiFiClientSecureとの違い:
+//  - サーバ証明書はSHA-256フィンガープリントで固定する(自己署名証明書のサーバにも使える)
+//  - TLSセッション(セッションIDまたはセッションチケット)を覚えておき、
+//    次の接続では証明書の検証と鍵交換を省いた簡略ハンドシェイクで再開する
+//    セッションはRAMに保持し、saveToNvsを有効にするとNVSにも保存して再起動後も使う
+// 接続(TCP)はHTTP keep-aliveで使い回すので、ハンドシェイクが要るのはサーバに閉じられた後だけ
+class TlsClient : public WiFiClient {
+private:
+  WiFiClient tcp;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_ssl_config conf;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_session session; // 再開に使うセッション
+  bool configured;    // conf/drbgの初期化済み
+  bool sslActive;     // ハンドシェイク済みでstop()されていない
+  bool peerClosed;    // サーバがclose_notifyを送ったか、接続が切れた
+  bool sessionValid;
+  int peeked;         // peek()で読んだ1バイト(なければ-1)
+
+  uint8_t pin[32];    // 固定する証明書のSHA-256
+  bool pinSet;
+  bool certChecked;   // 今回のハンドシェイクで証明書を受け取り、フィンガープリントが一致した
+  bool saveToNvs;
+  String sessionKey;  // NVSに保存したセッションの接続先("host:port")
+
+  bool lastResumed;
+  uint32_t lastHandshakeMicros;
+  uint32_t fullHandshakes;
+  uint32_t resumedHandshakes;
+
+public:
+  TlsClient();
+  ~TlsClient();
+
+  // "AB:CD:..."形式のSHA-256(区切りの":"や空白は省略可)。空や不正な値ならfalse
+  bool setPinnedFingerprint(const char* fingerprint);
+  // NVSへのセッション保存を有効にし、保存済みのセッションがあれば読み込む
+  // keyは接続先("host:port")。別の接続先のセッションは使わない
+  void enableSessionStore(const String& key);
+  // 覚えているセッションを捨てる(次の接続はフルハンドシェイク)
+  void clearSession();
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+  int connect(const char* host, uint16_t port) override;
+  int connect(const char* host, uint16_t port, int32_t timeout) override;
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t* buf, size_t size) override;
+  int available() override;
+  int read() override;
+  // データが届くまでsetTimeout()の時間だけ待つ。タイムアウトや切断では0
+  int read(uint8_t* buf, size_t size) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+
+  bool wasResumed() const;
+  uint32_t getHandshakeMicros() const;
+  void printStats() const;
+
+  // 証明書検証コールバック(内部用)
+  int verifyCertificate(mbedtls_x509_crt* crt, int depth, uint32_t* flags);
+
+private:
+  bool setup();
+  bool handshake(const char* host);
+  void rememberSession(bool fullHandshake);
+  void loadSession();
+  void saveSession();
+  void closeSsl();
+};
+
+#endif
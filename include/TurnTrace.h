@@ -0,0 +1,40 @@
+#ifndef TURN_TRACE_H
+#define TURN_TRACE_H
+
+#include <Arduino.h>
+
+// 会話1ターンの各段階の時刻(esp_timerのマイクロ秒)
+enum TracePhase {
+  TRACE_WAKE_DETECTED,
+  TRACE_RECORD_START,
+  TRACE_RECORD_STOP,
+  TRACE_UPLOAD_START,
+  TRACE_HEADERS_SENT,     // HTTPClientがボディを読み始めた(ヘッダ送信済み)
+  TRACE_BODY_SENT,
+  TRACE_RESPONSE_HEADERS, // ステータス行とヘッダを受信した
+  TRACE_FIRST_BYTE,       // 応答ボディの最初のバイト
+  TRACE_LAST_BYTE,
+  TRACE_PLAYBACK_START,
+  TRACE_FIRST_AUDIO,      // 最初の音声をI2Sへ書き込んだ
+  TRACE_PLAYBACK_END,
+  TRACE_PHASE_COUNT
+};
+
+// ターンの時刻記録。begin()からend()までの各段階を記録し、end()で1行のJSON("TURN "で始まる)を出力する
+// 各段階は最初の1回だけ記録する(再送などで同じ段階を通っても上書きしない)
+// どのタスクから呼んでもよい。集計はtools/trace_report.pyで行う
+class TurnTrace {
+public:
+  // ターン開始(triggerは"wake"/"touch"など。文字列リテラルを渡す)
+  static void begin(const char* trigger);
+  static void mark(TracePhase phase);
+  // 画面の切り替え(startUsは描画開始時刻。描画にかかった時間も記録する)
+  static void screen(const char* name, int64_t startUs);
+  // 数値の付加情報(応答サイズなど。keyは文字列リテラル)
+  static void annotate(const char* key, int32_t value);
+  // ターン終了。記録中なら出力する
+  static void end();
+  static bool isActive();
+};
+
+#endif
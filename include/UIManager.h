@@ -17,6 +17,29 @@ private:
   ScreenState currentScreen;
   TFT_eSprite sprite;
   
+  // 起動時にデコードした画面(スプライトと同じRGB565のバイト順、PSRAM)
+  // 画面の切り替えはこれを1回転送するだけにする。nullptrの画面は従来どおりファイルから描く
+  uint16_t* imageMemory;
+  const uint16_t* screenPixels[SCREEN_INIT];
+  
+  // 口パク: 口の領域だけを、起動時に作った口の絵(閉じ・半開き・開き)で描き直す
+  enum MouthShape {
+    MOUTH_CLOSED,
+    MOUTH_HALF,
+    MOUTH_OPEN,
+    MOUTH_SHAPES
+  };
+  uint16_t* mouthMemory;
+  const uint16_t* mouthSprites[MOUTH_SHAPES];
+  int16_t mouthX, mouthY, mouthW, mouthH;
+  MouthShape currentMouth;    // 画面に出ている口
+  uint32_t mouthPeak;         // 最近の音量の最大値(ゆっくり下げる。声の大きさによらず口を開けるため)
+  int64_t nextMouthFrameUs;   // これより前は描き直さない
+  uint32_t mouthIntervalUs;   // 描き直す最短の間隔(再生が途切れたら延ばす)
+  uint32_t lastUnderruns;
+  uint32_t mouthFrames;
+  uint32_t mouthMaxDrawUs;
+  
 public:
   UIManager();
   
@@ -26,9 +49,16 @@ public:
   void showNoticeScreen();
   void showThinkingScreen();
   void showSpeakingScreen();
+  // SPEAKING画面の間、メインループから呼ぶ
+  // level: 今スピーカーから出ている音量、underruns: 今の再生でDMAが空になった回数
+  void updateMouth(uint32_t level, uint32_t underruns);
   
 private:
-  void changeScreen(ScreenState newScreen, const char* imagePath);
+  void changeScreen(ScreenState newScreen);
+  void decodeImages();
+  bool prepareMouth();
+  bool findMouthRect();
+  void blitImage(int16_t x, int16_t y, int16_t w, int16_t h, const uint16_t* pixels);
   bool loadImageIfExists(const char* imagePath);
 };
 
@@ -2,43 +2,44 @@
 #define VOICE_DETECTOR_H
 
 #include <Arduino.h>
-#include <driver/i2s.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
 
+// ウェイクワード検出の前段に置く音量ゲート
+// 背景雑音のレベルを追従して推定し、フレームの音量がそれを十分上回ったときだけ
+// 後段(VAD/MFCC/DTW)を動かす。音量が下がってもハングオーバーの間は開いたままにする
 class VoiceDetector {
 private:
-  static const int SAMPLE_RATE = 16000;
-  static const int BUFFER_SIZE = 512;
-  static const int SILENCE_DURATION_MS = 2000;  // 無音判定時間(2秒)
-  static const int MIN_VOICE_DURATION_MS = 500;  // 最小音声継続時間
-  
-  bool isContinuousRecording;
-  bool voiceDetected;
-  unsigned long voiceStartTime;
-  unsigned long lastVoiceTime;
-  float averageVolume;
-  
-  // I2S設定
-  i2s_config_t i2sConfig;
-  i2s_pin_config_t pinConfig;
-
-  // FreeRTOSタスクハンドル
-  TaskHandle_t recordingTaskHandle;
-  
+  uint32_t noiseFloorQ8;  // 背景雑音レベル(小数部8bit)
+  uint32_t lastVolume;
+  bool floorInitialized;
+  bool gateOpen;
+  uint32_t quietMs;       // ゲートが開いている間、閾値を下回り続けている時間
+  uint32_t frameMs;
+
+  // 統計(ゲートの効果測定用)
+  uint32_t totalFrames;
+  uint32_t openFrames;
+  uint32_t openCount;
+
 public:
   VoiceDetector();
-  
-  bool init();
-  void startContinuousRecording();
-  void stopContinuousRecording();
-  bool isVoiceDetected();
-  
+
+  // frameDurationMs: process()に渡す1フレームの長さ
+  void init(uint32_t frameDurationMs);
+  void reset();
+
+  // フレームごとに呼ぶ。trueなら後段を動かす
+  bool process(const int16_t* samples, size_t sampleCount);
+  bool isOpen() const;
+
+  uint32_t getVolume() const;
+  uint32_t getNoiseFloor() const;
+  uint32_t getTotalFrames() const;
+  uint32_t getOpenFrames() const;
+  uint32_t getOpenCount() const;
+
 private:
-  void configureI2S();
-  float calculateVolume(int16_t* samples, size_t sampleCount);
-  void continuousRecordingTask();
-  static void continuousRecordingTaskWrapper(void* param);
+  uint32_t calculateVolume(const int16_t* samples, size_t sampleCount);
+  void updateNoiseFloor(uint32_t volume);
 };
 
 #endif
@@ -1,10 +1,29 @@
 #ifndef WAKE_WORD_MANAGER_H
 #define WAKE_WORD_MANAGER_H
 
+#include <atomic>
 #include <memory>
+#include <vector>
 // #include <esp_ns.h> // ESP32-S3 only, disabled.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_vad.h>
 #include "simplevox.h"
+#include "AudioCaptureService.h"
+#include "DtwMatcher.h"
+#include "MfccStream.h"
+#include "VoiceDetector.h"
 
+// Wake word detection runs in its own tasks, not in loop():
+//   DSP task   (WAKEWORD_TASK_CORE, high priority): frames -> energy gate -> VAD + streaming MFCC
+//   match task (WAKEWORD_TASK_CORE, low priority):  DTW on the even templates
+//   worker     (other core, low priority):          DTW on the odd templates
+// MFCC frames are computed as audio arrives, so when VAD closes a segment its
+// features are copied out of the stream's ring and only DTW remains. The DSP
+// task keeps consuming frames while DTW runs. Detections are posted to a queue
+// that loop() polls with pollDetection().
 class WakeWordManager {
 public:
     static constexpr int kSampleRate = 16000;
@@ -12,34 +31,144 @@ public:
     WakeWordManager();
     ~WakeWordManager();
 
-    bool init();
+    bool init(AudioCaptureService& capture);
     void reset();
-    
+
+    // Attach/detach from the capture service and resume/pause the DSP task
+    // (no I2S reconfiguration). stopListening() cancels a match in progress.
     bool startListening();
     void stopListening();
 
-    // Wake word detection loop
-    bool listenAndDetect();
+    // Samples per VAD frame; the capture service delivers frames of this size
+    int frameLength();
+
+    // Returns true once for each wake word detected since startListening()
+    bool pollDetection();
+
+    // Wake word registration process: records several takes for the given user
+    // and keeps the most central ones as that user's templates.
+    // Returns the number of templates saved.
+    int captureAndRegisterWakeWord(int user = 0);
 
-    // Wake word registration process
-    int captureAndRegisterWakeWord();
+    // Task bodies (called from the FreeRTOS task entry points)
+    void dspTask();
+    void matchTask();
+    void matchWorkerTask();
 
 private:
-    static constexpr int kAudioLengthSecs = 3; // Max audio length for VAD buffer
-    static constexpr int kAudioLength = kSampleRate * kAudioLengthSecs;
-    static constexpr int kRxBufferNum = 3; // Number of frames for mic buffer
-    static constexpr const char* kWakeWordFileName = "/wakeword.bin";
+    static constexpr int kAudioLengthSecs = 3; // Max segment length
+    static constexpr int kMaxSegmentFrames = kAudioLengthSecs * kSampleRate / MfccStream::kHop;
+    static constexpr int kVadFrameMs = 30;      // esp-sr VAD takes 10/20/30 ms frames
+    static constexpr int kHangoverMs = 300;     // Silence that closes a segment
+    static constexpr int kSegmentMarginFrames = 3; // Feature frames kept around the speech
+    static constexpr int kVadFrameSamples = kSampleRate * kVadFrameMs / 1000;
+    // Raw VAD frames held while the energy gate is closed and replayed when it
+    // opens, so live segments keep the same lead-in as registration takes:
+    // the segment margin plus the first MFCC window, and one frame of soft onset.
+    static constexpr int kGateLeadFrames =
+        (kSegmentMarginFrames * MfccStream::kHop + MfccStream::kFrameLength - MfccStream::kHop +
+         kVadFrameSamples - 1) / kVadFrameSamples + 1;
+    static constexpr int kLoadReportMs = 10000; // DEBUG_WAKEWORD_TIMING load report interval
+    static constexpr const char* kTemplateFilePrefix = "/wakeword_mfcc2_u"; // Streaming MFCC templates
+    static constexpr const char* kOldTemplateFilePrefix = "/wakeword_u"; // Batch MFCC templates (incompatible)
+    static constexpr const char* kThresholdFilePrefix = "/wakeword_thr_u"; // Calibrated DTW threshold per user
+    static constexpr const char* kLegacyWakeWordFileName = "/wakeword.bin"; // Single batch template (incompatible)
     static constexpr const char* kSpiffsBasePath = ""; // Use root of SPIFFS
 
-    int16_t* rawAudioBuffer; // Buffer to hold detected speech
-    int16_t* micFrameBuffer; // Circular buffer for microphone frames
+    struct WakeWordTemplate {
+        int user;
+        uint32_t threshold; // The user's calibrated DTW threshold
+        std::unique_ptr<simplevox::MfccFeature> feature;
+    };
+
+    // Per-stage timing in microseconds (DEBUG_WAKEWORD_TIMING)
+    struct StageTime {
+        uint32_t last;
+        uint32_t max;
+        uint64_t total;
+        uint32_t count;
+
+        void add(uint32_t us);
+        uint32_t average() const { return count ? (uint32_t)(total / count) : 0; }
+    };
+
+    CaptureConsumer micConsumer;  // Frames from the shared capture service
+    CaptureFrame* currentFrame;   // Frame being processed, released on next read
 
     // ns_handle_t nsInst; // Noise suppression instance (ESP32-S3 only)
-    simplevox::VadEngine vadEngine;
-    simplevox::MfccEngine mfccEngine;
-    simplevox::MfccFeature* registeredWakeWord; // Stored wake word feature
+    VoiceDetector voiceGate; // First stage: wakes VAD/MFCC only above the noise floor
+    vad_handle_t vadInst;
+    MfccStream mfccStream;
+    simplevox::MfccEngine mfccEngine; // Template file I/O only
+    std::vector<WakeWordTemplate> templates; // Stored wake word features, all users
+
+    TaskHandle_t dspTaskHandle;
+    TaskHandle_t matchTaskHandle;
+    SemaphoreHandle_t dspLock;   // Held by the DSP task while it uses the consumer and VAD
+    SemaphoreHandle_t matchLock; // Held by the match task while it uses the candidate and the templates
+    QueueHandle_t detectionQueue; // Matched user ids, read by pollDetection()
+    std::atomic<bool> listening;
+    std::atomic<bool> matchBusy;  // An utterance is handed to the match task
+    std::unique_ptr<simplevox::MfccFeature> matchFeature; // Features of that utterance
+
+    // Segmenter state; positions are MfccStream frame numbers
+    int speechRunMs;          // Consecutive speech before a segment opens
+    int silenceRunMs;         // Consecutive silence inside a segment
+    bool inSegment;
+    uint32_t runStartFrame;   // Where the current speech run began
+    uint32_t segmentStart;
+    uint32_t lastSpeechFrame; // End of the last speech frame in the segment
+    uint32_t firstValidFrame; // First frame after the last reset (segments never reach back past it)
+    bool stagesRunning;       // VAD/MFCC ran on the previous frame (gate open)
+    std::vector<int16_t> leadIn; // kGateLeadFrames frames skipped by the gate, ring
+    int leadHead;             // Oldest held frame
+    int leadCount;
+
+    // Matching is split between the match task (even templates) and a worker
+    // pinned to the other core (odd templates); the first accept stops both.
+    DtwMatcher dtwMatcher;
+    DtwMatcher workerMatcher;
+    TaskHandle_t matchWorkerHandle;
+    SemaphoreHandle_t matchDone; // Given by the worker when its share is finished
+    const simplevox::MfccFeature* matchCandidate;
+    std::atomic<bool> matchAccepted;
+    std::vector<uint32_t> templateBounds; // Per template: DtwMatcher::Stats::bound of the last match
+    uint32_t workerBestDistance;
+    int workerBestTemplate;
+
+    // Instrumentation
+    StageTime vadTime;       // per frame
+    StageTime mfccTime;      // per frame (streaming)
+    StageTime dtwTime;       // match task share
+    StageTime workerDtwTime; // worker share
+    StageTime decisionTime;  // end of speech -> decision
+    StageTime frameTime;     // gate + VAD + MFCC per frame
+    uint64_t loadBusyMicros; // frameTime summed over the current load window
+    uint32_t loadFrames;
+    uint32_t loadWindowStart;
+    uint32_t speechEndMicros;
+    uint32_t lastSequence;
+    bool haveSequence;
+    uint32_t droppedFrames;        // gaps in the capture sequence numbers
+    uint32_t droppedWhileMatching; // of which while a match was running
+    uint32_t skippedUtterances;    // utterances that ended while the previous one was still matching
 
     int16_t* readMicFrame();
+    void processFrame();
+    simplevox::MfccFeature* segmentFrame(int16_t* samples, int count);
+    void resetSegment();
+    void holdLeadIn(const int16_t* samples, int count);
+    void replayLeadIn();
+    void runMatch();
+    void printTiming();
+    void printLoad();
+    String templatePath(const char* prefix, int user, int index) const;
+    void loadTemplates();
+    uint32_t loadThreshold(int user) const;
+    bool saveThreshold(int user, uint32_t threshold) const;
+    void tagMemory();
+    simplevox::MfccFeature* captureTake();
+    void matchShare(DtwMatcher& matcher, int first, int step, uint32_t& bestDistance, int& bestTemplate);
 };
 
 #endif // WAKE_WORD_MANAGER_H
@@ -3,19 +3,116 @@
 
 // サーバ設定
 #define SERVER_URL "https://192.168.1.200:5050"
+// httpsの場合に固定するサーバ証明書のSHA-256フィンガープリント("AB:CD:..."形式)
+// 空のまま接続すると、サーバ証明書のフィンガープリントをシリアルに表示して接続を拒否する
+#define SERVER_CERT_FINGERPRINT ""
+#define TLS_SESSION_NVS false // TLSセッションをNVSにも保存し、再起動後もフルハンドシェイクを省く(鍵の素材がフラッシュに残る)
+#define TLS_HANDSHAKE_TIMEOUT_MS 15000
 
 // 音声録音設定
 #define MAX_TOUCH_RECORDING_TIME 10000  // タッチ録音の最大時間（ミリ秒）
 #define MAX_VOICE_RECORDING_TIME 5000   // 音声起動録音の最大時間（ミリ秒）
+// 待機中も直近の音声を保持し、録音開始時に先頭へ付け足す長さ（ミリ秒、0で無効）
+// ウェイクワード直後の話し始めが欠けないようにする。300〜1000程度。長くするとウェイクワードの末尾も含まれる
+#define PRE_ROLL_MS 500
+// 音声起動録音の終話検出(発話後に無音が続いたら録音を打ち切る。上限はMAX_VOICE_RECORDING_TIME)
+#define ENDPOINT_DETECTION true
+#define ENDPOINT_SILENCE_MS 700        // 発話後この時間無音が続いたら終話とみなす（ミリ秒）
+#define ENDPOINT_MIN_RECORDING_MS 1000 // これより短い録音は打ち切らない（ミリ秒）
+#define ENDPOINT_SPEECH_LEVEL 400      // フレームの平均振幅(直流成分除去後)がこれを超えたら発話とみなす
+
+// 送信設定
+#define PIPELINED_UPLOAD true // 録音しながら音声を送信する(false: 録音終了後に一括送信)
+// エンドポイントごとのアップロード形式
+// UPLOAD_FORMAT_JSON: {"audio":"<base64>"}, UPLOAD_FORMAT_BINARY: 長さ付きバイナリフレーム
+// BINARYはサーバが対応している場合だけ指定する(拒否された(415)場合は録音終了を待ってJSON形式で送り直すため、そのターンは遅くなる)
+#define UPLOAD_FORMAT_STS_WHISPER UPLOAD_FORMAT_JSON
+#define UPLOAD_FORMAT_STS_GOOGLE UPLOAD_FORMAT_JSON
+#define HTTP_TIMEOUT_MS 30000 // 応答を待つ時間（ミリ秒）。応答ボディの受信が途切れた場合もこの時間で打ち切る
+#define HTTP_KEEP_ALIVE true // サーバへの接続をリクエスト間で使い回し、録音開始時に接続しておく
+// エンドポイントごとの、バイナリ形式で送る音声のコーデック(AUDIO_CODEC_PCM16 / AUDIO_CODEC_IMA_ADPCM)
+// IMA-ADPCMはサーバがデコードできる場合だけ指定する(JSON形式では常にPCM16)
+#define UPLOAD_CODEC_STS_WHISPER AUDIO_CODEC_PCM16
+#define UPLOAD_CODEC_STS_GOOGLE AUDIO_CODEC_PCM16
+
+// バッファプール(起動時にPSRAMから一括で確保し、録音バッファと応答バッファが共有する)
+#define BUFFER_POOL_SEGMENT_SIZE (16 * 1024) // セグメントのサイズ(バイト)。ADPCMブロック(256バイト)の倍数にする
+#define BUFFER_POOL_SEGMENTS 52 // セグメント数。録音に20個(10秒分)を使い、残りが応答の上限(約512KB)
+
+// タスクのスタックサイズ(バイト)。メモリレポートのminFree(最小余裕)を見て調整する
+#define CAPTURE_TASK_STACK 4096
+#define RECORDING_TASK_STACK 4096
+#define PLAYBACK_TASK_STACK 8192
+#define PLAYBACK_WRITER_TASK_STACK 4096
+#define UPLOAD_TASK_STACK 8192
+#define CONNECTION_WARM_TASK_STACK 8192 // TLSのハンドシェイクも行う
+#define WAKEWORD_DSP_TASK_STACK 8192
+#define WAKEWORD_MATCH_TASK_STACK 8192
+#define WAKEWORD_WORKER_TASK_STACK 4096
+
+// 再生設定
+#define STREAMING_PLAYBACK true // レスポンスを受信しながら再生する(false: 全体受信後に再生)
+#define PLAYBACK_RING_SIZE (64 * 1024) // ストリーミング再生用リングバッファのサイズ(バイト)
+#define PLAYBACK_JITTER_MS 200 // 再生開始前に溜めておく音声の長さ(ミリ秒)
+#define PLAYBACK_SAMPLE_RATE 24000 // I2Sの出力レート。応答音声はこのレートに変換して再生する
+#define PLAYBACK_DMA_BUF_COUNT 8 // 再生用DMAバッファの数(増やすと途切れにくくなるが、内部RAMと遅延が増える)
+#define PLAYBACK_DMA_BUF_LEN 512 // DMAバッファ1つのサンプル数(最大1024。書き込みタスクへ渡すブロックも同じ長さ)
+#define PLAYBACK_HANDOFF_BLOCKS 2 // デコード側と書き込みタスクの間で受け渡すブロックの数(2でダブルバッファ)
+#define PLAYBACK_WRITER_PRIORITY 7 // I2S書き込みタスクの優先度(デコード・取り込み・受信タスクより高くする)
+#define RESPONSE_DEFAULT_SAMPLE_RATE 24000 // WAVヘッダのない応答のサンプリングレート
+#define ACCEPT_WAV_RESPONSE true // 応答をWAV(形式はヘッダで指定。8kHzなど低いレートも可)で受け取れることをサーバに通知する
+#define ACCEPT_ADPCM_RESPONSE true // 応答音声をIMA-ADPCMで受け取れることをサーバに通知する
+
+// 手元のクリップ(イヤコン・つなぎの言葉・保存した応答)
+#define CLIP_PACK_PATH "/clips.pak" // SPIFFS上のクリップパック(tools/make_clip_pack.pyで作る。なければイヤコンなし)
+#define CLIP_PACK_MAX_BYTES (256 * 1024) // 起動時にPSRAMへ読み込むパックの上限(バイト)
+#define CLIP_WAKE_EARCON false // ウェイクワードを検出したら"wake"を鳴らしてから録音する(再生中はマイクが止まり、プリロールと直後の発話が失われる)
+#define CLIP_FILLER_DELAY_MS 800 // 応答を待つ間、この時間が過ぎたら"filler"を再生する(0で再生しない)
+#define CLIP_RESPONSE_CACHE true // サーバがX-Audio-Cache-Keyを付けた応答をフラッシュに保存し、次回から手元で再生する
+#define CLIP_CACHE_MAX_BYTES (96 * 1024) // 保存する応答1つの上限(バイト)。取り込み用にPSRAMを同じだけ確保する
+#define CLIP_CACHE_WRITE_CHUNK 4096 // 待機中に1回で書き込むバイト数(書き込み中は両コアが止まるので小さくする)
+#define CLIP_CACHE_FLASH_RESERVE (64 * 1024) // SPIFFSに残しておく空き(バイト)。足りなければ古い応答から消す
+
+// 口パク(応答の再生中、口の周りだけを音量に合わせて描き直す)
+#define LIPSYNC_ENABLED true
+#define LIPSYNC_FRAME_MS 50 // 口を描き直す最短の間隔(ミリ秒)。再生のDMAが空になったら倍ずつ延ばす
+#define LIPSYNC_MAX_FRAME_MS 400 // 延ばした間隔の上限(ミリ秒)
+#define LIPSYNC_DRAW_BUDGET_PERCENT 20 // 描画に使ってよい時間の割合(1回の描画が長ければ、その分次の描画を遅らせる)
+#define LIPSYNC_SILENCE_LEVEL 300 // この音量(平均振幅)未満では口を閉じる
+// 口の領域(ピクセル)。LIPSYNC_MOUTH_Wが0なら、smile_closeとsmile_openで色が違う部分から自動で決める
+#define LIPSYNC_MOUTH_X 0
+#define LIPSYNC_MOUTH_Y 0
+#define LIPSYNC_MOUTH_W 0
+#define LIPSYNC_MOUTH_H 0
 
 // 音声検出設定
-#define SOFTWARE_GAIN 2.0 // マイクのソフトウェアゲイン（増幅率）
+#define SOFTWARE_GAIN 2.0 // マイクのソフトウェアゲイン（増幅率）。2のべき乗だとシフト演算で済む
+#define MIC_DC_REMOVAL false // マイク入力の直流成分を除去する(変更したらウェイクワードを登録し直す)
 #define VAD_MODE 3 // VADの感度(0:高感度, 4:低感度). ノイズを拾ってしまう場合は数値を上げる
 #define VAD_DECISION_TIME_MS 150 // このミリ秒以上音声が続いたら「発話」と判断する
-#define VOICE_DETECTION_THRESHOLD 3300 // DTWの閾値。この値より大きい音を検出すると録音開始: 常時3100~3200くらい
+#define WAKEWORD_DTW_THRESHOLD 180 // 較正値がないときのDTW距離の閾値(較正前に登録したテンプレート用)。小さいほど厳しい
+#define WAKEWORD_DTW_MARGIN_PERCENT 125 // 登録時の閾値 = 残したテンプレート同士の最大DTW距離 × この%。誤検出が多ければ下げる
+#define WAKEWORD_DTW_BAND_PERCENT 30 // DTWで許す時間伸縮の幅(長い方のフレーム数に対する%)
+#define WAKEWORD_MAX_USERS 4 // ウェイクワードを登録できる人数
+#define WAKEWORD_TEMPLATES_PER_USER 3 // 1人あたりに保存するテンプレート数
+#define WAKEWORD_REGISTRATION_TAKES 5 // 登録時に録る回数(このうち互いに近いものを残す)
+#define WAKEWORD_TASK_CORE 1 // ウェイクワード検出タスクを動かすコア(WiFiはコア0で動くため1)
+// ウェイクワード検出の前段ゲート(音量が背景雑音を上回ったときだけVAD/MFCC/DTWを動かす)
+#define WAKEWORD_ENERGY_GATE true
+#define VOICE_GATE_RATIO 2.0 // 背景雑音レベルの何倍の音量でゲートを開くか
+#define VOICE_GATE_MIN_LEVEL 150 // この音量(平均振幅)以下ではゲートを開かない
+#define VOICE_GATE_HANGOVER_MS 600 // 音量が下がってからゲートを閉じるまでの時間（ミリ秒）
 
 // デバッグ設定
 #define DEBUG_VOICE_DETECTION false
 #define DEBUG_NETWORK_COMMUNICATION true
+#define DEBUG_CODEC_BENCHMARK false // 起動時にADPCMのエンコード/デコード速度を計測する
+#define DEBUG_DSP_BENCHMARK false // 起動時にDSPカーネル(ゲイン等)とリサンプラの速度を計測する
+#define DEBUG_DTW_VERIFY false // ウェイクワード照合を従来の全探索DTWでも計算し、判定の食い違いを表示する
+#define DEBUG_WAKEWORD_TIMING false // ウェイクワード検出の段階ごとの処理時間と取りこぼしフレーム数を表示する
+#define DEBUG_TURN_TRACE true // 会話ターンごとの段階別の時刻を1行のJSONで表示する(tools/trace_report.pyで集計)
+#define DEBUG_MEMORY_REPORT true // ヒープ・PSRAM・タスクスタックの使用状況を定期的に表示する(シリアルに"mem"と送ればいつでも表示)
+#define MEMORY_REPORT_INTERVAL_MS 60000 // メモリレポートと残量チェックの間隔(ミリ秒、0で定期チェックなし)
+#define MEMORY_WARN_LARGEST_BLOCK (16 * 1024) // 内部RAMの最大空きブロックがこれを下回ったら警告する(バイト)
 
 #endif
@@ -0,0 +1,152 @@
+#include "AdpcmCodec.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+static const int16_t STEP_TABLE[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t INDEX_TABLE[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static inline int clampIndex(int index) {
+  return (index < 0) ? 0 : (index > 88) ? 88 : index;
+}
+
+static inline int32_t clampSample(int32_t value) {
+  return (value < -32768) ? -32768 : (value > 32767) ? 32767 : value;
+}
+
+// 1サンプルを4bitに量子化し、予測値とインデックスを更新する
+static inline uint8_t encodeNibble(int16_t sample, int32_t& predictor, int& index) {
+  int32_t step = STEP_TABLE[index];
+  int32_t diff = sample - predictor;
+  uint8_t code = 0;
+  if (diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+
+  int32_t delta = step >> 3;
+  if (diff >= step) { code |= 4; diff -= step; delta += step; }
+  step >>= 1;
+  if (diff >= step) { code |= 2; diff -= step; delta += step; }
+  step >>= 1;
+  if (diff >= step) { code |= 1; delta += step; }
+
+  predictor = clampSample((code & 8) ? predictor - delta : predictor + delta);
+  index = clampIndex(index + INDEX_TABLE[code]);
+  return code;
+}
+
+static inline int16_t decodeNibble(uint8_t code, int32_t& predictor, int& index) {
+  int32_t step = STEP_TABLE[index];
+  int32_t delta = step >> 3;
+  if (code & 4) delta += step;
+  if (code & 2) delta += step >> 1;
+  if (code & 1) delta += step >> 2;
+
+  predictor = clampSample((code & 8) ? predictor - delta : predictor + delta);
+  index = clampIndex(index + INDEX_TABLE[code]);
+  return (int16_t)predictor;
+}
+
+size_t AdpcmCodec::encodedSize(size_t samples) {
+  if (samples == 0) return 0;
+  return BLOCK_HEADER_SIZE + samples / 2;
+}
+
+size_t AdpcmCodec::decodedSamples(size_t bytes) {
+  if (bytes < BLOCK_HEADER_SIZE) return 0;
+  return 1 + (bytes - BLOCK_HEADER_SIZE) * 2;
+}
+
+size_t AdpcmCodec::encodeBlock(const int16_t* pcm, size_t samples, uint8_t* out, EncoderState& state) {
+  if (samples == 0) return 0;
+
+  int32_t predictor = pcm[0];
+  int index = clampIndex(state.index);
+
+  // ヘッダ: 先頭サンプルはそのまま格納する
+  out[0] = (uint8_t)(predictor & 0xFF);
+  out[1] = (uint8_t)((predictor >> 8) & 0xFF);
+  out[2] = (uint8_t)index;
+  out[3] = 0;
+
+  uint8_t* dst = out + BLOCK_HEADER_SIZE;
+  size_t i = 1;
+  for (; i + 1 < samples; i += 2) {
+    uint8_t lo = encodeNibble(pcm[i], predictor, index);
+    uint8_t hi = encodeNibble(pcm[i + 1], predictor, index);
+    *dst++ = lo | (hi << 4);
+  }
+  // 偶数サンプル数の場合は最後のニブルを0で埋める
+  if (i < samples) {
+    *dst++ = encodeNibble(pcm[i], predictor, index);
+  }
+
+  state.index = (uint8_t)index;
+  return dst - out;
+}
+
+size_t AdpcmCodec::decodeBlock(const uint8_t* in, size_t bytes, int16_t* pcm) {
+  if (bytes < BLOCK_HEADER_SIZE) return 0;
+
+  int32_t predictor = (int16_t)(in[0] | (in[1] << 8));
+  int index = clampIndex(in[2]);
+  pcm[0] = (int16_t)predictor;
+
+  int16_t* dst = pcm + 1;
+  for (size_t i = BLOCK_HEADER_SIZE; i < bytes; i++) {
+    *dst++ = decodeNibble(in[i] & 0x0F, predictor, index);
+    *dst++ = decodeNibble(in[i] >> 4, predictor, index);
+  }
+  return dst - pcm;
+}
+
+#ifdef ARDUINO
+void AdpcmCodec::benchmark() {
+  static const size_t SAMPLES = 505;
+  static int16_t pcm[SAMPLES];
+  static uint8_t encoded[BLOCK_HEADER_SIZE + SAMPLES / 2 + 1];
+  const int iterations = 100;
+
+  // 音声に近い信号として周波数の異なる正弦波を重ねる
+  for (size_t i = 0; i < SAMPLES; i++) {
+    pcm[i] = (int16_t)(8000 * sin(i * 0.07) + 3000 * sin(i * 0.31));
+  }
+
+  EncoderState state = { 0 };
+  size_t encodedBytes = 0;
+  uint32_t start = ESP.getCycleCount();
+  for (int n = 0; n < iterations; n++) {
+    encodedBytes = encodeBlock(pcm, SAMPLES, encoded, state);
+  }
+  uint32_t encodeCycles = ESP.getCycleCount() - start;
+
+  start = ESP.getCycleCount();
+  for (int n = 0; n < iterations; n++) {
+    decodeBlock(encoded, encodedBytes, pcm);
+  }
+  uint32_t decodeCycles = ESP.getCycleCount() - start;
+
+  Serial.printf("ADPCM benchmark: encode %.1f cycles/sample, decode %.1f cycles/sample (%u -> %u bytes)\n",
+                (float)encodeCycles / (iterations * SAMPLES),
+                (float)decodeCycles / (iterations * SAMPLES),
+                (unsigned)(SAMPLES * 2), (unsigned)encodedBytes);
+}
+#else
+void AdpcmCodec::benchmark() {}
+#endif
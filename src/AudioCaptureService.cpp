@@ -0,0 +1,284 @@
+#include "AudioCaptureService.h"
+#include "config.h"
+#include "MemoryMonitor.h"
+
+// FreeRTOSタスク用の静的関数
+static void captureTaskWrapper(void* param) {
+  MemoryMonitor::taskStarted(CAPTURE_TASK_STACK);
+  ((AudioCaptureService*)param)->captureTask();
+}
+
+// --- CaptureConsumer ---
+
+CaptureConsumer::CaptureConsumer(const char* consumerName) {
+  name = consumerName;
+  active = false;
+  waiter = nullptr;
+  droppedFrames = 0;
+}
+
+void CaptureConsumer::activate() {
+  drain(); // 前回の停止後に届いたフレームを捨てる
+  droppedFrames = 0;
+  active = true;
+}
+
+void CaptureConsumer::deactivate() {
+  active = false;
+  drain();
+}
+
+bool CaptureConsumer::isActive() const {
+  return active;
+}
+
+CaptureFrame* CaptureConsumer::receive(TickType_t timeout) {
+  CaptureFrame* frame = nullptr;
+  if (queue.pop(frame)) return frame;
+
+  // キューが空なら、取り込みタスクからの通知を待つ
+  waiter = xTaskGetCurrentTaskHandle();
+  TickType_t start = xTaskGetTickCount();
+  while (true) {
+    if (queue.pop(frame)) break;
+
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout) {
+      frame = nullptr;
+      break;
+    }
+    ulTaskNotifyTake(pdTRUE, timeout - elapsed);
+  }
+  waiter = nullptr;
+  return frame;
+}
+
+void CaptureConsumer::release(CaptureFrame* frame) {
+  if (frame) {
+    frame->refs.fetch_sub(1);
+  }
+}
+
+const char* CaptureConsumer::getName() const {
+  return name;
+}
+
+uint32_t CaptureConsumer::getDroppedFrames() const {
+  return droppedFrames;
+}
+
+void CaptureConsumer::drain() {
+  CaptureFrame* frame = nullptr;
+  while (queue.pop(frame)) {
+    release(frame);
+  }
+}
+
+// --- AudioCaptureService ---
+
+AudioCaptureService::AudioCaptureService() {
+  poolMemory = nullptr;
+  scratchFrame = nullptr;
+  frameLength = 0;
+  nextFrame = 0;
+  consumerCount = 0;
+  running = false;
+  captureTaskHandle = NULL;
+  sequence = 0;
+  overrunFrames = 0;
+  dcState = { 0, 0 };
+}
+
+AudioCaptureService::~AudioCaptureService() {
+  stop();
+  if (poolMemory) heap_caps_free(poolMemory);
+  if (scratchFrame) heap_caps_free(scratchFrame);
+}
+
+bool AudioCaptureService::init(size_t samplesPerFrame) {
+  frameLength = samplesPerFrame;
+
+  // フレームプール確保(i2s_readの書き込み先になるため内部RAMに置く)
+  poolMemory = (int16_t*)heap_caps_malloc(POOL_SIZE * frameLength * sizeof(int16_t), MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
+  scratchFrame = (int16_t*)heap_caps_malloc(frameLength * sizeof(int16_t), MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
+  if (!poolMemory || !scratchFrame) {
+    Serial.println("Failed to allocate capture frame pool");
+    return false;
+  }
+  MemoryMonitor::tag("capture.frames", poolMemory, POOL_SIZE * frameLength * sizeof(int16_t));
+
+  for (int i = 0; i < POOL_SIZE; i++) {
+    pool[i].samples = poolMemory + i * frameLength;
+    pool[i].length = 0;
+    pool[i].sequence = 0;
+    pool[i].refs = 0;
+  }
+
+  // Core2内蔵PDMマイクの設定
+  i2sConfig = {
+    .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_PDM),
+    .sample_rate = SAMPLE_RATE,
+    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+    .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
+    .communication_format = I2S_COMM_FORMAT_STAND_I2S,
+    .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
+    .dma_buf_count = 4,
+    .dma_buf_len = 512,
+    .use_apll = false,
+    .tx_desc_auto_clear = true,
+    .fixed_mclk = 0
+  };
+
+  pinConfig = {
+    .bck_io_num = I2S_PIN_NO_CHANGE,
+    .ws_io_num = 0,
+    .data_out_num = I2S_PIN_NO_CHANGE,
+    .data_in_num = 34
+  };
+
+  return true;
+}
+
+bool AudioCaptureService::addConsumer(CaptureConsumer* consumer) {
+  if (consumerCount >= MAX_CONSUMERS) {
+    Serial.printf("Too many capture consumers, cannot add %s\n", consumer->getName());
+    return false;
+  }
+  consumers[consumerCount++] = consumer;
+  return true;
+}
+
+bool AudioCaptureService::start() {
+  if (running) return true;
+
+  Serial.println("Starting audio capture (I2S)...");
+  i2s_driver_uninstall(I2S_NUM_0); // 再生で使っていた場合に備える
+  esp_err_t result = i2s_driver_install(I2S_NUM_0, &i2sConfig, 0, NULL);
+  if (result != ESP_OK) {
+    Serial.printf("I2S driver install failed: %d\n", result);
+    return false;
+  }
+  result = i2s_set_pin(I2S_NUM_0, &pinConfig);
+  if (result != ESP_OK) {
+    Serial.printf("I2S set pin failed: %d\n", result);
+    i2s_driver_uninstall(I2S_NUM_0);
+    return false;
+  }
+  i2s_zero_dma_buffer(I2S_NUM_0);
+
+  running = true;
+  if (xTaskCreate(captureTaskWrapper, "CaptureTask", CAPTURE_TASK_STACK, this, 6, &captureTaskHandle) != pdPASS) {
+    Serial.println("Failed to create capture task");
+    running = false;
+    captureTaskHandle = NULL;
+    i2s_driver_uninstall(I2S_NUM_0);
+    return false;
+  }
+  return true;
+}
+
+void AudioCaptureService::stop() {
+  if (!running) return;
+
+  Serial.println("Stopping audio capture (I2S)...");
+  running = false;
+
+  // タスクが自己終了するのを待つ(i2s_readのタイムアウト分)
+  unsigned long startTime = millis();
+  while (captureTaskHandle != NULL && millis() - startTime < 1000) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  if (captureTaskHandle != NULL) {
+    Serial.println("ERROR: CaptureTask did not terminate, forcing deletion.");
+    MemoryMonitor::forgetTask(captureTaskHandle);
+    vTaskDelete(captureTaskHandle);
+    captureTaskHandle = NULL;
+  }
+
+  i2s_driver_uninstall(I2S_NUM_0);
+}
+
+bool AudioCaptureService::isRunning() const {
+  return running;
+}
+
+size_t AudioCaptureService::getFrameLength() const {
+  return frameLength;
+}
+
+uint32_t AudioCaptureService::getOverrunFrames() const {
+  return overrunFrames;
+}
+
+CaptureFrame* AudioCaptureService::acquireFrame() {
+  // 全利用者が解放済みのフレームを順番に探す
+  for (int i = 0; i < POOL_SIZE; i++) {
+    CaptureFrame* frame = &pool[(nextFrame + i) % POOL_SIZE];
+    if (frame->refs.load() == 0) {
+      nextFrame = (nextFrame + i + 1) % POOL_SIZE;
+      return frame;
+    }
+  }
+  return nullptr;
+}
+
+void AudioCaptureService::distribute(CaptureFrame* frame) {
+  // 配り終えるまでは取り込みタスク自身も参照を持つ
+  frame->refs = 1;
+
+  for (int i = 0; i < consumerCount; i++) {
+    CaptureConsumer* consumer = consumers[i];
+    if (!consumer->active) continue;
+
+    frame->refs.fetch_add(1);
+    if (!consumer->queue.push(frame)) {
+      frame->refs.fetch_sub(1);
+      consumer->droppedFrames++;
+      continue;
+    }
+
+    TaskHandle_t waiter = consumer->waiter.load();
+    if (waiter) {
+      xTaskNotifyGive(waiter);
+    }
+  }
+
+  frame->refs.fetch_sub(1);
+}
+
+void AudioCaptureService::captureTask() {
+  const size_t frameBytes = frameLength * sizeof(int16_t);
+
+  while (running) {
+    // DMAからプールのフレームへ直接読み出す
+    CaptureFrame* frame = acquireFrame();
+    int16_t* dst = frame ? frame->samples : scratchFrame;
+    size_t bytesRead = 0;
+
+    esp_err_t result = i2s_read(I2S_NUM_0, dst, frameBytes, &bytesRead, pdMS_TO_TICKS(100));
+    if (result != ESP_OK || bytesRead != frameBytes) {
+      continue;
+    }
+    uint32_t frameSequence = sequence++;
+
+    if (!frame) {
+      overrunFrames++;
+      continue;
+    }
+
+    // 前処理(全利用者で共通)
+    if (MIC_DC_REMOVAL) {
+      AudioDsp::removeDc(dst, frameLength, dcState);
+    }
+    AudioDsp::applyGain<AudioDsp::gainQ8(SOFTWARE_GAIN)>(dst, frameLength);
+
+    frame->length = frameLength;
+    frame->sequence = frameSequence;
+    distribute(frame);
+  }
+
+  Serial.println("DEBUG: CaptureTask is exiting.");
+  captureTaskHandle = NULL;
+  MemoryMonitor::taskExiting();
+  vTaskDelete(NULL);
+}
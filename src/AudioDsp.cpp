@@ -0,0 +1,143 @@
+#include "AudioDsp.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+// 直流成分除去の極(0.995, Q15)。16kHzでカットオフ約13Hz
+static const int32_t DC_POLE_Q15 = 32604;
+
+void AudioDsp::applyGain(int16_t* samples, size_t count, int32_t gainQ8) {
+  for (size_t i = 0; i < count; i++) {
+    samples[i] = saturate(((int32_t)samples[i] * gainQ8 + 128) >> 8);
+  }
+}
+
+// y[n] = x[n] - x[n-1] + a * y[n-1]
+void AudioDsp::removeDc(int16_t* samples, size_t count, DcState& state) {
+  int32_t prevInput = state.prevInput;
+  int32_t prevOutput = state.prevOutput;
+  for (size_t i = 0; i < count; i++) {
+    int32_t input = samples[i];
+    // 出力は小数部8bitで保持し、丸め誤差が積もらないようにする
+    prevOutput = (input - prevInput) * 256 + (int32_t)(((int64_t)prevOutput * DC_POLE_Q15) >> 15);
+    prevInput = input;
+    samples[i] = saturate((prevOutput + 128) >> 8);
+  }
+  state.prevInput = prevInput;
+  state.prevOutput = prevOutput;
+}
+
+int32_t AudioDsp::mean(const int16_t* samples, size_t count) {
+  if (count == 0) return 0;
+  int32_t sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum += samples[i];
+  }
+  return sum / (int32_t)count;
+}
+
+uint32_t AudioDsp::meanAbs(const int16_t* samples, size_t count, int32_t offset) {
+  if (count == 0) return 0;
+  uint32_t sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    int32_t value = samples[i] - offset;
+    sum += (value < 0) ? -value : value;
+  }
+  return sum / count;
+}
+
+uint32_t AudioDsp::rms(const int16_t* samples, size_t count) {
+  if (count == 0) return 0;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    int32_t value = samples[i];
+    sum += (uint32_t)(value * value);
+  }
+  uint32_t meanSquare = (uint32_t)(sum / count);
+
+  // 整数平方根(ビットごとに決める)
+  uint32_t root = 0;
+  uint32_t bit = 1u << 30;
+  while (bit > meanSquare) bit >>= 2;
+  while (bit != 0) {
+    if (meanSquare >= root + bit) {
+      meanSquare -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+AudioDsp::PeakInfo AudioDsp::peak(const int16_t* samples, size_t count) {
+  PeakInfo info = { 0, 0 };
+  for (size_t i = 0; i < count; i++) {
+    int32_t value = samples[i];
+    uint16_t magnitude = (uint16_t)((value < 0) ? -value : value);
+    if (magnitude > info.peak) info.peak = magnitude;
+    if (magnitude >= 32767) info.clipped++;
+  }
+  return info;
+}
+
+#ifdef ARDUINO
+// 従来の浮動小数点ゲインループ(比較用)
+static void legacyGain(int16_t* samples, size_t count, float gain) {
+  for (size_t i = 0; i < count; i++) {
+    int32_t amplified_sample = (int32_t)samples[i] * gain;
+    if (amplified_sample > 32767) amplified_sample = 32767;
+    if (amplified_sample < -32768) amplified_sample = -32768;
+    samples[i] = (int16_t)amplified_sample;
+  }
+}
+
+void AudioDsp::benchmark() {
+  static const size_t SAMPLES = 512;
+  static int16_t source[SAMPLES];
+  static int16_t frame[SAMPLES];
+  const int iterations = 100;
+  volatile uint32_t sink = 0;
+
+  // 直流成分を含む音声に近い信号
+  for (size_t i = 0; i < SAMPLES; i++) {
+    source[i] = (int16_t)(-1200 + 6000 * sin(i * 0.07) + 2000 * sin(i * 0.31));
+  }
+
+  // 各カーネルを同じ入力で繰り返し実行し、1フレームあたりの平均サイクル数を表示する
+  auto measure = [&](const char* name, void (*kernel)(int16_t*, size_t)) {
+    uint32_t total = 0;
+    for (int n = 0; n < iterations; n++) {
+      memcpy(frame, source, sizeof(frame));
+      uint32_t start = ESP.getCycleCount();
+      kernel(frame, SAMPLES);
+      total += ESP.getCycleCount() - start;
+    }
+    Serial.printf("  %-24s %6u cycles/frame\n", name, (unsigned)(total / iterations));
+  };
+
+  Serial.printf("DSP benchmark (%u samples/frame):\n", (unsigned)SAMPLES);
+  measure("legacy float gain x2.0", [](int16_t* s, size_t n) { legacyGain(s, n, 2.0f); });
+  measure("applyGain<x2.0> (shift)", [](int16_t* s, size_t n) { applyGain<gainQ8(2.0)>(s, n); });
+  measure("legacy float gain x1.5", [](int16_t* s, size_t n) { legacyGain(s, n, 1.5f); });
+  measure("applyGain<x1.5>", [](int16_t* s, size_t n) { applyGain<gainQ8(1.5)>(s, n); });
+  measure("applyGain(runtime x1.5)", [](int16_t* s, size_t n) { applyGain(s, n, gainQ8(1.5)); });
+  measure("removeDc", [](int16_t* s, size_t n) { DcState state = { 0, 0 }; removeDc(s, n, state); });
+
+  uint32_t start = ESP.getCycleCount();
+  for (int n = 0; n < iterations; n++) sink += meanAbs(source, SAMPLES, mean(source, SAMPLES));
+  Serial.printf("  %-24s %6u cycles/frame\n", "mean + meanAbs", (unsigned)((ESP.getCycleCount() - start) / iterations));
+
+  start = ESP.getCycleCount();
+  for (int n = 0; n < iterations; n++) sink += rms(source, SAMPLES);
+  Serial.printf("  %-24s %6u cycles/frame\n", "rms", (unsigned)((ESP.getCycleCount() - start) / iterations));
+
+  start = ESP.getCycleCount();
+  for (int n = 0; n < iterations; n++) sink += peak(source, SAMPLES).clipped;
+  Serial.printf("  %-24s %6u cycles/frame\n", "peak", (unsigned)((ESP.getCycleCount() - start) / iterations));
+}
+#else
+void AudioDsp::benchmark() {}
+#endif
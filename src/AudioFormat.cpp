@@ -0,0 +1,68 @@
+#include "AudioFormat.h"
+#include <string.h>
+
+namespace {
+
+const uint16_t WAVE_FORMAT_PCM = 0x0001;
+const uint16_t WAVE_FORMAT_IMA_ADPCM = 0x0011;
+
+uint16_t readLe16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t readLe32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+} // namespace
+
+WavHeader::Result WavHeader::parse(const uint8_t* data, size_t length, AudioFormat& format, size_t& headerSize) {
+  if (length < 4) {
+    return (memcmp(data, "RIFF", length) == 0) ? WAV_NEED_MORE : WAV_NOT_WAV;
+  }
+  if (memcmp(data, "RIFF", 4) != 0) return WAV_NOT_WAV;
+  if (length < 12) return WAV_NEED_MORE;
+  if (memcmp(data + 8, "WAVE", 4) != 0) return WAV_UNSUPPORTED;
+
+  bool haveFormat = false;
+  size_t pos = 12;
+  while (true) {
+    if (pos + 8 > length) {
+      return (pos + 8 > MAX_HEADER_SIZE) ? WAV_UNSUPPORTED : WAV_NEED_MORE;
+    }
+    const uint8_t* id = data + pos;
+    uint32_t size = readLe32(data + pos + 4);
+    size_t body = pos + 8;
+
+    if (memcmp(id, "data", 4) == 0) {
+      if (!haveFormat) return WAV_UNSUPPORTED;
+      headerSize = body;
+      return WAV_OK;
+    }
+    if (size > MAX_HEADER_SIZE || body + size > MAX_HEADER_SIZE) return WAV_UNSUPPORTED;
+    if (body + size > length) return WAV_NEED_MORE;
+
+    if (memcmp(id, "fmt ", 4) == 0) {
+      if (size < 16) return WAV_UNSUPPORTED;
+      const uint8_t* fmt = data + body;
+      uint16_t tag = readLe16(fmt);
+      uint16_t channels = readLe16(fmt + 2);
+      uint32_t sampleRate = readLe32(fmt + 4);
+      uint16_t blockAlign = readLe16(fmt + 12);
+      uint16_t bitsPerSample = readLe16(fmt + 14);
+      if (channels != 1 || sampleRate == 0) return WAV_UNSUPPORTED;
+
+      if (tag == WAVE_FORMAT_PCM && bitsPerSample == 16) {
+        format.codec = AUDIO_CODEC_PCM16;
+      } else if (tag == WAVE_FORMAT_IMA_ADPCM && bitsPerSample == 4 &&
+                 blockAlign == AdpcmCodec::RESPONSE_BLOCK_SIZE) {
+        format.codec = AUDIO_CODEC_IMA_ADPCM;
+      } else {
+        return WAV_UNSUPPORTED;
+      }
+      format.sampleRate = sampleRate;
+      haveFormat = true;
+    }
+    pos = body + size + (size & 1); // チャンクは2バイト境界に揃う
+  }
+}
@@ -1,77 +1,149 @@
 #include "AudioManager.h"
 #include "config.h"
+#include "AudioDsp.h"
+#include "MemoryMonitor.h"
+#include "TurnTrace.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <Speaker.h>
 
 // 静的メンバ変数
 static AudioManager* instance = nullptr;
 
 // FreeRTOSタスク用の静的関数
 static void recordingTaskWrapper(void* param) {
+  MemoryMonitor::taskStarted(RECORDING_TASK_STACK);
   ((AudioManager*)param)->recordingTask();
 }
 
+static void streamingPlaybackTaskWrapper(void* param) {
+  MemoryMonitor::taskStarted(PLAYBACK_TASK_STACK);
+  ((AudioManager*)param)->streamingPlaybackTask();
+}
+
+// 再生タスクに渡すデータ(応答のセグメント、または連続したクリップのどちらか)
+struct PlaybackParams {
+  AudioManager* manager;
+  const SegmentChain* data;
+  const uint8_t* clip;
+  size_t clipSize;
+};
+
 static void playbackTaskWrapper(void* param) {
-  struct PlaybackParams {
-    AudioManager* manager;
-    uint8_t* data;
-    size_t size;
-  };
+  MemoryMonitor::taskStarted(PLAYBACK_TASK_STACK);
   PlaybackParams* params = (PlaybackParams*)param;
-  params->manager->playbackTask(params->data, params->size);
+  AudioManager* manager = params->manager;
+  const SegmentChain* data = params->data;
+  const uint8_t* clip = params->clip;
+  size_t clipSize = params->clipSize;
   delete params;
-  vTaskDelete(NULL);
+  manager->playbackTask(data, clip, clipSize);
 }
 
-AudioManager::AudioManager() {
+AudioManager::AudioManager() : recorderConsumer("recorder") {
   recordBuffer = nullptr;
+  recordSegments = 0;
+  bufferPool = nullptr;
   recordedSize = 0;
   currentRecordPos = 0;
   isRecording = false;
   isPlayingAudio = false;
+  blockQueue = NULL;
+  capture = nullptr;
+  recordingTaskHandle = NULL;
+  playbackTaskHandle = NULL;
+  preRollActive = false;
+  preRollBuffer = nullptr;
+  preRollCapacity = 0;
+  preRollPos = 0;
+  preRollFilled = 0;
+  liveStartPos = 0;
+  lastSpeechPos = 0;
+  speechHeard = false;
+  utteranceEnded = false;
+  playbackCodec = AUDIO_CODEC_PCM16;
+  underrunCount = 0;
+  firstAudioTime = 0;
+  tracePlayback = true;
+  levelWritten = 0;
   instance = this;
 }
 
 AudioManager::~AudioManager() {
   if (recordBuffer) {
-    free(recordBuffer);
+    bufferPool->release(recordBuffer, recordSegments);
+  }
+  if (preRollBuffer) {
+    heap_caps_free(preRollBuffer);
   }
 }
 
-bool AudioManager::init() {
-  // 録音バッファ確保
-  recordBuffer = (uint8_t*)malloc(MAX_RECORD_SIZE);
+bool AudioManager::init(AudioCaptureService& captureService, BufferPool& pool) {
+  // マイクは取り込みサービスが所有する。録音中だけフレームを受け取る
+  capture = &captureService;
+  if (!capture->addConsumer(&recorderConsumer)) {
+    return false;
+  }
+  
+  // 録音バッファ確保(プールの連続したセグメントを借りたままにする)
+  bufferPool = &pool;
+  recordSegments = (MAX_RECORD_SIZE + pool.getSegmentSize() - 1) / pool.getSegmentSize();
+  recordBuffer = pool.acquire(recordSegments);
   if (!recordBuffer) {
     Serial.println("Failed to allocate record buffer");
     return false;
   }
+  MemoryMonitor::tag("audio.record", recordBuffer, recordSegments * pool.getSegmentSize());
   
-  // I2S設定の初期化
-  i2sConfig = {
-    .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_TX),
-    .sample_rate = SAMPLE_RATE,
-    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
-    .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
-    .communication_format = I2S_COMM_FORMAT_STAND_I2S,
-    .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-    .dma_buf_count = 4,
-    .dma_buf_len = BUFFER_SIZE,
-    .use_apll = false,
-    .tx_desc_auto_clear = true,
-    .fixed_mclk = 0
-  };
-  
-  pinConfig = {
-    .bck_io_num = CONFIG_I2S_BCK_PIN,
-    .ws_io_num = CONFIG_I2S_LRCK_PIN,
-    .data_out_num = CONFIG_I2S_DATA_PIN,
-    .data_in_num = CONFIG_I2S_DATA_IN_PIN
-  };
+  // プリロール用リング確保
+  preRollCapacity = (size_t)SAMPLE_RATE * PRE_ROLL_MS / 1000 * sizeof(int16_t);
+  if (preRollCapacity > 0) {
+    constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+    preRollBuffer = (uint8_t*)heap_caps_malloc(preRollCapacity, memCaps);
+    if (!preRollBuffer) {
+      Serial.println("Failed to allocate pre-roll buffer");
+      return false;
+    }
+    MemoryMonitor::tag("audio.preroll", preRollBuffer, preRollCapacity);
+  }
+  
+  // 録音済みブロックの通知キュー
+  blockQueue = xQueueCreate(1, sizeof(RecordedBlock));
+  if (!blockQueue) {
+    Serial.println("Failed to create block queue");
+    return false;
+  }
+  
+  // ストリーミング再生用リングバッファ確保
+  if (STREAMING_PLAYBACK) {
+    if (!playbackRing.init(PLAYBACK_RING_SIZE)) {
+      return false;
+    }
+    MemoryMonitor::tag("audio.playring", playbackRing.getBuffer(), playbackRing.getCapacity());
+  }
+  
+  // スピーカー出力(DMAと書き込みタスク)の準備
+  if (!engine.init(PLAYBACK_SAMPLE_RATE)) {
+    return false;
+  }
   
   return true;
 }
 
+void AudioManager::startPreRoll() {
+  if (!preRollBuffer || preRollActive || isRecording) return;
+  
+  currentRecordPos = 0;
+  preRollPos = 0;
+  preRollFilled = 0;
+  preRollActive = true;
+  
+  capture->start();
+  recorderConsumer.activate();
+  
+  // 録音タスクをプリロールモードで起動(startRecording()で録音に切り替わる)
+  xTaskCreate(recordingTaskWrapper, "RecordingTask", RECORDING_TASK_STACK, this, 5, &recordingTaskHandle);
+}
+
 void AudioManager::startRecording() {
   if (isRecording) {
     Serial.println("DEBUG: Already recording, ignoring startRecording()");
@@ -79,23 +151,42 @@ void AudioManager::startRecording() {
   }
   
   Serial.println("DEBUG: Starting recording...");
-  configureI2SForRecording();
+  TurnTrace::mark(TRACE_RECORD_START);
   
   recordedSize = 0;
   currentRecordPos = 0;
+  liveStartPos = 0;
+  lastSpeechPos = 0;
+  speechHeard = false;
+  utteranceEnded = false;
+  xQueueReset(blockQueue);
   isRecording = true;
   
+  // プリロール中なら同じタスクがそのまま録音に切り替わる
+  if (preRollActive) {
+    return;
+  }
+  
+  // I2Sは再初期化せず、取り込みサービスからの受け取りを開始するだけ
+  capture->start();
+  recorderConsumer.activate();
+  
   // 録音タスクを作成
-  xTaskCreate(recordingTaskWrapper, "RecordingTask", 8192, this, 5, NULL);
+  xTaskCreate(recordingTaskWrapper, "RecordingTask", RECORDING_TASK_STACK, this, 5, &recordingTaskHandle);
   Serial.println("DEBUG: Recording task created");
 }
 
 size_t AudioManager::stopRecording() {
   isRecording = false;
-  i2s_driver_uninstall(I2S_NUM_0);
+  preRollActive = false;
   
-  // 少し待ってタスクの終了を待つ
-  vTaskDelay(pdMS_TO_TICKS(100));
+  // タスクが最後のフレームを書き終えて終了するのを待つ
+  unsigned long startTime = millis();
+  while (recordingTaskHandle != NULL && millis() - startTime < 1000) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  recorderConsumer.deactivate();
+  TurnTrace::mark(TRACE_RECORD_STOP);
   
   return recordedSize;
 }
@@ -108,156 +199,433 @@ size_t AudioManager::getRecordedSize() {
   return recordedSize;
 }
 
-void AudioManager::startPlayback(uint8_t* data, size_t size, int sampleRate) {
+bool AudioManager::isUtteranceEnded() {
+  return utteranceEnded;
+}
+
+QueueHandle_t AudioManager::getBlockQueue() {
+  return blockQueue;
+}
+
+void AudioManager::publishBlock(bool last) {
+  RecordedBlock block = { recordedSize, last };
+  xQueueOverwrite(blockQueue, &block);
+}
+
+// 古いデータを上書きしながらプリロールに追記する
+void AudioManager::appendPreRoll(const uint8_t* data, size_t size) {
+  if (size >= preRollCapacity) {
+    data += size - preRollCapacity;
+    size = preRollCapacity;
+  }
+  
+  size_t first = min(size, preRollCapacity - preRollPos);
+  memcpy(preRollBuffer + preRollPos, data, first);
+  memcpy(preRollBuffer, data + first, size - first);
+  
+  preRollPos = (preRollPos + size) % preRollCapacity;
+  preRollFilled = min(preRollFilled + size, preRollCapacity);
+}
+
+// プリロールの内容を古い順に録音バッファの先頭へ移す
+void AudioManager::flushPreRoll() {
+  size_t start = (preRollPos + preRollCapacity - preRollFilled) % preRollCapacity;
+  size_t first = min(preRollFilled, preRollCapacity - start);
+  memcpy(recordBuffer, preRollBuffer + start, first);
+  memcpy(recordBuffer + first, preRollBuffer, preRollFilled - first);
+  
+  currentRecordPos = preRollFilled;
+  recordedSize = currentRecordPos;
+  liveStartPos = currentRecordPos;
+  lastSpeechPos = currentRecordPos;
+  Serial.printf("DEBUG: Prepended %u ms of pre-roll\n",
+                (unsigned)(preRollFilled / sizeof(int16_t) * 1000 / SAMPLE_RATE));
+  preRollFilled = 0;
+  preRollActive = false;
+}
+
+// フレームの音量から終話を判定する(録音タスクから呼ぶ)
+// プリロールはウェイクワードの末尾を含みうるため、判定には録音開始後のフレームだけを使う
+void AudioManager::updateEndpoint(const int16_t* samples, size_t count) {
+  if (count == 0) return;
+  
+  // PDMマイクは直流成分を持つため、平均を引いてから平均振幅を求める
+  uint32_t level = AudioDsp::meanAbs(samples, count, AudioDsp::mean(samples, count));
+  
+  if (level > ENDPOINT_SPEECH_LEVEL) {
+    speechHeard = true;
+    lastSpeechPos = currentRecordPos;
+  }
+  
+  const size_t bytesPerMs = SAMPLE_RATE * sizeof(int16_t) / 1000;
+  size_t recordedMs = (currentRecordPos - liveStartPos) / bytesPerMs;
+  size_t silenceMs = (currentRecordPos - lastSpeechPos) / bytesPerMs;
+  if (speechHeard && recordedMs >= ENDPOINT_MIN_RECORDING_MS && silenceMs >= ENDPOINT_SILENCE_MS) {
+    utteranceEnded = true;
+  }
+  
+  if (DEBUG_VOICE_DETECTION) {
+    Serial.printf("Endpoint: level %u, silence %u ms\n", level, (unsigned)silenceMs);
+  }
+}
+
+void AudioManager::startPlayback(const SegmentChain* data, const AudioFormat& format) {
   if (isPlayingAudio) return;
+  if (!configureFormat(format)) return;
+  if (!startEngine()) return;
   
-  configureI2SForPlayback(sampleRate);
   isPlayingAudio = true;
+  tracePlayback = true;
   
   // 再生タスクを作成
-  struct PlaybackParams {
-    AudioManager* manager;
-    uint8_t* data;
-    size_t size;
-  };
-  
   PlaybackParams* params = new PlaybackParams();
   params->manager = this;
   params->data = data;
-  params->size = size;
+  params->clip = nullptr;
+  params->clipSize = 0;
+  
+  xTaskCreate(playbackTaskWrapper, "PlaybackTask", PLAYBACK_TASK_STACK, params, 5, &playbackTaskHandle);
+}
+
+void AudioManager::startClipPlayback(const uint8_t* data, size_t size, const AudioFormat& format, bool traced) {
+  if (isPlayingAudio) return;
+  if (!configureFormat(format)) return;
+  if (!startEngine()) return;
+  
+  if (traced) {
+    underrunCount = 0;
+    firstAudioTime = millis(); // 手元にあるので待たずに書き込む
+  }
+  isPlayingAudio = true;
+  tracePlayback = traced;
+  
+  PlaybackParams* params = new PlaybackParams();
+  params->manager = this;
+  params->data = nullptr;
+  params->clip = data;
+  params->clipSize = size;
   
-  xTaskCreate(playbackTaskWrapper, "PlaybackTask", 8192, params, 5, NULL);
+  xTaskCreate(playbackTaskWrapper, "PlaybackTask", PLAYBACK_TASK_STACK, params, 5, &playbackTaskHandle);
+}
+
+void AudioManager::startStreamingPlayback() {
+  if (isPlayingAudio) return;
+  if (!startEngine()) return;
+  
+  underrunCount = 0;
+  firstAudioTime = 0;
+  isPlayingAudio = true;
+  tracePlayback = true;
+  
+  // 再生タスクを作成(データはリングバッファから読み出す)
+  xTaskCreate(streamingPlaybackTaskWrapper, "PlaybackTask", PLAYBACK_TASK_STACK, this, 5, &playbackTaskHandle);
 }
 
 void AudioManager::stopPlayback() {
   isPlayingAudio = false;
-  i2s_driver_uninstall(I2S_NUM_0);
+  playbackRing.abort(); // 受信側の書き込み待ちを解除
+  
+  // ドライバの解放は再生タスク側で行う(書き込み中に解放しないため)
+  unsigned long startTime = millis();
+  while (playbackTaskHandle != NULL && millis() - startTime < 1000) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  if (playbackTaskHandle != NULL) {
+    Serial.println("ERROR: PlaybackTask did not terminate, forcing deletion.");
+    MemoryMonitor::forgetTask(playbackTaskHandle);
+    vTaskDelete(playbackTaskHandle);
+    playbackTaskHandle = NULL;
+    engine.stop(false);
+  }
 }
 
 bool AudioManager::isPlaying() {
   return isPlayingAudio;
 }
 
-void AudioManager::configureI2SForRecording() {
-  Serial.println("DEBUG: Configuring I2S for recording...");
-  i2s_driver_uninstall(I2S_NUM_0);
-  
-  i2sConfig.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_PDM);
-  i2sConfig.sample_rate = 16000;
-  i2sConfig.tx_desc_auto_clear = false;
-  pinConfig.data_in_num = CONFIG_I2S_DATA_IN_PIN;
+AudioRingBuffer* AudioManager::getPlaybackRing() {
+  return STREAMING_PLAYBACK ? &playbackRing : nullptr;
+}
 
-  esp_err_t result = i2s_driver_install(I2S_NUM_0, &i2sConfig, 0, NULL);
-  if (result != ESP_OK) {
-    Serial.printf("ERROR: I2S driver install failed: %d\n", result);
-    return;
-  } else {
-    Serial.println("DEBUG: I2S driver installed successfully");
-  }
+uint32_t AudioManager::getUnderrunCount() {
+  return underrunCount;
+}
+
+PlaybackStats AudioManager::getPlaybackStats() {
+  return engine.getStats();
+}
+
+unsigned long AudioManager::getFirstAudioTime() {
+  return firstAudioTime;
+}
+
+// 再生タスクから: これから渡すチャンクの音量を、DMAなどに溜まっている分だけ後の時刻で公開する
+void AudioManager::publishLevel(const int16_t* samples, size_t count) {
+  uint32_t level = (count > 0) ? AudioDsp::meanAbs(samples, count) : 0;
+  LevelPoint& point = levelPoints[levelWritten % LEVEL_POINTS];
+  point.playAt = millis() + engine.bufferedSamples() * 1000 / PLAYBACK_SAMPLE_RATE;
+  point.level = min(level, (uint32_t)UINT16_MAX);
+  levelWritten = levelWritten + 1;
+}
+
+uint16_t AudioManager::getOutputLevel() {
+  if (!isPlayingAudio) return 0;
   
-  result = i2s_set_pin(I2S_NUM_0, &pinConfig);
-  if (result != ESP_OK) {
-    Serial.printf("ERROR: I2S set pin failed: %d\n", result);
-    return;
-  } else {
-    Serial.println("DEBUG: I2S pins configured successfully");
+  // 新しい点から順に、時刻が来ている最初の点を返す(次に上書きされる位置は読まない)
+  uint32_t written = levelWritten;
+  unsigned long now = millis();
+  for (uint32_t n = 1; n < LEVEL_POINTS && n <= written; n++) {
+    const LevelPoint& point = levelPoints[(written - n) % LEVEL_POINTS];
+    if ((long)(now - point.playAt) >= 0) {
+      return point.level;
+    }
   }
-  
-  i2s_zero_dma_buffer(I2S_NUM_0);
-  Serial.println("DEBUG: I2S configuration complete");
+  return 0;
 }
 
-void AudioManager::configureI2SForPlayback(int sampleRate) {
-  i2s_driver_uninstall(I2S_NUM_0);
-  
-  i2sConfig.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX);
-  i2sConfig.sample_rate = sampleRate;
-  i2sConfig.tx_desc_auto_clear = true;
-  pinConfig.data_in_num = I2S_PIN_NO_CHANGE;
-  
-  esp_err_t result = i2s_driver_install(I2S_NUM_0, &i2sConfig, 0, NULL);
-  if (result != ESP_OK) {
-    Serial.printf("I2S driver install failed: %d\n", result);
-    return;
+bool AudioManager::configureFormat(const AudioFormat& format) {
+  playbackCodec = format.codec;
+  if (!resampler.configure(format.sampleRate, PLAYBACK_SAMPLE_RATE)) {
+    Serial.printf("Unsupported response sample rate: %u Hz\n", (unsigned)format.sampleRate);
+    return false;
   }
-  
-  result = i2s_set_pin(I2S_NUM_0, &pinConfig);
-  if (result != ESP_OK) {
-    Serial.printf("I2S set pin failed: %d\n", result);
-    return;
+  if (!resampler.isPassthrough()) {
+    Serial.printf("Resampling response: %u -> %d Hz\n", (unsigned)format.sampleRate, PLAYBACK_SAMPLE_RATE);
   }
-  
-  i2s_zero_dma_buffer(I2S_NUM_0);
+  return true;
 }
 
-// Make sure this method is declared public in AudioManager.h
-void AudioManager::recordingTask() {
-  uint8_t buffer[BUFFER_SIZE];
-  size_t bytesRead = 0;
+void AudioManager::finishEngine() {
+  // 中断されていなければ渡し済みの音声を再生しきってから止める
+  engine.stop(isPlayingAudio);
   
-  while (isRecording && currentRecordPos < MAX_RECORD_SIZE - BUFFER_SIZE) {
-    esp_err_t result = i2s_read(I2S_NUM_0, buffer, BUFFER_SIZE, &bytesRead, portMAX_DELAY);
-    // Serial.printf("i2s_read result: %d, bytesRead: %d, buffer: %d\n", result, bytesRead, buffer);
-
-    // int16_t* samples = (int16_t*)buffer;
-    // int16_t maxSample = 0;
-    // int16_t minSample = 0;
+  PlaybackStats stats = engine.getStats();
+  engine.printStats();
+  if (!tracePlayback) return;
+  TurnTrace::annotate("dma_underruns", stats.underruns);
+  TurnTrace::annotate("max_write_us", stats.maxWriteMicros);
+  TurnTrace::annotate("min_dma_fill", stats.blocksWritten > 0 ? stats.minDmaFill : 0);
+}
 
-    // for (int i = 0; i < BUFFER_SIZE / 2; ++i) {
-    //   if (samples[i] > maxSample) maxSample = samples[i];
-    //   if (samples[i] < minSample) minSample = samples[i];
-    // }
-    // Serial.printf("Sample range: %d ~ %d\n", minSample, maxSample);
+bool AudioManager::startEngine() {
+  // スピーカーとマイクはI2S_NUM_0を共有しているため、再生中は取り込みを止める
+  // 出力レートは応答によらず固定(応答のレートはリサンプラで合わせる)
+  capture->stop();
+  levelWritten = 0;
+  return engine.start();
+}
 
-    if (result != ESP_OK) {
-      Serial.printf("ERROR (AudioManager): i2s_read failed with code: %d\n", result);
+// Make sure this method is declared public in AudioManager.h
+void AudioManager::recordingTask() {
+  // ゲイン適用済みのフレームを取り込みサービスから受け取り、
+  // 待機中はプリロールへ、録音中は録音バッファへ追記する
+  while ((isRecording || preRollActive) && currentRecordPos < MAX_RECORD_SIZE) {
+    CaptureFrame* frame = recorderConsumer.receive(pdMS_TO_TICKS(100));
+    if (frame == nullptr) {
+      continue;
     }
-
-    if (bytesRead > 0) {
-      // Serial.printf("DEBUG (AudioManager): Read %d bytes\n", bytesRead);
-      int16_t* samples = (int16_t*)buffer;
-      size_t sampleCount = bytesRead / sizeof(int16_t);
-
-      // ソフトウェアゲインを適用
-      for (size_t i = 0; i < sampleCount; i++) {
-        int32_t amplified_sample = (int32_t)samples[i] * SOFTWARE_GAIN;
-        if (amplified_sample > 32767) amplified_sample = 32767;
-        if (amplified_sample < -32768) amplified_sample = -32768;
-        samples[i] = (int16_t)amplified_sample;
-      }
-      
-      memcpy(recordBuffer + currentRecordPos, buffer, bytesRead);
-      currentRecordPos += bytesRead;
-      recordedSize = currentRecordPos;
+    
+    const uint8_t* data = (const uint8_t*)frame->samples;
+    size_t bytes = frame->length * sizeof(int16_t);
+    
+    if (!isRecording) {
+      appendPreRoll(data, bytes);
+      recorderConsumer.release(frame);
+      continue;
     }
     
-    vTaskDelay(pdMS_TO_TICKS(1));
+    // 録音に切り替わった最初のフレームの前にプリロールを移す
+    if (preRollActive) {
+      flushPreRoll();
+    }
+    
+    if (bytes > MAX_RECORD_SIZE - currentRecordPos) {
+      bytes = MAX_RECORD_SIZE - currentRecordPos;
+    }
+    memcpy(recordBuffer + currentRecordPos, data, bytes);
+    recorderConsumer.release(frame);
+    
+    currentRecordPos += bytes;
+    recordedSize = currentRecordPos;
+    if (ENDPOINT_DETECTION) {
+      updateEndpoint((const int16_t*)(recordBuffer + currentRecordPos - bytes), bytes / sizeof(int16_t));
+    }
+    publishBlock(false);
   }
   
+  if (recorderConsumer.getDroppedFrames() > 0) {
+    Serial.printf("WARNING: Recorder dropped %u frames\n", recorderConsumer.getDroppedFrames());
+  }
+  
+  // ゲイン調整の目安としてピークと飽和したサンプル数を表示する
+  if (DEBUG_VOICE_DETECTION && recordedSize > 0) {
+    AudioDsp::PeakInfo info = AudioDsp::peak((const int16_t*)recordBuffer, recordedSize / sizeof(int16_t));
+    Serial.printf("Recording peak: %u, clipped samples: %u\n", info.peak, info.clipped);
+  }
+  
+  // 録音終了を通知(パイプライン送信の終端になる)
+  publishBlock(true);
+  recordingTaskHandle = NULL;
+  MemoryMonitor::taskExiting();
   vTaskDelete(NULL);
 }
 
-void AudioManager::playbackTask(uint8_t* data, size_t size) {
-  const size_t chunkSize = BUFFER_SIZE;
-  size_t bytesWritten = 0;
+// ADPCMの場合は1ブロックをデコードし、出力レートと違えば変換してから再生エンジンへ渡す
+// PCMのdataはint16_tの境界に揃っていること
+bool AudioManager::writeToI2S(const uint8_t* data, size_t size) {
+  int16_t decoded[AdpcmCodec::RESPONSE_BLOCK_SIZE * 2];
+  
+  if (playbackCodec == AUDIO_CODEC_IMA_ADPCM) {
+    size_t samples = AdpcmCodec::decodeBlock(data, size, decoded);
+    data = (const uint8_t*)decoded;
+    size = samples * sizeof(int16_t);
+  }
+  publishLevel((const int16_t*)data, size / sizeof(int16_t));
+  
+  if (resampler.isPassthrough()) {
+    size_t count = size / sizeof(int16_t);
+    return engine.write((const int16_t*)data, count) == count;
+  }
+  
+  int16_t resampled[256];
+  const int16_t* samples = (const int16_t*)data;
+  size_t remaining = size / sizeof(int16_t);
+  while (remaining > 0) {
+    size_t consumed = 0;
+    size_t produced = resampler.process(samples, remaining, consumed, resampled, sizeof(resampled) / sizeof(resampled[0]));
+    if (consumed == 0) break;
+    samples += consumed;
+    remaining -= consumed;
+    
+    if (engine.write(resampled, produced) != produced) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 連続した領域をチャンクに分けて再生する。中断されるか書き込めなければfalse
+bool AudioManager::playSpan(const uint8_t* data, size_t size) {
+  // ADPCMはブロック単位でデコードする
+  const size_t chunkSize = (playbackCodec == AUDIO_CODEC_IMA_ADPCM) ? AdpcmCodec::RESPONSE_BLOCK_SIZE : BUFFER_SIZE;
   size_t totalWritten = 0;
   
   while (isPlayingAudio && totalWritten < size) {
     size_t remainingBytes = size - totalWritten;
     size_t currentChunk = (remainingBytes < chunkSize) ? remainingBytes : chunkSize;
     
-    esp_err_t result = i2s_write(I2S_NUM_0, data + totalWritten, currentChunk, &bytesWritten, portMAX_DELAY);
+    if (!writeToI2S(data + totalWritten, currentChunk)) {
+      return false;
+    }
+    totalWritten += currentChunk;
+  }
+  return isPlayingAudio;
+}
+
+void AudioManager::playbackTask(const SegmentChain* data, const uint8_t* clip, size_t clipSize) {
+  if (tracePlayback) {
+    TurnTrace::mark(TRACE_PLAYBACK_START);
+    TurnTrace::mark(TRACE_FIRST_AUDIO); // 受信済みのデータをすぐ書き込む
+  }
+  
+  bool ok = true;
+  if (data) {
+    // セグメントのサイズはADPCMブロックの倍数なので、ブロックがセグメントをまたぐことはない
+    for (size_t s = 0; ok && s < data->getSegmentCount(); s++) {
+      ok = playSpan(data->getSegment(s), data->getSegmentLength(s));
+    }
+  } else {
+    ok = playSpan(clip, clipSize);
+  }
+  if (!ok) {
+    isPlayingAudio = false;
+  }
+  
+  // 最後まで再生しきり、ドライバを解放してから終了を通知する(次の状態がすぐI2Sを使えるように)
+  finishEngine();
+  if (tracePlayback) {
+    TurnTrace::mark(TRACE_PLAYBACK_END);
+  }
+  playbackTaskHandle = NULL;
+  isPlayingAudio = false;
+  MemoryMonitor::taskExiting();
+  vTaskDelete(NULL);
+}
+
+void AudioManager::streamingPlaybackTask() {
+  int16_t chunkSamples[BUFFER_SIZE / sizeof(int16_t)]; // PCMをサンプルとして読めるように揃える
+  uint8_t* chunk = (uint8_t*)chunkSamples;
+  bool starving = false;
+  TurnTrace::mark(TRACE_PLAYBACK_START);
+  
+  // 受信側は最初のデータより先に形式を設定するので、データが来てから形式を読む
+  while (isPlayingAudio && playbackRing.available() == 0 && !playbackRing.isFinished()) {
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  AudioFormat format = playbackRing.getFormat();
+  if (!configureFormat(format)) {
+    isPlayingAudio = false;
+    playbackRing.abort();
+  }
+  
+  // 1回に読み出す単位: PCMはサンプル境界、ADPCMはブロック単位
+  const bool adpcm = (playbackCodec == AUDIO_CODEC_IMA_ADPCM);
+  const size_t unit = adpcm ? AdpcmCodec::RESPONSE_BLOCK_SIZE : sizeof(int16_t);
+  const size_t readSize = adpcm ? AdpcmCodec::RESPONSE_BLOCK_SIZE : BUFFER_SIZE;
+  
+  // ジッタ吸収分が溜まるまで再生を開始しない(入力のレートで数える)
+  size_t jitterSamples = (size_t)format.sampleRate * PLAYBACK_JITTER_MS / 1000;
+  size_t jitterBytes = adpcm ? jitterSamples / 2 : jitterSamples * sizeof(int16_t);
+  jitterBytes = min(jitterBytes, playbackRing.getCapacity());
+  while (isPlayingAudio && playbackRing.available() < jitterBytes && !playbackRing.isFinished()) {
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  firstAudioTime = millis();
+  TurnTrace::mark(TRACE_FIRST_AUDIO);
+  
+  while (isPlayingAudio) {
+    // 受信完了フラグを先に見ることで、残量を確定値として扱える
+    bool finished = playbackRing.isFinished();
+    size_t avail = playbackRing.available();
+    size_t toRead = min(avail - avail % unit, readSize);
     
-    if (result == ESP_OK) {
-      totalWritten += bytesWritten;
-    } else {
-      Serial.printf("I2S write failed: %d\n", result);
-      break;
+    if (toRead == 0 && finished) {
+      if (!adpcm || avail == 0) break; // 受信完了かつ再生しきった
+      toRead = avail; // 最後の端数ブロック
     }
     
-    vTaskDelay(pdMS_TO_TICKS(1));
+    if (toRead == 0) {
+      // アンダーラン: 無音を挿入して受信を待つ
+      if (!starving) {
+        underrunCount++;
+        starving = true;
+      }
+      // (再生エンジンのブロックが空くまで待つので、DMAの消費に合わせて進む)
+      memset(chunkSamples, 0, sizeof(chunkSamples));
+      size_t count = sizeof(chunkSamples) / sizeof(int16_t);
+      publishLevel(chunkSamples, 0);
+      if (engine.write(chunkSamples, count) != count) {
+        break;
+      }
+      continue;
+    }
+    
+    starving = false;
+    size_t n = playbackRing.read(chunk, toRead);
+    if (!writeToI2S(chunk, n)) {
+      break;
+    }
   }
   
+  if (underrunCount > 0) {
+    Serial.printf("Playback underruns: %u\n", underrunCount);
+  }
+  TurnTrace::annotate("underruns", underrunCount);
+  
+  finishEngine();
+  TurnTrace::mark(TRACE_PLAYBACK_END);
+  playbackTaskHandle = NULL;
   isPlayingAudio = false;
-  i2s_driver_uninstall(I2S_NUM_0);
+  MemoryMonitor::taskExiting();
+  vTaskDelete(NULL);
 }
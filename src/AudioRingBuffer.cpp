@@ -0,0 +1,128 @@
+#include "AudioRingBuffer.h"
+#include "config.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+AudioRingBuffer::AudioRingBuffer() {
+  buffer = nullptr;
+  capacity = 0;
+  head = 0;
+  tail = 0;
+  finished = false;
+  aborted = false;
+  format = { RESPONSE_DEFAULT_SAMPLE_RATE, AUDIO_CODEC_PCM16 };
+}
+
+AudioRingBuffer::~AudioRingBuffer() {
+  if (buffer) {
+    heap_caps_free(buffer);
+  }
+}
+
+bool AudioRingBuffer::init(size_t size) {
+  // PSRAMがあればそちらに確保する
+  constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+  buffer = (uint8_t*)heap_caps_malloc(size, memCaps);
+  if (!buffer) {
+    Serial.println("Failed to allocate ring buffer");
+    return false;
+  }
+  capacity = size;
+  reset();
+  return true;
+}
+
+void AudioRingBuffer::reset() {
+  head = 0;
+  tail = 0;
+  finished = false;
+  aborted = false;
+  format = { RESPONSE_DEFAULT_SAMPLE_RATE, AUDIO_CODEC_PCM16 };
+}
+
+void AudioRingBuffer::setFormat(const AudioFormat& audioFormat) {
+  format = audioFormat;
+}
+
+AudioFormat AudioRingBuffer::getFormat() const {
+  return format;
+}
+
+size_t AudioRingBuffer::write(const uint8_t* data, size_t size) {
+  size_t written = 0;
+
+  while (written < size && !aborted) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t space = capacity - (h - tail.load(std::memory_order_acquire));
+    if (space == 0) {
+      // 再生側が読み出すまで待つ
+      vTaskDelay(pdMS_TO_TICKS(1));
+      continue;
+    }
+
+    size_t n = min(space, size - written);
+    size_t offset = h % capacity;
+    size_t first = min(n, capacity - offset);
+    memcpy(buffer + offset, data + written, first);
+    memcpy(buffer, data + written + first, n - first);
+
+    head.store(h + n, std::memory_order_release);
+    written += n;
+  }
+
+  return written;
+}
+
+uint8_t* AudioRingBuffer::writeSpan(size_t& length) {
+  size_t h = head.load(std::memory_order_relaxed);
+  size_t space = capacity - (h - tail.load(std::memory_order_acquire));
+  size_t offset = h % capacity;
+  length = min(space, capacity - offset); // 末尾で折り返す手前まで
+  return length > 0 ? buffer + offset : nullptr;
+}
+
+void AudioRingBuffer::commit(size_t length) {
+  head.store(head.load(std::memory_order_relaxed) + length, std::memory_order_release);
+}
+
+size_t AudioRingBuffer::read(uint8_t* dst, size_t size) {
+  size_t t = tail.load(std::memory_order_relaxed);
+  size_t n = min(size, head.load(std::memory_order_acquire) - t);
+  if (n == 0) return 0;
+
+  size_t offset = t % capacity;
+  size_t first = min(n, capacity - offset);
+  memcpy(dst, buffer + offset, first);
+  memcpy(dst + first, buffer, n - first);
+
+  tail.store(t + n, std::memory_order_release);
+  return n;
+}
+
+size_t AudioRingBuffer::available() const {
+  return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+size_t AudioRingBuffer::getCapacity() const {
+  return capacity;
+}
+
+const uint8_t* AudioRingBuffer::getBuffer() const {
+  return buffer;
+}
+
+void AudioRingBuffer::finish() {
+  finished = true;
+}
+
+bool AudioRingBuffer::isFinished() const {
+  return finished;
+}
+
+void AudioRingBuffer::abort() {
+  aborted = true;
+}
+
+bool AudioRingBuffer::isAborted() const {
+  return aborted;
+}
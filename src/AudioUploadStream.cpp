@@ -0,0 +1,278 @@
+#include "AudioUploadStream.h"
+#include <freertos/task.h>
+#include "TurnTrace.h"
+#include "Base64.h"
+
+static const char JSON_PREFIX[] = "{\"audio\":\"";
+static const char JSON_SUFFIX[] = "\"}";
+static const char LAST_CHUNK[] = "0\r\n\r\n";
+static const char FRAME_MAGIC[4] = { 'T', 'B', 'A', 'F' };
+
+AudioUploadStream::AudioUploadStream() {
+  begin(nullptr, 0);
+}
+
+void AudioUploadStream::begin(const uint8_t* data, size_t size, UploadFormat bodyFormat, AudioCodec bodyCodec) {
+  sourceData = data;
+  sourceSize = size;
+  sourcePos = 0;
+  sourceFinished = true;
+  sourceQueue = NULL;
+  chunked = false;
+  format = bodyFormat;
+  codec = bodyCodec;
+  adpcmState.index = 0;
+  frameSequence = 0;
+  phase = PHASE_PREFIX;
+  blockLen = 0;
+  blockPos = 0;
+  encodeMicros = 0;
+}
+
+void AudioUploadStream::beginPipelined(const uint8_t* data, QueueHandle_t blockQueue, UploadFormat bodyFormat,
+                                       AudioCodec bodyCodec) {
+  begin(data, 0, bodyFormat, bodyCodec);
+  sourceFinished = false;
+  sourceQueue = blockQueue;
+  chunked = true;
+}
+
+bool AudioUploadStream::rewind(UploadFormat bodyFormat) {
+  // 録音が終わるまで待ってから、確定したデータ全体を別形式で送り直す
+  unsigned long start = millis();
+  while (!sourceFinished) {
+    pollSource();
+    if (millis() - start > 15000) return false;
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  begin(sourceData, sourceSize, bodyFormat, codec);
+  return true;
+}
+
+bool AudioUploadStream::isUntouched() const {
+  return phase == PHASE_PREFIX && blockLen == 0;
+}
+
+bool AudioUploadStream::isChunked() const {
+  return chunked;
+}
+
+UploadFormat AudioUploadStream::getFormat() const {
+  return format;
+}
+
+const char* AudioUploadStream::contentType() const {
+  return (format == UPLOAD_FORMAT_BINARY) ? "application/octet-stream" : "application/json";
+}
+
+size_t AudioUploadStream::contentLength() const {
+  if (chunked) return 0;
+  if (format == UPLOAD_FORMAT_BINARY && codec == AUDIO_CODEC_IMA_ADPCM) {
+    size_t samples = sourceSize / 2;
+    size_t fullFrames = samples / FRAME_ADPCM_SAMPLES;
+    size_t rest = samples % FRAME_ADPCM_SAMPLES;
+    size_t length = fullFrames * (sizeof(AudioFrameHeader) + AdpcmCodec::encodedSize(FRAME_ADPCM_SAMPLES));
+    if (rest > 0) {
+      length += sizeof(AudioFrameHeader) + AdpcmCodec::encodedSize(rest);
+    }
+    return length + sizeof(AudioFrameHeader); // 終端フレーム
+  }
+  if (format == UPLOAD_FORMAT_BINARY) {
+    size_t frames = (sourceSize + FRAME_PAYLOAD_SIZE - 1) / FRAME_PAYLOAD_SIZE;
+    return (frames + 1) * sizeof(AudioFrameHeader) + sourceSize; // +1は終端フレーム
+  }
+  return (sizeof(JSON_PREFIX) - 1) + Base64::encodedLength(sourceSize) + (sizeof(JSON_SUFFIX) - 1);
+}
+
+uint32_t AudioUploadStream::getEncodeMicros() const {
+  return encodeMicros;
+}
+
+void AudioUploadStream::pollSource() {
+  if (!sourceQueue || sourceFinished) return;
+
+  RecordedBlock recorded;
+  if (xQueueReceive(sourceQueue, &recorded, 0) == pdTRUE) {
+    sourceSize = recorded.end;
+    sourceFinished = recorded.last;
+  }
+}
+
+size_t AudioUploadStream::fillPayload(char* dst) {
+  return (format == UPLOAD_FORMAT_BINARY) ? fillBinary(dst) : fillJson(dst);
+}
+
+size_t AudioUploadStream::fillJson(char* dst) {
+  while (true) {
+    switch (phase) {
+      case PHASE_PREFIX:
+        memcpy(dst, JSON_PREFIX, sizeof(JSON_PREFIX) - 1);
+        phase = PHASE_BODY;
+        return sizeof(JSON_PREFIX) - 1;
+
+      case PHASE_BODY: {
+        pollSource();
+        size_t remaining = sourceSize - sourcePos;
+        size_t toEncode = (remaining < RAW_BLOCK_SIZE) ? remaining : RAW_BLOCK_SIZE;
+        if (!sourceFinished) {
+          toEncode -= toEncode % 3; // 録音途中ではパディングを出さない
+        }
+        if (toEncode == 0) {
+          if (!sourceFinished) return 0; // 録音データ待ち
+          phase = PHASE_SUFFIX;
+          continue;
+        }
+        uint32_t start = micros();
+        size_t n = Base64::encode(sourceData + sourcePos, toEncode, dst);
+        encodeMicros += micros() - start;
+        sourcePos += toEncode;
+        return n;
+      }
+
+      case PHASE_SUFFIX:
+        memcpy(dst, JSON_SUFFIX, sizeof(JSON_SUFFIX) - 1);
+        phase = chunked ? PHASE_LAST_CHUNK : PHASE_DONE;
+        return sizeof(JSON_SUFFIX) - 1;
+
+      default:
+        return 0;
+    }
+  }
+}
+
+size_t AudioUploadStream::writeFrameHeader(char* dst, uint32_t payloadLength) {
+  AudioFrameHeader header;
+  memcpy(header.magic, FRAME_MAGIC, sizeof(header.magic));
+  header.payloadLength = payloadLength;
+  header.sampleRate = SAMPLE_RATE;
+  header.channels = CHANNELS;
+  header.codec = codec;
+  header.sequence = frameSequence++;
+  memcpy(dst, &header, sizeof(header)); // ESP32はリトルエンディアンなのでそのまま書き出せる
+  return sizeof(header);
+}
+
+size_t AudioUploadStream::fillFramePayload(char* dst, size_t& consumed) {
+  size_t remaining = sourceSize - sourcePos;
+
+  if (codec == AUDIO_CODEC_IMA_ADPCM) {
+    size_t samples = remaining / 2;
+    if (samples > FRAME_ADPCM_SAMPLES) samples = FRAME_ADPCM_SAMPLES;
+    if (!sourceFinished && samples % 2 == 0 && samples > 0) {
+      samples--; // 録音途中では詰め物のニブルが出ないよう奇数サンプルで区切る
+    }
+    consumed = samples * 2;
+    if (samples == 0) return 0;
+    return AdpcmCodec::encodeBlock((const int16_t*)(sourceData + sourcePos), samples, (uint8_t*)dst, adpcmState);
+  }
+
+  size_t payload = (remaining < FRAME_PAYLOAD_SIZE) ? remaining : FRAME_PAYLOAD_SIZE;
+  if (!sourceFinished) {
+    payload &= ~(size_t)1; // 録音途中ではサンプル境界で区切る
+  }
+  memcpy(dst, sourceData + sourcePos, payload);
+  consumed = payload;
+  return payload;
+}
+
+size_t AudioUploadStream::fillBinary(char* dst) {
+  switch (phase) {
+    case PHASE_PREFIX:
+    case PHASE_BODY: {
+      phase = PHASE_BODY;
+      pollSource();
+
+      size_t consumed = 0;
+      uint32_t start = micros();
+      size_t payload = fillFramePayload(dst + sizeof(AudioFrameHeader), consumed);
+      encodeMicros += micros() - start;
+
+      if (consumed == 0) {
+        if (!sourceFinished) return 0; // 録音データ待ち
+        // 終端フレーム
+        phase = chunked ? PHASE_LAST_CHUNK : PHASE_DONE;
+        return writeFrameHeader(dst, 0);
+      }
+      sourcePos += consumed;
+      return writeFrameHeader(dst, payload) + payload;
+    }
+
+    default:
+      return 0;
+  }
+}
+
+bool AudioUploadStream::fillBlock() {
+  blockPos = 0;
+  blockLen = 0;
+
+  if (phase == PHASE_LAST_CHUNK) {
+    blockLen = sizeof(LAST_CHUNK) - 1;
+    memcpy(block, LAST_CHUNK, blockLen);
+    phase = PHASE_DONE;
+    return true;
+  }
+
+  char* payload = block + CHUNK_HEADER_RESERVE;
+  size_t n = fillPayload(payload);
+  if (n == 0) return false;
+
+  blockPos = CHUNK_HEADER_RESERVE;
+  blockLen = CHUNK_HEADER_RESERVE + n;
+
+  if (chunked) {
+    // ペイロードの直前にチャンクサイズ行、直後に終端を付ける
+    char header[CHUNK_HEADER_RESERVE];
+    int headerLen = snprintf(header, sizeof(header), "%x\r\n", (unsigned int)n);
+    blockPos -= headerLen;
+    memcpy(block + blockPos, header, headerLen);
+    block[blockLen++] = '\r';
+    block[blockLen++] = '\n';
+  }
+  return true;
+}
+
+int AudioUploadStream::available() {
+  // HTTPClientはヘッダを書き終えてからボディを読み始める
+  TurnTrace::mark(TRACE_HEADERS_SENT);
+  if (blockPos >= blockLen && !fillBlock()) {
+    // 送出完了なら-1でHTTPClientの送信ループを終了させる。0は録音データ待ち
+    if (phase == PHASE_DONE) {
+      TurnTrace::mark(TRACE_BODY_SENT);
+      return -1;
+    }
+    return 0;
+  }
+  return blockLen - blockPos;
+}
+
+int AudioUploadStream::read() {
+  if (available() <= 0) return -1;
+  return (uint8_t)block[blockPos++];
+}
+
+int AudioUploadStream::peek() {
+  if (available() <= 0) return -1;
+  return (uint8_t)block[blockPos];
+}
+
+size_t AudioUploadStream::readBytes(char* buffer, size_t length) {
+  size_t copied = 0;
+  while (copied < length) {
+    int avail = available();
+    if (avail <= 0) break;
+
+    size_t n = min((size_t)avail, length - copied);
+    memcpy(buffer + copied, block + blockPos, n);
+    blockPos += n;
+    copied += n;
+  }
+  return copied;
+}
+
+size_t AudioUploadStream::write(uint8_t) {
+  return 0; // 読み出し専用
+}
+
+void AudioUploadStream::flush() {
+}
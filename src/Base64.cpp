@@ -0,0 +1,35 @@
+#include "Base64.h"
+
+static const char BASE64_TABLE[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t Base64::encodedLength(size_t length) {
+  return (length + 2) / 3 * 4;
+}
+
+size_t Base64::encode(const uint8_t* src, size_t length, char* dst) {
+  char* out = dst;
+  size_t i = 0;
+
+  // 3バイト -> 4文字
+  for (; i + 3 <= length; i += 3) {
+    uint32_t v = ((uint32_t)src[i] << 16) | ((uint32_t)src[i + 1] << 8) | src[i + 2];
+    *out++ = BASE64_TABLE[(v >> 18) & 0x3F];
+    *out++ = BASE64_TABLE[(v >> 12) & 0x3F];
+    *out++ = BASE64_TABLE[(v >> 6) & 0x3F];
+    *out++ = BASE64_TABLE[v & 0x3F];
+  }
+
+  // 端数はパディング付きで出力
+  size_t rest = length - i;
+  if (rest > 0) {
+    uint32_t v = (uint32_t)src[i] << 16;
+    if (rest == 2) v |= (uint32_t)src[i + 1] << 8;
+    *out++ = BASE64_TABLE[(v >> 18) & 0x3F];
+    *out++ = BASE64_TABLE[(v >> 12) & 0x3F];
+    *out++ = (rest == 2) ? BASE64_TABLE[(v >> 6) & 0x3F] : '=';
+    *out++ = '=';
+  }
+
+  return out - dst;
+}
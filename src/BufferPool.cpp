@@ -0,0 +1,193 @@
+#include "BufferPool.h"
+#include <string.h>
+
+BufferPool::BufferPool() {
+  arena = nullptr;
+  segmentSize = 0;
+  segmentCount = 0;
+  memset(used, 0, sizeof(used));
+  inUse = 0;
+  highWater = 0;
+  failures = 0;
+  lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+BufferPool::~BufferPool() {
+  if (arena) {
+    heap_caps_free(arena);
+  }
+}
+
+bool BufferPool::init(size_t bytesPerSegment, size_t segments) {
+  if (segments > MAX_SEGMENTS) {
+    Serial.printf("Buffer pool: too many segments (%u > %u)\n", (unsigned)segments, (unsigned)MAX_SEGMENTS);
+    return false;
+  }
+
+  // PSRAMがあればそちらに一括で確保する(以後は解放しない)
+  constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+  arena = (uint8_t*)heap_caps_malloc(bytesPerSegment * segments, memCaps);
+  if (!arena) {
+    Serial.println("Failed to allocate buffer pool");
+    return false;
+  }
+  segmentSize = bytesPerSegment;
+  segmentCount = segments;
+  return true;
+}
+
+uint8_t* BufferPool::acquire(size_t count) {
+  uint8_t* result = nullptr;
+
+  portENTER_CRITICAL(&lock);
+  // 先頭から空きの並びを探す(セグメント数は高々MAX_SEGMENTS)
+  size_t run = 0;
+  for (size_t i = 0; i < segmentCount && count > 0; i++) {
+    run = used[i] ? 0 : run + 1;
+    if (run == count) {
+      size_t first = i + 1 - count;
+      for (size_t j = first; j <= i; j++) used[j] = true;
+      inUse += count;
+      if (inUse > highWater) highWater = inUse;
+      result = arena + first * segmentSize;
+      break;
+    }
+  }
+  if (!result) failures++;
+  portEXIT_CRITICAL(&lock);
+
+  return result;
+}
+
+void BufferPool::release(uint8_t* segment, size_t count) {
+  if (!segment) return;
+  size_t first = (segment - arena) / segmentSize;
+
+  portENTER_CRITICAL(&lock);
+  for (size_t j = first; j < first + count && j < segmentCount; j++) {
+    if (used[j]) {
+      used[j] = false;
+      inUse--;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+size_t BufferPool::getSegmentSize() const {
+  return segmentSize;
+}
+
+size_t BufferPool::getSegmentCount() const {
+  return segmentCount;
+}
+
+size_t BufferPool::getInUse() const {
+  return inUse;
+}
+
+size_t BufferPool::getHighWater() const {
+  return highWater;
+}
+
+uint32_t BufferPool::getFailures() const {
+  return failures;
+}
+
+bool BufferPool::contains(const void* ptr) const {
+  const uint8_t* p = (const uint8_t*)ptr;
+  return arena && p >= arena && p < arena + segmentSize * segmentCount;
+}
+
+void BufferPool::printStats(const char* label) const {
+  Serial.printf("Buffer pool (%s): %u/%u segments in use, high water %u (%u KB), failures %u, free heap %u\n",
+                label, (unsigned)inUse, (unsigned)segmentCount, (unsigned)highWater,
+                (unsigned)(highWater * segmentSize / 1024), (unsigned)failures, (unsigned)ESP.getFreeHeap());
+}
+
+SegmentChain::SegmentChain() {
+  pool = nullptr;
+  count = 0;
+  size = 0;
+}
+
+SegmentChain::~SegmentChain() {
+  clear();
+}
+
+void SegmentChain::setPool(BufferPool* bufferPool) {
+  clear();
+  pool = bufferPool;
+}
+
+size_t SegmentChain::append(const uint8_t* data, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    size_t space;
+    uint8_t* dst = writeSpan(space);
+    if (!dst) break;
+    size_t n = min(length - written, space);
+    memcpy(dst, data + written, n);
+    commit(n);
+    written += n;
+  }
+  return written;
+}
+
+uint8_t* SegmentChain::writeSpan(size_t& length) {
+  length = 0;
+  if (!pool) return nullptr;
+  const size_t segmentSize = pool->getSegmentSize();
+
+  if (size == count * segmentSize) {
+    // 末尾のセグメントが埋まったので1つ足す
+    uint8_t* segment = (count < MAX_CHAIN) ? pool->acquire() : nullptr;
+    if (!segment) return nullptr;
+    segments[count++] = segment;
+  }
+  size_t offset = size % segmentSize;
+  length = segmentSize - offset;
+  return segments[size / segmentSize] + offset;
+}
+
+void SegmentChain::commit(size_t length) {
+  size += length;
+}
+
+bool SegmentChain::reserve(size_t total) {
+  if (!pool) return false;
+  const size_t segmentSize = pool->getSegmentSize();
+
+  while (count * segmentSize < total) {
+    uint8_t* segment = (count < MAX_CHAIN) ? pool->acquire() : nullptr;
+    if (!segment) return false;
+    segments[count++] = segment;
+  }
+  return true;
+}
+
+void SegmentChain::clear() {
+  for (size_t i = 0; i < count; i++) {
+    pool->release(segments[i]);
+  }
+  count = 0;
+  size = 0;
+}
+
+size_t SegmentChain::getSize() const {
+  return size;
+}
+
+size_t SegmentChain::getSegmentCount() const {
+  return count;
+}
+
+const uint8_t* SegmentChain::getSegment(size_t index) const {
+  return (index < count) ? segments[index] : nullptr;
+}
+
+size_t SegmentChain::getSegmentLength(size_t index) const {
+  if (index >= count) return 0;
+  const size_t segmentSize = pool->getSegmentSize();
+  size_t start = index * segmentSize;
+  return (start < size) ? min(size - start, segmentSize) : 0;
+}
@@ -0,0 +1,376 @@
+#include "ClipCache.h"
+#include "config.h"
+#include "MemoryMonitor.h"
+#include <SPIFFS.h>
+#include <esp_heap_caps.h>
+#include <string.h>
+
+namespace {
+
+const char PACK_MAGIC[4] = { 'T', 'B', 'C', 'P' };
+const uint16_t PACK_VERSION = 1;
+const size_t PACK_HEADER_SIZE = 8;
+const size_t PACK_ENTRY_SIZE = 32;
+
+// 保存した応答のファイル: "TBCC", sampleRate(u32), codec(u8), 予約3バイト, WAVヘッダの長さ(u32), 本文
+const char CACHE_MAGIC[4] = { 'T', 'B', 'C', 'C' };
+const size_t CACHE_HEADER_SIZE = 16;
+const char* const CACHE_INDEX_PATH = "/cache/index";
+
+const size_t DIGEST_BYTES = ClipCache::KEY_LENGTH / 2;
+
+uint16_t readLe16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t readLe32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void writeLe32(uint8_t* p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+} // namespace
+
+ClipCache::ClipCache() {
+  packCount = 0;
+  packMemory = nullptr;
+  entryCount = 0;
+  indexDirty = false;
+  work = nullptr;
+  workSize = 0;
+  workState = WORK_IDLE;
+  workKey[0] = '\0';
+  workFormat = { RESPONSE_DEFAULT_SAMPLE_RATE, AUDIO_CODEC_PCM16 };
+  workHeaderSize = 0;
+  workOverflow = false;
+  writePos = 0;
+  hits = 0;
+  stored = 0;
+  rejected = 0;
+  mbedtls_md_init(&sha);
+}
+
+ClipCache::~ClipCache() {
+  if (packMemory) heap_caps_free(packMemory);
+  if (work) heap_caps_free(work);
+  mbedtls_md_free(&sha);
+}
+
+bool ClipCache::init() {
+  loadPack();
+
+  if (CLIP_RESPONSE_CACHE) {
+    constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+    work = (uint8_t*)heap_caps_malloc(CLIP_CACHE_MAX_BYTES, memCaps);
+    if (!work || mbedtls_md_setup(&sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0) {
+      Serial.println("Failed to allocate response cache buffer");
+      return false;
+    }
+    MemoryMonitor::tag("clips.work", work, CLIP_CACHE_MAX_BYTES);
+    loadIndex();
+  }
+
+  printStats();
+  return true;
+}
+
+bool ClipCache::loadPack() {
+  File file = SPIFFS.open(CLIP_PACK_PATH, "r");
+  if (!file) {
+    Serial.printf("No clip pack at %s, earcons disabled\n", CLIP_PACK_PATH);
+    return false;
+  }
+
+  size_t fileSize = file.size();
+  uint8_t header[PACK_HEADER_SIZE];
+  if (file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, PACK_MAGIC, 4) != 0 ||
+      readLe16(header + 4) != PACK_VERSION) {
+    Serial.println("Clip pack has an unknown format");
+    file.close();
+    return false;
+  }
+  size_t count = readLe16(header + 6);
+  if (count > MAX_PACK_CLIPS || fileSize > CLIP_PACK_MAX_BYTES) {
+    Serial.printf("Clip pack too large (%u clips, %u bytes)\n", (unsigned)count, (unsigned)fileSize);
+    file.close();
+    return false;
+  }
+
+  // パック全体を読み込み、項目はその中を指す
+  constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+  packMemory = (uint8_t*)heap_caps_malloc(fileSize, memCaps);
+  if (!packMemory) {
+    Serial.println("Failed to allocate clip pack");
+    file.close();
+    return false;
+  }
+  file.seek(0);
+  size_t loaded = file.read(packMemory, fileSize);
+  file.close();
+  if (loaded != fileSize || PACK_HEADER_SIZE + count * PACK_ENTRY_SIZE > fileSize) {
+    Serial.println("Failed to read clip pack");
+    heap_caps_free(packMemory);
+    packMemory = nullptr;
+    return false;
+  }
+  MemoryMonitor::tag("clips.pack", packMemory, fileSize);
+
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t* entry = packMemory + PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE;
+    uint32_t offset = readLe32(entry + NAME_LENGTH);
+    uint32_t length = readLe32(entry + NAME_LENGTH + 4);
+    uint32_t sampleRate = readLe32(entry + NAME_LENGTH + 8);
+    uint8_t codec = entry[NAME_LENGTH + 12];
+    if (offset > fileSize || length > fileSize - offset || sampleRate == 0 || codec > AUDIO_CODEC_IMA_ADPCM) {
+      Serial.printf("Skipping malformed clip %u in pack\n", (unsigned)i);
+      continue;
+    }
+
+    PackClip& clip = packClips[packCount++];
+    memcpy(clip.name, entry, NAME_LENGTH);
+    clip.name[NAME_LENGTH] = '\0';
+    clip.clip = { packMemory + offset, length, { sampleRate, (AudioCodec)codec } };
+  }
+  return true;
+}
+
+bool ClipCache::find(const char* name, Clip& clip) const {
+  for (size_t i = 0; i < packCount; i++) {
+    if (strcmp(packClips[i].name, name) == 0) {
+      clip = packClips[i].clip;
+      return true;
+    }
+  }
+  return false;
+}
+
+// --- 応答キャッシュ ---
+
+bool ClipCache::isValidKey(const char* key) {
+  if (strlen(key) != KEY_LENGTH) return false;
+  for (size_t i = 0; i < KEY_LENGTH; i++) {
+    if (!isxdigit((unsigned char)key[i])) return false;
+  }
+  return true;
+}
+
+String ClipCache::pathFor(const char* key) {
+  return String("/cache/") + key;
+}
+
+void ClipCache::loadIndex() {
+  File file = SPIFFS.open(CACHE_INDEX_PATH, "r");
+  if (!file) return;
+
+  while (file.available() && entryCount < MAX_ENTRIES) {
+    String key = file.readStringUntil('\n');
+    key.trim();
+    if (!isValidKey(key.c_str()) || !SPIFFS.exists(pathFor(key.c_str()))) continue;
+    strcpy(entries[entryCount++].key, key.c_str());
+  }
+  file.close();
+}
+
+void ClipCache::saveIndex() const {
+  File file = SPIFFS.open(CACHE_INDEX_PATH, "w");
+  if (!file) {
+    Serial.println("Failed to save response cache index");
+    return;
+  }
+  for (size_t i = 0; i < entryCount; i++) {
+    file.println(entries[i].key);
+  }
+  file.close();
+}
+
+String ClipCache::advertisedKeys() const {
+  String keys;
+  for (size_t i = 0; i < entryCount; i++) {
+    if (i > 0) keys += ',';
+    keys += entries[i].key;
+  }
+  return keys;
+}
+
+bool ClipCache::contains(const char* key) const {
+  for (size_t i = 0; i < entryCount; i++) {
+    if (strcasecmp(entries[i].key, key) == 0) return true;
+  }
+  return false;
+}
+
+void ClipCache::touch(size_t index) {
+  // 先頭へ移す(末尾が次に消す候補)
+  CacheEntry entry = entries[index];
+  memmove(&entries[1], &entries[0], index * sizeof(CacheEntry));
+  entries[0] = entry;
+  indexDirty = true;
+}
+
+void ClipCache::removeEntry(size_t index) {
+  SPIFFS.remove(pathFor(entries[index].key));
+  memmove(&entries[index], &entries[index + 1], (entryCount - index - 1) * sizeof(CacheEntry));
+  entryCount--;
+  indexDirty = true;
+}
+
+void ClipCache::evictUntilFits(size_t bytes) {
+  while (entryCount > 0 &&
+         (entryCount >= MAX_ENTRIES || SPIFFS.totalBytes() - SPIFFS.usedBytes() < bytes + CLIP_CACHE_FLASH_RESERVE)) {
+    Serial.printf("Evicting cached response %s\n", entries[entryCount - 1].key);
+    removeEntry(entryCount - 1);
+  }
+}
+
+bool ClipCache::load(const char* key, Clip& clip) {
+  if (!work || workState == WORK_CAPTURING || workState == WORK_PENDING || workState == WORK_WRITING) {
+    return false;
+  }
+
+  size_t index = 0;
+  while (index < entryCount && strcasecmp(entries[index].key, key) != 0) index++;
+  if (index == entryCount) return false;
+
+  File file = SPIFFS.open(pathFor(entries[index].key), "r");
+  uint8_t header[CACHE_HEADER_SIZE];
+  bool ok = file && file.read(header, sizeof(header)) == sizeof(header) && memcmp(header, CACHE_MAGIC, 4) == 0;
+  size_t length = ok ? file.size() - CACHE_HEADER_SIZE : 0;
+  size_t headerSize = ok ? readLe32(header + 12) : 0;
+  ok = ok && length <= CLIP_CACHE_MAX_BYTES && headerSize <= length &&
+       file.read(work, length) == length;
+  if (file) file.close();
+  if (!ok) {
+    Serial.printf("Cached response %s is unreadable, removing it\n", entries[index].key);
+    removeEntry(index);
+    return false;
+  }
+
+  workState = WORK_LOADED;
+  workSize = length;
+  clip = { work + headerSize, length - headerSize, { readLe32(header + 4), (AudioCodec)header[8] } };
+  touch(index);
+  hits++;
+  return true;
+}
+
+void ClipCache::beginCapture(const char* key) {
+  // 保存待ちが残っている間(会話の開始でcancelPending()されていない)は取り込まない
+  if (!work || workState == WORK_PENDING || workState == WORK_WRITING) return;
+  if (!isValidKey(key) || contains(key)) return;
+
+  for (size_t i = 0; i <= KEY_LENGTH; i++) {
+    workKey[i] = tolower((unsigned char)key[i]);
+  }
+  workSize = 0;
+  workOverflow = false;
+  mbedtls_md_starts(&sha);
+  workState = WORK_CAPTURING;
+}
+
+void ClipCache::capture(const uint8_t* data, size_t length) {
+  if (workState != WORK_CAPTURING) return;
+
+  mbedtls_md_update(&sha, data, length);
+  if (workOverflow || length > CLIP_CACHE_MAX_BYTES - workSize) {
+    workOverflow = true;
+    return;
+  }
+  memcpy(work + workSize, data, length);
+  workSize += length;
+}
+
+void ClipCache::endCapture(bool complete, const AudioFormat& format, size_t headerSize) {
+  if (workState != WORK_CAPTURING) return;
+
+  uint8_t digest[32];
+  mbedtls_md_finish(&sha, digest);
+  char hex[KEY_LENGTH + 1];
+  for (size_t i = 0; i < DIGEST_BYTES; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+
+  const char* reason = nullptr;
+  if (!complete) reason = "incomplete";
+  else if (workOverflow) reason = "too large";
+  else if (format.sampleRate == 0 || headerSize > workSize) reason = "unplayable";
+  else if (strcmp(hex, workKey) != 0) reason = "content does not match its key";
+
+  if (reason) {
+    Serial.printf("Not caching response %s: %s\n", workKey, reason);
+    rejected++;
+    workState = WORK_IDLE;
+    return;
+  }
+  workFormat = format;
+  workHeaderSize = headerSize;
+  workState = WORK_PENDING;
+}
+
+void ClipCache::poll() {
+  if (workState == WORK_PENDING) {
+    evictUntilFits(CACHE_HEADER_SIZE + workSize);
+    writeFile = SPIFFS.open(pathFor(workKey), "w");
+    uint8_t header[CACHE_HEADER_SIZE] = {};
+    memcpy(header, CACHE_MAGIC, 4);
+    writeLe32(header + 4, workFormat.sampleRate);
+    header[8] = workFormat.codec;
+    writeLe32(header + 12, workHeaderSize);
+    if (!writeFile || writeFile.write(header, sizeof(header)) != sizeof(header)) {
+      Serial.printf("Failed to create cache file for %s\n", workKey);
+      cancelPending();
+      return;
+    }
+    writePos = 0;
+    workState = WORK_WRITING;
+    return;
+  }
+
+  if (workState == WORK_WRITING) {
+    // 1回あたりの書き込みを小さくして、ウェイクワード検出などが止まる時間を短くする
+    size_t n = min((size_t)CLIP_CACHE_WRITE_CHUNK, workSize - writePos);
+    if (writeFile.write(work + writePos, n) != n) {
+      Serial.printf("Failed to write cache file for %s\n", workKey);
+      cancelPending();
+      return;
+    }
+    writePos += n;
+    if (writePos < workSize) return;
+
+    writeFile.close();
+    memmove(&entries[1], &entries[0], entryCount * sizeof(CacheEntry));
+    strcpy(entries[0].key, workKey);
+    entryCount++;
+    stored++;
+    workState = WORK_IDLE;
+    saveIndex();
+    indexDirty = false;
+    Serial.printf("Cached response %s (%u bytes)\n", workKey, (unsigned)workSize);
+    return;
+  }
+
+  if (indexDirty) {
+    saveIndex();
+    indexDirty = false;
+  }
+}
+
+void ClipCache::cancelPending() {
+  if (workState == WORK_WRITING) {
+    writeFile.close();
+    SPIFFS.remove(pathFor(workKey));
+  }
+  if (workState == WORK_PENDING || workState == WORK_WRITING) {
+    Serial.printf("Discarding unsaved cached response %s\n", workKey);
+    workState = WORK_IDLE;
+  }
+}
+
+void ClipCache::printStats() const {
+  Serial.printf("Clips: %u in pack, %u cached responses (hits %u, stored %u, rejected %u)\n",
+                (unsigned)packCount, (unsigned)entryCount, hits, stored, rejected);
+}
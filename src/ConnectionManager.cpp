@@ -0,0 +1,152 @@
+#include "ConnectionManager.h"
+#include "config.h"
+#include "MemoryMonitor.h"
+
+// FreeRTOSタスク用の静的関数
+static void warmTaskWrapper(void* param) {
+  MemoryMonitor::taskStarted(CONNECTION_WARM_TASK_STACK);
+  ((ConnectionManager*)param)->warmTask();
+}
+
+ConnectionManager::ConnectionManager() {
+  client = &plainClient;
+  secure = false;
+  port = 80;
+  lock = NULL;
+  warmTaskHandle = NULL;
+  connectCount = 0;
+  reuseCount = 0;
+  failureCount = 0;
+  lastSetupMicros = 0;
+  lastReused = false;
+}
+
+ConnectionManager::~ConnectionManager() {
+  client->stop();
+  if (lock) vSemaphoreDelete(lock);
+}
+
+bool ConnectionManager::init(const char* baseUrl) {
+  lock = xSemaphoreCreateMutex();
+  if (!lock) {
+    Serial.println("Failed to create connection lock");
+    return false;
+  }
+
+  // "scheme://host[:port][/path]" から接続先を取り出す
+  String url(baseUrl);
+  int hostStart = url.indexOf("://");
+  if (hostStart < 0) {
+    Serial.printf("Invalid server URL: %s\n", baseUrl);
+    return false;
+  }
+  port = url.startsWith("https") ? 443 : 80;
+  hostStart += 3;
+  int hostEnd = url.indexOf('/', hostStart);
+  String authority = (hostEnd < 0) ? url.substring(hostStart) : url.substring(hostStart, hostEnd);
+  int colon = authority.indexOf(':');
+  if (colon >= 0) {
+    port = authority.substring(colon + 1).toInt();
+    authority = authority.substring(0, colon);
+  }
+  host = authority;
+
+  secure = url.startsWith("https");
+  client = secure ? (WiFiClient*)&secureClient : &plainClient;
+  if (secure) {
+    if (!secureClient.setPinnedFingerprint(SERVER_CERT_FINGERPRINT)) {
+      // 接続は試み、そのときにサーバ証明書のフィンガープリントを表示する
+      Serial.println("SERVER_CERT_FINGERPRINT is missing or invalid; TLS connections will be refused");
+    }
+    if (TLS_SESSION_NVS) {
+      secureClient.enableSessionStore(host + ":" + String(port));
+    }
+  }
+  return true;
+}
+
+bool ConnectionManager::ensureConnected(bool& reused) {
+  // connected()は受信待ちのない状態でサーバが閉じたことも検出する
+  reused = client->connected();
+  if (reused) return true;
+
+  client->stop();
+  if (WiFi.status() != WL_CONNECTED || !client->connect(host.c_str(), port)) {
+    failureCount++;
+    return false;
+  }
+  if (!secure) client->setNoDelay(true); // 小さなチャンクを溜めずに送る(TlsClientは内部で設定済み)
+  connectCount++;
+  return true;
+}
+
+WiFiClient* ConnectionManager::acquire() {
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  unsigned long start = micros();
+  bool ok = ensureConnected(lastReused);
+  lastSetupMicros = micros() - start;
+  if (ok && lastReused) reuseCount++;
+
+  if (DEBUG_NETWORK_COMMUNICATION) {
+    Serial.printf("Connection to %s:%u %s in %lu us\n", host.c_str(), port,
+                  !ok ? "failed" : lastReused ? "reused" : "opened", (unsigned long)lastSetupMicros);
+  }
+  return ok ? client : nullptr;
+}
+
+void ConnectionManager::release() {
+  xSemaphoreGive(lock);
+}
+
+void ConnectionManager::drop() {
+  client->stop();
+}
+
+void ConnectionManager::warm() {
+  if (!lock || warmTaskHandle != NULL) return;
+  if (xTaskCreate(warmTaskWrapper, "ConnWarmTask", CONNECTION_WARM_TASK_STACK, this, 3, &warmTaskHandle) != pdPASS) {
+    warmTaskHandle = NULL;
+  }
+}
+
+void ConnectionManager::warmTask() {
+  // 送信タスクが使用中なら、その接続がそのまま使われるので何もしない
+  if (xSemaphoreTake(lock, 0) == pdTRUE) {
+    unsigned long start = micros();
+    bool reused = false;
+    bool ok = ensureConnected(reused);
+    xSemaphoreGive(lock);
+
+    if (DEBUG_NETWORK_COMMUNICATION) {
+      Serial.printf("Connection warm-up: %s in %lu us\n",
+                    !ok ? "failed" : reused ? "still open" : "opened", (unsigned long)(micros() - start));
+    }
+  }
+
+  warmTaskHandle = NULL;
+  MemoryMonitor::taskExiting();
+  vTaskDelete(NULL);
+}
+
+bool ConnectionManager::wasReused() const {
+  return lastReused;
+}
+
+bool ConnectionManager::isSecure() const {
+  return secure;
+}
+
+bool ConnectionManager::wasTlsResumed() const {
+  return secure && !lastReused && secureClient.wasResumed();
+}
+
+uint32_t ConnectionManager::getSetupMicros() const {
+  return lastSetupMicros;
+}
+
+void ConnectionManager::printStats() const {
+  Serial.printf("Connections: %u opened, %u reused, %u failed\n",
+                (unsigned)connectCount, (unsigned)reuseCount, (unsigned)failureCount);
+  if (secure) secureClient.printStats();
+}
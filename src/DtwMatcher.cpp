@@ -0,0 +1,170 @@
+#include "DtwMatcher.h"
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+namespace {
+
+constexpr uint32_t kInfinity = UINT32_MAX / 2; // headroom so INF + cost does not wrap
+
+// Shared by the lower bound and the cell cost so that LB <= cost always holds
+inline uint32_t rootOf(uint64_t squared) {
+    return (uint32_t)sqrtf((float)squared);
+}
+
+} // namespace
+
+DtwMatcher::DtwMatcher(int bandPercent)
+    : bandPercent(bandPercent),
+      stats{Stage::Full, 0, 0, kRejected} {}
+
+uint32_t DtwMatcher::frameDistance(const int16_t* a, const int16_t* b, int coefs) {
+    uint64_t sum = 0;
+    for (int k = 0; k < coefs; k++) {
+        uint32_t diff = (uint32_t)abs((int32_t)a[k] - b[k]);
+        sum += diff * diff;
+    }
+    return rootOf(sum);
+}
+
+// Columns of the reference allowed for a query row: a band of +-radius around
+// the diagonal scaled to the two lengths, so (0,0) and (rows-1,cols-1) are always inside.
+void DtwMatcher::bandWindow(int row, int rows, int cols, int radius, int& lo, int& hi) const {
+    int centre = (rows > 1) ? (int)((int64_t)row * (cols - 1) / (rows - 1)) : 0;
+    lo = std::max(0, centre - radius);
+    hi = std::min(cols - 1, centre + radius);
+}
+
+// LB_Keogh: for every query frame, the distance to the min/max envelope of the
+// reference frames inside its band. Every warping path visits each query row at
+// least once within the band, so the sum is a lower bound on the total cost.
+// The envelope is maintained with monotonic deques, O(coefs * (rows + cols)).
+// Leaves suffix sums in lowerBound (lowerBound[i] = bound for rows i..end).
+uint32_t DtwMatcher::computeLowerBound(const simplevox::MfccFeature& reference,
+                                       const simplevox::MfccFeature& query, int radius) {
+    const int rows = query.frame_num();
+    const int cols = reference.frame_num();
+    const int coefs = std::min(query.coef_num(), reference.coef_num());
+
+    std::fill(excess.begin(), excess.begin() + rows, 0);
+
+    for (int k = 0; k < coefs; k++) {
+        int maxHead = 0, maxTail = 0, minHead = 0, minTail = 0;
+        int next = 0;
+        for (int i = 0; i < rows; i++) {
+            int lo, hi;
+            bandWindow(i, rows, cols, radius, lo, hi);
+
+            // Windows only move forward, so each reference frame enters and leaves once
+            for (; next <= hi; next++) {
+                const int16_t value = reference.feature(next)[k];
+                while (maxTail > maxHead && reference.feature(maxQueue[maxTail - 1])[k] <= value) maxTail--;
+                maxQueue[maxTail++] = next;
+                while (minTail > minHead && reference.feature(minQueue[minTail - 1])[k] >= value) minTail--;
+                minQueue[minTail++] = next;
+            }
+            while (maxQueue[maxHead] < lo) maxHead++;
+            while (minQueue[minHead] < lo) minHead++;
+
+            const int32_t upper = reference.feature(maxQueue[maxHead])[k];
+            const int32_t lower = reference.feature(minQueue[minHead])[k];
+            const int32_t q = query.feature(i)[k];
+            uint32_t e = (q > upper) ? q - upper : (q < lower) ? lower - q : 0;
+            excess[i] += e * e;
+        }
+    }
+
+    lowerBound[rows] = 0;
+    for (int i = rows - 1; i >= 0; i--) {
+        lowerBound[i] = lowerBound[i + 1] + rootOf(excess[i]);
+    }
+    return lowerBound[0];
+}
+
+uint32_t DtwMatcher::match(const simplevox::MfccFeature& reference,
+                           const simplevox::MfccFeature& query,
+                           uint32_t threshold,
+                           const std::atomic<bool>* cancel) {
+    const int rows = query.frame_num();
+    const int cols = reference.frame_num();
+    const int coefs = std::min(query.coef_num(), reference.coef_num());
+
+    stats.stage = Stage::LowerBound;
+    stats.cells = 0;
+    stats.totalCells = (uint32_t)rows * cols;
+    stats.bound = kRejected;
+    if (rows == 0 || cols == 0) return kRejected;
+
+    // Accept iff cost / (rows + cols) < threshold
+    const uint64_t limit = (uint64_t)threshold * (rows + cols);
+
+    // Band radius: a fraction of the longer sequence, but never narrower than the
+    // diagonal's slope so that consecutive rows stay connected.
+    int radius = std::max(rows, cols) * bandPercent / 100;
+    radius = std::max(radius, (cols + rows - 1) / rows);
+
+    if ((int)prevRow.size() < cols) {
+        prevRow.resize(cols);
+        currRow.resize(cols);
+        maxQueue.resize(cols);
+        minQueue.resize(cols);
+    }
+    if ((int)excess.size() < rows) {
+        excess.resize(rows);
+        lowerBound.resize(rows + 1);
+    }
+
+    // 1. Lower bound
+    const uint32_t keogh = computeLowerBound(reference, query, radius);
+    if (keogh >= limit) {
+        stats.bound = keogh / (rows + cols);
+        return kRejected;
+    }
+
+    // 2./3. Banded DTW, two rows at a time, abandoning as soon as the bound is hit
+    stats.stage = Stage::Abandoned;
+    int prevLo = 0, prevHi = -1;
+    for (int i = 0; i < rows; i++) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            stats.stage = Stage::Cancelled;
+            return kRejected;
+        }
+
+        int lo, hi;
+        bandWindow(i, rows, cols, radius, lo, hi);
+        const int16_t* q = query.feature(i);
+        uint32_t rowMin = kInfinity;
+
+        for (int j = lo; j <= hi; j++) {
+            uint32_t best;
+            if (i == 0 && j == 0) {
+                best = 0;
+            } else {
+                best = kInfinity;
+                if (j >= prevLo && j <= prevHi) best = std::min(best, prevRow[j]);              // (i-1, j)
+                if (j - 1 >= prevLo && j - 1 <= prevHi) best = std::min(best, prevRow[j - 1]);  // (i-1, j-1)
+                if (j - 1 >= lo) best = std::min(best, currRow[j - 1]);                         // (i, j-1)
+            }
+            uint32_t cost = (best >= kInfinity) ? kInfinity
+                                                : best + frameDistance(q, reference.feature(j), coefs);
+            currRow[j] = cost;
+            rowMin = std::min(rowMin, cost);
+        }
+        stats.cells += hi - lo + 1;
+
+        if ((uint64_t)rowMin + lowerBound[i + 1] >= limit) {
+            stats.bound = (uint32_t)std::min<uint64_t>(((uint64_t)rowMin + lowerBound[i + 1]) / (rows + cols),
+                                                       kRejected);
+            return kRejected;
+        }
+
+        std::swap(prevRow, currRow);
+        prevLo = lo;
+        prevHi = hi;
+    }
+
+    stats.stage = Stage::Full;
+    uint32_t distance = prevRow[cols - 1] / (rows + cols);
+    stats.bound = distance;
+    return (distance < threshold) ? distance : kRejected;
+}
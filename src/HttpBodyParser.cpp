@@ -0,0 +1,195 @@
+#include "HttpBodyParser.h"
+
+namespace {
+
+// 8桁(4GB未満)を超えるチャンクサイズは不正とみなす
+const int MAX_SIZE_DIGITS = 8;
+
+int hexValue(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+} // namespace
+
+HttpBodyParser::HttpBodyParser() {
+  beginUntilClose();
+}
+
+void HttpBodyParser::beginChunked() {
+  state = STATE_SIZE;
+  chunked = true;
+  untilClose = false;
+  remaining = 0;
+  chunkSize = 0;
+  sizeDigits = 0;
+  payloadBytes = 0;
+  error = ERROR_NONE;
+}
+
+void HttpBodyParser::beginFixed(size_t length) {
+  beginChunked();
+  chunked = false;
+  remaining = length;
+  state = (length > 0) ? STATE_DATA : STATE_DONE;
+}
+
+void HttpBodyParser::beginUntilClose() {
+  beginChunked();
+  chunked = false;
+  untilClose = true;
+  remaining = SIZE_MAX;
+  state = STATE_DATA;
+}
+
+size_t HttpBodyParser::payloadWanted() const {
+  return (state == STATE_DATA) ? remaining : 0;
+}
+
+void HttpBodyParser::payloadRead(size_t length) {
+  if (state != STATE_DATA || length > remaining) return;
+  payloadBytes += length;
+  if (untilClose) return;
+
+  remaining -= length;
+  if (remaining == 0) {
+    state = chunked ? STATE_DATA_CR : STATE_DONE;
+  }
+}
+
+bool HttpBodyParser::feed(uint8_t c) {
+  // 改行はCRLFのほか、LFだけでも受け付ける
+  switch (state) {
+    case STATE_SIZE: {
+      int digit = hexValue(c);
+      if (digit >= 0) {
+        if (++sizeDigits > MAX_SIZE_DIGITS) break;
+        chunkSize = (chunkSize << 4) | digit;
+        return true;
+      }
+      if (sizeDigits == 0) break; // 数字のないサイズ行
+      if (c == ';' || c == ' ' || c == '\t') {
+        state = STATE_EXTENSION;
+        return true;
+      }
+      if (c == '\r') {
+        state = STATE_SIZE_LF;
+        return true;
+      }
+      if (c == '\n') return endSizeLine();
+      break;
+    }
+
+    case STATE_EXTENSION:
+      if (c == '\r') state = STATE_SIZE_LF;
+      else if (c == '\n') return endSizeLine();
+      return true;
+
+    case STATE_SIZE_LF:
+      if (c == '\n') return endSizeLine();
+      break;
+
+    case STATE_DATA_CR:
+      if (c == '\r') {
+        state = STATE_DATA_LF;
+        return true;
+      }
+      if (c == '\n') return endChunk();
+      break;
+
+    case STATE_DATA_LF:
+      if (c == '\n') return endChunk();
+      break;
+
+    case STATE_TRAILER:
+      if (c == '\r') state = STATE_FINAL_LF;
+      else if (c == '\n') state = STATE_DONE;
+      else state = STATE_TRAILER_LINE;
+      return true;
+
+    case STATE_TRAILER_LINE:
+      if (c == '\n') state = STATE_TRAILER;
+      return true;
+
+    case STATE_FINAL_LF:
+      if (c != '\n') break;
+      state = STATE_DONE;
+      return true;
+
+    case STATE_DATA:
+    case STATE_DONE:
+    case STATE_ERROR:
+      break;
+  }
+
+  fail(ERROR_MALFORMED);
+  return false;
+}
+
+bool HttpBodyParser::endSizeLine() {
+  if (chunkSize == 0) {
+    state = STATE_TRAILER; // 終端チャンク
+  } else {
+    remaining = chunkSize;
+    state = STATE_DATA;
+  }
+  return true;
+}
+
+bool HttpBodyParser::endChunk() {
+  chunkSize = 0;
+  sizeDigits = 0;
+  state = STATE_SIZE;
+  return true;
+}
+
+void HttpBodyParser::endOfStream() {
+  if (state == STATE_DONE || state == STATE_ERROR) return;
+  if (untilClose) {
+    state = STATE_DONE;
+  } else {
+    fail(ERROR_TRUNCATED);
+  }
+}
+
+void HttpBodyParser::timedOut() {
+  if (state == STATE_DONE || state == STATE_ERROR) return;
+  fail(ERROR_TIMEOUT);
+}
+
+void HttpBodyParser::fail(Error reason) {
+  state = STATE_ERROR;
+  error = reason;
+}
+
+bool HttpBodyParser::isDone() const {
+  return state == STATE_DONE;
+}
+
+bool HttpBodyParser::hasError() const {
+  return state == STATE_ERROR;
+}
+
+HttpBodyParser::Error HttpBodyParser::getError() const {
+  return error;
+}
+
+const char* HttpBodyParser::errorString() const {
+  switch (error) {
+    case ERROR_NONE: return "none";
+    case ERROR_MALFORMED: return "malformed chunk";
+    case ERROR_TRUNCATED: return "connection closed before the end of the body";
+    case ERROR_TIMEOUT: return "timed out";
+  }
+  return "unknown";
+}
+
+bool HttpBodyParser::isReusable() const {
+  return state == STATE_DONE && !untilClose;
+}
+
+size_t HttpBodyParser::getPayloadBytes() const {
+  return payloadBytes;
+}
@@ -0,0 +1,237 @@
+#include "MemoryMonitor.h"
+#include "config.h"
+#include <esp_heap_caps.h>
+#include <soc/soc_memory_layout.h>
+#include <string.h>
+
+namespace {
+
+const int MAX_TASKS = 16;
+const int MAX_TAGS = 24;
+const size_t COMMAND_LENGTH = 16;
+
+struct TaskEntry {
+  char name[configMAX_TASK_NAME_LEN];
+  uint32_t stackSize;
+  TaskHandle_t handle;  // 実行中のみ。終了したらNULL
+  uint32_t minFree;     // これまでに観測したスタック余裕の最小値(バイト)
+  uint32_t runs;        // 起動回数
+};
+
+struct TagEntry {
+  const char* name; // 文字列リテラルを渡す
+  const void* ptr;
+  size_t bytes;
+};
+
+TaskEntry tasks[MAX_TASKS];
+int taskCount = 0;
+TagEntry tags[MAX_TAGS];
+int tagCount = 0;
+const BufferPool* bufferPool = nullptr;
+portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+unsigned long lastReportTime = 0;
+bool lowMemoryWarned = false;
+char command[COMMAND_LENGTH];
+size_t commandLength = 0;
+
+// ロックを持った状態で呼ぶ
+void sampleStack(TaskEntry& entry, uint32_t free) {
+  if (free < entry.minFree) entry.minFree = free;
+}
+
+const char* locationOf(const void* ptr) {
+  if (bufferPool && bufferPool->contains(ptr)) return "pool";
+  return esp_ptr_external_ram(ptr) ? "psram" : "internal";
+}
+
+} // namespace
+
+void MemoryMonitor::init(const BufferPool* pool) {
+  bufferPool = pool;
+  lastReportTime = millis();
+}
+
+void MemoryMonitor::taskStarted(uint32_t stackSize) {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  const char* name = pcTaskGetTaskName(NULL);
+
+  portENTER_CRITICAL(&lock);
+  TaskEntry* entry = nullptr;
+  for (int i = 0; i < taskCount; i++) {
+    if (strncmp(tasks[i].name, name, sizeof(tasks[i].name)) == 0) {
+      entry = &tasks[i];
+      break;
+    }
+  }
+  if (!entry && taskCount < MAX_TASKS) {
+    entry = &tasks[taskCount++];
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    entry->name[sizeof(entry->name) - 1] = '\0';
+    entry->minFree = UINT32_MAX;
+    entry->runs = 0;
+  }
+  if (entry) {
+    entry->stackSize = stackSize;
+    entry->handle = self;
+    entry->runs++;
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void MemoryMonitor::taskExiting() {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  uint32_t free = uxTaskGetStackHighWaterMark(NULL);
+
+  portENTER_CRITICAL(&lock);
+  for (int i = 0; i < taskCount; i++) {
+    if (tasks[i].handle == self) {
+      sampleStack(tasks[i], free);
+      tasks[i].handle = NULL;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void MemoryMonitor::forgetTask(TaskHandle_t handle) {
+  if (handle == NULL) return;
+
+  portENTER_CRITICAL(&lock);
+  for (int i = 0; i < taskCount; i++) {
+    if (tasks[i].handle == handle) {
+      sampleStack(tasks[i], uxTaskGetStackHighWaterMark(handle));
+      tasks[i].handle = NULL;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void MemoryMonitor::tag(const char* name, const void* ptr, size_t bytes) {
+  if (!ptr || bytes == 0) {
+    untag(name);
+    return;
+  }
+
+  portENTER_CRITICAL(&lock);
+  int index = 0;
+  while (index < tagCount && strcmp(tags[index].name, name) != 0) index++;
+  if (index < MAX_TAGS) {
+    if (index == tagCount) tagCount++;
+    tags[index] = { name, ptr, bytes };
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void MemoryMonitor::untag(const char* name) {
+  portENTER_CRITICAL(&lock);
+  for (int i = 0; i < tagCount; i++) {
+    if (strcmp(tags[i].name, name) == 0) {
+      tags[i] = tags[--tagCount];
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void MemoryMonitor::poll() {
+  // シリアルコマンド("mem"で即時出力)
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      command[commandLength] = '\0';
+      if (strcmp(command, "mem") == 0) {
+        printReport("request");
+      }
+      commandLength = 0;
+    } else if (commandLength < COMMAND_LENGTH - 1) {
+      command[commandLength++] = c;
+    }
+  }
+
+  if (MEMORY_REPORT_INTERVAL_MS <= 0 || millis() - lastReportTime < MEMORY_REPORT_INTERVAL_MS) {
+    return;
+  }
+  lastReportTime = millis();
+
+  // 最大空きブロックが小さくなったら定期出力が無効でも一度だけ知らせる
+  size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  bool low = largest < MEMORY_WARN_LARGEST_BLOCK;
+  if (low && !lowMemoryWarned) {
+    Serial.printf("WARNING: Largest free internal block is %u bytes\n", (unsigned)largest);
+    printReport("low");
+  } else if (DEBUG_MEMORY_REPORT) {
+    printReport("periodic");
+  }
+  lowMemoryWarned = low;
+}
+
+void MemoryMonitor::printReport(const char* reason) {
+  const uint32_t internalCaps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  size_t heapFree = heap_caps_get_free_size(internalCaps);
+  size_t heapLargest = heap_caps_get_largest_free_block(internalCaps);
+
+  Serial.printf("MEM {\"reason\":\"%s\",\"uptime\":%lu", reason, millis());
+  Serial.printf(",\"heap\":{\"free\":%u,\"min\":%u,\"largest\":%u,\"frag\":%u}",
+                (unsigned)heapFree,
+                (unsigned)heap_caps_get_minimum_free_size(internalCaps),
+                (unsigned)heapLargest,
+                heapFree ? (unsigned)(100 - heapLargest * 100 / heapFree) : 0);
+  Serial.printf(",\"psram\":{\"size\":%u,\"free\":%u,\"min\":%u,\"largest\":%u}",
+                (unsigned)heap_caps_get_total_size(MALLOC_CAP_SPIRAM),
+                (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+                (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM),
+                (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+  if (bufferPool) {
+    Serial.printf(",\"pool\":{\"segments\":%u,\"segmentSize\":%u,\"inUse\":%u,\"high\":%u,\"failures\":%u}",
+                  (unsigned)bufferPool->getSegmentCount(), (unsigned)bufferPool->getSegmentSize(),
+                  (unsigned)bufferPool->getInUse(), (unsigned)bufferPool->getHighWater(),
+                  (unsigned)bufferPool->getFailures());
+  }
+
+  // スタック余裕は1タスクずつロック内で測る(測っている間にタスクが削除されないように)
+  Serial.print(",\"tasks\":[");
+  for (int i = 0; i < MAX_TASKS; i++) {
+    TaskEntry entry;
+    bool running = false;
+    portENTER_CRITICAL(&lock);
+    bool valid = i < taskCount;
+    if (valid) {
+      running = tasks[i].handle != NULL;
+      if (running) sampleStack(tasks[i], uxTaskGetStackHighWaterMark(tasks[i].handle));
+      entry = tasks[i];
+    }
+    portEXIT_CRITICAL(&lock);
+    if (!valid) break;
+
+    Serial.printf("%s{\"name\":\"%s\",\"stack\":%u,\"minFree\":%u,\"runs\":%u,\"running\":%s}",
+                  i ? "," : "", entry.name, (unsigned)entry.stackSize,
+                  entry.minFree == UINT32_MAX ? 0u : (unsigned)entry.minFree,
+                  (unsigned)entry.runs, running ? "true" : "false");
+  }
+
+  // 名前付きの領域(内部RAM/PSRAM/プールごとに合計も出す)
+  TagEntry snapshot[MAX_TAGS];
+  int count;
+  portENTER_CRITICAL(&lock);
+  count = tagCount;
+  memcpy(snapshot, tags, sizeof(TagEntry) * count);
+  portEXIT_CRITICAL(&lock);
+
+  size_t internalTotal = 0;
+  size_t psramTotal = 0;
+  size_t poolTotal = 0;
+  Serial.print("],\"tags\":[");
+  for (int i = 0; i < count; i++) {
+    const char* where = locationOf(snapshot[i].ptr);
+    Serial.printf("%s{\"name\":\"%s\",\"bytes\":%u,\"where\":\"%s\"}",
+                  i ? "," : "", snapshot[i].name, (unsigned)snapshot[i].bytes, where);
+    if (strcmp(where, "pool") == 0) poolTotal += snapshot[i].bytes;
+    else if (strcmp(where, "psram") == 0) psramTotal += snapshot[i].bytes;
+    else internalTotal += snapshot[i].bytes;
+  }
+  Serial.printf("],\"tagged\":{\"internal\":%u,\"psram\":%u,\"pool\":%u}}\n",
+                (unsigned)internalTotal, (unsigned)psramTotal, (unsigned)poolTotal);
+}
@@ -0,0 +1,185 @@
+#include "MfccStream.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+constexpr float kPreEmphasis = 0.97f;
+constexpr float kMinMelEnergy = 1e-3f; // floor before log, keeps digital silence finite
+constexpr float kPi = 3.14159265f;
+
+inline float hzToMel(float hz) {
+    return 2595.0f * log10f(1.0f + hz / 700.0f);
+}
+
+inline float melToHz(float mel) {
+    return 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f);
+}
+
+} // namespace
+
+MfccStream::MfccStream(int sampleRate, int maxFrames)
+    : maxFrames(maxFrames),
+      frameCount(0),
+      pending(kFrameLength),
+      pendingCount(0),
+      ring((size_t)maxFrames * kCoefs),
+      window(kFrameLength),
+      cosTable(kFftSize / 2),
+      sinTable(kFftSize / 2),
+      bitReverse(kFftSize),
+      melEdges(kMelBands + 2),
+      dctTable(kCoefs * kMelBands),
+      re(kFftSize),
+      im(kFftSize),
+      mel(kMelBands) {
+    for (int i = 0; i < kFrameLength; i++) {
+        window[i] = 0.54f - 0.46f * cosf(2.0f * kPi * i / (kFrameLength - 1));
+    }
+
+    for (int i = 0; i < kFftSize / 2; i++) {
+        cosTable[i] = cosf(2.0f * kPi * i / kFftSize);
+        sinTable[i] = -sinf(2.0f * kPi * i / kFftSize);
+    }
+    int bits = 0;
+    while ((1 << bits) < kFftSize) bits++;
+    for (int i = 0; i < kFftSize; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        }
+        bitReverse[i] = (uint16_t)r;
+    }
+
+    // Triangular filters equally spaced on the mel scale, up to Nyquist
+    const float melMax = hzToMel(sampleRate / 2.0f);
+    for (int b = 0; b < kMelBands + 2; b++) {
+        melEdges[b] = melToHz(melMax * b / (kMelBands + 1)) * kFftSize / sampleRate;
+    }
+
+    // DCT-II, skipping c0
+    for (int c = 0; c < kCoefs; c++) {
+        for (int b = 0; b < kMelBands; b++) {
+            dctTable[c * kMelBands + b] = cosf(kPi * (c + 1) * (b + 0.5f) / kMelBands);
+        }
+    }
+}
+
+void MfccStream::reset() {
+    pendingCount = 0;
+}
+
+int MfccStream::push(const int16_t* samples, int count) {
+    int completed = 0;
+    while (count > 0) {
+        int n = std::min(count, kFrameLength - pendingCount);
+        memcpy(&pending[pendingCount], samples, n * sizeof(int16_t));
+        pendingCount += n;
+        samples += n;
+        count -= n;
+
+        if (pendingCount == kFrameLength) {
+            computeFrame(pending.data(), &ring[(frameCount % maxFrames) * kCoefs]);
+            frameCount++;
+            completed++;
+            // Keep the overlap for the next frame
+            memmove(pending.data(), &pending[kHop], (kFrameLength - kHop) * sizeof(int16_t));
+            pendingCount = kFrameLength - kHop;
+        }
+    }
+    return completed;
+}
+
+size_t MfccStream::memoryBytes() const {
+    return (pending.capacity() + ring.capacity()) * sizeof(int16_t) +
+           bitReverse.capacity() * sizeof(uint16_t) +
+           (window.capacity() + cosTable.capacity() + sinTable.capacity() + melEdges.capacity() +
+            dctTable.capacity() + re.capacity() + im.capacity() + mel.capacity()) * sizeof(float);
+}
+
+simplevox::MfccFeature* MfccStream::extract(uint32_t first, uint32_t last) const {
+    if (last <= first || last > frameCount || frameCount - first > (uint32_t)maxFrames) {
+        return nullptr;
+    }
+    auto* feature = new simplevox::MfccFeature(last - first, kCoefs);
+    for (uint32_t f = first; f < last; f++) {
+        memcpy(feature->feature(f - first), &ring[(f % maxFrames) * kCoefs], kCoefs * sizeof(int16_t));
+    }
+    return feature;
+}
+
+void MfccStream::computeFrame(const int16_t* frame, int16_t* out) {
+    // 1. Pre-emphasis and window
+    float previous = frame[0];
+    for (int i = 0; i < kFrameLength; i++) {
+        float sample = frame[i];
+        re[i] = (sample - kPreEmphasis * previous) * window[i];
+        im[i] = 0.0f;
+        previous = sample;
+    }
+    for (int i = kFrameLength; i < kFftSize; i++) {
+        re[i] = 0.0f;
+        im[i] = 0.0f;
+    }
+
+    // 2. Power spectrum (bins 0..N/2 are left in re[])
+    fft();
+    for (int k = 0; k <= kFftSize / 2; k++) {
+        re[k] = re[k] * re[k] + im[k] * im[k];
+    }
+
+    // 3. Log mel energies
+    for (int b = 0; b < kMelBands; b++) {
+        const float left = melEdges[b];
+        const float centre = melEdges[b + 1];
+        const float right = melEdges[b + 2];
+        float energy = 0.0f;
+        for (int k = (int)ceilf(left); k <= (int)right && k <= kFftSize / 2; k++) {
+            float weight = (k <= centre) ? (k - left) / (centre - left) : (right - k) / (right - centre);
+            if (weight > 0.0f) energy += weight * re[k];
+        }
+        mel[b] = logf(std::max(energy, kMinMelEnergy));
+    }
+
+    // 4. DCT to cepstra, quantised
+    for (int c = 0; c < kCoefs; c++) {
+        const float* basis = &dctTable[c * kMelBands];
+        float sum = 0.0f;
+        for (int b = 0; b < kMelBands; b++) {
+            sum += basis[b] * mel[b];
+        }
+        float scaled = sum * kScale;
+        scaled = std::max(-32768.0f, std::min(32767.0f, scaled));
+        out[c] = (int16_t)lrintf(scaled);
+    }
+}
+
+// In-place iterative radix-2 FFT over re[]/im[]
+void MfccStream::fft() {
+    for (int i = 0; i < kFftSize; i++) {
+        int j = bitReverse[i];
+        if (j > i) {
+            std::swap(re[i], re[j]);
+            std::swap(im[i], im[j]);
+        }
+    }
+    for (int size = 2; size <= kFftSize; size <<= 1) {
+        const int half = size / 2;
+        const int step = kFftSize / size;
+        for (int start = 0; start < kFftSize; start += size) {
+            for (int k = 0; k < half; k++) {
+                const float wr = cosTable[k * step];
+                const float wi = sinTable[k * step];
+                const int a = start + k;
+                const int b = a + half;
+                const float tr = re[b] * wr - im[b] * wi;
+                const float ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
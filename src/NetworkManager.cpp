@@ -1,24 +1,54 @@
 #include <M5Core2.h>
 #include "NetworkManager.h"
 #include "config.h"
-#include <base64.h>
+#include "MemoryMonitor.h"
+#include "TurnTrace.h"
+#include "HttpBodyParser.h"
+
+// エンドポイントごとのアップロード形式とコーデック
+struct EndpointFormat {
+  const char* endpoint;
+  UploadFormat format;
+  AudioCodec codec;
+};
+
+static const EndpointFormat ENDPOINT_FORMATS[] = {
+  { "stsWhisper", UPLOAD_FORMAT_STS_WHISPER, UPLOAD_CODEC_STS_WHISPER },
+  { "stsGoogle", UPLOAD_FORMAT_STS_GOOGLE, UPLOAD_CODEC_STS_GOOGLE },
+};
+
+// FreeRTOSタスク用の静的関数
+static void uploadTaskWrapper(void* param) {
+  MemoryMonitor::taskStarted(UPLOAD_TASK_STACK);
+  ((NetworkManager*)param)->uploadTask();
+}
 
 NetworkManager::NetworkManager() {
-  responseBuffer = nullptr;
+  bufferPool = nullptr;
   responseSize = 0;
-  responseCapacity = 0;
+  responseTruncated = false;
   responseReady = false;
-  isReceivingChunks = false;
   responseCode = 0;
+  responseCodec = AUDIO_CODEC_PCM16;
+  responseFormat = { RESPONSE_DEFAULT_SAMPLE_RATE, AUDIO_CODEC_PCM16 };
+  hasErrorFlag = false;
+  requestCompleteTime = 0;
+  responseHeaderSize = 0;
+  clipCache = nullptr;
+  cachedResponseKey[0] = '\0';
+  uploadTaskHandle = NULL;
+  uploadCancelled = false;
+  responseStarted = false;
+  responseRing = nullptr;
+  binaryRejected = false;
 }
 
 NetworkManager::~NetworkManager() {
-  if (responseBuffer) {
-    free(responseBuffer);
-  }
+  responseChain.clear();
 }
 
 bool NetworkManager::connectWiFi(const char* ssid, const char* password) {
+  connection.init(SERVER_URL);
   WiFi.begin(ssid, password);
   
   int attempts = 0;
@@ -45,151 +75,456 @@ bool NetworkManager::sendAudioData(uint8_t* audioData, size_t dataSize, const ch
     M5.Lcd.println("WiFi not connected");
     return false;
   }
-  
-  // 前回のレスポンスバッファをクリア
-  if (responseBuffer) {
-    free(responseBuffer);
-    responseBuffer = nullptr;
+  if (uploadTaskHandle != NULL) {
+    Serial.println("Previous upload still in flight");
+    return false;
   }
-  responseSize = 0;
-  responseCapacity = 0;
-  responseReady = false;
   
-  // Base64エンコード
-  String base64Audio = encodeBase64(audioData, dataSize);
-  Serial.printf("base64AudioSize: %d\n", base64Audio.length());
+  // ボディは送信しながら生成する
+  // (エンコード済みデータ全体をStringに展開するとヒープが枯渇するため)
+  uploadStream.begin(audioData, dataSize, uploadFormatFor(endpoint), uploadCodecFor(endpoint));
+  
+  // POST送信(レスポンスは送信タスク内で受信する)
+  return startUploadTask(endpoint);
+}
+
+bool NetworkManager::beginStreamingUpload(const uint8_t* recordBuffer, QueueHandle_t blockQueue, const char* endpoint) {
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("WiFi not connected, streaming upload disabled");
+    return false;
+  }
+  if (uploadTaskHandle != NULL) {
+    Serial.println("Previous upload still in flight, streaming upload disabled");
+    return false;
+  }
   
-  // JSON作成: JsonDocumentだとデータが大きすぎて入らない
-  String jsonPayload = "{\"audio\":\"" + base64Audio + "\"}";
+  // 録音中のバッファを読み出し元とし、録音済み位置はキューで受け取る
+  uploadStream.beginPipelined(recordBuffer, blockQueue, uploadFormatFor(endpoint), uploadCodecFor(endpoint));
   
-  // URL作成
-  String url = String(SERVER_URL) + "/" + endpoint;
+  // 録音開始と同時にPOSTを開き、録音済みブロックを順次送信する
+  return startUploadTask(endpoint);
+}
+
+UploadFormat NetworkManager::uploadFormatFor(const char* endpoint) {
+  if (binaryRejected) return UPLOAD_FORMAT_JSON;
   
-  // POST送信
-  return sendPOSTRequest(url, jsonPayload);
+  for (const auto& entry : ENDPOINT_FORMATS) {
+    if (strcmp(entry.endpoint, endpoint) == 0) {
+      return entry.format;
+    }
+  }
+  return UPLOAD_FORMAT_JSON;
 }
 
-bool NetworkManager::sendPOSTRequest(const String& url, const String& jsonPayload) {
-  WiFiClient client;
+AudioCodec NetworkManager::uploadCodecFor(const char* endpoint) {
+  for (const auto& entry : ENDPOINT_FORMATS) {
+    if (strcmp(entry.endpoint, endpoint) == 0) {
+      return entry.codec;
+    }
+  }
+  return AUDIO_CODEC_PCM16;
+}
 
-  // エラー状態クリア
+bool NetworkManager::startUploadTask(const char* endpoint) {
+  resetResponse();
   hasErrorFlag = false;
+  uploadCancelled = false;
+  uploadUrl = String(SERVER_URL) + "/" + endpoint;
+  
+  if (xTaskCreate(uploadTaskWrapper, "UploadTask", UPLOAD_TASK_STACK, this, 4, &uploadTaskHandle) != pdPASS) {
+    Serial.println("Failed to create upload task");
+    uploadTaskHandle = NULL;
+    return false;
+  }
+  return true;
+}
+
+void NetworkManager::setResponseRing(AudioRingBuffer* ring) {
+  responseRing = ring;
+}
+
+void NetworkManager::setBufferPool(BufferPool* pool) {
+  bufferPool = pool;
+  responseChain.setPool(pool);
+}
+
+void NetworkManager::setClipCache(ClipCache* cache) {
+  clipCache = cache;
+}
+
+void NetworkManager::cancelStreamingUpload() {
+  // 送信中のボディは録音終了で完結するため、レスポンスを破棄するだけにする
+  if (uploadTaskHandle != NULL) {
+    uploadCancelled = true;
+    if (responseRing) responseRing->abort();
+  }
+}
+
+bool NetworkManager::isUploading() {
+  return uploadTaskHandle != NULL;
+}
+
+void NetworkManager::uploadTask() {
+  bool ok = sendPOSTRequest(uploadUrl, uploadStream);
+  
+  // バイナリ形式に未対応のサーバにはJSON形式で送り直す
+  if (!ok && responseCode == 415 && uploadStream.getFormat() == UPLOAD_FORMAT_BINARY && !uploadCancelled) {
+    Serial.println("Binary upload rejected by server, falling back to JSON");
+    binaryRejected = true;
+    if (uploadStream.rewind(UPLOAD_FORMAT_JSON)) {
+      resetResponse();
+      ok = sendPOSTRequest(uploadUrl, uploadStream);
+    }
+  }
+  
+  if (uploadCancelled) {
+    Serial.println("Upload cancelled, discarding response");
+    responseReady = false;
+  } else if (!ok) {
+    if (responseRing) responseRing->finish();
+    hasErrorFlag = true;
+  }
+  
+  uploadTaskHandle = NULL;
+  MemoryMonitor::taskExiting();
+  vTaskDelete(NULL);
+}
+
+int NetworkManager::startRequest(const String& url, AudioUploadStream& body) {
+  WiFiClient* client = connection.acquire();
+  if (!client) {
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+
+  http.begin(*client, url);
+  http.setReuse(HTTP_KEEP_ALIVE); // 応答後も接続を閉じない(サーバが許可した場合)
+  http.addHeader("Content-Type", body.contentType());
+  if (body.getFormat() == UPLOAD_FORMAT_BINARY) {
+    http.addHeader("X-Audio-Framing", "tbaf-v1");
+  }
+  if (body.isChunked()) {
+    http.addHeader("Transfer-Encoding", "chunked");
+  }
+  if (ACCEPT_ADPCM_RESPONSE) {
+    http.addHeader("X-Accept-Audio-Codec", "ima-adpcm");
+  }
+  if (ACCEPT_WAV_RESPONSE) {
+    http.addHeader("X-Accept-Audio-Format", "wav");
+  }
+  if (clipCache && CLIP_RESPONSE_CACHE) {
+    // 保存済みの応答を通知する(サーバは同じ応答ならX-Audio-Cache-Hitだけを返す)
+    http.addHeader("X-Accept-Audio-Cache", "1");
+    String keys = clipCache->advertisedKeys();
+    if (keys.length() > 0) {
+      http.addHeader("X-Audio-Cache-Keys", keys);
+    }
+  }
+  const char* collectHeaderKeys[] = { "X-Audio-Codec", "Transfer-Encoding", "X-Audio-Cache-Key", "X-Audio-Cache-Hit" };
+  http.collectHeaders(collectHeaderKeys, 4);
+  http.setTimeout(HTTP_TIMEOUT_MS);
+
+  return http.sendRequest("POST", &body, body.contentLength());
+}
+
+void NetworkManager::finishRequest(bool reusable) {
+  http.end();
+  if (!reusable) {
+    connection.drop();
+  }
+  connection.release();
+}
+
+bool NetworkManager::sendPOSTRequest(const String& url, AudioUploadStream& body) {
+  // エラー状態クリア(失敗時のエラー設定は呼び出し側で行う)
   responseReady = false;
   responseCode = 0;
 
-  http.begin(client, url);
-  http.addHeader("Content-Type", "application/json");
-  http.setTimeout(30000); // 30秒タイムアウト
-  
   Serial.printf("Sending POST to: %s\n", url.c_str());
-  Serial.printf("Payload size: %d bytes\n", jsonPayload.length());
+  if (body.isChunked()) {
+    Serial.println("Payload size: (chunked)");
+  } else {
+    Serial.printf("Payload size: %d bytes\n", body.contentLength());
+  }
   
-  int httpResponseCode = http.POST(jsonPayload);
+  unsigned long uploadStart = millis();
+  TurnTrace::mark(TRACE_UPLOAD_START);
+  int httpResponseCode = startRequest(url, body);
+  
+  // 使い回した接続がサーバ側で閉じられていた場合は、新しい接続で1度だけ送り直す
+  // ボディを読み始めていたら、録音の終了を待って全体を送り直す
+  if (httpResponseCode < 0 && connection.wasReused() && !uploadCancelled &&
+      (body.isUntouched() || body.rewind(body.getFormat()))) {
+    Serial.printf("Reused connection failed (%s), retrying on a new connection\n",
+                  http.errorToString(httpResponseCode).c_str());
+    finishRequest(false);
+    httpResponseCode = startRequest(url, body);
+  }
   responseCode = httpResponseCode;
+  TurnTrace::annotate("conn_reused", connection.wasReused() ? 1 : 0);
+  TurnTrace::annotate("conn_setup_us", connection.getSetupMicros());
+  if (connection.isSecure() && !connection.wasReused()) {
+    TurnTrace::annotate("tls_resumed", connection.wasTlsResumed() ? 1 : 0);
+  }
+  
+  if (DEBUG_NETWORK_COMMUNICATION) {
+    Serial.printf("Upload finished in %lu ms (encode: %lu us)\n",
+                  millis() - uploadStart, (unsigned long)body.getEncodeMicros());
+  }
   
   if (httpResponseCode == 200) {
     Serial.println("POST successful, processing response");
-    processChunkedResponse();
+    TurnTrace::mark(TRACE_RESPONSE_HEADERS);
+    responseCodec = (http.header("X-Audio-Codec") == "ima-adpcm") ? AUDIO_CODEC_IMA_ADPCM : AUDIO_CODEC_PCM16;
+    if (clipCache && CLIP_RESPONSE_CACHE) {
+      // 再生側がキーを見るので、responseStartedより先に決める
+      String hit = http.header("X-Audio-Cache-Hit");
+      if (hit.length() > 0 && clipCache->contains(hit.c_str())) {
+        strncpy(cachedResponseKey, hit.c_str(), sizeof(cachedResponseKey) - 1);
+        cachedResponseKey[sizeof(cachedResponseKey) - 1] = '\0';
+        Serial.printf("Server chose cached response %s\n", cachedResponseKey);
+      }
+      TurnTrace::annotate("cache_hit", cachedResponseKey[0] != '\0' ? 1 : 0);
+      String key = http.header("X-Audio-Cache-Key");
+      if (key.length() > 0) {
+        clipCache->beginCapture(key.c_str());
+      }
+    }
+    responseStarted = true;
+    bool complete = processResponseBody();
+    // 読み残しのある接続は次のリクエストに使えない
+    finishRequest(complete);
+    requestCompleteTime = millis();
+    if (bufferPool) {
+      MemoryMonitor::tag("net.response", responseChain.getSegment(0),
+                         responseChain.getSegmentCount() * bufferPool->getSegmentSize());
+    }
+    if (DEBUG_NETWORK_COMMUNICATION) {
+      connection.printStats();
+    }
     responseReady = true;
     return true;
   } else {
+    requestCompleteTime = millis();
     Serial.printf("POST failed, error code: %d\n", httpResponseCode);
-    hasErrorFlag = true;
     if (httpResponseCode > 0) {
       String response = http.getString();
       Serial.printf("Error response: %s\n", response.c_str());
     }
+    finishRequest(httpResponseCode > 0);
     return false;
   }
 }
 
-void NetworkManager::processChunkedResponse() {
+bool NetworkManager::processResponseBody() {
   WiFiClient* stream = http.getStreamPtr();
+  HttpBodyParser parser;
+  String transferEncoding = http.header("Transfer-Encoding");
+  transferEncoding.toLowerCase();
+  int contentLength = http.getSize();
 
-  allocateResponseBuffer(64 * 1024);
+  if (transferEncoding.indexOf("chunked") >= 0) {
+    parser.beginChunked();
+  } else if (contentLength >= 0) {
+    parser.beginFixed(contentLength);
+    // 全体を受信する場合は、必要なセグメントを先に確保しておく
+    if (!responseRing && !responseChain.reserve(contentLength)) {
+      Serial.printf("Response of %d bytes does not fit in the buffer pool\n", contentLength);
+    }
+  } else {
+    parser.beginUntilClose();
+  }
 
-  while (true) {
-    String chunkSizeLine = stream->readStringUntil('\n');
-    chunkSizeLine.trim(); // 改行除去
+  // 本文は受信先(リングかセグメント)へ直接読み込み、区切りだけを1バイトずつパーサに渡す
+  // 先頭(WAVヘッダ)だけは形式が決まるまでscratchに受ける。形式が決まった後はプールが尽きた分の読み捨てに使う
+  uint8_t scratch[WavHeader::MAX_HEADER_SIZE];
+  size_t headerLength = 0;
+  bool formatKnown = false;
+  unsigned long lastReceived = millis();
+  while (!parser.isDone() && !parser.hasError()) {
+    if (uploadCancelled || (responseRing && responseRing->isAborted())) break;
 
-    size_t chunkSize = strtol(chunkSizeLine.c_str(), NULL, 16);
-    if (chunkSize == 0) break; // 終了チャンク
+    int received;
+    size_t wanted = parser.payloadWanted();
+    if (wanted > 0 && !formatKnown) {
+      received = stream->read(scratch + headerLength, min(wanted, sizeof(scratch) - headerLength));
+      if (received > 0) {
+        TurnTrace::mark(TRACE_FIRST_BYTE);
+        parser.payloadRead(received);
+        if (clipCache) clipCache->capture(scratch + headerLength, received);
+        headerLength += received;
+        formatKnown = detectResponseFormat(scratch, headerLength, false);
+        if (formatKnown && responseFormat.sampleRate == 0) break; // 再生できない形式
+      }
+    } else if (wanted > 0) {
+      size_t space = 0;
+      uint8_t* dst = responseRing ? responseRing->writeSpan(space) : responseChain.writeSpan(space);
+      bool keep = (dst != nullptr);
+      if (!keep) {
+        if (responseRing) {
+          // 再生側が読み出すまで待つ(受信の停止ではないのでタイムアウトに数えない)
+          vTaskDelay(pdMS_TO_TICKS(1));
+          lastReceived = millis();
+          continue;
+        }
+        if (!responseTruncated) {
+          Serial.println("Response buffer pool exhausted, dropping the rest of the response");
+          responseTruncated = true;
+        }
+        dst = scratch;
+        space = sizeof(scratch);
+      }
 
-    while (chunkSize > 0) {
-      size_t toRead = min(chunkSize, size_t(1024));
-      uint8_t buffer[1024];
-      size_t bytesRead = stream->readBytes(buffer, toRead);
-      if (bytesRead > 0) {
-        appendToResponseBuffer(buffer, bytesRead);
-        chunkSize -= bytesRead;
-      } else {
-        break; // エラー
+      received = stream->read(dst, min(wanted, space));
+      if (received > 0) {
+        parser.payloadRead(received);
+        if (clipCache) clipCache->capture(dst, received);
+        if (keep) {
+          if (responseRing) responseRing->commit(received);
+          else responseChain.commit(received);
+          responseSize += received;
+        }
       }
+    } else {
+      received = stream->read();
+      if (received >= 0) {
+        parser.feed((uint8_t)received);
+        received = 1;
+      }
+    }
+
+    if (received > 0) {
+      lastReceived = millis();
+      continue;
     }
+    if (!stream->connected() && stream->available() <= 0) {
+      parser.endOfStream();
+    } else if (millis() - lastReceived >= HTTP_TIMEOUT_MS) {
+      parser.timedOut();
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(1));
+    }
+  }
+
+  // 形式を決める前に本文が終わった(ヘッダより短い応答)
+  if (!formatKnown) detectResponseFormat(scratch, headerLength, true);
+  bool playable = responseFormat.sampleRate != 0;
 
-    // チャンク終端の \r\n を読み飛ばす
-    stream->readStringUntil('\n');
+  TurnTrace::mark(TRACE_LAST_BYTE);
+  TurnTrace::annotate("response_bytes", responseSize);
+  TurnTrace::annotate("response_rate", responseFormat.sampleRate);
+  if (responseRing) responseRing->finish();
+  if (clipCache) {
+    // 途中で切れた応答はキーと一致しないので保存されない
+    clipCache->endCapture(parser.isDone() && !responseTruncated, responseFormat, responseHeaderSize);
   }
 
-  http.end();
+  if (parser.hasError()) {
+    // 受信できた分はそのまま再生する
+    Serial.printf("Response body error: %s after %u bytes\n", parser.errorString(),
+                  (unsigned)parser.getPayloadBytes());
+    TurnTrace::annotate("response_error", parser.getError());
+  }
   Serial.printf("Total response size: %d bytes\n", responseSize);
+  if (DEBUG_NETWORK_COMMUNICATION && bufferPool) {
+    bufferPool->printStats("response");
+  }
+  return playable && parser.isReusable();
+}
+
+bool NetworkManager::detectResponseFormat(const uint8_t* data, size_t length, bool final) {
+  size_t headerSize = 0;
+  responseHeaderSize = 0;
+  WavHeader::Result result = WavHeader::parse(data, length, responseFormat, headerSize);
+  if (result == WavHeader::WAV_NEED_MORE && !final) {
+    if (length < WavHeader::MAX_HEADER_SIZE) return false;
+    result = WavHeader::WAV_UNSUPPORTED;
+  }
+
+  if (result == WavHeader::WAV_OK) {
+    if (DEBUG_NETWORK_COMMUNICATION) {
+      Serial.printf("Response format: WAV %u Hz, %s\n", (unsigned)responseFormat.sampleRate,
+                    responseFormat.codec == AUDIO_CODEC_IMA_ADPCM ? "IMA-ADPCM" : "PCM16");
+    }
+  } else if (result == WavHeader::WAV_UNSUPPORTED) {
+    Serial.println("Unsupported WAV format in response, discarding it");
+    responseFormat.sampleRate = 0;
+    return true;
+  } else {
+    // ヘッダのない音声(従来の形式): コーデックはX-Audio-Codecヘッダ、レートは既定値
+    responseFormat = { RESPONSE_DEFAULT_SAMPLE_RATE, responseCodec };
+    headerSize = 0;
+  }
+
+  // 最初のデータより先に形式を渡す
+  responseHeaderSize = headerSize;
+  if (responseRing) responseRing->setFormat(responseFormat);
+  storeResponse(data + headerSize, length - headerSize);
+  return true;
+}
+
+void NetworkManager::storeResponse(const uint8_t* data, size_t size) {
+  if (responseRing) {
+    responseSize += responseRing->write(data, size); // 空きがなければ再生側の読み出しを待つ
+    return;
+  }
+  size_t appended = responseChain.append(data, size);
+  if (appended < size && !responseTruncated) {
+    Serial.println("Response buffer pool exhausted, dropping the rest of the response");
+    responseTruncated = true;
+  }
+  responseSize += appended;
 }
 
 bool NetworkManager::isResponseReady() {
   return responseReady;
 }
 
-uint8_t* NetworkManager::getResponseData() {
-  return responseBuffer;
+bool NetworkManager::isResponseStarted() {
+  return responseStarted;
+}
+
+const SegmentChain* NetworkManager::getResponseData() {
+  return &responseChain;
 }
 
 size_t NetworkManager::getResponseSize() {
   return responseSize;
 }
 
-String NetworkManager::encodeBase64(const uint8_t* data, size_t length) {
-  return base64::encode(data, length);
+AudioFormat NetworkManager::getResponseFormat() {
+  return responseFormat;
 }
 
-void NetworkManager::allocateResponseBuffer(size_t size) {
-  responseBuffer = (uint8_t*)malloc(size);
-  if (responseBuffer) {
-    responseCapacity = size;
-    responseSize = 0;
-  } else {
-    Serial.println("Failed to allocate response buffer");
-  }
+const char* NetworkManager::getCachedResponseKey() {
+  return cachedResponseKey;
 }
 
-void NetworkManager::appendToResponseBuffer(const uint8_t* data, size_t size) {
-  if (!responseBuffer) return;
-  
-  // バッファサイズが不足する場合は拡張
-  if (responseSize + size > responseCapacity) {
-    size_t newCapacity = responseCapacity * 2;
-    while (newCapacity < responseSize + size) {
-      newCapacity *= 2;
-    }
-    
-    uint8_t* newBuffer = (uint8_t*)realloc(responseBuffer, newCapacity);
-    if (newBuffer) {
-      responseBuffer = newBuffer;
-      responseCapacity = newCapacity;
-    } else {
-      Serial.println("Failed to expand response buffer");
-      return;
-    }
-  }
-  
-  memcpy(responseBuffer + responseSize, data, size);
-  responseSize += size;
+unsigned long NetworkManager::getRequestCompleteTime() {
+  return requestCompleteTime;
+}
+
+void NetworkManager::resetResponse() {
+  // 前回のレスポンスのセグメントをプールへ返す
+  responseChain.clear();
+  MemoryMonitor::untag("net.response");
+  responseSize = 0;
+  responseTruncated = false;
+  responseReady = false;
+  responseStarted = false;
+  responseHeaderSize = 0;
+  cachedResponseKey[0] = '\0';
+  if (responseRing) responseRing->reset();
 }
 
 void NetworkManager::initConversation() {
-  WiFiClient client;
-  HTTPClient http;
-  http.begin(client, String(SERVER_URL) + "/initConversation");
-  int response = http.POST("");
+  // 送信と同じ接続を使う(起動直後に開いた接続が最初のターンでそのまま使える)
+  WiFiClient* client = connection.acquire();
+  int response = HTTPC_ERROR_CONNECTION_REFUSED;
+  if (client) {
+    http.begin(*client, String(SERVER_URL) + "/initConversation");
+    http.setReuse(HTTP_KEEP_ALIVE);
+    response = http.POST("");
+  }
   
   if (response == 200) {
     Serial.println("Conversation reset successfully.");
@@ -197,7 +532,16 @@ void NetworkManager::initConversation() {
     Serial.printf("Failed to reset conversation. HTTP code: %d\n", response);
   }
 
-  http.end();
+  if (response > 0) {
+    http.getString(); // 応答を読み切ってから接続を返す
+  }
+  finishRequest(response > 0);
+}
+
+void NetworkManager::prewarmConnection() {
+  if (HTTP_KEEP_ALIVE) {
+    connection.warm();
+  }
 }
 
 bool NetworkManager::hasError() {
@@ -0,0 +1,276 @@
+#include "PlaybackEngine.h"
+#include "config.h"
+#include "MemoryMonitor.h"
+#include <esp_timer.h>
+#include <Speaker.h>
+
+// FreeRTOSタスク用の静的関数
+static void writerTaskWrapper(void* param) {
+  MemoryMonitor::taskStarted(PLAYBACK_WRITER_TASK_STACK);
+  ((PlaybackEngine*)param)->writerTask();
+}
+
+PlaybackEngine::PlaybackEngine() {
+  blockMemory = nullptr;
+  blockSamples = 0;
+  blockCount = 0;
+  freeBlocks = NULL;
+  readyBlocks = NULL;
+  i2sEvents = NULL;
+  fillBlock = -1;
+  fillPos = 0;
+  running = false;
+  primed = false;
+  skipEvents = 0;
+  writerTaskHandle = NULL;
+  memset(&stats, 0, sizeof(stats));
+}
+
+PlaybackEngine::~PlaybackEngine() {
+  stop(false);
+  if (blockMemory) heap_caps_free(blockMemory);
+  if (freeBlocks) vQueueDelete(freeBlocks);
+  if (readyBlocks) vQueueDelete(readyBlocks);
+}
+
+bool PlaybackEngine::init(uint32_t sampleRate) {
+  // 受け渡しブロックはDMAバッファと同じ長さにして、1回のi2s_writeでDMAバッファ1つを埋める
+  blockSamples = PLAYBACK_DMA_BUF_LEN;
+  blockCount = min((size_t)PLAYBACK_HANDOFF_BLOCKS, MAX_BLOCKS);
+  blockMemory = (int16_t*)heap_caps_malloc(blockCount * blockSamples * sizeof(int16_t), MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
+  freeBlocks = xQueueCreate(blockCount, sizeof(uint8_t));
+  readyBlocks = xQueueCreate(blockCount, sizeof(uint8_t));
+  if (!blockMemory || !freeBlocks || !readyBlocks) {
+    Serial.println("Failed to allocate playback blocks");
+    return false;
+  }
+  MemoryMonitor::tag("audio.playblocks", blockMemory, blockCount * blockSamples * sizeof(int16_t));
+  for (size_t i = 0; i < blockCount; i++) {
+    blocks[i] = blockMemory + i * blockSamples;
+    blockLength[i] = 0;
+  }
+
+  i2sConfig = {
+    .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX),
+    .sample_rate = (int)sampleRate,
+    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+    .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
+    .communication_format = I2S_COMM_FORMAT_STAND_I2S,
+    .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
+    .dma_buf_count = PLAYBACK_DMA_BUF_COUNT,
+    .dma_buf_len = PLAYBACK_DMA_BUF_LEN,
+    .use_apll = false,
+    .tx_desc_auto_clear = true, // 書き込みが間に合わなければ無音を出す
+    .fixed_mclk = 0
+  };
+
+  pinConfig = {
+    .bck_io_num = CONFIG_I2S_BCK_PIN,
+    .ws_io_num = CONFIG_I2S_LRCK_PIN,
+    .data_out_num = CONFIG_I2S_DATA_PIN,
+    .data_in_num = I2S_PIN_NO_CHANGE
+  };
+
+  return true;
+}
+
+bool PlaybackEngine::start() {
+  if (running) return true;
+
+  i2s_driver_uninstall(I2S_NUM_0); // 取り込みで使っていた場合に備える
+  esp_err_t result = i2s_driver_install(I2S_NUM_0, &i2sConfig, PLAYBACK_DMA_BUF_COUNT * 2, &i2sEvents);
+  if (result != ESP_OK) {
+    Serial.printf("I2S driver install failed: %d\n", result);
+    return false;
+  }
+  result = i2s_set_pin(I2S_NUM_0, &pinConfig);
+  if (result != ESP_OK) {
+    Serial.printf("I2S set pin failed: %d\n", result);
+    i2s_driver_uninstall(I2S_NUM_0);
+    return false;
+  }
+  i2s_zero_dma_buffer(I2S_NUM_0);
+
+  // 前回の停止で残ったブロックを空きに戻す
+  xQueueReset(freeBlocks);
+  xQueueReset(readyBlocks);
+  for (size_t i = 0; i < blockCount; i++) {
+    uint8_t index = i;
+    xQueueSend(freeBlocks, &index, 0);
+  }
+  fillBlock = -1;
+  fillPos = 0;
+  primed = false;
+  skipEvents = 0;
+  memset(&stats, 0, sizeof(stats));
+  stats.dmaCapacity = PLAYBACK_DMA_BUF_COUNT * blockSamples;
+  stats.minDmaFill = stats.dmaCapacity;
+
+  running = true;
+  if (xTaskCreate(writerTaskWrapper, "PlaybackWriter", PLAYBACK_WRITER_TASK_STACK, this,
+                  PLAYBACK_WRITER_PRIORITY, &writerTaskHandle) != pdPASS) {
+    Serial.println("Failed to create playback writer task");
+    running = false;
+    writerTaskHandle = NULL;
+    i2s_driver_uninstall(I2S_NUM_0);
+    return false;
+  }
+  return true;
+}
+
+void PlaybackEngine::stop(bool drain) {
+  if (!running) return;
+
+  if (drain) {
+    // 受け渡し待ちのブロックとDMAに積んだ分を再生しきるまで待つ
+    flush();
+    unsigned long limitMs = (blockCount + PLAYBACK_DMA_BUF_COUNT) * blockSamples * 1000UL / i2sConfig.sample_rate + 200;
+    unsigned long startTime = millis();
+    while ((uxQueueMessagesWaiting(readyBlocks) > 0 || stats.dmaFill > 0) && millis() - startTime < limitMs) {
+      vTaskDelay(pdMS_TO_TICKS(5));
+    }
+  }
+
+  running = false;
+  unsigned long startTime = millis();
+  while (writerTaskHandle != NULL && millis() - startTime < 1000) {
+    vTaskDelay(pdMS_TO_TICKS(5));
+  }
+  if (writerTaskHandle != NULL) {
+    Serial.println("ERROR: PlaybackWriter did not terminate, forcing deletion.");
+    MemoryMonitor::forgetTask(writerTaskHandle);
+    vTaskDelete(writerTaskHandle);
+    writerTaskHandle = NULL;
+  }
+
+  i2s_driver_uninstall(I2S_NUM_0);
+  i2sEvents = NULL;
+}
+
+bool PlaybackEngine::isRunning() const {
+  return running;
+}
+
+size_t PlaybackEngine::write(const int16_t* samples, size_t count) {
+  size_t written = 0;
+  while (written < count && running) {
+    if (fillBlock < 0 && !acquireBlock()) continue;
+
+    size_t n = min(count - written, blockSamples - fillPos);
+    memcpy(blocks[fillBlock] + fillPos, samples + written, n * sizeof(int16_t));
+    fillPos += n;
+    written += n;
+    if (fillPos == blockSamples) {
+      submitBlock();
+    }
+  }
+  return written;
+}
+
+void PlaybackEngine::flush() {
+  if (fillBlock >= 0 && fillPos > 0) {
+    submitBlock();
+  }
+}
+
+bool PlaybackEngine::acquireBlock() {
+  // 書き込みタスクがブロックを空けるまで待つ(停止を見逃さないよう時間を区切る)
+  uint8_t index;
+  if (xQueueReceive(freeBlocks, &index, pdMS_TO_TICKS(100)) != pdTRUE) {
+    return false;
+  }
+  fillBlock = index;
+  fillPos = 0;
+  return true;
+}
+
+void PlaybackEngine::submitBlock() {
+  uint8_t index = fillBlock;
+  blockLength[index] = fillPos;
+  xQueueSend(readyBlocks, &index, portMAX_DELAY); // ブロック数と同じ長さなので満杯にはならない
+  fillBlock = -1;
+  fillPos = 0;
+}
+
+size_t PlaybackEngine::bufferedSamples() const {
+  size_t queued = readyBlocks ? uxQueueMessagesWaiting(readyBlocks) : 0;
+  return stats.dmaFill + queued * blockSamples + (fillBlock >= 0 ? fillPos : 0);
+}
+
+PlaybackStats PlaybackEngine::getStats() const {
+  PlaybackStats result = stats;
+  result.queuedBlocks = readyBlocks ? uxQueueMessagesWaiting(readyBlocks) : 0;
+  return result;
+}
+
+void PlaybackEngine::printStats() const {
+  PlaybackStats s = getStats();
+  Serial.printf("Playback: %u blocks, %u underruns, max write %u us (DMA buffer %u us), min DMA fill %u/%u samples\n",
+                s.blocksWritten, s.underruns, s.maxWriteMicros,
+                (unsigned)(blockSamples * 1000000ULL / i2sConfig.sample_rate),
+                (unsigned)(s.blocksWritten > 0 ? s.minDmaFill : 0), (unsigned)s.dmaCapacity);
+}
+
+void PlaybackEngine::handleEvents() {
+  // DMAバッファ1つの再生が終わるたびにTX_DONEが届く
+  i2s_event_t event;
+  while (i2sEvents && xQueueReceive(i2sEvents, &event, 0) == pdTRUE) {
+    if (event.type != I2S_EVENT_TX_DONE) continue;
+    if (skipEvents > 0) {
+      skipEvents--;
+      continue;
+    }
+    stats.dmaFill -= min(stats.dmaFill, blockSamples);
+  }
+}
+
+void PlaybackEngine::writerTask() {
+  // 起動直後はDMAが一巡するまで待つ
+  // ドライバは再生済みのバッファを空きとして最大(数-1)個保持し、一巡した後は
+  // 空のDMAに書き込んだデータが再生中のバッファの次に入る(その分のTX_DONEを1回読み飛ばせばよい)
+  i2s_event_t event;
+  int warmup = 0;
+  while (running && warmup < PLAYBACK_DMA_BUF_COUNT - 1 &&
+         xQueueReceive(i2sEvents, &event, pdMS_TO_TICKS(100)) == pdTRUE) {
+    if (event.type == I2S_EVENT_TX_DONE) warmup++;
+  }
+
+  while (running) {
+    uint8_t index;
+    if (xQueueReceive(readyBlocks, &index, pdMS_TO_TICKS(5)) != pdTRUE) {
+      handleEvents(); // データがない間も残量を追う
+      continue;
+    }
+
+    handleEvents();
+    if (stats.dmaFill == 0) {
+      // DMAが空になってから書き込む: 最初以外は音が途切れている
+      if (primed) stats.underruns++;
+      skipEvents = 1;
+    }
+    if (primed && stats.dmaFill < stats.minDmaFill) {
+      stats.minDmaFill = stats.dmaFill;
+    }
+
+    size_t bytesWritten = 0;
+    int64_t start = esp_timer_get_time();
+    esp_err_t result = i2s_write(I2S_NUM_0, blocks[index], blockLength[index] * sizeof(int16_t), &bytesWritten, portMAX_DELAY);
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+    xQueueSend(freeBlocks, &index, 0);
+    if (result != ESP_OK) {
+      Serial.printf("I2S write failed: %d\n", result);
+      continue;
+    }
+
+    primed = true;
+    stats.dmaFill += bytesWritten / sizeof(int16_t);
+    stats.blocksWritten++;
+    if (elapsed > stats.maxWriteMicros) {
+      stats.maxWriteMicros = elapsed;
+    }
+  }
+
+  writerTaskHandle = NULL;
+  MemoryMonitor::taskExiting();
+  vTaskDelete(NULL);
+}
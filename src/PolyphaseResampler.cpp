@@ -0,0 +1,167 @@
+#include "PolyphaseResampler.h"
+#include "AudioDsp.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+namespace {
+
+const int COEFFICIENT_SHIFT = 14; // 係数はQ14(1位相の絶対値の和が1を少し超えても積和がint32に収まる)
+const float CUTOFF = 0.45f;       // 低い方のレートのナイキスト周波数に対する遮断周波数(0.5で一致)
+
+uint32_t gcd(uint32_t a, uint32_t b) {
+  while (b != 0) {
+    uint32_t rest = a % b;
+    a = b;
+    b = rest;
+  }
+  return a;
+}
+
+} // namespace
+
+PolyphaseResampler::PolyphaseResampler() {
+  coefficients = nullptr;
+  phases = 1;
+  step = 1;
+  passthrough = true;
+  reset();
+}
+
+PolyphaseResampler::~PolyphaseResampler() {
+  free(coefficients);
+}
+
+bool PolyphaseResampler::configure(uint32_t inputRate, uint32_t outputRate) {
+  if (inputRate == 0 || outputRate == 0) return false;
+  uint32_t divisor = gcd(inputRate, outputRate);
+  uint32_t up = outputRate / divisor;
+  uint32_t down = inputRate / divisor;
+  reset();
+
+  passthrough = (up == down);
+  if (passthrough) return true;
+  if (up > MAX_PHASES) return false;
+  if (coefficients && up == phases && down == step) return true;
+
+  free(coefficients);
+  coefficients = (int16_t*)malloc(up * TAPS * sizeof(int16_t));
+  if (!coefficients) {
+    phases = 1;
+    step = 1;
+    return false;
+  }
+  phases = up;
+  step = down;
+
+  // L倍のレートでのローパス(Blackman窓付きsinc)を位相ごとに分け、各位相の和を1にする(直流の利得を揃える)
+  const int length = up * TAPS;
+  const float cutoff = CUTOFF / (up > down ? up : down); // L倍のレートで正規化した遮断周波数
+  const float center = (length - 1) / 2.0f;
+  for (uint32_t p = 0; p < up; p++) {
+    float taps[TAPS];
+    float sum = 0;
+    for (int j = 0; j < TAPS; j++) {
+      int i = j * up + p;
+      float x = 2 * cutoff * (i - center);
+      float sinc = (x == 0) ? 1.0f : sinf((float)M_PI * x) / ((float)M_PI * x);
+      float window = 0.42f - 0.5f * cosf(2 * (float)M_PI * i / (length - 1))
+                   + 0.08f * cosf(4 * (float)M_PI * i / (length - 1));
+      taps[j] = sinc * window;
+      sum += taps[j];
+    }
+    for (int j = 0; j < TAPS; j++) {
+      coefficients[p * TAPS + j] = AudioDsp::saturate((int32_t)lroundf(taps[j] / sum * (1 << COEFFICIENT_SHIFT)));
+    }
+  }
+  return true;
+}
+
+void PolyphaseResampler::reset() {
+  memset(history, 0, sizeof(history));
+  historyPos = 0;
+  phase = 0;
+}
+
+bool PolyphaseResampler::isPassthrough() const {
+  return passthrough;
+}
+
+void PolyphaseResampler::push(int16_t sample) {
+  historyPos = (historyPos == 0) ? TAPS - 1 : historyPos - 1;
+  history[historyPos] = sample;
+  history[historyPos + TAPS] = sample;
+}
+
+int16_t PolyphaseResampler::filter(uint32_t phaseIndex) const {
+  // 窓は新しいサンプルが先頭
+  const int16_t* c = coefficients + phaseIndex * TAPS;
+  const int16_t* x = history + historyPos;
+  int32_t acc = 1 << (COEFFICIENT_SHIFT - 1);
+  for (int j = 0; j < TAPS; j++) {
+    acc += (int32_t)c[j] * x[j];
+  }
+  return AudioDsp::saturate(acc >> COEFFICIENT_SHIFT);
+}
+
+size_t PolyphaseResampler::process(const int16_t* input, size_t count, size_t& consumed, int16_t* output, size_t capacity) {
+  if (passthrough) {
+    size_t n = (count < capacity) ? count : capacity;
+    memcpy(output, input, n * sizeof(int16_t));
+    consumed = n;
+    return n;
+  }
+  if (!coefficients) {
+    consumed = count;
+    return 0;
+  }
+
+  // 入力1サンプルごとに、その区間に入る出力(位相がL未満の間)を作る
+  const size_t maxPerInput = (phases + step - 1) / step;
+  size_t produced = 0;
+  size_t used = 0;
+  while (used < count && produced + maxPerInput <= capacity) {
+    push(input[used++]);
+    while (phase < phases) {
+      output[produced++] = filter(phase);
+      phase += step;
+    }
+    phase -= phases;
+  }
+  consumed = used;
+  return produced;
+}
+
+#ifdef ARDUINO
+void PolyphaseResampler::benchmark() {
+  static const size_t SAMPLES = 512;
+  static int16_t input[SAMPLES];
+  static int16_t output[SAMPLES * 3];
+  const int iterations = 20;
+
+  for (size_t i = 0; i < SAMPLES; i++) {
+    input[i] = (int16_t)(8000 * sin(i * 0.07) + 3000 * sin(i * 0.31));
+  }
+
+  const uint32_t rates[] = { 8000, 16000, 22050 };
+  for (uint32_t rate : rates) {
+    PolyphaseResampler resampler;
+    if (!resampler.configure(rate, 24000)) continue;
+    size_t produced = 0;
+    uint32_t start = ESP.getCycleCount();
+    for (int n = 0; n < iterations; n++) {
+      size_t consumed;
+      produced = resampler.process(input, SAMPLES, consumed, output, sizeof(output) / sizeof(output[0]));
+    }
+    uint32_t cycles = ESP.getCycleCount() - start;
+    Serial.printf("Resampler %u -> 24000 Hz: %.1f cycles/output sample\n",
+                  (unsigned)rate, (float)cycles / (iterations * produced));
+  }
+}
+#else
+void PolyphaseResampler::benchmark() {}
+#endif
@@ -0,0 +1,418 @@
+#include "TlsClient.h"
+#include "config.h"
+#include <Preferences.h>
+#include <mbedtls/error.h>
+#include <mbedtls/md.h>
+#include <mbedtls/net_sockets.h>
+#include <string.h>
+
+namespace {
+
+const int32_t DEFAULT_CONNECT_TIMEOUT_MS = 3000; // WiFiClient::connect()の既定値と同じ
+const char* const NVS_NAMESPACE = "tls";
+
+// mbedTLSの入出力(TCPはWiFiClientに任せる)。受信は待たずに返し、待つのは呼び出し側のループ
+int sendCallback(void* ctx, const unsigned char* buf, size_t len) {
+  WiFiClient* tcp = (WiFiClient*)ctx;
+  size_t written = tcp->write(buf, len);
+  if (written > 0) return (int)written;
+  return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_CONN_RESET;
+}
+
+int receiveCallback(void* ctx, unsigned char* buf, size_t len) {
+  WiFiClient* tcp = (WiFiClient*)ctx;
+  int avail = tcp->available();
+  if (avail <= 0) {
+    return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int received = tcp->read(buf, len < (size_t)avail ? len : (size_t)avail);
+  return received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+int verifyCallback(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags) {
+  return ((TlsClient*)ctx)->verifyCertificate(crt, depth, flags);
+}
+
+void printTlsError(const char* what, int ret) {
+  char message[96];
+  mbedtls_strerror(ret, message, sizeof(message));
+  Serial.printf("%s failed: -0x%04x %s\n", what, (unsigned)-ret, message);
+}
+
+int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+} // namespace
+
+TlsClient::TlsClient() {
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_ssl_config_init(&conf);
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_session_init(&session);
+  configured = false;
+  sslActive = false;
+  peerClosed = false;
+  sessionValid = false;
+  peeked = -1;
+  memset(pin, 0, sizeof(pin));
+  pinSet = false;
+  certChecked = false;
+  saveToNvs = false;
+  lastResumed = false;
+  lastHandshakeMicros = 0;
+  fullHandshakes = 0;
+  resumedHandshakes = 0;
+}
+
+TlsClient::~TlsClient() {
+  stop();
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_config_free(&conf);
+  mbedtls_ctr_drbg_free(&drbg);
+  mbedtls_entropy_free(&entropy);
+}
+
+bool TlsClient::setPinnedFingerprint(const char* fingerprint) {
+  pinSet = false;
+  size_t count = 0;
+  int high = -1;
+  for (const char* p = fingerprint; *p; p++) {
+    if (*p == ':' || *p == ' ') continue;
+    int value = hexValue(*p);
+    if (value < 0 || count >= sizeof(pin)) return false;
+    if (high < 0) {
+      high = value;
+    } else {
+      pin[count++] = (uint8_t)((high << 4) | value);
+      high = -1;
+    }
+  }
+  pinSet = (count == sizeof(pin) && high < 0);
+  return pinSet;
+}
+
+void TlsClient::enableSessionStore(const String& key) {
+  saveToNvs = true;
+  sessionKey = key;
+  loadSession();
+}
+
+void TlsClient::clearSession() {
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  sessionValid = false;
+
+  if (saveToNvs) {
+    Preferences prefs;
+    if (prefs.begin(NVS_NAMESPACE, false)) {
+      prefs.remove("session");
+      prefs.end();
+    }
+  }
+}
+
+bool TlsClient::setup() {
+  if (configured) return true;
+
+  const char* personalization = "tenori-tls";
+  int ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                  (const unsigned char*)personalization, strlen(personalization));
+  if (ret != 0) {
+    printTlsError("TLS random seed", ret);
+    return false;
+  }
+  ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret != 0) {
+    printTlsError("TLS config", ret);
+    return false;
+  }
+  mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+  // CAチェーンは持たず、検証はverifyCertificate()のフィンガープリント照合だけで行う
+  // (VERIFY_REQUIREDはCAチェーンがないと必ず失敗する。コールバックのエラーはOPTIONALでも接続を止める)
+  mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+  mbedtls_ssl_conf_verify(&conf, verifyCallback, this);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  configured = true;
+  return true;
+}
+
+int TlsClient::verifyCertificate(mbedtls_x509_crt* crt, int depth, uint32_t* flags) {
+  // 信頼はサーバ証明書のフィンガープリントだけで決める
+  // (自己署名でも使え、時計が合っていなくても有効期限で落ちない。中間・ルート証明書は見ない)
+  *flags = 0;
+  if (depth != 0) return 0;
+
+  uint8_t digest[32];
+  const mbedtls_md_info_t* sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  if (!sha256 || mbedtls_md(sha256, crt->raw.p, crt->raw.len, digest) != 0) {
+    return MBEDTLS_ERR_X509_FATAL_ERROR;
+  }
+  if (pinSet && memcmp(digest, pin, sizeof(pin)) == 0) {
+    certChecked = true;
+    return 0;
+  }
+
+  // 設定に貼り付けられる形で表示する
+  Serial.print(pinSet ? "Server certificate does not match SERVER_CERT_FINGERPRINT: "
+                      : "SERVER_CERT_FINGERPRINT is not set. Server certificate: ");
+  for (size_t i = 0; i < sizeof(digest); i++) {
+    Serial.printf("%s%02X", i ? ":" : "", digest[i]);
+  }
+  Serial.println();
+  return MBEDTLS_ERR_X509_FATAL_ERROR;
+}
+
+bool TlsClient::handshake(const char* host) {
+  int ret = mbedtls_ssl_setup(&ssl, &conf);
+  if (ret == 0) ret = mbedtls_ssl_set_hostname(&ssl, host);
+  if (ret != 0) {
+    printTlsError("TLS setup", ret);
+    closeSsl();
+    return false;
+  }
+  mbedtls_ssl_set_bio(&ssl, &tcp, sendCallback, receiveCallback, NULL);
+
+  bool resuming = sessionValid && mbedtls_ssl_set_session(&ssl, &session) == 0;
+  certChecked = false;
+
+  unsigned long start = micros();
+  unsigned long startMillis = millis();
+  while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) break;
+    if (millis() - startMillis >= TLS_HANDSHAKE_TIMEOUT_MS) {
+      ret = MBEDTLS_ERR_SSL_TIMEOUT;
+      break;
+    }
+    vTaskDelay(1);
+  }
+  lastHandshakeMicros = micros() - start;
+
+  // 証明書が届くのはフルハンドシェイクだけ。届かなかったならセッションの再開
+  if (ret == 0 && !certChecked && !resuming) {
+    Serial.println("TLS handshake completed without a verified certificate");
+    ret = MBEDTLS_ERR_X509_FATAL_ERROR;
+  }
+  if (ret != 0) {
+    printTlsError("TLS handshake", ret);
+    // 保存していたセッションが原因かもしれないので、次はフルハンドシェイクにする
+    if (resuming) clearSession();
+    closeSsl();
+    return false;
+  }
+
+  sslActive = true;
+  peerClosed = false;
+  lastResumed = !certChecked;
+  if (lastResumed) resumedHandshakes++;
+  else fullHandshakes++;
+  rememberSession(!lastResumed);
+
+  if (DEBUG_NETWORK_COMMUNICATION) {
+    Serial.printf("TLS %s handshake in %lu us (%s)\n", lastResumed ? "resumed" : "full",
+                  (unsigned long)lastHandshakeMicros, mbedtls_ssl_get_ciphersuite(&ssl));
+  }
+  return true;
+}
+
+void TlsClient::rememberSession(bool fullHandshake) {
+  // 再開した場合もサーバが新しいチケットを発行していることがあるので取り直す
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  sessionValid = mbedtls_ssl_get_session(&ssl, &session) == 0;
+
+  // NVSの書き換えはフルハンドシェイクの後だけ(毎ターン書くとフラッシュが減る)
+  if (sessionValid && fullHandshake && saveToNvs) saveSession();
+}
+
+void TlsClient::loadSession() {
+  Preferences prefs;
+  if (!prefs.begin(NVS_NAMESPACE, true)) return;
+
+  size_t length = prefs.getBytesLength("session");
+  if (length > 0 && prefs.getString("key", "") == sessionKey) {
+    uint8_t* data = (uint8_t*)malloc(length);
+    if (data && prefs.getBytes("session", data, length) == length) {
+      mbedtls_ssl_session_free(&session);
+      mbedtls_ssl_session_init(&session);
+      // ビルド設定の違うファームウェアが保存したものは読めない(フルハンドシェイクになるだけ)
+      sessionValid = mbedtls_ssl_session_load(&session, data, length) == 0;
+    }
+    free(data);
+  }
+  prefs.end();
+
+  if (DEBUG_NETWORK_COMMUNICATION && sessionValid) {
+    Serial.printf("Loaded TLS session for %s from NVS\n", sessionKey.c_str());
+  }
+}
+
+void TlsClient::saveSession() {
+  size_t length = 0;
+  mbedtls_ssl_session_save(&session, NULL, 0, &length); // 必要な長さを得る
+  if (length == 0) return;
+
+  uint8_t* data = (uint8_t*)malloc(length);
+  if (!data) return;
+  if (mbedtls_ssl_session_save(&session, data, length, &length) == 0) {
+    Preferences prefs;
+    if (prefs.begin(NVS_NAMESPACE, false)) {
+      prefs.putString("key", sessionKey);
+      prefs.putBytes("session", data, length);
+      prefs.end();
+    }
+  }
+  // セッションには鍵の素材が含まれるので、解放前に消しておく
+  memset(data, 0, length);
+  free(data);
+}
+
+void TlsClient::closeSsl() {
+  if (sslActive && !peerClosed) mbedtls_ssl_close_notify(&ssl);
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_init(&ssl);
+  sslActive = false;
+  peerClosed = false;
+  peeked = -1;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip.toString().c_str(), port, DEFAULT_CONNECT_TIMEOUT_MS);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+  return connect(ip.toString().c_str(), port, timeout);
+}
+
+int TlsClient::connect(const char* host, uint16_t port) {
+  return connect(host, port, DEFAULT_CONNECT_TIMEOUT_MS);
+}
+
+int TlsClient::connect(const char* host, uint16_t port, int32_t timeout) {
+  stop();
+  if (!setup()) return 0;
+  if (!tcp.connect(host, port, timeout)) return 0;
+  tcp.setNoDelay(true);
+  if (!handshake(host)) {
+    tcp.stop();
+    return 0;
+  }
+  return 1;
+}
+
+size_t TlsClient::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+size_t TlsClient::write(const uint8_t* buf, size_t size) {
+  if (!sslActive || peerClosed) return 0;
+
+  size_t written = 0;
+  unsigned long start = millis();
+  while (written < size) {
+    int ret = mbedtls_ssl_write(&ssl, buf + written, size - written);
+    if (ret > 0) {
+      written += ret;
+      start = millis();
+      continue;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      peerClosed = true;
+      break;
+    }
+    if (millis() - start >= getTimeout()) break;
+    vTaskDelay(1);
+  }
+  return written;
+}
+
+int TlsClient::available() {
+  if (!sslActive) return 0;
+
+  if (!peerClosed && mbedtls_ssl_get_bytes_avail(&ssl) == 0) {
+    // 届いているレコードを復号しておく(読み出しはしない)
+    int ret = mbedtls_ssl_read(&ssl, NULL, 0);
+    if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      peerClosed = true; // close_notifyを受け取ったか、接続が切れた
+    }
+  }
+  return (peeked >= 0 ? 1 : 0) + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::read() {
+  if (peeked >= 0) {
+    int value = peeked;
+    peeked = -1;
+    return value;
+  }
+  uint8_t value;
+  if (available() <= 0 || mbedtls_ssl_read(&ssl, &value, 1) != 1) return -1;
+  return value;
+}
+
+int TlsClient::read(uint8_t* buf, size_t size) {
+  if (!sslActive || !buf || size == 0) return 0;
+
+  size_t copied = 0;
+  if (peeked >= 0) {
+    buf[copied++] = (uint8_t)peeked;
+    peeked = -1;
+  }
+
+  unsigned long start = millis();
+  while (copied < size) {
+    int ret = mbedtls_ssl_read(&ssl, buf + copied, size - copied);
+    if (ret > 0) {
+      copied += ret;
+      break;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      peerClosed = true; // 0はEOF
+      break;
+    }
+    if (copied > 0 || millis() - start >= getTimeout()) break;
+    vTaskDelay(1);
+  }
+  return (int)copied;
+}
+
+int TlsClient::peek() {
+  if (peeked < 0) peeked = read();
+  return peeked;
+}
+
+void TlsClient::flush() {
+  // 送信はwrite()で済んでいる。受信データは捨てない
+}
+
+void TlsClient::stop() {
+  closeSsl();
+  tcp.stop();
+}
+
+uint8_t TlsClient::connected() {
+  if (!sslActive) return 0;
+  if (available() > 0) return 1;
+  return !peerClosed && tcp.connected();
+}
+
+bool TlsClient::wasResumed() const {
+  return lastResumed;
+}
+
+uint32_t TlsClient::getHandshakeMicros() const {
+  return lastHandshakeMicros;
+}
+
+void TlsClient::printStats() const {
+  Serial.printf("TLS handshakes: %u full, %u resumed (last %lu us)\n",
+                (unsigned)fullHandshakes, (unsigned)resumedHandshakes, (unsigned long)lastHandshakeMicros);
+}
@@ -0,0 +1,139 @@
+#include "TurnTrace.h"
+#include "config.h"
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <string.h>
+
+namespace {
+
+const int MAX_SCREENS = 8;
+const int MAX_NOTES = 16;
+
+const char* const PHASE_NAMES[TRACE_PHASE_COUNT] = {
+  "wake",
+  "record_start",
+  "record_stop",
+  "upload_start",
+  "headers_sent",
+  "body_sent",
+  "response_headers",
+  "first_byte",
+  "last_byte",
+  "playback_start",
+  "first_audio",
+  "playback_end",
+};
+
+struct ScreenEvent {
+  const char* name;
+  int64_t start;
+  int64_t end;
+};
+
+struct Note {
+  const char* key;
+  int32_t value;
+};
+
+bool active = false;
+uint32_t turnNumber = 0;
+const char* trigger = "";
+int64_t startTime = 0;
+int64_t stamps[TRACE_PHASE_COUNT]; // 0なら未記録
+ScreenEvent screens[MAX_SCREENS];
+int screenCount = 0;
+Note notes[MAX_NOTES];
+int noteCount = 0;
+portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+} // namespace
+
+void TurnTrace::begin(const char* turnTrigger) {
+  if (!DEBUG_TURN_TRACE) return;
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&lock);
+  active = true;
+  turnNumber++;
+  trigger = turnTrigger;
+  startTime = now;
+  memset(stamps, 0, sizeof(stamps));
+  screenCount = 0;
+  noteCount = 0;
+  portEXIT_CRITICAL(&lock);
+}
+
+void TurnTrace::mark(TracePhase phase) {
+  // 記録済みならロックを取らずに戻る(送信ループなど頻繁に呼ばれる箇所があるため)
+  if (!active || stamps[phase] != 0) return;
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&lock);
+  if (active && stamps[phase] == 0) stamps[phase] = now;
+  portEXIT_CRITICAL(&lock);
+}
+
+void TurnTrace::screen(const char* name, int64_t startUs) {
+  if (!active) return;
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&lock);
+  if (active && screenCount < MAX_SCREENS) {
+    screens[screenCount++] = { name, startUs, now };
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void TurnTrace::annotate(const char* key, int32_t value) {
+  if (!active) return;
+
+  portENTER_CRITICAL(&lock);
+  int index = 0;
+  while (index < noteCount && strcmp(notes[index].key, key) != 0) index++;
+  if (active && index < MAX_NOTES) {
+    if (index == noteCount) noteCount++;
+    notes[index] = { key, value };
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+bool TurnTrace::isActive() {
+  return active;
+}
+
+void TurnTrace::end() {
+  if (!active) return;
+
+  // 出力中に他のタスクが書き換えないよう、先に写してから記録を止める
+  int64_t phaseCopy[TRACE_PHASE_COUNT];
+  ScreenEvent screenCopy[MAX_SCREENS];
+  Note noteCopy[MAX_NOTES];
+  portENTER_CRITICAL(&lock);
+  active = false;
+  memcpy(phaseCopy, stamps, sizeof(stamps));
+  memcpy(screenCopy, screens, sizeof(screens));
+  memcpy(noteCopy, notes, sizeof(notes));
+  int screenTotal = screenCount;
+  int noteTotal = noteCount;
+  portEXIT_CRITICAL(&lock);
+
+  // 時刻はターン開始からのマイクロ秒
+  Serial.printf("TURN {\"turn\":%u,\"trigger\":\"%s\",\"complete\":%s,\"phases\":{",
+                (unsigned)turnNumber, trigger, phaseCopy[TRACE_PLAYBACK_END] ? "true" : "false");
+  bool first = true;
+  for (int i = 0; i < TRACE_PHASE_COUNT; i++) {
+    if (phaseCopy[i] == 0) continue;
+    Serial.printf("%s\"%s\":%ld", first ? "" : ",", PHASE_NAMES[i], (long)(phaseCopy[i] - startTime));
+    first = false;
+  }
+  Serial.print("},\"screens\":[");
+  for (int i = 0; i < screenTotal; i++) {
+    Serial.printf("%s{\"name\":\"%s\",\"t\":%ld,\"draw\":%ld}", i ? "," : "", screenCopy[i].name,
+                  (long)(screenCopy[i].start - startTime), (long)(screenCopy[i].end - screenCopy[i].start));
+  }
+  Serial.print("],\"notes\":{");
+  for (int i = 0; i < noteTotal; i++) {
+    Serial.printf("%s\"%s\":%ld", i ? "," : "", noteCopy[i].key, (long)noteCopy[i].value);
+  }
+  Serial.println("}}");
+}
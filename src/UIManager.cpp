@@ -1,8 +1,62 @@
 #include "UIManager.h"
+#include "config.h"
 #include <SPIFFS.h>
+#include "MemoryMonitor.h"
+#include "TurnTrace.h"
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+// 画面ごとの画像(ScreenStateの順)
+static const char* const SCREEN_IMAGES[] = {
+  "/smile_close.jpg", // SCREEN_IDLE
+  "/hearing.jpg",     // SCREEN_HEARING
+  "/notice.jpg",      // SCREEN_NOTICE
+  "/thinking.jpg",    // SCREEN_THINKING
+  "/smile_open.jpg",  // SCREEN_SPEAKING
+};
+
+// 口の領域を自動で決めるときの、色が違うとみなす差(8bitに換算したRGBの差の和)と領域の上限
+static const int MOUTH_DIFF_THRESHOLD = 48;
+static const size_t MAX_MOUTH_PIXELS = 320 * 240 / 4;
+
+// スプライトのRGB565は上位バイトと下位バイトが入れ替わっている
+static inline uint16_t swapPixel(uint16_t p) {
+  return (p >> 8) | (p << 8);
+}
+
+static int colorDistance(uint16_t a, uint16_t b) {
+  a = swapPixel(a);
+  b = swapPixel(b);
+  return abs((a >> 11) - (b >> 11)) * 8 + abs(((a >> 5) & 0x3F) - ((b >> 5) & 0x3F)) * 4 + abs((a & 0x1F) - (b & 0x1F)) * 8;
+}
+
+static uint16_t blendPixel(uint16_t a, uint16_t b) {
+  a = swapPixel(a);
+  b = swapPixel(b);
+  uint16_t r = ((a >> 11) + (b >> 11)) / 2;
+  uint16_t g = (((a >> 5) & 0x3F) + ((b >> 5) & 0x3F)) / 2;
+  uint16_t bl = ((a & 0x1F) + (b & 0x1F)) / 2;
+  return swapPixel((r << 11) | (g << 5) | bl);
+}
 
 UIManager::UIManager() : sprite(&M5.Lcd) {
   currentScreen = SCREEN_INIT;
+  imageMemory = nullptr;
+  for (int i = 0; i < SCREEN_INIT; i++) {
+    screenPixels[i] = nullptr;
+  }
+  mouthMemory = nullptr;
+  for (int i = 0; i < MOUTH_SHAPES; i++) {
+    mouthSprites[i] = nullptr;
+  }
+  mouthX = mouthY = mouthW = mouthH = 0;
+  currentMouth = MOUTH_OPEN;
+  mouthPeak = 0;
+  nextMouthFrameUs = 0;
+  mouthIntervalUs = LIPSYNC_FRAME_MS * 1000;
+  lastUnderruns = 0;
+  mouthFrames = 0;
+  mouthMaxDrawUs = 0;
 }
 
 bool UIManager::init() {
@@ -13,6 +67,13 @@ bool UIManager::init() {
   
   // スプライトを作成
   sprite.createSprite(M5.Lcd.width(), M5.Lcd.height());
+  MemoryMonitor::tag("ui.sprite", sprite.getPointer(), (size_t)M5.Lcd.width() * M5.Lcd.height() * 2); // 16bitカラー
+  
+  // 画面の画像を先にデコードしておく(切り替えのたびにJPEGを展開しない)
+  decodeImages();
+  if (LIPSYNC_ENABLED) {
+    prepareMouth();
+  }
   
   // タッチパネル初期化
   M5.Touch.begin();
@@ -20,33 +81,147 @@ bool UIManager::init() {
   return true;
 }
 
+void UIManager::decodeImages() {
+  const size_t framePixels = (size_t)sprite.width() * sprite.height();
+  const size_t totalBytes = framePixels * sizeof(uint16_t) * SCREEN_INIT;
+  constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+  imageMemory = (uint16_t*)heap_caps_malloc(totalBytes, memCaps);
+  if (!imageMemory) {
+    Serial.println("Not enough memory for decoded screens, drawing them from flash");
+    return;
+  }
+  MemoryMonitor::tag("ui.screens", imageMemory, totalBytes);
+  
+  // スプライトに展開してから写し取る(表示のたびにかかっていた時間の目安として表示する)
+  for (int i = 0; i < SCREEN_INIT; i++) {
+    if (!SPIFFS.exists(SCREEN_IMAGES[i])) {
+      Serial.printf("❌ Image file not found: %s\n", SCREEN_IMAGES[i]);
+      continue;
+    }
+    int64_t start = esp_timer_get_time();
+    sprite.fillSprite(BLACK);
+    sprite.drawJpgFile(SPIFFS, SCREEN_IMAGES[i]);
+    uint16_t* pixels = imageMemory + i * framePixels;
+    memcpy(pixels, sprite.getPointer(), framePixels * sizeof(uint16_t));
+    screenPixels[i] = pixels;
+    Serial.printf("Decoded %s in %lu us\n", SCREEN_IMAGES[i], (unsigned long)(esp_timer_get_time() - start));
+  }
+}
+
+// 口を閉じた画像(smile_close)と開いた画像(smile_open)から、口の領域の絵を3つ作る
+bool UIManager::prepareMouth() {
+  const uint16_t* closedFrame = screenPixels[SCREEN_IDLE];
+  const uint16_t* openFrame = screenPixels[SCREEN_SPEAKING];
+  if (!closedFrame || !openFrame) {
+    Serial.println("Lip sync needs pre-decoded smile_close and smile_open images, disabled");
+    return false;
+  }
+  if (!findMouthRect()) return false;
+  
+  const size_t pixels = (size_t)mouthW * mouthH;
+  constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
+  mouthMemory = (uint16_t*)heap_caps_malloc(pixels * sizeof(uint16_t) * MOUTH_SHAPES, memCaps);
+  if (!mouthMemory) {
+    Serial.println("Not enough memory for mouth sprites, lip sync disabled");
+    return false;
+  }
+  MemoryMonitor::tag("ui.mouth", mouthMemory, pixels * sizeof(uint16_t) * MOUTH_SHAPES);
+  
+  uint16_t* closed = mouthMemory;
+  uint16_t* half = closed + pixels;
+  uint16_t* open = half + pixels;
+  const int frameWidth = sprite.width();
+  for (int y = 0; y < mouthH; y++) {
+    size_t src = (size_t)(mouthY + y) * frameWidth + mouthX;
+    size_t dst = (size_t)y * mouthW;
+    memcpy(closed + dst, closedFrame + src, mouthW * sizeof(uint16_t));
+    memcpy(open + dst, openFrame + src, mouthW * sizeof(uint16_t));
+    for (int x = 0; x < mouthW; x++) {
+      half[dst + x] = blendPixel(closed[dst + x], open[dst + x]);
+    }
+  }
+  mouthSprites[MOUTH_CLOSED] = closed;
+  mouthSprites[MOUTH_HALF] = half;
+  mouthSprites[MOUTH_OPEN] = open;
+  Serial.printf("Lip sync mouth region: (%d, %d) %dx%d\n", mouthX, mouthY, mouthW, mouthH);
+  return true;
+}
+
+bool UIManager::findMouthRect() {
+  const int width = sprite.width();
+  const int height = sprite.height();
+  if (LIPSYNC_MOUTH_W > 0) {
+    mouthX = constrain(LIPSYNC_MOUTH_X, 0, width - 1);
+    mouthY = constrain(LIPSYNC_MOUTH_Y, 0, height - 1);
+    mouthW = min(LIPSYNC_MOUTH_W, width - mouthX);
+    mouthH = min(LIPSYNC_MOUTH_H, height - mouthY);
+    return mouthH > 0;
+  }
+  
+  // 2つの画像で色がはっきり違う画素を囲む(JPEGのノイズ程度の差は無視する)
+  const uint16_t* closedFrame = screenPixels[SCREEN_IDLE];
+  const uint16_t* openFrame = screenPixels[SCREEN_SPEAKING];
+  int left = width, top = height, right = -1, bottom = -1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      size_t i = (size_t)y * width + x;
+      if (colorDistance(closedFrame[i], openFrame[i]) > MOUTH_DIFF_THRESHOLD) {
+        left = min(left, x);
+        right = max(right, x);
+        top = min(top, y);
+        bottom = max(bottom, y);
+      }
+    }
+  }
+  if (right < 0) {
+    Serial.println("smile_close and smile_open are identical, lip sync disabled");
+    return false;
+  }
+  
+  mouthX = left;
+  mouthY = top;
+  mouthW = right - left + 1;
+  mouthH = bottom - top + 1;
+  if ((size_t)mouthW * mouthH > MAX_MOUTH_PIXELS) {
+    Serial.printf("Mouth region (%d, %d) %dx%d is too large, set LIPSYNC_MOUTH_* in config.h; lip sync disabled\n",
+                  mouthX, mouthY, mouthW, mouthH);
+    return false;
+  }
+  return true;
+}
+
 void UIManager::showIdleScreen() {
-  changeScreen(SCREEN_IDLE, "/smile_close.jpg");
+  changeScreen(SCREEN_IDLE);
 }
 
 void UIManager::showHearingScreen() {
-  changeScreen(SCREEN_HEARING, "/hearing.jpg");
+  changeScreen(SCREEN_HEARING);
 }
 
 void UIManager::showNoticeScreen() {
-  changeScreen(SCREEN_NOTICE, "/notice.jpg");
+  changeScreen(SCREEN_NOTICE);
 }
 
 void UIManager::showThinkingScreen() {
-  changeScreen(SCREEN_THINKING, "/thinking.jpg");
+  changeScreen(SCREEN_THINKING);
 }
 
 void UIManager::showSpeakingScreen() {
-  changeScreen(SCREEN_SPEAKING, "/smile_open.jpg");
+  changeScreen(SCREEN_SPEAKING);
 }
 
-void UIManager::changeScreen(ScreenState newScreen, const char* imagePath) {
+void UIManager::changeScreen(ScreenState newScreen) {
   if (currentScreen == newScreen) return;
 
   currentScreen = newScreen;
+  const char* imagePath = SCREEN_IMAGES[newScreen];
+  int64_t drawStart = esp_timer_get_time();
   
-  // 画像を読み込んで表示
-  if (!loadImageIfExists(imagePath)) {
+  // デコード済みならそのまま転送し、なければ画像を読み込んで表示
+  bool cached = (screenPixels[newScreen] != nullptr);
+  if (cached) {
+    blitImage(0, 0, sprite.width(), sprite.height(), screenPixels[newScreen]);
+  } else if (!loadImageIfExists(imagePath)) {
     // 画像が読み込めない場合はテキストで状態を表示
     M5.Lcd.setTextColor(WHITE);
     M5.Lcd.setTextSize(2);
@@ -68,7 +243,61 @@ void UIManager::changeScreen(ScreenState newScreen, const char* imagePath) {
     }
   }
   
-  Serial.printf("Screen changed to: %s\n", imagePath);
+  if (newScreen == SCREEN_SPEAKING) {
+    // 画像の口は開いている。音量に合わせてupdateMouth()で描き直す
+    currentMouth = MOUTH_OPEN;
+    mouthPeak = 0;
+    nextMouthFrameUs = 0;
+    mouthIntervalUs = LIPSYNC_FRAME_MS * 1000;
+    lastUnderruns = 0;
+    mouthFrames = 0;
+    mouthMaxDrawUs = 0;
+  }
+  
+  TurnTrace::screen(imagePath, drawStart);
+  Serial.printf("Screen changed to: %s in %lu us (%s)\n", imagePath,
+                (unsigned long)(esp_timer_get_time() - drawStart), cached ? "pre-decoded" : "from flash");
+}
+
+void UIManager::blitImage(int16_t x, int16_t y, int16_t w, int16_t h, const uint16_t* pixels) {
+  // スプライトのバッファと同じバイト順なので、pushSprite()と同じくバイトを入れ替えずに送る
+  bool swapBytes = M5.Lcd.getSwapBytes();
+  M5.Lcd.setSwapBytes(false);
+  M5.Lcd.pushImage(x, y, w, h, pixels);
+  M5.Lcd.setSwapBytes(swapBytes);
+}
+
+void UIManager::updateMouth(uint32_t level, uint32_t underruns) {
+  if (currentScreen != SCREEN_SPEAKING || !mouthMemory) return;
+  
+  // 音が途切れたら、描く間隔を延ばして再生に譲る
+  if (underruns != lastUnderruns) {
+    lastUnderruns = underruns;
+    mouthIntervalUs = min(mouthIntervalUs * 2, (uint32_t)LIPSYNC_MAX_FRAME_MS * 1000);
+    Serial.printf("Playback underrun, lip sync interval now %u ms\n", (unsigned)(mouthIntervalUs / 1000));
+  }
+  
+  // 口の開き具合は最近の最大音量との比で決める(最大値は呼ばれるたびに少しずつ下げる)
+  mouthPeak = max(level, mouthPeak - mouthPeak / 64);
+  MouthShape shape = MOUTH_CLOSED;
+  if (level >= LIPSYNC_SILENCE_LEVEL) {
+    if (level * 100 >= mouthPeak * 60) shape = MOUTH_OPEN;
+    else if (level * 100 >= mouthPeak * 25) shape = MOUTH_HALF;
+  }
+  
+  int64_t now = esp_timer_get_time();
+  if (shape == currentMouth || now < nextMouthFrameUs) return;
+  
+  blitImage(mouthX, mouthY, mouthW, mouthH, mouthSprites[shape]);
+  currentMouth = shape;
+  uint32_t drawUs = (uint32_t)(esp_timer_get_time() - now);
+  
+  // 描画にかかった時間がLIPSYNC_DRAW_BUDGET_PERCENTに収まるように次の描画を遅らせる
+  nextMouthFrameUs = now + max(mouthIntervalUs, drawUs * 100 / LIPSYNC_DRAW_BUDGET_PERCENT);
+  mouthFrames++;
+  mouthMaxDrawUs = max(mouthMaxDrawUs, drawUs);
+  TurnTrace::annotate("mouth_frames", mouthFrames);
+  TurnTrace::annotate("mouth_max_draw_us", mouthMaxDrawUs);
 }
 
 bool UIManager::loadImageIfExists(const char* imagePath) {
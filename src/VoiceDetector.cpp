@@ -1,162 +1,102 @@
 #include "VoiceDetector.h"
 #include "config.h"
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <math.h>
+#include "AudioDsp.h"
+
+// 背景雑音の追従速度(1/2^n)。下がるときは速く、上がるときはゆっくり追う
+// 発話が続いても雑音レベルとして取り込まれないよう、上昇はゲートが閉じているときだけ
+static const int FLOOR_FALL_SHIFT = 3;  // 約8フレーム
+static const int FLOOR_RISE_SHIFT = 7;  // 約128フレーム(30ms/フレームで約4秒)
 
 VoiceDetector::VoiceDetector() {
-  isContinuousRecording = false;
-  voiceDetected = false;
-  voiceStartTime = 0;
-  lastVoiceTime = 0;
-  averageVolume = 0.0;
+  frameMs = 30;
+  reset();
 }
 
-bool VoiceDetector::init() {
-  // I2S設定の初期化
-  i2sConfig = {
-    .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_PDM),
-    .sample_rate = SAMPLE_RATE,
-    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
-    .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
-    .communication_format = I2S_COMM_FORMAT_STAND_I2S,
-    .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-    .dma_buf_count = 4,
-    .dma_buf_len = BUFFER_SIZE,
-    .use_apll = false,
-    .tx_desc_auto_clear = true,
-    .fixed_mclk = 0
-  };
-  
-  pinConfig = {
-    .bck_io_num = -1,       // 内部マイクのため不要
-    .ws_io_num = 0,
-    .data_out_num = -1,     // 出力は使用しない
-    .data_in_num = 34       // M5Core2の標準DINピン
-  };
-  
-  return true;
+void VoiceDetector::init(uint32_t frameDurationMs) {
+  frameMs = frameDurationMs;
+  reset();
 }
 
-void VoiceDetector::startContinuousRecording() {
-  if (isContinuousRecording) return;
-  
-  configureI2S();
-  isContinuousRecording = true;
-  voiceDetected = false;
-  voiceStartTime = 0;
-  lastVoiceTime = 0;
-  
-  // 音声検出タスクを作成
-  xTaskCreate(continuousRecordingTaskWrapper, "VoiceDetectionTask", 4096, this, 4, &recordingTaskHandle);
-  
-  Serial.println("Continuous voice detection started");
+void VoiceDetector::reset() {
+  noiseFloorQ8 = 0;
+  lastVolume = 0;
+  floorInitialized = false;
+  gateOpen = false;
+  quietMs = 0;
+  totalFrames = 0;
+  openFrames = 0;
+  openCount = 0;
 }
 
-void VoiceDetector::stopContinuousRecording() {
-  if (!isContinuousRecording || recordingTaskHandle == NULL) return;
+uint32_t VoiceDetector::calculateVolume(const int16_t* samples, size_t sampleCount) {
+  // 直流成分に引きずられないよう、フレーム平均からの平均振幅を使う
+  return AudioDsp::meanAbs(samples, sampleCount, AudioDsp::mean(samples, sampleCount));
+}
 
-  Serial.println("DEBUG: Requesting VoiceDetectionTask to stop...");
-  isContinuousRecording = false;
+void VoiceDetector::updateNoiseFloor(uint32_t volume) {
+  uint32_t volumeQ8 = volume << 8;
+  if (!floorInitialized) {
+    noiseFloorQ8 = volumeQ8;
+    floorInitialized = true;
+  } else if (volumeQ8 < noiseFloorQ8) {
+    noiseFloorQ8 -= (noiseFloorQ8 - volumeQ8) >> FLOOR_FALL_SHIFT;
+  } else if (!gateOpen) {
+    noiseFloorQ8 += (volumeQ8 - noiseFloorQ8) >> FLOOR_RISE_SHIFT;
+  }
+}
 
-  // タスクが自己終了するのを待つ（最大1秒）
-  unsigned long startTime = millis();
-  while (recordingTaskHandle != NULL && millis() - startTime < 1000) {
-    vTaskDelay(pdMS_TO_TICKS(20));
+bool VoiceDetector::process(const int16_t* samples, size_t sampleCount) {
+  uint32_t volume = calculateVolume(samples, sampleCount);
+  lastVolume = volume;
+
+  // 閾値: 雑音レベル x VOICE_GATE_RATIO(ただしVOICE_GATE_MIN_LEVEL以上)
+  uint32_t threshold = (uint32_t)(((uint64_t)noiseFloorQ8 * AudioDsp::gainQ8(VOICE_GATE_RATIO)) >> 16);
+  if (threshold < VOICE_GATE_MIN_LEVEL) threshold = VOICE_GATE_MIN_LEVEL;
+  bool loud = floorInitialized && volume > threshold;
+
+  updateNoiseFloor(volume);
+
+  if (loud) {
+    if (!gateOpen) openCount++;
+    gateOpen = true;
+    quietMs = 0;
+  } else if (gateOpen) {
+    quietMs += frameMs;
+    if (quietMs >= VOICE_GATE_HANGOVER_MS) {
+      gateOpen = false;
+    }
   }
 
-  if (recordingTaskHandle != NULL) {
-    Serial.println("ERROR: VoiceDetectionTask did not terminate, forcing deletion.");
-    vTaskDelete(recordingTaskHandle);
-    recordingTaskHandle = NULL;
-    i2s_driver_uninstall(I2S_NUM_0); // フォールバックとしてドライバをアンインストール
-  } else {
-    Serial.println("DEBUG: VoiceDetectionTask stopped successfully.");
+  totalFrames++;
+  if (gateOpen) openFrames++;
+
+  if (DEBUG_VOICE_DETECTION) {
+    Serial.printf("Volume: %u (floor: %u, threshold: %u)%s\n",
+                  (unsigned)volume, (unsigned)(noiseFloorQ8 >> 8), (unsigned)threshold, gateOpen ? " [open]" : "");
   }
+  return gateOpen;
 }
 
-bool VoiceDetector::isVoiceDetected() {
-  return voiceDetected;
+bool VoiceDetector::isOpen() const {
+  return gateOpen;
 }
 
-void VoiceDetector::configureI2S() {
-  i2s_driver_uninstall(I2S_NUM_0);
-  
-  esp_err_t result = i2s_driver_install(I2S_NUM_0, &i2sConfig, 0, NULL);
-  if (result != ESP_OK) {
-    Serial.printf("I2S driver install failed: %d\n", result);
-    return;
-  }
-  
-  result = i2s_set_pin(I2S_NUM_0, &pinConfig);
-  if (result != ESP_OK) {
-    Serial.printf("I2S set pin failed: %d\n", result);
-    return;
-  }
-  
-  i2s_zero_dma_buffer(I2S_NUM_0);
+uint32_t VoiceDetector::getVolume() const {
+  return lastVolume;
 }
 
-float VoiceDetector::calculateVolume(int16_t* samples, size_t sampleCount) {
-  if (sampleCount == 0) return 0.0;
-  
-  float sum = 0.0;
-  for (size_t i = 0; i < sampleCount; i++) {
-    sum += abs(samples[i]);
-  }
-  
-  return sum / sampleCount;
+uint32_t VoiceDetector::getNoiseFloor() const {
+  return noiseFloorQ8 >> 8;
 }
 
-void VoiceDetector::continuousRecordingTask() {
-  int16_t buffer[BUFFER_SIZE];
-  size_t bytesRead = 0;
-  
-  while (isContinuousRecording) {
-    // voiceDetectedがtrueになったら、状態がリセットされるまでVAD処理を停止
-    if (!voiceDetected) {
-      // Serial.println("DEBUG: VAD loop running, trying to read I2S...");
-      esp_err_t result = i2s_read(I2S_NUM_0, buffer, sizeof(buffer), &bytesRead, portMAX_DELAY);
-      
-      if (result != ESP_OK) {
-        Serial.printf("ERROR: i2s_read failed with code: %d\n", result);
-      }
-
-      if (bytesRead > 0) {
-        int16_t* samples = (int16_t*)buffer;
-        size_t sampleCount = bytesRead / sizeof(int16_t);
-
-        // ソフトウェアゲインを適用
-        for (size_t i = 0; i < sampleCount; i++) {
-          int32_t amplified_sample = (int32_t)samples[i] * SOFTWARE_GAIN;
-          if (amplified_sample > 32767) amplified_sample = 32767;
-          if (amplified_sample < -32768) amplified_sample = -32768;
-          samples[i] = (int16_t)amplified_sample;
-        }
-
-        float currentVolume = calculateVolume(samples, sampleCount);
-        
-        // デバッグ用に現在の音量とサンプルデータを表示
-        Serial.printf("Volume: %.2f (Gain: x%.1f, Samples: %d, %d, ...)\n", 
-                      currentVolume, SOFTWARE_GAIN, samples[0], samples[1]);
-
-        // 平滑化せず、直接的な音量で判断することで応答性を向上
-        if (currentVolume > VOICE_DETECTION_THRESHOLD) {
-          voiceDetected = true;
-          Serial.printf(">>> Voice detected! (Volume: %.2f > Threshold: %d)\n", currentVolume, VOICE_DETECTION_THRESHOLD);
-        }
-      }
-    }
-    vTaskDelay(pdMS_TO_TICKS(10));
-  }
-  
-  // クリーンアップ処理
-  i2s_driver_uninstall(I2S_NUM_0);
-  Serial.println("DEBUG: VoiceDetectionTask cleaned up and is exiting.");
-  recordingTaskHandle = NULL; // ハンドルをNULLにしてタスクの終了を通知
-  vTaskDelete(NULL);          // タスク自身を削除
+uint32_t VoiceDetector::getTotalFrames() const {
+  return totalFrames;
+}
+
+uint32_t VoiceDetector::getOpenFrames() const {
+  return openFrames;
 }
 
-void VoiceDetector::continuousRecordingTaskWrapper(void* param) {
-  ((VoiceDetector*)param)->continuousRecordingTask();
+uint32_t VoiceDetector::getOpenCount() const {
+  return openCount;
 }
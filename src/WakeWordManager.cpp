@@ -1,79 +1,120 @@
 #include "WakeWordManager.h"
 #include "config.h"
+#include "MemoryMonitor.h"
+#include "TurnTrace.h"
 #include <M5Core2.h>
 #include <SPIFFS.h>
+#include <algorithm>
+#include <numeric>
+#include <string.h>
+
+static void dspTaskWrapper(void* param) {
+    MemoryMonitor::taskStarted(WAKEWORD_DSP_TASK_STACK);
+    static_cast<WakeWordManager*>(param)->dspTask();
+}
+
+static void matchTaskWrapper(void* param) {
+    MemoryMonitor::taskStarted(WAKEWORD_MATCH_TASK_STACK);
+    static_cast<WakeWordManager*>(param)->matchTask();
+}
+
+static void matchWorkerTaskWrapper(void* param) {
+    MemoryMonitor::taskStarted(WAKEWORD_WORKER_TASK_STACK);
+    static_cast<WakeWordManager*>(param)->matchWorkerTask();
+}
+
+void WakeWordManager::StageTime::add(uint32_t us) {
+    last = us;
+    max = std::max(max, us);
+    total += us;
+    count++;
+}
 
 WakeWordManager::WakeWordManager()
-    : rawAudioBuffer(nullptr),
-      micFrameBuffer(nullptr),
+    : micConsumer("wakeword"),
+      currentFrame(nullptr),
       // nsInst(nullptr), // NS disabled
-      registeredWakeWord(nullptr) {}
+      vadInst(nullptr),
+      mfccStream(kSampleRate, kMaxSegmentFrames + 2 * kSegmentMarginFrames),
+      dspTaskHandle(nullptr),
+      matchTaskHandle(nullptr),
+      dspLock(nullptr),
+      matchLock(nullptr),
+      detectionQueue(nullptr),
+      listening(false),
+      matchBusy(false),
+      speechRunMs(0),
+      silenceRunMs(0),
+      inSegment(false),
+      runStartFrame(0),
+      segmentStart(0),
+      lastSpeechFrame(0),
+      firstValidFrame(0),
+      stagesRunning(false),
+      leadIn((size_t)kGateLeadFrames * kVadFrameSamples),
+      leadHead(0),
+      leadCount(0),
+      dtwMatcher(WAKEWORD_DTW_BAND_PERCENT),
+      workerMatcher(WAKEWORD_DTW_BAND_PERCENT),
+      matchWorkerHandle(nullptr),
+      matchDone(nullptr),
+      matchCandidate(nullptr),
+      matchAccepted(false),
+      workerBestDistance(DtwMatcher::kRejected),
+      workerBestTemplate(-1),
+      vadTime{},
+      mfccTime{},
+      dtwTime{},
+      workerDtwTime{},
+      decisionTime{},
+      frameTime{},
+      loadBusyMicros(0),
+      loadFrames(0),
+      loadWindowStart(0),
+      speechEndMicros(0),
+      lastSequence(0),
+      haveSequence(false),
+      droppedFrames(0),
+      droppedWhileMatching(0),
+      skippedUtterances(0) {}
 
 WakeWordManager::~WakeWordManager() {
-    if (rawAudioBuffer) heap_caps_free(rawAudioBuffer);
-    if (micFrameBuffer) heap_caps_free(micFrameBuffer);
-    if (registeredWakeWord) delete registeredWakeWord;
+    for (TaskHandle_t task : { dspTaskHandle, matchTaskHandle, matchWorkerHandle }) {
+        if (task) {
+            MemoryMonitor::forgetTask(task);
+            vTaskDelete(task);
+        }
+    }
+    if (dspLock) vSemaphoreDelete(dspLock);
+    if (matchLock) vSemaphoreDelete(matchLock);
+    if (matchDone) vSemaphoreDelete(matchDone);
+    if (detectionQueue) vQueueDelete(detectionQueue);
+    if (vadInst) vad_destroy(vadInst);
     // if (nsInst) ns_pro_destroy(nsInst); // NS disabled
 }
 
-#include <driver/i2s.h>
-
-// --- I2S Configuration ---
-// Copied from the old VoiceDetector, as this is a known-good config for Core2
-static i2s_config_t i2s_config = {
-    .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_PDM),
-    .sample_rate = WakeWordManager::kSampleRate,
-    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
-    .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
-    .communication_format = I2S_COMM_FORMAT_STAND_I2S,
-    .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-    .dma_buf_count = 4,
-    .dma_buf_len = 512, // Buffer size
-    .use_apll = false,
-    .tx_desc_auto_clear = true,
-    .fixed_mclk = 0
-};
-
-static i2s_pin_config_t i2s_pin_config = {
-    .bck_io_num = I2S_PIN_NO_CHANGE,
-    .ws_io_num = 0,
-    .data_out_num = I2S_PIN_NO_CHANGE,
-    .data_in_num = 34
-};
-// --- End I2S Configuration ---
-
-
-bool WakeWordManager::init() {
-    // This function now only initializes the engines and allocates memory.
-    // I2S hardware is handled by startListening().
+bool WakeWordManager::init(AudioCaptureService& capture) {
+    // This function initializes the engines, allocates memory and starts the
+    // detection tasks (paused until startListening()).
+    // The microphone is owned by AudioCaptureService; we register as a consumer.
 
     // 1. Configure Engines from config.h
-    auto vadConfig = vadEngine.config();
-    vadConfig.sample_rate = kSampleRate;
-    
-    // --- VAD Sensitivity Diagnostics ---
-    vadConfig.vad_mode = simplevox::VadMode::Aggression_LV2;
-    vadConfig.decision_time_ms = 150;
-    
+    // VAD is esp-sr's per-frame classifier; segmentation (VAD_DECISION_TIME_MS,
+    // hangover) is done here so that MFCC can run on every frame as it arrives.
+    const vad_mode_t vadMode = static_cast<vad_mode_t>(VAD_MODE);
+
     auto mfccConfig = mfccEngine.config();
     mfccConfig.sample_rate = kSampleRate;
 
     // 2. Allocate Memory
-    constexpr uint32_t memCaps = (CONFIG_SPIRAM) ? (MALLOC_CAP_8BIT | MALLOC_CAP_SPIRAM) : MALLOC_CAP_8BIT;
-    rawAudioBuffer = (int16_t*)heap_caps_malloc(kAudioLength * sizeof(*rawAudioBuffer), memCaps);
-    if (!rawAudioBuffer) {
-        M5.Lcd.println("Failed to allocate rawAudioBuffer");
-        return false;
-    }
+    // No raw audio buffer: features are kept in mfccStream's ring (~7 KB)
 
-    micFrameBuffer = (int16_t*)heap_caps_malloc(kRxBufferNum * vadConfig.frame_length() * sizeof(*micFrameBuffer), MALLOC_CAP_8BIT);
-    if (!micFrameBuffer) {
-        M5.Lcd.println("Failed to allocate micFrameBuffer");
+    // 3. Register with the capture service (frames arrive only while listening)
+    if (!capture.addConsumer(&micConsumer)) {
+        M5.Lcd.println("Failed to register mic consumer");
         return false;
     }
 
-    // I2S hardware is initialized in startListening()
-
     // 4. Initialize Noise Suppression (Disabled for ESP32)
     /*
     nsInst = ns_pro_create(vadConfig.frame_time_ms, 1, vadConfig.sample_rate);
@@ -84,7 +125,9 @@ bool WakeWordManager::init() {
     */
 
     // 5. Initialize Engines
-    if (!vadEngine.init(vadConfig)) {
+    voiceGate.init(kVadFrameMs);
+    vadInst = vad_create(vadMode);
+    if (!vadInst) {
         M5.Lcd.println("Failed to init vad.");
         return false;
     }
@@ -93,189 +136,627 @@ bool WakeWordManager::init() {
         return false;
     }
 
-    // 6. Initialize SPIFFS and load wake word
+    // 6. Initialize SPIFFS and load wake word templates
     if (!SPIFFS.begin(true)) {
         M5.Lcd.println("SPIFFS Mount Failed");
         return false;
     }
+    loadTemplates();
+    tagMemory();
+
+    // 7. Start the detection tasks. The DSP task preempts the match task on the
+    // same core, so frames keep flowing while MFCC/DTW run; both match tasks
+    // share the loop task's priority so the UI is not starved either.
+    dspLock = xSemaphoreCreateMutex();
+    matchLock = xSemaphoreCreateMutex();
+    matchDone = xSemaphoreCreateBinary();
+    detectionQueue = xQueueCreate(4, sizeof(int));
+    if (!dspLock || !matchLock || !matchDone || !detectionQueue) {
+        M5.Lcd.println("Failed to create wake word sync objects");
+        return false;
+    }
+    const UBaseType_t loopPriority = uxTaskPriorityGet(NULL);
+    if (xTaskCreatePinnedToCore(dspTaskWrapper, "WakeDspTask", WAKEWORD_DSP_TASK_STACK, this,
+                                loopPriority + 4, &dspTaskHandle, WAKEWORD_TASK_CORE) != pdPASS ||
+        xTaskCreatePinnedToCore(matchTaskWrapper, "WakeMatchTask", WAKEWORD_MATCH_TASK_STACK, this,
+                                loopPriority, &matchTaskHandle, WAKEWORD_TASK_CORE) != pdPASS) {
+        M5.Lcd.println("Failed to start wake word tasks");
+        return false;
+    }
+    const BaseType_t otherCore = (WAKEWORD_TASK_CORE == 0) ? 1 : 0;
+    if (xTaskCreatePinnedToCore(matchWorkerTaskWrapper, "WakeWorkerTask", WAKEWORD_WORKER_TASK_STACK, this,
+                                loopPriority, &matchWorkerHandle, otherCore) != pdPASS) {
+        // Not fatal: all templates are then matched by the match task
+        Serial.println("Failed to start wake word match worker, matching on one core.");
+        matchWorkerHandle = nullptr;
+    }
 
-    String wakeWordPath = String(kSpiffsBasePath) + kWakeWordFileName;
-    if (SPIFFS.exists(wakeWordPath)) {
-        M5.Lcd.println("Wake word file exists. Loading...");
-        if (registeredWakeWord) delete registeredWakeWord;
-        registeredWakeWord = mfccEngine.loadFile(wakeWordPath.c_str());
-        if (registeredWakeWord) {
-            M5.Lcd.println("Wake word loaded.");
-        } else {
-            M5.Lcd.println("Failed to load wake word.");
+    return true;
+}
+
+String WakeWordManager::templatePath(const char* prefix, int user, int index) const {
+    return String(kSpiffsBasePath) + prefix + user + "_" + index + ".bin";
+}
+
+void WakeWordManager::loadTemplates() {
+    templates.clear();
+
+    for (int user = 0; user < WAKEWORD_MAX_USERS; user++) {
+        const uint32_t threshold = loadThreshold(user);
+        for (int i = 0; i < WAKEWORD_TEMPLATES_PER_USER; i++) {
+            String path = templatePath(kTemplateFilePrefix, user, i);
+            if (!SPIFFS.exists(path)) continue;
+            simplevox::MfccFeature* feature = mfccEngine.loadFile(path.c_str());
+            if (feature) {
+                templates.push_back({user, threshold, std::unique_ptr<simplevox::MfccFeature>(feature)});
+            } else {
+                Serial.printf("Failed to load %s\n", path.c_str());
+            }
         }
-    } else {
+    }
+
+    // Templates from the batch MFCC extractor use different features
+    if (templates.empty() &&
+        (SPIFFS.exists(String(kSpiffsBasePath) + kLegacyWakeWordFileName) ||
+         SPIFFS.exists(templatePath(kOldTemplateFilePrefix, 0, 0)))) {
+        M5.Lcd.println("Old wake word format, please register again.");
+    } else if (templates.empty()) {
         M5.Lcd.println("No wake word file found.");
+    } else {
+        M5.Lcd.printf("%d wake word template(s) loaded.\n", (int)templates.size());
     }
+}
 
-    return true;
+// Templates registered before calibration have no threshold file and use the
+// configured fallback.
+uint32_t WakeWordManager::loadThreshold(int user) const {
+    uint32_t threshold = WAKEWORD_DTW_THRESHOLD;
+    File file = SPIFFS.open(String(kSpiffsBasePath) + kThresholdFilePrefix + user + ".bin", "r");
+    if (file) {
+        uint32_t stored = 0;
+        if (file.read((uint8_t*)&stored, sizeof(stored)) == sizeof(stored) && stored > 0) {
+            threshold = stored;
+        }
+        file.close();
+    }
+    return threshold;
+}
+
+bool WakeWordManager::saveThreshold(int user, uint32_t threshold) const {
+    File file = SPIFFS.open(String(kSpiffsBasePath) + kThresholdFilePrefix + user + ".bin", "w");
+    if (!file) return false;
+    bool ok = file.write((const uint8_t*)&threshold, sizeof(threshold)) == sizeof(threshold);
+    file.close();
+    return ok;
+}
+
+void WakeWordManager::tagMemory() {
+    MemoryMonitor::tag("wake.mfcc", mfccStream.ringData(), mfccStream.memoryBytes());
+    MemoryMonitor::tag("wake.leadin", leadIn.data(), leadIn.size() * sizeof(int16_t));
+
+    size_t templateBytes = 0;
+    for (const auto& t : templates) {
+        templateBytes += (size_t)t.feature->frame_num() * MfccStream::kCoefs * sizeof(int16_t);
+    }
+    MemoryMonitor::tag("wake.templates", templates.empty() ? nullptr : templates[0].feature->feature(0),
+                       templateBytes);
 }
 
 void WakeWordManager::reset() {
-    vadEngine.reset();
+    // The DSP task owns the segmenter while listening
+    xSemaphoreTake(dspLock, portMAX_DELAY);
+    resetSegment();
+    xSemaphoreGive(dspLock);
+}
+
+void WakeWordManager::resetSegment() {
+    mfccStream.reset();
+    firstValidFrame = mfccStream.produced();
+    speechRunMs = 0;
+    silenceRunMs = 0;
+    inSegment = false;
+}
+
+int WakeWordManager::frameLength() {
+    return kVadFrameSamples;
 }
 
 bool WakeWordManager::startListening() {
-    Serial.println("Starting wake word listener (I2S)...");
-    i2s_driver_uninstall(I2S_NUM_0); // Ensure clean state
-    esp_err_t result = i2s_driver_install(I2S_NUM_0, &i2s_config, 0, NULL);
-    if (result != ESP_OK) {
-        Serial.printf("I2S driver install failed: %d\n", result);
+    if (!dspTaskHandle) {
         return false;
     }
-    result = i2s_set_pin(I2S_NUM_0, &i2s_pin_config);
-    if (result != ESP_OK) {
-        Serial.printf("I2S set pin failed: %d\n", result);
-        return false;
-    }
-    i2s_zero_dma_buffer(I2S_NUM_0);
+    Serial.println("Starting wake word listener...");
+    xQueueReset(detectionQueue);
+    haveSequence = false;
+    leadCount = 0;
+    micConsumer.activate();
+    listening.store(true);
+    xTaskNotifyGive(dspTaskHandle);
     return true;
 }
 
 void WakeWordManager::stopListening() {
-    Serial.println("Stopping wake word listener (I2S)...");
-    i2s_driver_uninstall(I2S_NUM_0);
+    Serial.println("Stopping wake word listener...");
+    listening.store(false);
+    matchAccepted.store(true); // Cancels a DTW in progress (no detection is posted)
+
+    // Wait for the DSP task to finish its frame, then take the consumer back
+    xSemaphoreTake(dspLock, portMAX_DELAY);
+    micConsumer.deactivate();
+    micConsumer.release(currentFrame);
+    currentFrame = nullptr;
+    resetSegment();
+    xSemaphoreGive(dspLock);
+
+    // ...and for the match task, so the buffers and templates are free
+    xSemaphoreTake(matchLock, portMAX_DELAY);
+    xSemaphoreGive(matchLock);
 }
 
-int16_t* WakeWordManager::readMicFrame() {
-    static int rxIndex = 0;
-    const int frameLength = vadEngine.config().frame_length();
-    const int frameBytes = frameLength * sizeof(int16_t);
-    size_t bytesRead = 0;
-
-    // Read one frame's worth of data from I2S
-    esp_err_t result = i2s_read(I2S_NUM_0, &micFrameBuffer[frameLength * rxIndex], frameBytes, &bytesRead, portMAX_DELAY);
+bool WakeWordManager::pollDetection() {
+    int user;
+    return detectionQueue && xQueueReceive(detectionQueue, &user, 0) == pdTRUE;
+}
 
-    if (result != ESP_OK || bytesRead != frameBytes) {
-        M5.Lcd.printf("i2s_read error: %d, bytes: %d\n", result, bytesRead);
+int16_t* WakeWordManager::readMicFrame() {
+    // Hand the previous frame back to the pool before waiting for the next one
+    micConsumer.release(currentFrame);
+    currentFrame = micConsumer.receive(pdMS_TO_TICKS(100));
+    if (currentFrame == nullptr) {
         return nullptr;
     }
-
-    // Return the buffer that was just filled
-    return &micFrameBuffer[frameLength * rxIndex];
+    return currentFrame->samples;
 }
 
-bool WakeWordManager::listenAndDetect() {
-    if (!registeredWakeWord) {
-        // No wake word registered, cannot detect.
-        return false;
+void WakeWordManager::dspTask() {
+    while (true) {
+        if (!listening.load()) {
+            // Paused; startListening() wakes us (stale frame notifications just loop)
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        xSemaphoreTake(dspLock, portMAX_DELAY);
+        if (listening.load()) {
+            processFrame();
+        }
+        xSemaphoreGive(dspLock);
     }
+}
 
+// One frame through VAD and MFCC; a finished utterance is handed to the match task
+void WakeWordManager::processFrame() {
     auto* frameData = readMicFrame();
     if (frameData == nullptr) {
-        return false;
+        return;
     }
 
-    // Apply software gain
-    const int frameLength = vadEngine.config().frame_length();
-    int16_t* samples = frameData;
-    for (size_t i = 0; i < frameLength; i++) {
-        int32_t amplified_sample = (int32_t)samples[i] * SOFTWARE_GAIN;
-        if (amplified_sample > 32767) amplified_sample = 32767;
-        if (amplified_sample < -32768) amplified_sample = -32768;
-        samples[i] = (int16_t)amplified_sample;
+    // Sequence gaps are frames lost either in the capture pool or in our queue
+    const uint32_t sequence = currentFrame->sequence;
+    if (haveSequence && sequence != lastSequence + 1) {
+        const uint32_t gap = sequence - lastSequence - 1;
+        droppedFrames += gap;
+        leadCount = 0; // The held frames no longer lead into this one
+        if (matchBusy.load()) droppedWhileMatching += gap;
     }
+    lastSequence = sequence;
+    haveSequence = true;
+
+    // Software gain is applied once by AudioCaptureService
 
     // Apply noise suppression (Disabled for ESP32)
     // ns_process(nsInst, frameData, frameData);
 
-    // Perform VAD
-    int detectedLength = vadEngine.detect(rawAudioBuffer, kAudioLength, frameData);
-    if (detectedLength <= 0) {
-        return false; // No speech detected yet
+    // Energy gate first: VAD and MFCC only run while the frame is louder than
+    // the background (or a segment is still open)
+    const uint32_t start = micros();
+    const bool gateOpen = !WAKEWORD_ENERGY_GATE || voiceGate.process(frameData, currentFrame->length);
+    std::unique_ptr<simplevox::MfccFeature> feature;
+    if (gateOpen || inSegment) {
+        if (!stagesRunning) {
+            // Frames were skipped; start MFCC afresh so no window spans the gap,
+            // then catch up on the quiet frames just before the gate opened
+            resetSegment();
+            stagesRunning = true;
+            replayLeadIn();
+        }
+        feature.reset(segmentFrame(frameData, currentFrame->length));
+    } else {
+        stagesRunning = false;
+        holdLeadIn(frameData, currentFrame->length);
+    }
+    const uint32_t elapsed = micros() - start;
+    frameTime.add(elapsed);
+    loadBusyMicros += elapsed;
+    if (DEBUG_WAKEWORD_TIMING && ++loadFrames * kVadFrameMs >= kLoadReportMs) {
+        printLoad();
+    }
+
+    if (!feature) {
+        return; // No complete segment yet
+    }
+
+    if (templates.empty()) {
+        // No wake word registered, cannot detect.
+        return;
+    }
+    if (matchBusy.load()) {
+        // Still matching the previous utterance; dropping this one keeps VAD real-time
+        skippedUtterances++;
+        return;
     }
 
-    // Speech detected, now compare with wake word
+    // Speech detected, let the match task compare it
     Serial.println("Speech detected, comparing...");
-    std::unique_ptr<simplevox::MfccFeature> currentFeature(mfccEngine.create(rawAudioBuffer, detectedLength));
-    
-    if (!currentFeature) {
-        M5.Lcd.println("MFCC creation failed.");
-        vadEngine.reset();
-        return false;
+    speechEndMicros = micros();
+    matchFeature = std::move(feature);
+    matchBusy.store(true);
+    xTaskNotifyGive(matchTaskHandle);
+}
+
+void WakeWordManager::holdLeadIn(const int16_t* samples, int count) {
+    if (count != kVadFrameSamples) {
+        leadCount = 0;
+        return;
+    }
+    const int slot = (leadHead + leadCount) % kGateLeadFrames;
+    memcpy(&leadIn[(size_t)slot * kVadFrameSamples], samples, kVadFrameSamples * sizeof(int16_t));
+    if (leadCount < kGateLeadFrames) {
+        leadCount++;
+    } else {
+        leadHead = (leadHead + 1) % kGateLeadFrames;
+    }
+}
+
+// A segment cannot close within the held frames, so nothing is returned
+void WakeWordManager::replayLeadIn() {
+    for (int i = 0; i < leadCount; i++) {
+        int16_t* frame = &leadIn[(size_t)((leadHead + i) % kGateLeadFrames) * kVadFrameSamples];
+        std::unique_ptr<simplevox::MfccFeature> unused(segmentFrame(frame, kVadFrameSamples));
     }
+    leadHead = 0;
+    leadCount = 0;
+}
 
-    const auto dist = simplevox::calcDTW(*registeredWakeWord, *currentFeature);
-    
-    // Threshold for DTW distance needs tuning. Lower is better match.
-    const int dtwThreshold = 180; 
-    Serial.printf("DTW Distance: %6lu (Threshold: %d)\n", dist, dtwThreshold);
+// Feeds one VAD frame to MFCC and the segmenter. Returns the features of a
+// segment once VAD_DECISION_TIME_MS of speech has been followed by
+// kHangoverMs of silence, nullptr otherwise.
+simplevox::MfccFeature* WakeWordManager::segmentFrame(int16_t* samples, int count) {
+    const uint32_t frameStart = mfccStream.produced();
 
-    vadEngine.reset();
+    uint32_t start = micros();
+    mfccStream.push(samples, count);
+    mfccTime.add(micros() - start);
 
-    if (dist < dtwThreshold) {
-        Serial.println(">>> WAKE WORD DETECTED! <<<");
-        return true;
+    start = micros();
+    const bool speech = vad_process(vadInst, samples, kSampleRate, kVadFrameMs) == VAD_SPEECH;
+    vadTime.add(micros() - start);
+
+    if (!inSegment) {
+        if (!speech) {
+            speechRunMs = 0;
+            return nullptr;
+        }
+        if (speechRunMs == 0) runStartFrame = frameStart;
+        speechRunMs += kVadFrameMs;
+        if (speechRunMs >= VAD_DECISION_TIME_MS) {
+            inSegment = true;
+            silenceRunMs = 0;
+            segmentStart = (runStartFrame > firstValidFrame + kSegmentMarginFrames)
+                               ? runStartFrame - kSegmentMarginFrames : firstValidFrame;
+            lastSpeechFrame = mfccStream.produced();
+        }
+        return nullptr;
     }
 
-    return false;
+    if (speech) {
+        silenceRunMs = 0;
+        lastSpeechFrame = mfccStream.produced();
+    } else {
+        silenceRunMs += kVadFrameMs;
+    }
+
+    if (mfccStream.produced() - segmentStart > (uint32_t)kMaxSegmentFrames) {
+        // Longer than any wake word; wait for the next one
+        resetSegment();
+        return nullptr;
+    }
+    if (silenceRunMs < kHangoverMs) {
+        return nullptr;
+    }
+
+    const uint32_t end = std::min(lastSpeechFrame + kSegmentMarginFrames, mfccStream.produced());
+    inSegment = false;
+    speechRunMs = 0;
+    return mfccStream.extract(segmentStart, end);
 }
 
-int WakeWordManager::captureAndRegisterWakeWord() {
-    M5.Lcd.println("Listening for wake word...");
+// Matches templates first, first + step, ... until one accepts or another
+// matcher has already accepted.
+void WakeWordManager::matchShare(DtwMatcher& matcher, int first, int step,
+                                 uint32_t& bestDistance, int& bestTemplate) {
+    bestDistance = DtwMatcher::kRejected;
+    bestTemplate = -1;
+    for (int t = first; t < (int)templates.size(); t += step) {
+        if (matchAccepted.load()) return;
+        uint32_t dist = matcher.match(*templates[t].feature, *matchCandidate,
+                                      templates[t].threshold, &matchAccepted);
+        templateBounds[t] = matcher.lastStats().bound;
+        if (dist != DtwMatcher::kRejected) {
+            bestDistance = dist;
+            bestTemplate = t;
+            matchAccepted.store(true);
+            return;
+        }
+    }
+}
 
-    // Start I2S listener specifically for registration
-    if (!startListening()) {
-        M5.Lcd.println("Failed to start listener for registration.");
-        return 0;
+void WakeWordManager::matchWorkerTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        const uint32_t start = micros();
+        matchShare(workerMatcher, 1, 2, workerBestDistance, workerBestTemplate);
+        workerDtwTime.add(micros() - start);
+        xSemaphoreGive(matchDone);
+    }
+}
+
+void WakeWordManager::matchTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!matchBusy.load()) {
+            continue;
+        }
+        xSemaphoreTake(matchLock, portMAX_DELAY);
+        if (listening.load()) {
+            runMatch();
+        }
+        matchBusy.store(false);
+        xSemaphoreGive(matchLock);
+    }
+}
+
+void WakeWordManager::runMatch() {
+    std::unique_ptr<simplevox::MfccFeature> currentFeature = std::move(matchFeature);
+
+    // The candidate's MFCC is computed once and shared by both cores.
+    // Each template is matched against its user's calibrated threshold.
+    matchCandidate = currentFeature.get();
+    matchAccepted.store(false);
+    templateBounds.assign(templates.size(), DtwMatcher::kRejected);
+
+    const uint32_t start = micros();
+    const bool useWorker = matchWorkerHandle != nullptr && templates.size() > 1;
+    if (useWorker) {
+        xTaskNotifyGive(matchWorkerHandle);
+    }
+    uint32_t dist;
+    int matched;
+    matchShare(dtwMatcher, 0, useWorker ? 2 : 1, dist, matched);
+    dtwTime.add(micros() - start);
+    if (useWorker) {
+        xSemaphoreTake(matchDone, portMAX_DELAY);
+        if (matched < 0) {
+            dist = workerBestDistance;
+            matched = workerBestTemplate;
+        }
+    }
+    decisionTime.add(micros() - speechEndMicros);
+
+    if (matched >= 0) {
+        Serial.printf("DTW Distance: %6lu (Threshold: %lu, template %d of user %d)\n",
+                      (unsigned long)dist, (unsigned long)templates[matched].threshold,
+                      matched, templates[matched].user);
+    } else if (listening.load() && !templates.empty()) {
+        // The matchers stop at the threshold, so only a lower bound is known.
+        const int closest = (int)(std::min_element(templateBounds.begin(), templateBounds.end()) -
+                                  templateBounds.begin());
+        if (DEBUG_WAKEWORD_TIMING || DEBUG_DTW_VERIFY) {
+            // Re-run the most promising template without pruning for the exact distance
+            const uint32_t closestDist = dtwMatcher.match(*templates[closest].feature, *matchCandidate,
+                                                          DtwMatcher::kRejected - 1);
+            Serial.printf("DTW rejected by all %d templates (closest: %lu, Threshold: %lu, template %d of user %d)\n",
+                          (int)templates.size(), (unsigned long)closestDist,
+                          (unsigned long)templates[closest].threshold, closest, templates[closest].user);
+        } else {
+            Serial.printf("DTW rejected by all %d templates (closest >= %lu, Threshold: %lu, template %d of user %d)\n",
+                          (int)templates.size(), (unsigned long)templateBounds[closest],
+                          (unsigned long)templates[closest].threshold, closest, templates[closest].user);
+        }
+    }
+    matchCandidate = nullptr;
+
+    if (DEBUG_DTW_VERIFY) {
+        // Cross-check against the full quadratic DTW; decisions must agree
+        bool fullAccept = false;
+        for (const auto& tmpl : templates) {
+            if (simplevox::calcDTW(*tmpl.feature, *currentFeature) < tmpl.threshold) {
+                fullAccept = true;
+                break;
+            }
+        }
+        if (listening.load() && fullAccept != (matched >= 0)) {
+            Serial.printf("WARNING: DTW decision mismatch (full: %s, banded: %s)\n",
+                          fullAccept ? "accepted" : "rejected", fullAccept ? "rejected" : "accepted");
+        }
     }
 
-    // Loop until a single utterance is captured by VAD
-    int detectedLength = 0;
-    while (detectedLength <= 0) {
+    if (DEBUG_WAKEWORD_TIMING) {
+        printTiming();
+    }
+
+    // stopListening() may have cancelled us; only post live detections
+    if (matched >= 0 && listening.load()) {
+        Serial.println(">>> WAKE WORD DETECTED! <<<");
+        TurnTrace::begin("wake");
+        TurnTrace::mark(TRACE_WAKE_DETECTED);
+        int user = templates[matched].user;
+        xQueueSend(detectionQueue, &user, 0);
+    }
+}
+
+void WakeWordManager::printTiming() {
+    Serial.printf("Wake timing: VAD %lu/%lu us, MFCC %lu/%lu us per frame (avg/max), "
+                  "DTW %lu us + worker %lu us, decision %lu ms after end of speech\n",
+                  (unsigned long)vadTime.average(), (unsigned long)vadTime.max,
+                  (unsigned long)mfccTime.average(), (unsigned long)mfccTime.max,
+                  (unsigned long)dtwTime.last,
+                  (unsigned long)workerDtwTime.last, (unsigned long)(decisionTime.last / 1000));
+    Serial.printf("Wake frames: dropped %lu (%lu while matching), queue drops %lu, "
+                  "skipped utterances %lu\n",
+                  (unsigned long)droppedFrames, (unsigned long)droppedWhileMatching,
+                  (unsigned long)micConsumer.getDroppedFrames(), (unsigned long)skippedUtterances);
+}
+
+// Share of the DSP task's core spent on gate + VAD + MFCC over the last window.
+// Compare WAKEWORD_ENERGY_GATE true/false in a quiet room to see the idle saving.
+void WakeWordManager::printLoad() {
+    const uint32_t now = micros();
+    const uint32_t window = now - loadWindowStart;
+    if (loadWindowStart != 0 && window > 0) {
+        const uint32_t permille = (uint32_t)(loadBusyMicros * 1000 / window);
+        const uint32_t total = voiceGate.getTotalFrames();
+        Serial.printf("Wake DSP load: %lu.%lu%% (%lu us/frame avg, %lu max), gate %s",
+                      (unsigned long)(permille / 10), (unsigned long)(permille % 10),
+                      (unsigned long)(loadBusyMicros / loadFrames), (unsigned long)frameTime.max,
+                      WAKEWORD_ENERGY_GATE ? "on" : "off");
+        if (WAKEWORD_ENERGY_GATE && total > 0) {
+            Serial.printf(": open %lu%% of frames, %lu openings, noise floor %lu",
+                          (unsigned long)((uint64_t)voiceGate.getOpenFrames() * 100 / total),
+                          (unsigned long)voiceGate.getOpenCount(), (unsigned long)voiceGate.getNoiseFloor());
+        }
+        Serial.println();
+    }
+    loadWindowStart = now;
+    loadBusyMicros = 0;
+    loadFrames = 0;
+}
+
+// Records one utterance (as delimited by VAD) and returns its MFCC feature,
+// or nullptr if the middle button cancels. loop() does not run meanwhile, so
+// the button is polled here.
+simplevox::MfccFeature* WakeWordManager::captureTake() {
+    resetSegment();
+    simplevox::MfccFeature* feature = nullptr;
+    while (!feature) {
         M5.update(); // Update button states etc.
-        // Button B check is now handled globally in main.cpp loop()
+        if (M5.BtnB.wasPressed()) {
+            return nullptr;
+        }
 
         auto* frameData = readMicFrame();
         if (frameData == nullptr) {
             continue;
         }
-        
-        // Apply software gain
-        const int frameLength = vadEngine.config().frame_length();
-        int16_t* samples = frameData;
-        for (size_t i = 0; i < frameLength; i++) {
-            int32_t amplified_sample = (int32_t)samples[i] * SOFTWARE_GAIN;
-            if (amplified_sample > 32767) amplified_sample = 32767;
-            if (amplified_sample < -32768) amplified_sample = -32768;
-            samples[i] = (int16_t)amplified_sample;
-        }
 
         // ns_process(nsInst, frameData, frameData); // NS disabled
-        detectedLength = vadEngine.detect(rawAudioBuffer, kAudioLength, frameData);
-        vTaskDelay(pdMS_TO_TICKS(10));
+        feature = segmentFrame(frameData, currentFrame->length);
     }
 
-    M5.Lcd.printf("Captured %d samples. Creating MFCC...\n", detectedLength);
+    M5.Lcd.printf("Captured %d MFCC frames.\n", feature->frame_num());
+    return feature;
+}
 
-    // Delete old feature if it exists
-    if (registeredWakeWord != nullptr) {
-        delete registeredWakeWord;
-        registeredWakeWord = nullptr;
+int WakeWordManager::captureAndRegisterWakeWord(int user) {
+    M5.Lcd.println("Listening for wake word...");
+
+    // Pause the detection tasks; registration reads the consumer directly
+    stopListening();
+    micConsumer.activate();
+
+    // 1. Record several takes
+    std::vector<std::unique_ptr<simplevox::MfccFeature>> takes;
+    for (int take = 0; take < WAKEWORD_REGISTRATION_TAKES; take++) {
+        M5.Lcd.printf("Take %d/%d: say the wake word\n", take + 1, WAKEWORD_REGISTRATION_TAKES);
+        simplevox::MfccFeature* feature = captureTake();
+        if (!feature) {
+            break;
+        }
+        takes.emplace_back(feature);
     }
+    micConsumer.deactivate(); // Stop listener after registration
+    micConsumer.release(currentFrame);
+    currentFrame = nullptr;
 
-    // Create new MFCC feature
-    registeredWakeWord = mfccEngine.create(rawAudioBuffer, detectedLength);
+    if ((int)takes.size() < WAKEWORD_REGISTRATION_TAKES) {
+        // Cancelled: keep the current templates untouched
+        M5.Lcd.println("Registration cancelled.");
+        return 0;
+    }
 
-    if (registeredWakeWord) {
-        String wakeWordPath = String(kSpiffsBasePath) + kWakeWordFileName;
-        if (mfccEngine.saveFile(wakeWordPath.c_str(), *registeredWakeWord)) {
-            M5.Lcd.println("Wake word registered and saved!");
-        } else {
-            M5.Lcd.println("ERROR: Failed to save wake word!");
-            delete registeredWakeWord;
-            registeredWakeWord = nullptr;
+    // 2. Keep the most central takes: smallest total DTW distance to the others.
+    // Outliers (a cough, a clipped start) end up far from everything else.
+    const int takeCount = (int)takes.size();
+    std::vector<uint64_t> score(takeCount, 0);
+    std::vector<uint32_t> pairDistance(takeCount * takeCount, 0);
+    for (int a = 0; a < takeCount; a++) {
+        for (int b = a + 1; b < takeCount; b++) {
+            uint32_t dist = dtwMatcher.match(*takes[a], *takes[b], DtwMatcher::kRejected - 1);
+            pairDistance[a * takeCount + b] = dist;
+            pairDistance[b * takeCount + a] = dist;
+            score[a] += dist;
+            score[b] += dist;
         }
+    }
+    std::vector<int> order(takeCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return score[a] < score[b]; });
+    for (int i = 0; i < takeCount; i++) {
+        Serial.printf("Take %d: total distance %llu%s\n", order[i] + 1, (unsigned long long)score[order[i]],
+                      i < WAKEWORD_TEMPLATES_PER_USER ? " (kept)" : "");
+    }
+
+    // 3. Calibrate the threshold on the features actually matched: the kept
+    // takes are the user's own spread, so allow the widest of them plus a margin.
+    const int keep = std::min(takeCount, WAKEWORD_TEMPLATES_PER_USER);
+    uint32_t threshold = WAKEWORD_DTW_THRESHOLD;
+    if (keep > 1) {
+        uint32_t widest = 0;
+        for (int i = 0; i < keep; i++) {
+            for (int j = i + 1; j < keep; j++) {
+                widest = std::max(widest, pairDistance[order[i] * takeCount + order[j]]);
+            }
+        }
+        threshold = std::max<uint32_t>(1, (uint32_t)((uint64_t)widest * WAKEWORD_DTW_MARGIN_PERCENT / 100));
+        Serial.printf("Calibrated DTW threshold for user %d: %lu (widest kept pair %lu)\n",
+                      user, (unsigned long)threshold, (unsigned long)widest);
     } else {
-        M5.Lcd.println("ERROR: MFCC creation failed!");
+        Serial.printf("One take only; DTW threshold for user %d stays at %lu\n",
+                      user, (unsigned long)threshold);
+    }
+
+    // 4. Replace this user's templates
+    templates.erase(std::remove_if(templates.begin(), templates.end(),
+                                   [user](const WakeWordTemplate& t) { return t.user == user; }),
+                    templates.end());
+    for (int i = 0; i < WAKEWORD_TEMPLATES_PER_USER; i++) {
+        for (const char* prefix : {kTemplateFilePrefix, kOldTemplateFilePrefix}) {
+            String path = templatePath(prefix, user, i);
+            if (SPIFFS.exists(path)) SPIFFS.remove(path);
+        }
+    }
+    String legacyPath = String(kSpiffsBasePath) + kLegacyWakeWordFileName;
+    if (user == 0 && SPIFFS.exists(legacyPath)) {
+        SPIFFS.remove(legacyPath);
     }
 
-    vadEngine.reset();
-    stopListening(); // Stop listener after registration
-    return detectedLength;
+    int saved = 0;
+    for (int i = 0; i < keep; i++) {
+        auto& feature = takes[order[i]];
+        String path = templatePath(kTemplateFilePrefix, user, saved);
+        if (!mfccEngine.saveFile(path.c_str(), *feature)) {
+            M5.Lcd.println("ERROR: Failed to save wake word!");
+            continue;
+        }
+        templates.push_back({user, threshold, std::move(feature)});
+        saved++;
+    }
+    if (saved > 0 && !saveThreshold(user, threshold)) {
+        Serial.println("Failed to save the DTW threshold; the fallback is used after reboot.");
+    }
+
+    tagMemory();
+    if (saved > 0) {
+        M5.Lcd.printf("Wake word registered and saved! (%d templates)\n", saved);
+    }
+    return saved;
 }
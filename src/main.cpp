@@ -8,14 +8,25 @@
 #include "UIManager.h"
 #include "NetworkManager.h"
 #include "WakeWordManager.h"
+#include "AudioCaptureService.h"
+#include "AdpcmCodec.h"
+#include "AudioDsp.h"
+#include "PolyphaseResampler.h"
+#include "BufferPool.h"
+#include "MemoryMonitor.h"
+#include "TurnTrace.h"
+#include "ClipCache.h"
 #include "config.h"
 #include <loadenv.hpp>
 
 // Global variables
+BufferPool bufferPool; // PSRAM arena shared by the record and response buffers, carved once at boot
+AudioCaptureService captureService; // Owns the mic; other managers consume its frames
 AudioManager audioManager;
 UIManager uiManager;
 NetworkManager networkManager;
 WakeWordManager wakeWordManager;
+ClipCache clipCache; // Earcons and fillers from flash, plus responses the server tagged for reuse
 
 // State management
 enum AppState {
@@ -30,7 +41,13 @@ enum AppState {
 AppState currentState = STATE_IDLE;
 AppState nextState = STATE_IDLE;
 unsigned long recordingStartTime = 0;
+unsigned long speechEndTime = 0;    // When recording stopped (for latency measurement)
+bool uploadInFlight = false;        // A pipelined upload is streaming the current recording
+bool lastUploadPipelined = false;   // Whether the last request used the pipelined path
 bool stateChanged = false;
+bool fillerPlayed = false;          // The filler clip was started for the current wait
+bool errorClipPlayed = false;       // The error clip was started for the current wait
+bool wakeEarconPlaying = false;     // Recording starts once the wake earcon has finished
 
 // --- State Transition ---
 void changeState(AppState newState) {
@@ -40,33 +57,79 @@ void changeState(AppState newState) {
   }
 }
 
+// --- Upload Pipelining ---
+// Open the POST as soon as recording starts so that only the last block is
+// still in flight when the user stops talking. Falls back to the batch upload
+// in stopRecordingAndSend() if the pipelined request could not be started.
+void beginPipelinedUpload(const char* endpoint) {
+  if (!PIPELINED_UPLOAD) return;
+  uploadInFlight = networkManager.beginStreamingUpload(
+      audioManager.getRecordedData(), audioManager.getBlockQueue(), endpoint);
+}
+
+void cancelPipelinedUpload() {
+  if (uploadInFlight) {
+    networkManager.cancelStreamingUpload();
+    uploadInFlight = false;
+  }
+}
+
+// --- Local Clips ---
+// Starts a clip from the pack. Playback takes I2S from the mic, so callers
+// wait for it to finish before recording or going back to IDLE.
+bool playClip(const char* name) {
+  Clip clip;
+  if (audioManager.isPlaying() || !clipCache.find(name, clip)) return false;
+  audioManager.startClipPlayback(clip.data, clip.size, clip.format, false);
+  return audioManager.isPlaying();
+}
+
 // --- State Init Functions ---
 void initIdleState() {
   Serial.println("=== Entering IDLE state ===");
+  TurnTrace::end(); // Emits the finished (or abandoned) turn, if one was traced
   uiManager.showIdleScreen();
+  captureService.start(); // No-op unless playback released I2S
+  audioManager.startPreRoll(); // Keep the last PRE_ROLL_MS so the first syllables survive
   wakeWordManager.startListening(); // Start listening for wake word
   wakeWordManager.reset();
 }
 
 void initTouchRecordingState() {
   Serial.println("=== Entering TOUCH_RECORDING state ===");
-  wakeWordManager.stopListening(); // Stop wake word listener to free I2S
+  wakeWordManager.stopListening(); // Swap consumers; the I2S driver keeps running
+  clipCache.cancelPending(); // Flash writes stall both cores; drop an unsaved response instead
+  TurnTrace::begin("touch");
   recordingStartTime = millis();
+  networkManager.prewarmConnection(); // Connect while the user talks, not after
   uiManager.showHearingScreen();
   audioManager.startRecording();
+  beginPipelinedUpload("stsGoogle");
+}
+
+void startVoiceRecording() {
+  recordingStartTime = millis();
+  audioManager.startRecording();
+  beginPipelinedUpload("stsWhisper");
 }
 
 void initVoiceRecordingState() {
   Serial.println("=== Entering VOICE_RECORDING state (after wake word) ===");
-  wakeWordManager.stopListening(); // Stop wake word listener to free I2S
-  recordingStartTime = millis();
+  wakeWordManager.stopListening(); // Swap consumers; the I2S driver keeps running
+  clipCache.cancelPending(); // Flash writes stall both cores; drop an unsaved response instead
+  networkManager.prewarmConnection(); // Connect while the user talks, not after
   uiManager.showNoticeScreen();
-  audioManager.startRecording();
+  // Acknowledge the wake word before listening. Playback takes I2S from the
+  // mic, so the pre-roll is lost and recording waits for the clip to finish.
+  wakeEarconPlaying = CLIP_WAKE_EARCON && playClip("wake");
+  if (!wakeEarconPlaying) {
+    startVoiceRecording();
+  }
 }
 
 void initWakeWordRegistrationState() {
     Serial.println("=== Entering WAKEWORD_REGISTRATION state ===");
-    // I2S will be started/stopped within captureAndRegisterWakeWord()
+    // The wake word consumer is attached/detached within captureAndRegisterWakeWord()
     M5.Lcd.fillScreen(BLACK);
     M5.Lcd.setCursor(0, 0);
     M5.Lcd.println("Say the wake word...");
@@ -75,6 +138,8 @@ void initWakeWordRegistrationState() {
 
 void initWaitingResponseState() {
   Serial.println("=== Entering WAITING_RESPONSE state ===");
+  fillerPlayed = false;
+  errorClipPlayed = false;
   // The screen is now changed before entering this state.
   // uiManager.showThinkingScreen();
 }
@@ -83,10 +148,21 @@ void initPlayingResponseState() {
   Serial.println("=== Entering PLAYING_RESPONSE state ===");
   uiManager.showSpeakingScreen();
   
-  size_t responseSize = networkManager.getResponseSize();
-  uint8_t* responseData = networkManager.getResponseData();
-  
-  audioManager.startPlayback(responseData, responseSize, 24000);
+  const char* cachedKey = networkManager.getCachedResponseKey();
+  if (cachedKey[0] != '\0') {
+    // The server answered with a response kept in flash; its body is empty
+    Clip cached;
+    if (clipCache.load(cachedKey, cached)) {
+      audioManager.startClipPlayback(cached.data, cached.size, cached.format, true);
+    } else {
+      playClip("error");
+    }
+  } else if (STREAMING_PLAYBACK) {
+    // The response is still downloading into the playback ring buffer, which carries its format.
+    audioManager.startStreamingPlayback();
+  } else {
+    audioManager.startPlayback(networkManager.getResponseData(), networkManager.getResponseFormat());
+  }
 }
 
 // --- Audio Handling ---
@@ -94,28 +170,45 @@ void stopRecordingAndSend(const char* endpoint) {
   Serial.printf("=== Stopping recording and sending to %s ===\n", endpoint);
   
   size_t dataSize = audioManager.stopRecording();
+  speechEndTime = millis();
   Serial.printf("DEBUG: Recorded data size: %d bytes\n", dataSize);
   
   if (dataSize > 0) {
     // Change to thinking screen immediately after recording stops.
     uiManager.showThinkingScreen();
 
-    uint8_t* audioData = audioManager.getRecordedData();
-    networkManager.sendAudioData(audioData, dataSize, endpoint);
+    lastUploadPipelined = uploadInFlight;
+    TurnTrace::annotate("pipelined", uploadInFlight ? 1 : 0);
+    TurnTrace::annotate("recorded_bytes", dataSize);
+    if (uploadInFlight) {
+      // The body is already streaming; stopRecording() published the last block.
+      uploadInFlight = false;
+    } else {
+      uint8_t* audioData = audioManager.getRecordedData();
+      if (!networkManager.sendAudioData(audioData, dataSize, endpoint)) {
+        Serial.println("ERROR: Failed to start upload, returning to IDLE state");
+        changeState(STATE_IDLE);
+        return;
+      }
+    }
     changeState(STATE_WAITING_RESPONSE);
   } else {
     Serial.println("ERROR: No recorded data, returning to IDLE state");
+    cancelPipelinedUpload();
     changeState(STATE_IDLE);
   }
 }
 
 // --- State Handler Functions ---
 void handleIdleState() {
-  // Listen for wake word. Button presses are handled in the main loop.
-  if (wakeWordManager.listenAndDetect()) {
+  // Wake word detection runs in its own tasks; just pick up the result.
+  // Button presses are handled in the main loop.
+  if (wakeWordManager.pollDetection()) {
     // Wake word detected, start voice recording
     changeState(STATE_VOICE_RECORDING);
+    return;
   }
+  clipCache.poll(); // Writes a newly tagged response to flash a chunk at a time
 }
 
 void handleTouchRecordingState() {
@@ -128,11 +221,24 @@ void handleTouchRecordingState() {
 }
 
 void handleVoiceRecordingState() {
+  if (wakeEarconPlaying) {
+    if (audioManager.isPlaying()) return;
+    wakeEarconPlaying = false;
+    captureService.start(); // Playback released I2S
+    startVoiceRecording();
+    return;
+  }
+
   unsigned long recordingDuration = millis() - recordingStartTime;
 
-  // Stop recording after a fixed time, or if a button is tapped to interrupt
+  // Stop recording when the user stops talking, after the maximum time as a
+  // guard rail, or if a button is tapped to interrupt
   if (recordingDuration > MAX_VOICE_RECORDING_TIME) {
     stopRecordingAndSend("stsWhisper");
+  } else if (ENDPOINT_DETECTION && audioManager.isUtteranceEnded()) {
+    Serial.printf("Endpoint: utterance ended after %lu ms (%lu ms before MAX_VOICE_RECORDING_TIME)\n",
+                  recordingDuration, (unsigned long)MAX_VOICE_RECORDING_TIME - recordingDuration);
+    stopRecordingAndSend("stsWhisper");
   } else if (M5.BtnA.wasPressed() || M5.BtnB.wasPressed() || M5.BtnC.wasPressed()) {
     stopRecordingAndSend("stsWhisper");
   }
@@ -151,15 +257,44 @@ void handleWakeWordRegistrationState() {
 }
 
 void handleWaitingResponseState() {
-  if (networkManager.isResponseReady()) {
+  // In streaming mode playback starts on the first response bytes; the
+  // playback task holds off until its jitter threshold has been buffered.
+  bool ready = STREAMING_PLAYBACK ? networkManager.isResponseStarted()
+                                  : networkManager.isResponseReady();
+  // Cover a slow response with a local filler clip
+  if (!ready && !fillerPlayed && CLIP_FILLER_DELAY_MS > 0 && millis() - speechEndTime >= CLIP_FILLER_DELAY_MS) {
+    fillerPlayed = true;
+    playClip("filler");
+  }
+  if (audioManager.isPlaying()) {
+    return; // Let the filler or error clip finish; the response waits in its buffer
+  }
+  
+  if (ready) {
     changeState(STATE_PLAYING_RESPONSE);
   } else if (networkManager.hasError()) {
+    if (!errorClipPlayed) {
+      errorClipPlayed = true;
+      if (playClip("error")) return;
+    }
     changeState(STATE_IDLE);
   }
 }
 
 void handlePlayingResponseState() {
+  if (LIPSYNC_ENABLED) {
+    // Redraws only the mouth, and backs off if the I2S writer reports underruns
+    uiManager.updateMouth(audioManager.getOutputLevel(), audioManager.getPlaybackStats().underruns);
+  }
   if (!audioManager.isPlaying()) {
+    Serial.printf("Latency (end of speech -> request complete): %lu ms [%s]\n",
+                  networkManager.getRequestCompleteTime() - speechEndTime,
+                  lastUploadPipelined ? "pipelined" : "batch");
+    if (STREAMING_PLAYBACK) {
+      Serial.printf("Latency (end of speech -> first audio): %lu ms, underruns: %u\n",
+                    audioManager.getFirstAudioTime() - speechEndTime,
+                    audioManager.getUnderrunCount());
+    }
     changeState(STATE_IDLE);
   }
 }
@@ -169,6 +304,7 @@ void setup() {
   M5.begin();
   Serial.begin(115200);
   Serial.println("=== Bot-tan Starting ===");
+  MemoryMonitor::taskStarted(CONFIG_ARDUINO_LOOP_STACK_SIZE); // setup() and loop() share the Arduino loop task
 
   SPIFFS.begin(true);
   
@@ -177,23 +313,47 @@ void setup() {
   std::string password = env["WIFI_PASSWORD"];
   networkManager.connectWiFi(ssid.c_str(), password.c_str());
   
-  audioManager.init();
   uiManager.init();
-  if (!wakeWordManager.init()) {
+  if (!bufferPool.init(BUFFER_POOL_SEGMENT_SIZE, BUFFER_POOL_SEGMENTS)) {
+      M5.Lcd.println("BufferPool Init Failed!");
+      while(1) delay(100);
+  }
+  MemoryMonitor::init(&bufferPool);
+  if (!wakeWordManager.init(captureService)) {
       M5.Lcd.println("WakeWordManager Init Failed!");
       while(1) delay(100);
   }
+  // Capture frames match the VAD frame so the wake word path needs no re-chunking
+  if (!captureService.init(wakeWordManager.frameLength())) {
+      M5.Lcd.println("AudioCaptureService Init Failed!");
+      while(1) delay(100);
+  }
+  audioManager.init(captureService, bufferPool);
+  clipCache.init(); // Without a pack or cache the bot just stays silent where clips would play
+  networkManager.setClipCache(&clipCache);
+  networkManager.setResponseRing(audioManager.getPlaybackRing());
+  networkManager.setBufferPool(&bufferPool);
   
+  if (DEBUG_CODEC_BENCHMARK) {
+    AdpcmCodec::benchmark();
+  }
+  if (DEBUG_DSP_BENCHMARK) {
+    AudioDsp::benchmark();
+    PolyphaseResampler::benchmark();
+  }
+
   M5.Axp.SetSpkEnable(true);
   networkManager.initConversation();
 
   // Directly set and initialize the first state
   currentState = STATE_IDLE;
   initIdleState();
+  MemoryMonitor::printReport("boot");
 }
 
 void loop() {
   M5.update();
+  MemoryMonitor::poll(); // Periodic memory report, or on demand with "mem" over serial
   
   // Global B button check for cancelling any state and returning to IDLE
   if (M5.BtnB.wasPressed()) {
@@ -201,7 +361,13 @@ void loop() {
     switch (currentState) {
       case STATE_TOUCH_RECORDING:
       case STATE_VOICE_RECORDING:
+        if (wakeEarconPlaying) {
+          wakeEarconPlaying = false;
+          audioManager.stopPlayback(); // Recording has not started yet
+          break;
+        }
         audioManager.stopRecording();
+        cancelPipelinedUpload();
         break;
       case STATE_PLAYING_RESPONSE:
         audioManager.stopPlayback();
@@ -209,8 +375,11 @@ void loop() {
       case STATE_IDLE: // If in IDLE, just reset wake word manager
         wakeWordManager.reset();
         break;
+      case STATE_WAITING_RESPONSE:
+        networkManager.cancelStreamingUpload(); // Discard a response still in flight
+        audioManager.stopPlayback(); // Cut a filler or error clip short
+        break;
       case STATE_WAKEWORD_REGISTRATION: // Handled by global state change
-      case STATE_WAITING_RESPONSE: // No specific stop needed, just transition
         break;
     }
     changeState(STATE_IDLE);
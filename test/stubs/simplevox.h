@@ -0,0 +1,29 @@
+// Host stand-in for the simplevox feature container (only what DtwMatcher uses).
+// The real library is built for the device only.
+#ifndef SIMPLEVOX_STUB_H
+#define SIMPLEVOX_STUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace simplevox {
+
+class MfccFeature {
+public:
+    MfccFeature(int frames, int coefs) : frames(frames), coefs(coefs), data((size_t)frames * coefs) {}
+
+    int frame_num() const { return frames; }
+    int coef_num() const { return coefs; }
+    int16_t* feature(int frame) { return &data[(size_t)frame * coefs]; }
+    const int16_t* feature(int frame) const { return &data[(size_t)frame * coefs]; }
+
+private:
+    int frames;
+    int coefs;
+    std::vector<int16_t> data;
+};
+
+} // namespace simplevox
+
+#endif // SIMPLEVOX_STUB_H
@@ -0,0 +1,182 @@
+// IMA-ADPCMコーデックのホスト用テストとベンチマーク
+// 実行: pio test -e native -f test_adpcm
+#include <unity.h>
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <vector>
+#include "AdpcmCodec.h"
+
+// 音声に近い信号として周波数の異なる正弦波を重ねる(実機のベンチマークと同じ)
+static std::vector<int16_t> makeSignal(size_t samples, double phase = 0) {
+  std::vector<int16_t> pcm(samples);
+  for (size_t i = 0; i < samples; i++) {
+    double t = phase + i;
+    pcm[i] = (int16_t)(8000 * sin(t * 0.07) + 3000 * sin(t * 0.31));
+  }
+  return pcm;
+}
+
+static double snrDb(const int16_t* reference, const int16_t* decoded, size_t samples) {
+  double signal = 0, noise = 0;
+  for (size_t i = 0; i < samples; i++) {
+    double diff = (double)decoded[i] - reference[i];
+    signal += (double)reference[i] * reference[i];
+    noise += diff * diff;
+  }
+  return (noise == 0) ? 200 : 10 * log10(signal / noise);
+}
+
+static std::vector<int16_t> roundTrip(const std::vector<int16_t>& pcm, AdpcmCodec::EncoderState& state) {
+  std::vector<uint8_t> encoded(AdpcmCodec::encodedSize(pcm.size()));
+  size_t bytes = AdpcmCodec::encodeBlock(pcm.data(), pcm.size(), encoded.data(), state);
+  TEST_ASSERT_EQUAL_UINT32(encoded.size(), bytes);
+  std::vector<int16_t> decoded(AdpcmCodec::decodedSamples(bytes));
+  TEST_ASSERT_EQUAL_UINT32(decoded.size(), AdpcmCodec::decodeBlock(encoded.data(), bytes, decoded.data()));
+  return decoded;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_odd_block_round_trip() {
+  std::vector<int16_t> pcm = makeSignal(505);
+  AdpcmCodec::EncoderState state = { 0 };
+  roundTrip(pcm, state); // ステップインデックスを信号に合わせる
+  std::vector<int16_t> decoded = roundTrip(pcm, state);
+
+  TEST_ASSERT_EQUAL_UINT32(AdpcmCodec::RESPONSE_BLOCK_SIZE, AdpcmCodec::encodedSize(505));
+  TEST_ASSERT_EQUAL_UINT32(505, decoded.size());
+  TEST_ASSERT_EQUAL_INT16(pcm[0], decoded[0]); // 先頭サンプルはヘッダにそのまま入る
+  double snr = snrDb(pcm.data(), decoded.data(), pcm.size());
+  printf("ADPCM SNR (505 samples): %.1f dB\n", snr);
+  TEST_ASSERT_TRUE(snr > 25.0);
+}
+
+// 偶数サンプルでは最後のニブルが詰め物になり、デコード結果が1サンプル増える
+void test_even_block_round_trip() {
+  std::vector<int16_t> pcm = makeSignal(504);
+  AdpcmCodec::EncoderState state = { 0 };
+  roundTrip(pcm, state);
+  std::vector<int16_t> decoded = roundTrip(pcm, state);
+
+  TEST_ASSERT_EQUAL_UINT32(4 + 252, AdpcmCodec::encodedSize(504));
+  TEST_ASSERT_EQUAL_UINT32(505, decoded.size());
+  TEST_ASSERT_TRUE(snrDb(pcm.data(), decoded.data(), pcm.size()) > 25.0);
+}
+
+void test_short_blocks() {
+  for (size_t samples = 1; samples <= 8; samples++) {
+    std::vector<int16_t> pcm = makeSignal(samples);
+    AdpcmCodec::EncoderState state = { 0 };
+    std::vector<int16_t> decoded = roundTrip(pcm, state);
+    TEST_ASSERT_EQUAL_UINT32(samples | 1, decoded.size()); // 偶数なら1増える
+    TEST_ASSERT_EQUAL_INT16(pcm[0], decoded[0]);
+  }
+  AdpcmCodec::EncoderState state = { 0 };
+  uint8_t out[8];
+  TEST_ASSERT_EQUAL_UINT32(0, AdpcmCodec::encodedSize(0));
+  TEST_ASSERT_EQUAL_UINT32(0, AdpcmCodec::encodeBlock(nullptr, 0, out, state));
+  TEST_ASSERT_EQUAL_UINT32(0, AdpcmCodec::decodedSamples(3));
+  TEST_ASSERT_EQUAL_UINT32(0, AdpcmCodec::decodeBlock(out, 3, nullptr));
+}
+
+// ブロックの終わりのステップインデックスが次のブロックのヘッダに入り、
+// 各ブロックは単独でデコードできる
+void test_index_carries_over_blocks() {
+  const size_t blockSamples = 505;
+  const int blocks = 6;
+  std::vector<int16_t> pcm = makeSignal(blockSamples * blocks);
+  // 途中で音量を上げ、インデックスが動くようにする
+  for (size_t i = blockSamples * 3; i < pcm.size(); i++) pcm[i] = (int16_t)(pcm[i] * 2);
+
+  AdpcmCodec::EncoderState state = { 0 };
+  std::vector<uint8_t> encoded(AdpcmCodec::encodedSize(blockSamples));
+  std::vector<int16_t> decoded(blockSamples);
+  uint8_t previousIndex = 0;
+  for (int b = 0; b < blocks; b++) {
+    const int16_t* block = pcm.data() + b * blockSamples;
+    size_t bytes = AdpcmCodec::encodeBlock(block, blockSamples, encoded.data(), state);
+    TEST_ASSERT_EQUAL_UINT8(previousIndex, encoded[2]);
+    TEST_ASSERT_TRUE(state.index <= 88);
+    previousIndex = state.index;
+
+    AdpcmCodec::decodeBlock(encoded.data(), bytes, decoded.data());
+    if (b > 0) {
+      TEST_ASSERT_TRUE(snrDb(block, decoded.data(), blockSamples) > 25.0);
+    }
+  }
+  TEST_ASSERT_TRUE(previousIndex > 0);
+
+  // 毎ブロック0から始めると、立ち上がりでステップが追いつかない
+  AdpcmCodec::EncoderState carried = { 0 };
+  for (int b = 0; b < 3; b++) {
+    std::vector<int16_t> block(pcm.begin() + b * blockSamples, pcm.begin() + (b + 1) * blockSamples);
+    roundTrip(block, carried);
+  }
+  std::vector<int16_t> loud(pcm.begin() + 3 * blockSamples, pcm.begin() + 4 * blockSamples);
+  AdpcmCodec::EncoderState fresh = { 0 };
+  double carriedSnr = snrDb(loud.data(), roundTrip(loud, carried).data(), blockSamples);
+  double freshSnr = snrDb(loud.data(), roundTrip(loud, fresh).data(), blockSamples);
+  TEST_ASSERT_TRUE(carriedSnr > freshSnr);
+}
+
+// フルスケールの矩形波や雑音でも予測値が折り返さない
+void test_full_scale_does_not_wrap() {
+  std::vector<int16_t> pcm(505);
+  std::mt19937 rng(1);
+  for (int pattern = 0; pattern < 2; pattern++) {
+    for (size_t i = 0; i < pcm.size(); i++) {
+      pcm[i] = (pattern == 0) ? (((i / 40) % 2) ? 32767 : -32768) : (int16_t)rng();
+    }
+    AdpcmCodec::EncoderState state = { 0 };
+    for (int n = 0; n < 4; n++) {
+      std::vector<int16_t> decoded = roundTrip(pcm, state);
+      if (pattern == 0) {
+        // 各半周期の終わりでは符号が入力と一致する
+        for (size_t i = 39; i < pcm.size(); i += 40) {
+          TEST_ASSERT_TRUE((pcm[i] > 0) == (decoded[i] > 0));
+        }
+      }
+    }
+  }
+}
+
+void test_benchmark_throughput() {
+  const size_t blockSamples = 505;
+  const int blocks = 4000;
+  std::vector<int16_t> pcm = makeSignal(blockSamples);
+  std::vector<uint8_t> encoded(AdpcmCodec::encodedSize(blockSamples));
+  std::vector<int16_t> decoded(blockSamples);
+  AdpcmCodec::EncoderState state = { 0 };
+
+  volatile size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < blocks; n++) {
+    sink += AdpcmCodec::encodeBlock(pcm.data(), blockSamples, encoded.data(), state);
+  }
+  double encodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+  for (int n = 0; n < blocks; n++) {
+    sink += AdpcmCodec::decodeBlock(encoded.data(), encoded.size(), decoded.data());
+  }
+  double decodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  const double samples = (double)blocks * blockSamples;
+  printf("ADPCM: encode %.1f Msamples/s, decode %.1f Msamples/s\n",
+         samples / encodeSeconds / 1e6, samples / decodeSeconds / 1e6);
+  TEST_ASSERT_TRUE(sink > 0);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_odd_block_round_trip);
+  RUN_TEST(test_even_block_round_trip);
+  RUN_TEST(test_short_blocks);
+  RUN_TEST(test_index_carries_over_blocks);
+  RUN_TEST(test_full_scale_does_not_wrap);
+  RUN_TEST(test_benchmark_throughput);
+  return UNITY_END();
+}
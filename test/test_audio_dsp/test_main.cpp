@@ -0,0 +1,182 @@
+// 固定小数点DSPカーネルのホスト用テストとベンチマーク
+// 実行: pio test -e native -f test_audio_dsp
+#include <unity.h>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "AudioDsp.h"
+#include "config.h"
+
+// 置き換える前のキャプチャのゲインループ(SOFTWARE_GAINはdouble)
+static void legacyGain(int16_t* samples, size_t count, double gain) {
+  for (size_t i = 0; i < count; i++) {
+    int32_t amplified_sample = (int32_t)samples[i] * gain;
+    if (amplified_sample > 32767) amplified_sample = 32767;
+    if (amplified_sample < -32768) amplified_sample = -32768;
+    samples[i] = (int16_t)amplified_sample;
+  }
+}
+
+// int16の全値
+static std::vector<int16_t> allSamples() {
+  std::vector<int16_t> samples(65536);
+  for (int i = 0; i < 65536; i++) samples[i] = (int16_t)(i - 32768);
+  return samples;
+}
+
+template <int32_t GainQ8>
+static void checkBitExact(double gain) {
+  std::vector<int16_t> expected = allSamples();
+  std::vector<int16_t> compiled = expected;
+  std::vector<int16_t> runtime = expected;
+  legacyGain(expected.data(), expected.size(), gain);
+  AudioDsp::applyGain<GainQ8>(compiled.data(), compiled.size());
+  AudioDsp::applyGain(runtime.data(), runtime.size(), GainQ8);
+  TEST_ASSERT_EQUAL_INT16_ARRAY(expected.data(), compiled.data(), expected.size());
+  TEST_ASSERT_EQUAL_INT16_ARRAY(expected.data(), runtime.data(), expected.size());
+}
+
+void setUp() {}
+void tearDown() {}
+
+// 2のべき乗のゲインはシフトになり、従来のループと全入力で一致する
+void test_power_of_two_gain_is_bit_exact() {
+  checkBitExact<AudioDsp::gainQ8(1.0)>(1.0);
+  checkBitExact<AudioDsp::gainQ8(2.0)>(2.0);
+  checkBitExact<AudioDsp::gainQ8(4.0)>(4.0);
+  checkBitExact<AudioDsp::gainQ8(8.0)>(8.0);
+}
+
+// 設定中のSOFTWARE_GAINで、キャプチャの出力が変わっていないこと
+void test_configured_gain_matches_legacy() {
+  std::vector<int16_t> expected = allSamples();
+  std::vector<int16_t> actual = expected;
+  legacyGain(expected.data(), expected.size(), SOFTWARE_GAIN);
+  AudioDsp::applyGain<AudioDsp::gainQ8(SOFTWARE_GAIN)>(actual.data(), actual.size());
+  const int32_t q8 = AudioDsp::gainQ8(SOFTWARE_GAIN);
+  const bool shift = q8 >= 256 && (q8 & (q8 - 1)) == 0 && q8 == SOFTWARE_GAIN * 256;
+  if (shift) {
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected.data(), actual.data(), expected.size());
+  } else {
+    // Q8は四捨五入、従来のループは0方向への切り捨てなので1LSBまでずれる
+    for (size_t i = 0; i < expected.size(); i++) {
+      TEST_ASSERT_INT_WITHIN(1, expected[i], actual[i]);
+    }
+  }
+}
+
+// 2のべき乗でないゲインは丸め方だけが違う
+void test_fractional_gain_within_one_lsb() {
+  std::vector<int16_t> expected = allSamples();
+  std::vector<int16_t> compiled = expected;
+  legacyGain(expected.data(), expected.size(), 1.5);
+  AudioDsp::applyGain<AudioDsp::gainQ8(1.5)>(compiled.data(), compiled.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    TEST_ASSERT_INT_WITHIN(1, expected[i], compiled[i]);
+  }
+}
+
+void test_gain_saturates() {
+  int16_t samples[4] = { 32767, -32768, 16384, -16385 };
+  AudioDsp::applyGain<AudioDsp::gainQ8(2.0)>(samples, 4);
+  TEST_ASSERT_EQUAL_INT16(32767, samples[0]);
+  TEST_ASSERT_EQUAL_INT16(-32768, samples[1]);
+  TEST_ASSERT_EQUAL_INT16(32767, samples[2]);
+  TEST_ASSERT_EQUAL_INT16(-32768, samples[3]);
+}
+
+// フレームに分けて処理しても、まとめて処理した結果と一致する。直流成分はほぼ消える
+void test_remove_dc_carries_state() {
+  std::vector<int16_t> signal(16000);
+  for (size_t i = 0; i < signal.size(); i++) {
+    signal[i] = (int16_t)(-1200 + 6000 * sin(i * 0.07));
+  }
+  std::vector<int16_t> whole = signal;
+  AudioDsp::DcState state = { 0, 0 };
+  AudioDsp::removeDc(whole.data(), whole.size(), state);
+
+  std::vector<int16_t> framed = signal;
+  AudioDsp::DcState framedState = { 0, 0 };
+  for (size_t pos = 0; pos < framed.size(); pos += 480) {
+    AudioDsp::removeDc(framed.data() + pos, 480 < framed.size() - pos ? 480 : framed.size() - pos, framedState);
+  }
+  TEST_ASSERT_EQUAL_INT16_ARRAY(whole.data(), framed.data(), whole.size());
+
+  const size_t tail = 8000; // 過渡応答が収まった後半
+  TEST_ASSERT_INT_WITHIN(30, 0, AudioDsp::mean(whole.data() + tail, whole.size() - tail));
+}
+
+void test_statistics_match_reference() {
+  std::mt19937 rng(1);
+  for (int iteration = 0; iteration < 100; iteration++) {
+    std::vector<int16_t> samples(1 + rng() % 1024);
+    const int offset = (int)(rng() % 4000) - 2000;
+    for (auto& s : samples) s = (int16_t)std::max(-32768, std::min(32767, offset + (int)(rng() % 20001) - 10000));
+    if (iteration == 0) samples[0] = -32768;
+
+    int64_t sum = 0;
+    uint64_t squares = 0;
+    uint16_t peak = 0;
+    for (int16_t s : samples) {
+      sum += s;
+      squares += (uint64_t)((int64_t)s * s);
+      uint16_t magnitude = (uint16_t)abs((int)s);
+      if (magnitude > peak) peak = magnitude;
+    }
+    const int32_t mean = (int32_t)(sum / (int64_t)samples.size());
+    uint64_t absSum = 0;
+    for (int16_t s : samples) absSum += (uint64_t)abs(s - mean);
+
+    TEST_ASSERT_EQUAL_INT32(mean, AudioDsp::mean(samples.data(), samples.size()));
+    TEST_ASSERT_EQUAL_UINT32((uint32_t)(absSum / samples.size()),
+                             AudioDsp::meanAbs(samples.data(), samples.size(), mean));
+    TEST_ASSERT_EQUAL_UINT32((uint32_t)sqrt((double)(uint32_t)(squares / samples.size())),
+                             AudioDsp::rms(samples.data(), samples.size()));
+    TEST_ASSERT_EQUAL_UINT32(peak, AudioDsp::peak(samples.data(), samples.size()).peak);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, AudioDsp::rms(nullptr, 0));
+}
+
+void test_benchmark_gain() {
+  const size_t frame = 512;
+  const int iterations = 20000;
+  std::vector<int16_t> source(frame);
+  for (size_t i = 0; i < frame; i++) source[i] = (int16_t)(6000 * sin(i * 0.07));
+  std::vector<int16_t> work(frame);
+
+  auto measure = [&](const char* name, void (*kernel)(int16_t*, size_t)) {
+    volatile int32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) {
+      memcpy(work.data(), source.data(), frame * sizeof(int16_t));
+      kernel(work.data(), frame);
+      sink += work[n % frame];
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("  %-24s %7.1f ns/frame\n", name, seconds / iterations * 1e9);
+    (void)sink;
+  };
+  printf("DSP benchmark (%u samples/frame):\n", (unsigned)frame);
+  measure("legacy gain x2.0", [](int16_t* s, size_t n) { legacyGain(s, n, 2.0); });
+  measure("applyGain<x2.0> (shift)", [](int16_t* s, size_t n) { AudioDsp::applyGain<AudioDsp::gainQ8(2.0)>(s, n); });
+  measure("legacy gain x1.5", [](int16_t* s, size_t n) { legacyGain(s, n, 1.5); });
+  measure("applyGain<x1.5>", [](int16_t* s, size_t n) { AudioDsp::applyGain<AudioDsp::gainQ8(1.5)>(s, n); });
+  measure("removeDc", [](int16_t* s, size_t n) { AudioDsp::DcState state = { 0, 0 }; AudioDsp::removeDc(s, n, state); });
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_power_of_two_gain_is_bit_exact);
+  RUN_TEST(test_configured_gain_matches_legacy);
+  RUN_TEST(test_fractional_gain_within_one_lsb);
+  RUN_TEST(test_gain_saturates);
+  RUN_TEST(test_remove_dc_carries_state);
+  RUN_TEST(test_statistics_match_reference);
+  RUN_TEST(test_benchmark_gain);
+  return UNITY_END();
+}
@@ -0,0 +1,141 @@
+// Base64エンコーダのホスト用テストとベンチマーク
+// 実行: pio test -e native -f test_base64
+#include <unity.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Base64.h"
+
+static std::string encodeString(const std::string& input) {
+  std::string out(Base64::encodedLength(input.size()), '?');
+  size_t n = Base64::encode((const uint8_t*)input.data(), input.size(), &out[0]);
+  TEST_ASSERT_EQUAL_UINT32(out.size(), n);
+  return out;
+}
+
+// 比較用の素朴なデコーダ
+static std::vector<uint8_t> decode(const std::string& text) {
+  static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::vector<uint8_t> out;
+  uint32_t bits = 0;
+  int count = 0;
+  for (char c : text) {
+    if (c == '=') break;
+    const char* p = strchr(table, c);
+    TEST_ASSERT_NOT_NULL(p);
+    bits = (bits << 6) | (uint32_t)(p - table);
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out.push_back((uint8_t)(bits >> count));
+    }
+  }
+  return out;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// RFC 4648 のテストベクタ(1バイト・2バイトの端数のパディングを含む)
+void test_rfc4648_vectors() {
+  TEST_ASSERT_EQUAL_STRING("", encodeString("").c_str());
+  TEST_ASSERT_EQUAL_STRING("Zg==", encodeString("f").c_str());
+  TEST_ASSERT_EQUAL_STRING("Zm8=", encodeString("fo").c_str());
+  TEST_ASSERT_EQUAL_STRING("Zm9v", encodeString("foo").c_str());
+  TEST_ASSERT_EQUAL_STRING("Zm9vYg==", encodeString("foob").c_str());
+  TEST_ASSERT_EQUAL_STRING("Zm9vYmE=", encodeString("fooba").c_str());
+  TEST_ASSERT_EQUAL_STRING("Zm9vYmFy", encodeString("foobar").c_str());
+}
+
+void test_all_byte_values_in_padding_positions() {
+  for (int a = 0; a < 256; a++) {
+    const uint8_t one[1] = { (uint8_t)a };
+    char out[8];
+    TEST_ASSERT_EQUAL_UINT32(4, Base64::encode(one, 1, out));
+    TEST_ASSERT_EQUAL('=', out[2]);
+    TEST_ASSERT_EQUAL('=', out[3]);
+    std::vector<uint8_t> back = decode(std::string(out, 4));
+    TEST_ASSERT_EQUAL_UINT32(1, back.size());
+    TEST_ASSERT_EQUAL_UINT8(a, back[0]);
+
+    const uint8_t two[2] = { (uint8_t)a, (uint8_t)(255 - a) };
+    TEST_ASSERT_EQUAL_UINT32(4, Base64::encode(two, 2, out));
+    TEST_ASSERT_NOT_EQUAL('=', out[2]);
+    TEST_ASSERT_EQUAL('=', out[3]);
+    back = decode(std::string(out, 4));
+    TEST_ASSERT_EQUAL_UINT32(2, back.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(two, back.data(), 2);
+  }
+}
+
+void test_encoded_length() {
+  for (size_t n = 0; n < 100; n++) {
+    TEST_ASSERT_EQUAL_UINT32((n + 2) / 3 * 4, Base64::encodedLength(n));
+    TEST_ASSERT_EQUAL_UINT32(0, Base64::encodedLength(n) % 4);
+  }
+}
+
+void test_random_round_trip() {
+  std::mt19937 rng(1);
+  for (int iteration = 0; iteration < 200; iteration++) {
+    std::vector<uint8_t> data(rng() % 2000);
+    for (auto& b : data) b = (uint8_t)rng();
+    std::string text(Base64::encodedLength(data.size()), '?');
+    TEST_ASSERT_EQUAL_UINT32(text.size(), Base64::encode(data.data(), data.size(), &text[0]));
+    std::vector<uint8_t> back = decode(text);
+    TEST_ASSERT_EQUAL_UINT32(data.size(), back.size());
+    if (!data.empty()) TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), back.data(), data.size());
+  }
+}
+
+// 録音途中のアップロードは3の倍数ずつエンコードして連結する。一括でエンコードした結果と同じになること
+void test_split_at_multiples_of_three() {
+  std::mt19937 rng(2);
+  std::vector<uint8_t> data(3000 + 2);
+  for (auto& b : data) b = (uint8_t)rng();
+  std::string whole(Base64::encodedLength(data.size()), '?');
+  Base64::encode(data.data(), data.size(), &whole[0]);
+
+  std::string pieces;
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t n = std::min<size_t>(data.size() - pos, 3 * (1 + rng() % 200));
+    char buffer[1000];
+    pieces.append(buffer, Base64::encode(data.data() + pos, n, buffer));
+    pos += n;
+  }
+  TEST_ASSERT_EQUAL_STRING(whole.c_str(), pieces.c_str());
+}
+
+void test_benchmark_throughput() {
+  const size_t size = 1 << 20;
+  const int iterations = 20;
+  std::vector<uint8_t> data(size);
+  std::mt19937 rng(3);
+  for (auto& b : data) b = (uint8_t)rng();
+  std::vector<char> out(Base64::encodedLength(size));
+
+  volatile size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < iterations; n++) {
+    sink += Base64::encode(data.data(), size, out.data());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Base64 encode: %.1f MB/s (%d x %u bytes)\n", iterations * size / seconds / 1e6, iterations, (unsigned)size);
+  TEST_ASSERT_TRUE(sink > 0);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_rfc4648_vectors);
+  RUN_TEST(test_all_byte_values_in_padding_positions);
+  RUN_TEST(test_encoded_length);
+  RUN_TEST(test_random_round_trip);
+  RUN_TEST(test_split_at_multiples_of_three);
+  RUN_TEST(test_benchmark_throughput);
+  return UNITY_END();
+}
@@ -0,0 +1,195 @@
+// Host comparison of DtwMatcher against a plain quadratic DTW with the same metric
+// (Euclidean frame distance, symmetric steps, cost / (n + m)).
+// Run: pio test -e native -f test_dtw_matcher
+#include <unity.h>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include "DtwMatcher.h"
+#include "config.h"
+
+using simplevox::MfccFeature;
+
+static const int kCoefs = 12;
+static std::mt19937 rng(1);
+
+static uint32_t cellCost(const int16_t* a, const int16_t* b) {
+    uint64_t sum = 0;
+    for (int k = 0; k < kCoefs; k++) {
+        int32_t diff = (int32_t)a[k] - b[k];
+        sum += (uint64_t)((int64_t)diff * diff);
+    }
+    return (uint32_t)sqrtf((float)sum);
+}
+
+// Full DTW, optionally restricted to the same Sakoe-Chiba band as DtwMatcher
+static uint32_t referenceDtw(const MfccFeature& reference, const MfccFeature& query, int bandPercent) {
+    const int rows = query.frame_num();
+    const int cols = reference.frame_num();
+    int radius = std::max(rows, cols) * bandPercent / 100;
+    radius = std::max(radius, (cols + rows - 1) / rows);
+    const uint64_t inf = UINT64_MAX / 4;
+    std::vector<uint64_t> cost((size_t)rows * cols, inf);
+    for (int i = 0; i < rows; i++) {
+        int centre = (rows > 1) ? (int)((int64_t)i * (cols - 1) / (rows - 1)) : 0;
+        for (int j = 0; j < cols; j++) {
+            if (j < centre - radius || j > centre + radius) continue;
+            uint64_t best = (i == 0 && j == 0) ? 0 : inf;
+            if (i > 0) best = std::min(best, cost[(size_t)(i - 1) * cols + j]);
+            if (j > 0) best = std::min(best, cost[(size_t)i * cols + j - 1]);
+            if (i > 0 && j > 0) best = std::min(best, cost[(size_t)(i - 1) * cols + j - 1]);
+            if (best < inf) cost[(size_t)i * cols + j] = best + cellCost(query.feature(i), reference.feature(j));
+        }
+    }
+    return (uint32_t)(cost[(size_t)rows * cols - 1] / (rows + cols));
+}
+
+// A slowly drifting feature track, roughly like c1..c12 of a word at 64 units per cepstral unit
+static MfccFeature randomWord(int frames) {
+    MfccFeature feature(frames, kCoefs);
+    std::normal_distribution<float> step(0, 90);
+    for (int k = 0; k < kCoefs; k++) {
+        float value = step(rng) * 3;
+        for (int i = 0; i < frames; i++) {
+            value += step(rng) * 0.3f;
+            feature.feature(i)[k] = (int16_t)std::max(-32768.0f, std::min(32767.0f, value));
+        }
+    }
+    return feature;
+}
+
+// Resamples the word to another length with a non-linear time warp and adds noise
+static MfccFeature warpedCopy(const MfccFeature& word, int frames, float noise) {
+    MfccFeature feature(frames, kCoefs);
+    std::normal_distribution<float> jitter(0, noise);
+    const float bend = (float)(rng() % 7);
+    for (int i = 0; i < frames; i++) {
+        float t = (frames > 1) ? (float)i * (word.frame_num() - 1) / (frames - 1) : 0;
+        t += bend * sinf(3.14159f * i / frames);
+        int j = std::max(0, std::min(word.frame_num() - 1, (int)t));
+        for (int k = 0; k < kCoefs; k++) {
+            feature.feature(i)[k] = (int16_t)(word.feature(j)[k] + jitter(rng));
+        }
+    }
+    return feature;
+}
+
+static MfccFeature randomQuery(const MfccFeature& word) {
+    const int frames = 1 + (int)(rng() % 120);
+    return (rng() % 3 == 0) ? randomWord(frames) : warpedCopy(word, frames, (float)(rng() % 200));
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Without a threshold, the distance is the exact banded DTW distance
+void test_distance_matches_banded_reference() {
+    DtwMatcher matcher(WAKEWORD_DTW_BAND_PERCENT);
+    for (int iteration = 0; iteration < 300; iteration++) {
+        MfccFeature word = randomWord(1 + (int)(rng() % 120));
+        MfccFeature query = randomQuery(word);
+        uint32_t expected = referenceDtw(word, query, WAKEWORD_DTW_BAND_PERCENT);
+        TEST_ASSERT_EQUAL_UINT32(expected, matcher.match(word, query, DtwMatcher::kRejected - 1));
+        TEST_ASSERT_TRUE(matcher.lastStats().stage == DtwMatcher::Stage::Full);
+        TEST_ASSERT_EQUAL_UINT32(expected, matcher.lastStats().bound);
+    }
+}
+
+// A band as wide as the longer sequence is the unconstrained DTW (simplevox::calcDTW)
+void test_full_band_matches_unbanded_reference() {
+    DtwMatcher matcher(100);
+    for (int iteration = 0; iteration < 200; iteration++) {
+        MfccFeature word = randomWord(1 + (int)(rng() % 100));
+        MfccFeature query = randomQuery(word);
+        TEST_ASSERT_EQUAL_UINT32(referenceDtw(word, query, 1000),
+                                 matcher.match(word, query, DtwMatcher::kRejected - 1));
+    }
+}
+
+// The lower bound and early abandoning never change a decision, and the bound
+// they report never exceeds the true distance
+void test_pruning_keeps_decisions() {
+    DtwMatcher matcher(WAKEWORD_DTW_BAND_PERCENT);
+    int stages[3] = { 0, 0, 0 };
+    for (int iteration = 0; iteration < 2000; iteration++) {
+        MfccFeature word = randomWord(20 + (int)(rng() % 100));
+        MfccFeature query = randomQuery(word);
+        const uint32_t expected = referenceDtw(word, query, WAKEWORD_DTW_BAND_PERCENT);
+        // Thresholds around the true distance, where pruning is most likely to be wrong
+        const uint32_t thresholds[] = { 1, expected / 2 + 1, expected, expected + 1, expected * 2 + 1 };
+        for (uint32_t threshold : thresholds) {
+            uint32_t result = matcher.match(word, query, threshold);
+            const DtwMatcher::Stats& stats = matcher.lastStats();
+            if (expected < threshold) {
+                TEST_ASSERT_EQUAL_UINT32(expected, result);
+            } else {
+                TEST_ASSERT_EQUAL_UINT32(DtwMatcher::kRejected, result);
+                TEST_ASSERT_TRUE(stats.bound >= threshold);
+                TEST_ASSERT_TRUE(stats.bound <= expected);
+                stages[(int)stats.stage]++;
+            }
+            TEST_ASSERT_TRUE(stats.cells <= stats.totalCells);
+        }
+    }
+    printf("Rejections by stage: lower bound %d, abandoned %d, full %d\n", stages[0], stages[1], stages[2]);
+    TEST_ASSERT_TRUE(stages[0] > 0);
+    TEST_ASSERT_TRUE(stages[1] > 0);
+}
+
+void test_cancel_stops_match() {
+    DtwMatcher matcher(WAKEWORD_DTW_BAND_PERCENT);
+    MfccFeature word = randomWord(60);
+    MfccFeature query = warpedCopy(word, 70, 10);
+    std::atomic<bool> cancel(true);
+    TEST_ASSERT_EQUAL_UINT32(DtwMatcher::kRejected, matcher.match(word, query, DtwMatcher::kRejected - 1, &cancel));
+    TEST_ASSERT_TRUE(matcher.lastStats().stage == DtwMatcher::Stage::Cancelled);
+    TEST_ASSERT_EQUAL_UINT32(DtwMatcher::kRejected, matcher.lastStats().bound);
+}
+
+void test_benchmark_against_full_dtw() {
+    DtwMatcher matcher(WAKEWORD_DTW_BAND_PERCENT);
+    std::vector<MfccFeature> words, queries;
+    std::vector<uint32_t> thresholds;
+    for (int i = 0; i < 200; i++) {
+        words.push_back(randomWord(60 + (int)(rng() % 40)));
+        queries.push_back((i % 4 == 0) ? warpedCopy(words.back(), 60 + (int)(rng() % 40), 40)
+                                       : randomWord(60 + (int)(rng() % 40)));
+    }
+    // Threshold just above the genuine matches, as a calibrated one would be
+    uint32_t genuine = 0;
+    for (size_t i = 0; i < words.size(); i += 4) {
+        genuine = std::max(genuine, referenceDtw(words[i], queries[i], WAKEWORD_DTW_BAND_PERCENT));
+    }
+    const uint32_t threshold = genuine * 5 / 4 + 1;
+
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < words.size(); i++) sink += referenceDtw(words[i], queries[i], 1000);
+    double fullSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t cells = 0, totalCells = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < words.size(); i++) {
+        sink += matcher.match(words[i], queries[i], threshold);
+        cells += matcher.lastStats().cells;
+        totalCells += matcher.lastStats().totalCells;
+    }
+    double matcherSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("DTW: full %.1f us/match, DtwMatcher %.1f us/match (%.1f%% of cells, threshold %u)\n",
+           fullSeconds / words.size() * 1e6, matcherSeconds / words.size() * 1e6,
+           100.0 * cells / totalCells, (unsigned)threshold);
+    (void)sink;
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_distance_matches_banded_reference);
+    RUN_TEST(test_full_band_matches_unbanded_reference);
+    RUN_TEST(test_pruning_keeps_decisions);
+    RUN_TEST(test_cancel_stops_match);
+    RUN_TEST(test_benchmark_against_full_dtw);
+    return UNITY_END();
+}
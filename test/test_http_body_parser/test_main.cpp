@@ -0,0 +1,291 @@
+// HTTP応答ボディの区切り(chunked / Content-Length / 切断まで)のホスト用ファズテストとベンチマーク
+// 実行: pio test -e native -f test_http_body_parser
+#include <unity.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "HttpBodyParser.h"
+
+static std::mt19937 rng(1);
+
+// NetworkManagerと同じ使い方で、届いた分を処理する。本文はpayloadに追加し、消費したバイト数を返す
+// (完了またはエラーになったら、残りは次の応答のものなので読まない)
+static size_t consume(HttpBodyParser& parser, const std::string& data, size_t pos, size_t length,
+                      std::string& payload) {
+  const size_t start = pos;
+  const size_t end = pos + length;
+  while (pos < end && !parser.isDone() && !parser.hasError()) {
+    size_t wanted = parser.payloadWanted();
+    if (wanted > 0) {
+      size_t n = std::min(wanted, end - pos);
+      payload.append(data, pos, n);
+      parser.payloadRead(n);
+      pos += n;
+    } else {
+      parser.feed((uint8_t)data[pos++]);
+    }
+  }
+  return pos - start;
+}
+
+// ランダムな区切りで届けたときの結果
+struct Outcome {
+  std::string payload;
+  size_t consumed;
+};
+
+static Outcome deliver(HttpBodyParser& parser, const std::string& data, bool byteByByte = false) {
+  Outcome outcome = { std::string(), 0 };
+  size_t pos = 0;
+  while (pos < data.size() && !parser.isDone() && !parser.hasError()) {
+    size_t piece = byteByByte ? 1 : 1 + rng() % std::min<size_t>(data.size() - pos, 1 + rng() % 1500);
+    piece = std::min(piece, data.size() - pos);
+    size_t used = consume(parser, data, pos, piece, outcome.payload);
+    outcome.consumed += used;
+    if (used < piece) break;
+    pos += piece;
+  }
+  return outcome;
+}
+
+static std::string randomBytes(size_t length) {
+  std::string bytes(length, '\0');
+  for (auto& c : bytes) c = (char)rng();
+  return bytes;
+}
+
+static std::string hex(size_t value, bool upper) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), upper ? "%zX" : "%zx", value);
+  return buffer;
+}
+
+// 本文をランダムなチャンクに分けてエンコードする(拡張・トレーラ・LFだけの改行も混ぜる)
+static std::string encodeChunked(const std::string& payload) {
+  const char* eol = (rng() % 4 == 0) ? "\n" : "\r\n";
+  std::string out;
+  size_t pos = 0;
+  while (pos < payload.size()) {
+    size_t n = std::min<size_t>(payload.size() - pos, 1 + rng() % 700);
+    out += std::string(rng() % 3 == 0 ? "00" : "") + hex(n, rng() % 2);
+    if (rng() % 5 == 0) out += ";name=value";
+    out += eol;
+    out.append(payload, pos, n);
+    out += eol;
+    pos += n;
+  }
+  out += "0";
+  out += eol;
+  if (rng() % 3 == 0) {
+    out += "X-Trailer: 1";
+    out += eol;
+  }
+  out += eol;
+  return out;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_chunked_split_randomly() {
+  for (int iteration = 0; iteration < 500; iteration++) {
+    const std::string payload = randomBytes(rng() % 5000);
+    const std::string body = encodeChunked(payload);
+    const std::string next = "HTTP/1.1 200 OK\r\n"; // 同じ接続の次の応答
+    HttpBodyParser parser;
+    parser.beginChunked();
+    Outcome outcome = deliver(parser, body + next, iteration % 10 == 0);
+
+    TEST_ASSERT_TRUE(parser.isDone());
+    TEST_ASSERT_TRUE(parser.isReusable());
+    TEST_ASSERT_EQUAL_UINT32(body.size(), outcome.consumed);
+    TEST_ASSERT_EQUAL_UINT32(payload.size(), parser.getPayloadBytes());
+    TEST_ASSERT_TRUE(payload == outcome.payload);
+  }
+}
+
+void test_content_length_split_randomly() {
+  for (int iteration = 0; iteration < 500; iteration++) {
+    const std::string payload = randomBytes(rng() % 5000);
+    HttpBodyParser parser;
+    parser.beginFixed(payload.size());
+    Outcome outcome = deliver(parser, payload + "HTTP/1.1 200 OK\r\n", iteration % 10 == 0);
+
+    TEST_ASSERT_TRUE(parser.isDone());
+    TEST_ASSERT_TRUE(parser.isReusable());
+    TEST_ASSERT_EQUAL_UINT32(payload.size(), outcome.consumed);
+    TEST_ASSERT_TRUE(payload == outcome.payload);
+  }
+}
+
+void test_until_close_split_randomly() {
+  for (int iteration = 0; iteration < 200; iteration++) {
+    const std::string payload = randomBytes(rng() % 5000);
+    HttpBodyParser parser;
+    parser.beginUntilClose();
+    Outcome outcome = deliver(parser, payload);
+    TEST_ASSERT_FALSE(parser.isDone());
+    parser.endOfStream();
+
+    TEST_ASSERT_TRUE(parser.isDone());
+    TEST_ASSERT_FALSE(parser.isReusable()); // 切断で終わった接続は使い回せない
+    TEST_ASSERT_TRUE(payload == outcome.payload);
+  }
+}
+
+// 途中で接続が閉じたら切り詰めとして失敗する(切断で終わる本文以外)
+void test_truncated_bodies() {
+  const std::string payload = randomBytes(300);
+  const std::string chunked = encodeChunked(payload);
+  for (size_t cut = 0; cut < chunked.size(); cut++) {
+    HttpBodyParser parser;
+    parser.beginChunked();
+    deliver(parser, chunked.substr(0, cut));
+    TEST_ASSERT_FALSE(parser.isDone());
+    parser.endOfStream();
+    TEST_ASSERT_TRUE(parser.hasError());
+    TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_TRUNCATED, parser.getError());
+  }
+  for (size_t cut = 0; cut < payload.size(); cut++) {
+    HttpBodyParser parser;
+    parser.beginFixed(payload.size());
+    Outcome outcome = deliver(parser, payload.substr(0, cut));
+    parser.endOfStream();
+    TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_TRUNCATED, parser.getError());
+    TEST_ASSERT_EQUAL_UINT32(cut, outcome.payload.size());
+  }
+
+  HttpBodyParser parser;
+  parser.beginFixed(10);
+  parser.timedOut();
+  TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_TIMEOUT, parser.getError());
+
+  HttpBodyParser empty;
+  empty.beginFixed(0);
+  TEST_ASSERT_TRUE(empty.isDone());
+  empty.endOfStream();
+  empty.timedOut();
+  TEST_ASSERT_TRUE(empty.isDone());
+}
+
+void test_malformed_chunks() {
+  const char* cases[] = {
+    "\r\n",                    // サイズがない
+    "g\r\n",                   // 16進数でない
+    "123456789\r\nx",          // 8桁を超える
+    "3\r\nabcX\r\n0\r\n\r\n",  // データの後にCRLFがない
+    "3\r\nabc\rX",
+    "3\rX",
+    "0\r\n\rX",
+    "-1\r\n",
+  };
+  for (const char* text : cases) {
+    HttpBodyParser parser;
+    parser.beginChunked();
+    deliver(parser, text, true);
+    TEST_ASSERT_TRUE_MESSAGE(parser.hasError(), text);
+    TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_MALFORMED, parser.getError());
+    // エラーの後は何も受け付けない
+    TEST_ASSERT_EQUAL_UINT32(0, parser.payloadWanted());
+    TEST_ASSERT_FALSE(parser.feed('0'));
+    parser.endOfStream();
+    TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_MALFORMED, parser.getError());
+  }
+}
+
+// 壊れた入力でも、渡した以上の本文を読ませず、完了・エラー・続き待ちのどれかで止まる
+void test_mutated_chunked_bodies() {
+  int done = 0, malformed = 0, truncated = 0;
+  for (int iteration = 0; iteration < 3000; iteration++) {
+    std::string body = encodeChunked(randomBytes(rng() % 2000));
+    const int mutations = 1 + rng() % 4;
+    for (int m = 0; m < mutations && !body.empty(); m++) {
+      size_t at = rng() % body.size();
+      switch (rng() % 4) {
+        case 0: body[at] = (char)rng(); break;
+        case 1: body.erase(at, 1 + rng() % 8); break;
+        case 2: body.insert(at, 1 + rng() % 4, "0123456789abcdef\r\n;"[rng() % 19]); break;
+        case 3: body[at] ^= (char)(1 << (rng() % 8)); break;
+      }
+    }
+
+    HttpBodyParser parser;
+    parser.beginChunked();
+    Outcome outcome = deliver(parser, body);
+    TEST_ASSERT_TRUE(outcome.consumed <= body.size());
+    TEST_ASSERT_TRUE(outcome.payload.size() <= outcome.consumed);
+    TEST_ASSERT_EQUAL_UINT32(outcome.payload.size(), parser.getPayloadBytes());
+
+    if (parser.isDone()) {
+      TEST_ASSERT_TRUE(parser.isReusable());
+      done++;
+    } else if (parser.hasError()) {
+      TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_MALFORMED, parser.getError());
+      malformed++;
+    } else {
+      TEST_ASSERT_EQUAL_UINT32(body.size(), outcome.consumed); // 続きを待っている
+      parser.endOfStream();
+      TEST_ASSERT_EQUAL(HttpBodyParser::ERROR_TRUNCATED, parser.getError());
+      truncated++;
+    }
+  }
+  printf("Mutated bodies: %d done, %d malformed, %d truncated\n", done, malformed, truncated);
+  TEST_ASSERT_TRUE(malformed > 0);
+  TEST_ASSERT_TRUE(truncated > 0);
+}
+
+// 受信バッファ4KBずつ読む場合の処理速度(本文のコピーを含む)
+void test_benchmark_throughput() {
+  const std::string payload = randomBytes(1 << 20);
+  struct Case {
+    const char* name;
+    size_t chunk;
+  };
+  const Case cases[] = { { "chunked 1 KB", 1024 }, { "chunked 16 KB", 16384 }, { "Content-Length", 0 } };
+  for (const Case& c : cases) {
+    std::string body;
+    if (c.chunk == 0) {
+      body = payload;
+    } else {
+      for (size_t pos = 0; pos < payload.size(); pos += c.chunk) {
+        body += hex(c.chunk, false) + "\r\n";
+        body.append(payload, pos, c.chunk);
+        body += "\r\n";
+      }
+      body += "0\r\n\r\n";
+    }
+
+    const int iterations = 20;
+    std::string out;
+    out.reserve(payload.size());
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) {
+      HttpBodyParser parser;
+      if (c.chunk == 0) parser.beginFixed(body.size());
+      else parser.beginChunked();
+      out.clear();
+      for (size_t pos = 0; pos < body.size(); pos += 4096) {
+        consume(parser, body, pos, std::min<size_t>(4096, body.size() - pos), out);
+      }
+      TEST_ASSERT_TRUE(parser.isDone());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("HttpBodyParser %-16s %8.1f MB/s\n", c.name, iterations * payload.size() / seconds / 1e6);
+    TEST_ASSERT_TRUE(out == payload);
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_chunked_split_randomly);
+  RUN_TEST(test_content_length_split_randomly);
+  RUN_TEST(test_until_close_split_randomly);
+  RUN_TEST(test_truncated_bodies);
+  RUN_TEST(test_malformed_chunks);
+  RUN_TEST(test_mutated_chunked_bodies);
+  RUN_TEST(test_benchmark_throughput);
+  return UNITY_END();
+}
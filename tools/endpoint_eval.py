@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Replay recorded utterances through the device's end-of-utterance detector.
+
+Runs the same frame-energy end-pointing as AudioManager::updateEndpoint over a
+corpus of 16 kHz mono 16-bit WAV files and reports, per file and on average,
+how much earlier recording stops than the fixed MAX_VOICE_RECORDING_TIME.
+
+Usage:
+  python3 tools/endpoint_eval.py corpus/*.wav [--silence-ms 700] [--level 400]
+"""
+
+import argparse
+import array
+import sys
+import wave
+
+
+def frame_levels(samples, frame_len):
+    """Mean absolute deviation from the frame mean, as on the device (integer math)."""
+    for start in range(0, len(samples) - frame_len + 1, frame_len):
+        frame = samples[start:start + frame_len]
+        mean = int(sum(frame) / frame_len)  # C integer division truncates toward zero
+        yield sum(abs(s - mean) for s in frame) // frame_len
+
+
+def endpoint_ms(samples, args):
+    """Returns the recording length in ms at which the device would stop."""
+    frame_len = args.sample_rate * args.frame_ms // 1000
+    speech_heard = False
+    recorded_ms = 0
+    last_speech_ms = 0
+    for level in frame_levels(samples, frame_len):
+        recorded_ms += args.frame_ms
+        if recorded_ms > args.max_ms:
+            return args.max_ms
+        if level > args.level:
+            speech_heard = True
+            last_speech_ms = recorded_ms
+        if (speech_heard and recorded_ms >= args.min_ms
+                and recorded_ms - last_speech_ms >= args.silence_ms):
+            return recorded_ms
+    # Ran out of audio: the device would have kept recording until the limit
+    return args.max_ms
+
+
+def load(path, gain):
+    with wave.open(path, "rb") as w:
+        if w.getnchannels() != 1 or w.getsampwidth() != 2:
+            raise ValueError("expected mono 16-bit PCM")
+        rate = w.getframerate()
+        samples = array.array("h")
+        samples.frombytes(w.readframes(w.getnframes()))
+    if sys.byteorder == "big":
+        samples.byteswap()
+    return [max(-32768, min(32767, int(s * gain))) for s in samples], rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("files", nargs="+")
+    parser.add_argument("--silence-ms", type=int, default=700, help="ENDPOINT_SILENCE_MS")
+    parser.add_argument("--min-ms", type=int, default=1000, help="ENDPOINT_MIN_RECORDING_MS")
+    parser.add_argument("--max-ms", type=int, default=5000, help="MAX_VOICE_RECORDING_TIME")
+    parser.add_argument("--level", type=int, default=400, help="ENDPOINT_SPEECH_LEVEL")
+    parser.add_argument("--gain", type=float, default=1.0,
+                        help="gain to apply first (use SOFTWARE_GAIN for raw mic captures)")
+    parser.add_argument("--frame-ms", type=int, default=10, help="capture frame length")
+    parser.add_argument("--sample-rate", type=int, default=16000)
+    args = parser.parse_args()
+
+    saved = []
+    for path in args.files:
+        try:
+            samples, rate = load(path, args.gain)
+        except (ValueError, wave.Error) as e:
+            print("%s: skipped (%s)" % (path, e))
+            continue
+        if rate != args.sample_rate:
+            print("%s: skipped (sample rate %d)" % (path, rate))
+            continue
+        stop = endpoint_ms(samples, args)
+        saved.append(args.max_ms - stop)
+        print("%s: %.2f s of audio, stops at %d ms, %d ms earlier" % (
+            path, len(samples) / rate, stop, args.max_ms - stop))
+
+    if saved:
+        saved.sort()
+        print("%d files: mean %d ms earlier, median %d ms, %d hit the %d ms limit" % (
+            len(saved), sum(saved) // len(saved), saved[len(saved) // 2],
+            saved.count(0), args.max_ms))
+
+
+if __name__ == "__main__":
+    main()
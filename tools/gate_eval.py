@@ -0,0 +1,396 @@
+#!/usr/bin/env python3
+"""Replay recordings through the wake word energy gate (VoiceDetector).
+
+Runs the same adaptive noise-floor gate as VoiceDetector::process over 16 kHz
+mono 16-bit WAV files and reports how often VAD/MFCC/DTW would run, and
+whether the gate was open over every speech frame of each wake word take.
+
+  wake word takes  -> positional files. Recall is the share of files whose
+                      speech frames (level > --speech-level) all fell inside
+                      an open gate; a miss means the cascade could lose a
+                      detection that the ungated path would have made.
+  background audio -> --background files. The open share is the fraction of
+                      frames on which the later stages still run while idle.
+
+Each file is replayed from a fresh noise floor, so recordings should start
+with at least half a second of room noise, as on the device.
+
+With --dtw, the takes are also segmented and matched as on the device, to check
+that gating does not cut live utterances differently from the templates:
+
+  registration -> ungated, as captureAndRegisterWakeWord records templates
+  gated        -> through the gate, replaying the held lead-in frames when it
+                  opens (WakeWordManager::replayLeadIn)
+  no lead-in   -> through the gate, starting MFCC at the frame that opened it
+
+Each take is matched leave-one-out against templates picked and calibrated from
+the other takes' registration segments (most central WAKEWORD_TEMPLATES_PER_USER,
+threshold = widest kept pair x WAKEWORD_DTW_MARGIN_PERCENT). The script has no
+esp-sr VAD: frames above --speech-level count as speech for the segmenter, and
+MFCC runs in double precision, so distances can differ from the device by a few
+units.
+
+Usage:
+  python3 tools/gate_eval.py takes/*.wav --background idle/*.wav [--ratio 2.0]
+  python3 tools/gate_eval.py takes/*.wav --dtw
+"""
+
+import argparse
+import array
+import cmath
+import math
+import sys
+import wave
+
+FLOOR_FALL_SHIFT = 3
+FLOOR_RISE_SHIFT = 7
+
+# MfccStream
+MFCC_FRAME = 400
+MFCC_HOP = 160
+FFT_SIZE = 512
+MEL_BANDS = 26
+COEFS = 12
+SCALE = 64
+PRE_EMPHASIS = 0.97
+MIN_MEL_ENERGY = 1e-3
+
+# WakeWordManager
+SEGMENT_MARGIN_FRAMES = 3
+HANGOVER_MS = 300
+MAX_SEGMENT_FRAMES = 3 * 16000 // MFCC_HOP
+
+
+def frame_volumes(samples, frame_len):
+    """Mean absolute deviation from the frame mean, as on the device (integer math)."""
+    for start in range(0, len(samples) - frame_len + 1, frame_len):
+        frame = samples[start:start + frame_len]
+        mean = int(sum(frame) / frame_len)  # C integer division truncates toward zero
+        yield sum(abs(s - mean) for s in frame) // frame_len
+
+
+def run_gate(volumes, args):
+    """Returns one bool per frame: whether the gate was open after that frame."""
+    ratio_q8 = int(args.ratio * 256 + 0.5)
+    floor_q8 = None
+    gate_open = False
+    quiet_ms = 0
+    states = []
+    for volume in volumes:
+        threshold = 0 if floor_q8 is None else (floor_q8 * ratio_q8) >> 16
+        threshold = max(threshold, args.min_level)
+        loud = floor_q8 is not None and volume > threshold
+
+        volume_q8 = volume << 8
+        if floor_q8 is None:
+            floor_q8 = volume_q8
+        elif volume_q8 < floor_q8:
+            floor_q8 -= (floor_q8 - volume_q8) >> FLOOR_FALL_SHIFT
+        elif not gate_open:
+            floor_q8 += (volume_q8 - floor_q8) >> FLOOR_RISE_SHIFT
+
+        if loud:
+            gate_open = True
+            quiet_ms = 0
+        elif gate_open:
+            quiet_ms += args.frame_ms
+            if quiet_ms >= args.hangover_ms:
+                gate_open = False
+        states.append(gate_open)
+    return states
+
+
+class Mfcc:
+    """Streaming MFCC, as MfccStream (c1..c12 in SCALE units)."""
+
+    def __init__(self, sample_rate):
+        self.window = [0.54 - 0.46 * math.cos(2 * math.pi * i / (MFCC_FRAME - 1)) for i in range(MFCC_FRAME)]
+        self.twiddle = [cmath.exp(-2j * math.pi * i / FFT_SIZE) for i in range(FFT_SIZE // 2)]
+        bits = FFT_SIZE.bit_length() - 1
+        self.reverse = [int(format(i, "0%db" % bits)[::-1], 2) for i in range(FFT_SIZE)]
+        mel_max = 2595 * math.log10(1 + sample_rate / 2 / 700)
+        self.edges = [700 * (10 ** (mel_max * b / (MEL_BANDS + 1) / 2595) - 1) * FFT_SIZE / sample_rate
+                      for b in range(MEL_BANDS + 2)]
+        self.dct = [[math.cos(math.pi * (c + 1) * (b + 0.5) / MEL_BANDS) for b in range(MEL_BANDS)]
+                    for c in range(COEFS)]
+        self.reset()
+        self.frames = []
+
+    def reset(self):
+        self.pending = []
+
+    def push(self, samples):
+        self.pending.extend(samples)
+        while len(self.pending) >= MFCC_FRAME:
+            self.frames.append(self.compute(self.pending[:MFCC_FRAME]))
+            del self.pending[:MFCC_HOP]
+
+    def fft(self, x):
+        x = [x[self.reverse[i]] for i in range(FFT_SIZE)]
+        size = 2
+        while size <= FFT_SIZE:
+            half = size // 2
+            step = FFT_SIZE // size
+            for start in range(0, FFT_SIZE, size):
+                for k in range(half):
+                    a = start + k
+                    t = x[a + half] * self.twiddle[k * step]
+                    x[a + half] = x[a] - t
+                    x[a] = x[a] + t
+            size *= 2
+        return x
+
+    def compute(self, frame):
+        previous = frame[0]
+        x = [0j] * FFT_SIZE
+        for i, sample in enumerate(frame):
+            x[i] = complex((sample - PRE_EMPHASIS * previous) * self.window[i])
+            previous = sample
+        power = [abs(v) ** 2 for v in self.fft(x)[:FFT_SIZE // 2 + 1]]
+        mel = []
+        for b in range(MEL_BANDS):
+            left, centre, right = self.edges[b], self.edges[b + 1], self.edges[b + 2]
+            energy = 0.0
+            for k in range(int(math.ceil(left)), min(int(right), FFT_SIZE // 2) + 1):
+                weight = (k - left) / (centre - left) if k <= centre else (right - k) / (right - centre)
+                if weight > 0:
+                    energy += weight * power[k]
+            mel.append(math.log(max(energy, MIN_MEL_ENERGY)))
+        return [max(-32768, min(32767, int(round(sum(d * m for d, m in zip(basis, mel)) * SCALE))))
+                for basis in self.dct]
+
+
+class Segmenter:
+    """WakeWordManager::segmentFrame, with a level threshold in place of the esp-sr VAD."""
+
+    def __init__(self, args):
+        self.args = args
+        self.mfcc = Mfcc(args.sample_rate)
+        self.reset()
+
+    def reset(self):
+        self.mfcc.reset()
+        self.first_valid = len(self.mfcc.frames)
+        self.speech_run_ms = 0
+        self.silence_run_ms = 0
+        self.in_segment = False
+
+    def feed(self, frame, level):
+        frame_start = len(self.mfcc.frames)
+        self.mfcc.push(frame)
+        produced = len(self.mfcc.frames)
+        speech = level > self.args.speech_level
+        if not self.in_segment:
+            if not speech:
+                self.speech_run_ms = 0
+                return None
+            if self.speech_run_ms == 0:
+                self.run_start = frame_start
+            self.speech_run_ms += self.args.frame_ms
+            if self.speech_run_ms >= self.args.vad_decision_ms:
+                self.in_segment = True
+                self.silence_run_ms = 0
+                self.segment_start = (self.run_start - SEGMENT_MARGIN_FRAMES
+                                      if self.run_start > self.first_valid + SEGMENT_MARGIN_FRAMES
+                                      else self.first_valid)
+                self.last_speech = produced
+            return None
+        if speech:
+            self.silence_run_ms = 0
+            self.last_speech = produced
+        else:
+            self.silence_run_ms += self.args.frame_ms
+        if produced - self.segment_start > MAX_SEGMENT_FRAMES:
+            self.reset()
+            return None
+        if self.silence_run_ms < HANGOVER_MS:
+            return None
+        end = min(self.last_speech + SEGMENT_MARGIN_FRAMES, produced)
+        self.in_segment = False
+        self.speech_run_ms = 0
+        return self.mfcc.frames[self.segment_start:end]
+
+
+def segment(samples, volumes, states, args, mode):
+    """First segment of a take. mode: "registration", "gated" or "no lead-in"."""
+    frame_len = args.sample_rate * args.frame_ms // 1000
+    lead_frames = ((SEGMENT_MARGIN_FRAMES * MFCC_HOP + MFCC_FRAME - MFCC_HOP + frame_len - 1) // frame_len + 1
+                   if mode == "gated" else 0)
+    segmenter = Segmenter(args)
+    running = False
+    held = []
+    for i, volume in enumerate(volumes):
+        frame = samples[i * frame_len:(i + 1) * frame_len]
+        if mode == "registration" or states[i] or segmenter.in_segment:
+            if not running:
+                segmenter.reset()
+                running = True
+                for old, old_volume in held:
+                    segmenter.feed(old, old_volume)
+                held = []
+            feature = segmenter.feed(frame, volume)
+            if feature:
+                return feature
+        else:
+            running = False
+            if lead_frames:
+                held = (held + [(frame, volume)])[-lead_frames:]
+    return None
+
+
+def dtw(reference, query, band_percent):
+    """Normalized banded DTW distance, as DtwMatcher without a threshold."""
+    rows, cols = len(query), len(reference)
+    radius = max(max(rows, cols) * band_percent // 100, (cols + rows - 1) // rows)
+    inf = float("inf")
+    previous = None
+    for i in range(rows):
+        centre = i * (cols - 1) // (rows - 1) if rows > 1 else 0
+        lo, hi = max(0, centre - radius), min(cols - 1, centre + radius)
+        current = [inf] * cols
+        q = query[i]
+        for j in range(lo, hi + 1):
+            if i == 0 and j == 0:
+                best = 0
+            else:
+                best = inf
+                if previous is not None:
+                    best = min(best, previous[j], previous[j - 1] if j > 0 else inf)
+                if j > lo:
+                    best = min(best, current[j - 1])
+            if best < inf:
+                r = reference[j]
+                current[j] = best + int(math.sqrt(sum((a - b) * (a - b) for a, b in zip(q, r))))
+        previous = current
+    return int(previous[cols - 1] // (rows + cols))
+
+
+def evaluate_dtw(takes, args):
+    names = [name for name, _ in takes]
+    templates = [segments["registration"] for _, segments in takes]
+    count = len(takes)
+    pair = [[0] * count for _ in range(count)]
+    for a in range(count):
+        for b in range(a + 1, count):
+            pair[a][b] = pair[b][a] = dtw(templates[a], templates[b], args.band)
+
+    modes = ("registration", "gated", "no lead-in")
+    hits = dict((mode, 0) for mode in modes)
+    totals = dict((mode, 0) for mode in modes)
+    for q in range(count):
+        others = [t for t in range(count) if t != q]
+        others.sort(key=lambda t: sum(pair[t][o] for o in others))
+        kept = others[:args.templates]
+        widest = max([pair[a][b] for a in kept for b in kept if a < b] or [0])
+        threshold = max(1, widest * args.margin // 100) if len(kept) > 1 else args.threshold
+        distances = []
+        for mode in modes:
+            query = takes[q][1][mode]
+            if not query:
+                distances.append("%s none" % mode)
+                continue
+            best = min(dtw(templates[t], query, args.band) for t in kept)
+            totals[mode] += best
+            if best < threshold:
+                hits[mode] += 1
+            distances.append("%s %d" % (mode, best))
+        print("%s: threshold %d, closest template: %s" % (names[q], threshold, ", ".join(distances)))
+    for mode in modes:
+        print("dtw recall (%s): %d/%d, mean closest distance %.1f" % (
+            mode, hits[mode], count, totals[mode] / float(count)))
+
+
+def load(path, gain):
+    with wave.open(path, "rb") as w:
+        if w.getnchannels() != 1 or w.getsampwidth() != 2:
+            raise ValueError("expected mono 16-bit PCM")
+        rate = w.getframerate()
+        samples = array.array("h")
+        samples.frombytes(w.readframes(w.getnframes()))
+    if sys.byteorder == "big":
+        samples.byteswap()
+    return [max(-32768, min(32767, int(s * gain))) for s in samples], rate
+
+
+def replay(path, args):
+    try:
+        samples, rate = load(path, args.gain)
+    except (ValueError, wave.Error) as e:
+        print("%s: skipped (%s)" % (path, e))
+        return None
+    if rate != args.sample_rate:
+        print("%s: skipped (sample rate %d)" % (path, rate))
+        return None
+    frame_len = args.sample_rate * args.frame_ms // 1000
+    volumes = list(frame_volumes(samples, frame_len))
+    return volumes, run_gate(volumes, args), samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("files", nargs="*", help="wake word takes")
+    parser.add_argument("--background", nargs="*", default=[], help="idle recordings without the wake word")
+    parser.add_argument("--ratio", type=float, default=2.0, help="VOICE_GATE_RATIO")
+    parser.add_argument("--min-level", type=int, default=150, help="VOICE_GATE_MIN_LEVEL")
+    parser.add_argument("--hangover-ms", type=int, default=600, help="VOICE_GATE_HANGOVER_MS")
+    parser.add_argument("--speech-level", type=int, default=400,
+                        help="frames above this level count as speech (ENDPOINT_SPEECH_LEVEL)")
+    parser.add_argument("--gain", type=float, default=1.0,
+                        help="gain to apply first (use SOFTWARE_GAIN for raw mic captures)")
+    parser.add_argument("--frame-ms", type=int, default=30, help="wake word frame length")
+    parser.add_argument("--sample-rate", type=int, default=16000)
+    parser.add_argument("--dtw", action="store_true",
+                        help="also compare template and live segmentation by DTW distance (slow)")
+    parser.add_argument("--vad-decision-ms", type=int, default=150, help="VAD_DECISION_TIME_MS")
+    parser.add_argument("--band", type=int, default=30, help="WAKEWORD_DTW_BAND_PERCENT")
+    parser.add_argument("--templates", type=int, default=3, help="WAKEWORD_TEMPLATES_PER_USER")
+    parser.add_argument("--margin", type=int, default=125, help="WAKEWORD_DTW_MARGIN_PERCENT")
+    parser.add_argument("--threshold", type=int, default=180,
+                        help="WAKEWORD_DTW_THRESHOLD (used when fewer than two templates remain)")
+    args = parser.parse_args()
+
+    hits = 0
+    takes = 0
+    segmented = []
+    for path in args.files:
+        result = replay(path, args)
+        if result is None:
+            continue
+        volumes, states, samples = result
+        if args.dtw:
+            segments = dict((mode, segment(samples, volumes, states, args, mode))
+                            for mode in ("registration", "gated", "no lead-in"))
+            if segments["registration"]:
+                segmented.append((path, segments))
+            else:
+                print("%s: no segment found, left out of the DTW comparison" % path)
+        speech = [i for i, v in enumerate(volumes) if v > args.speech_level]
+        missed = [i for i in speech if not states[i]]
+        takes += 1
+        if speech and not missed:
+            hits += 1
+        print("%s: open %d%% of frames, speech frames %d, outside the gate %d%s" % (
+            path, 100 * sum(states) // max(1, len(states)), len(speech), len(missed),
+            "" if speech else " (no speech found, check --speech-level)"))
+    if takes:
+        print("recall: %d/%d takes fully inside the gate" % (hits, takes))
+    if args.dtw and len(segmented) >= 2:
+        evaluate_dtw(segmented, args)
+
+    open_frames = 0
+    total_frames = 0
+    for path in args.background:
+        result = replay(path, args)
+        if result is None:
+            continue
+        states = result[1]
+        open_frames += sum(states)
+        total_frames += len(states)
+        print("%s: open %d%% of frames" % (path, 100 * sum(states) // max(1, len(states))))
+    if total_frames:
+        print("idle: later stages run on %.1f%% of %d background frames" % (
+            100.0 * open_frames / total_frames, total_frames))
+
+
+if __name__ == "__main__":
+    main()
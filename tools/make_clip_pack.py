@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Build the clip pack the device plays without asking the server.
+
+The pack holds short earcons and fillers, each stored at its own sample rate
+as PCM16 or IMA-ADPCM, and is loaded into PSRAM at boot (CLIP_PACK_PATH).
+The firmware looks clips up by name:
+
+  wake    played when the wake word is detected, before recording starts
+  filler  played when the response takes longer than CLIP_FILLER_DELAY_MS
+  error   played when the request fails
+
+Clips come from mono 16-bit WAV files (resampled to --rate) or, for quick
+tests, from generated tones. Copy the result into the data/ directory and
+upload it with the SPIFFS image:
+
+  python3 tools/make_clip_pack.py -o data/clips.pak \\
+      filler=just_a_moment.wav error=sorry.wav --tone wake=1320:120 --adpcm
+  pio run -t uploadfs
+
+Pack layout (little endian):
+  "TBCP", version u16 = 1, count u16
+  count x { name[16] (NUL padded), offset u32, length u32, sampleRate u32, codec u8, reserved[3] }
+  clip data, each clip starting on a 4-byte boundary (offsets are from the start of the file)
+
+Usage:
+  python3 tools/make_clip_pack.py -o clips.pak [name=file.wav ...] [--tone name=freq:ms ...]
+                                  [--rate 16000] [--adpcm]
+"""
+
+import argparse
+import array
+import math
+import struct
+import sys
+import wave
+
+from standin_server import CODEC_IMA_ADPCM, CODEC_PCM16, adpcm_encode, resample_linear
+
+PACK_MAGIC = b"TBCP"
+PACK_VERSION = 1
+PACK_HEADER = struct.Struct("<4sHH")
+PACK_ENTRY = struct.Struct("<16sIIIB3x")
+NAME_LENGTH = 16
+MAX_CLIPS = 16  # must match ClipCache::MAX_PACK_CLIPS
+
+
+def read_wav(path, rate):
+    with wave.open(path, "rb") as w:
+        if w.getnchannels() != 1 or w.getsampwidth() != 2:
+            raise ValueError("%s: expected mono 16-bit PCM" % path)
+        pcm = w.readframes(w.getnframes())
+        return resample_linear(pcm, w.getframerate(), rate)
+
+
+def tone(freq, ms, rate):
+    """Sine tone with 5 ms fades so it does not click."""
+    count = rate * ms // 1000
+    fade = max(1, rate * 5 // 1000)
+    out = array.array("h", bytes(count * 2))
+    for i in range(count):
+        gain = min(1.0, i / fade, (count - 1 - i) / fade)
+        out[i] = int(12000 * gain * math.sin(2 * math.pi * freq * i / rate))
+    return out.tobytes()
+
+
+def split_spec(spec):
+    name, sep, value = spec.partition("=")
+    if not sep or not name or not value:
+        raise ValueError("expected name=value, got %r" % spec)
+    if len(name.encode()) > NAME_LENGTH:
+        raise ValueError("clip name %r is longer than %d bytes" % (name, NAME_LENGTH))
+    return name, value
+
+
+def build_pack(clips, rate, adpcm):
+    """clips: list of (name, pcm16 bytes) -> pack bytes."""
+    codec = CODEC_IMA_ADPCM if adpcm else CODEC_PCM16
+    table = bytearray()
+    data = bytearray()
+    data_start = PACK_HEADER.size + PACK_ENTRY.size * len(clips)
+    for name, pcm in clips:
+        body = adpcm_encode(pcm) if adpcm else pcm
+        while (data_start + len(data)) % 4:
+            data.append(0)
+        table += PACK_ENTRY.pack(name.encode(), data_start + len(data), len(body), rate, codec)
+        data += body
+    return PACK_HEADER.pack(PACK_MAGIC, PACK_VERSION, len(clips)) + table + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("clips", nargs="*", metavar="name=file.wav", help="clip from a mono 16-bit WAV file")
+    parser.add_argument("--tone", action="append", default=[], metavar="name=freq:ms",
+                        help="clip generated as a sine tone, e.g. wake=1320:120")
+    parser.add_argument("--rate", type=int, default=16000,
+                        help="sample rate the clips are stored at (the device resamples them)")
+    parser.add_argument("--adpcm", action="store_true", help="store the clips as IMA-ADPCM (a quarter of the size)")
+    parser.add_argument("-o", "--output", required=True)
+    args = parser.parse_args()
+
+    clips = []
+    try:
+        for spec in args.clips:
+            name, path = split_spec(spec)
+            clips.append((name, read_wav(path, args.rate)))
+        for spec in args.tone:
+            name, value = split_spec(spec)
+            freq, _, ms = value.partition(":")
+            clips.append((name, tone(float(freq), int(ms or 150), args.rate)))
+    except (ValueError, OSError, wave.Error) as e:
+        sys.exit("error: %s" % e)
+    if not clips:
+        parser.error("no clips given")
+    if len(clips) > MAX_CLIPS:
+        parser.error("at most %d clips fit in a pack" % MAX_CLIPS)
+
+    pack = build_pack(clips, args.rate, args.adpcm)
+    with open(args.output, "wb") as f:
+        f.write(pack)
+    for name, pcm in clips:
+        print("%-16s %6.2f s" % (name, len(pcm) / 2 / args.rate))
+    print("Wrote %s: %d clips, %d bytes" % (args.output, len(clips), len(pack)))
+
+
+if __name__ == "__main__":
+    main()
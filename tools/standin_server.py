@@ -0,0 +1,396 @@
+#!/usr/bin/env python3
+"""Local stand-in for the STS server, for testing the device over loopback/LAN.
+
+Accepts the same endpoints as the real backend and answers every turn with a
+chunked 24 kHz 16-bit PCM "parrot" of the uploaded audio, so the upload and
+playback paths can be exercised without the real speech pipeline.
+
+Upload formats understood:
+  * application/json          {"audio": "<base64 PCM16>"}
+  * application/octet-stream  TBAF frames (X-Audio-Framing: tbaf-v1), PCM16 or IMA-ADPCM
+Both may arrive with Content-Length or Transfer-Encoding: chunked.
+
+If the request carries "X-Accept-Audio-Codec: ima-adpcm" the response is sent
+as IMA-ADPCM blocks of 256 bytes and tagged "X-Audio-Codec: ima-adpcm".
+If it carries "X-Accept-Audio-Format: wav" the audio is prefixed with a WAV
+header and sent at --response-rate (default 24000 Hz); the device resamples
+it to its fixed playback rate.
+
+With --canned every turn is answered with the same WAV phrase instead of the
+parrot. If the request carries "X-Accept-Audio-Cache: 1" the response is tagged
+with "X-Audio-Cache-Key" (the first 8 bytes of the SHA-256 of the body, in
+hex); once the device lists that key in "X-Audio-Cache-Keys", the server
+answers with "X-Audio-Cache-Hit: <key>" and an empty body, and the device
+plays its flash copy.
+
+With --tls-cert/--tls-key the server speaks HTTPS. It prints the certificate's
+SHA-256 fingerprint for SERVER_CERT_FINGERPRINT and logs, per connection,
+whether the TLS session was resumed or needed a full handshake. A self-signed
+certificate is enough:
+  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+    -days 3650 -subj "/CN=tenori-standin" -keyout key.pem -out cert.pem
+
+Usage:
+  python3 tools/standin_server.py [--port 5050] [--reject-binary] [--keepalive-timeout 5]
+                                  [--content-length] [--break-response truncate|malformed]
+                                  [--tls-cert cert.pem --tls-key key.pem] [--response-rate 8000]
+                                  [--canned phrase.wav]
+"""
+
+import argparse
+import array
+import base64
+import hashlib
+import json
+import ssl
+import struct
+import time
+import wave
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+FRAME_HEADER = struct.Struct("<4sIIBBH")  # magic, payloadLength, sampleRate, channels, codec, sequence
+FRAME_MAGIC = b"TBAF"
+CODEC_PCM16 = 0
+CODEC_IMA_ADPCM = 1
+
+RESPONSE_SAMPLE_RATE = 24000
+RESPONSE_CHUNK_BYTES = 4096
+ADPCM_RESPONSE_BLOCK = 256  # bytes; must match AdpcmCodec::RESPONSE_BLOCK_SIZE
+
+STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767,
+]
+INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8] * 2
+
+
+def adpcm_decode_block(block):
+    """IMA-ADPCM block (4-byte header + nibbles, low nibble first) -> PCM16 bytes."""
+    predictor, index = struct.unpack_from("<hB", block)
+    out = array.array("h", [predictor])
+    for byte in block[4:]:
+        for code in (byte & 0x0F, byte >> 4):
+            step = STEP_TABLE[index]
+            delta = step >> 3
+            if code & 4:
+                delta += step
+            if code & 2:
+                delta += step >> 1
+            if code & 1:
+                delta += step >> 2
+            predictor = predictor - delta if code & 8 else predictor + delta
+            predictor = max(-32768, min(32767, predictor))
+            index = max(0, min(88, index + INDEX_TABLE[code]))
+            out.append(predictor)
+    return out.tobytes()
+
+
+def adpcm_encode(pcm, block_bytes=ADPCM_RESPONSE_BLOCK):
+    """PCM16 bytes -> concatenated IMA-ADPCM blocks of block_bytes (last may be shorter)."""
+    samples = array.array("h")
+    samples.frombytes(pcm[: len(pcm) // 2 * 2])
+    per_block = (block_bytes - 4) * 2 + 1
+    out = bytearray()
+    index = 0
+    for start in range(0, len(samples), per_block):
+        block = samples[start:start + per_block]
+        predictor = block[0]
+        out += struct.pack("<hBB", predictor, index, 0)
+        codes = []
+        for sample in block[1:]:
+            step = STEP_TABLE[index]
+            diff = sample - predictor
+            code = 0
+            if diff < 0:
+                code = 8
+                diff = -diff
+            delta = step >> 3
+            if diff >= step:
+                code |= 4
+                diff -= step
+                delta += step
+            step >>= 1
+            if diff >= step:
+                code |= 2
+                diff -= step
+                delta += step
+            step >>= 1
+            if diff >= step:
+                code |= 1
+                delta += step
+            predictor = predictor - delta if code & 8 else predictor + delta
+            predictor = max(-32768, min(32767, predictor))
+            index = max(0, min(88, index + INDEX_TABLE[code]))
+            codes.append(code)
+        if len(codes) % 2:
+            codes.append(0)
+        out += bytes(codes[i] | (codes[i + 1] << 4) for i in range(0, len(codes), 2))
+    return bytes(out)
+
+
+def read_chunked(rfile):
+    body = bytearray()
+    while True:
+        size_line = rfile.readline().strip()
+        size = int(size_line.split(b";")[0], 16)
+        if size == 0:
+            # trailers until blank line
+            while rfile.readline().strip():
+                pass
+            return bytes(body)
+        body += rfile.read(size)
+        rfile.readline()  # CRLF
+
+
+def decode_frames(body):
+    """Returns (pcm, sample_rate, frame_count). Raises ValueError on malformed input."""
+    pcm = bytearray()
+    pos = 0
+    expected_seq = 0
+    sample_rate = None
+    frames = 0
+    while True:
+        if pos + FRAME_HEADER.size > len(body):
+            raise ValueError("truncated frame header at %d" % pos)
+        magic, length, rate, channels, codec, seq = FRAME_HEADER.unpack_from(body, pos)
+        pos += FRAME_HEADER.size
+        if magic != FRAME_MAGIC:
+            raise ValueError("bad magic %r at %d" % (magic, pos))
+        if seq != expected_seq & 0xFFFF:
+            raise ValueError("sequence gap: got %d, expected %d" % (seq, expected_seq))
+        expected_seq += 1
+        frames += 1
+        if length == 0:
+            break
+        if channels != 1:
+            raise ValueError("only mono is supported, got %d channels" % channels)
+        payload = body[pos:pos + length]
+        if len(payload) != length:
+            raise ValueError("truncated payload in frame %d" % seq)
+        pos += length
+        if codec == CODEC_PCM16:
+            pcm += payload
+        elif codec == CODEC_IMA_ADPCM:
+            pcm += adpcm_decode_block(payload)
+        else:
+            raise ValueError("unsupported codec %d" % codec)
+        sample_rate = rate
+    return bytes(pcm), sample_rate or 16000, frames
+
+
+def resample_linear(pcm, src_rate, dst_rate):
+    src = array.array("h")
+    src.frombytes(pcm[: len(pcm) // 2 * 2])
+    if not src or src_rate == dst_rate:
+        return src.tobytes()
+    out_len = len(src) * dst_rate // src_rate
+    out = array.array("h", bytes(out_len * 2))
+    step = src_rate / dst_rate
+    last = len(src) - 1
+    for i in range(out_len):
+        x = i * step
+        j = int(x)
+        frac = x - j
+        a = src[j]
+        b = src[j + 1] if j < last else a
+        out[i] = int(a + (b - a) * frac)
+    return out.tobytes()
+
+
+def wav_header(rate, data_bytes, adpcm):
+    """RIFF/WAVE header for mono PCM16, or IMA-ADPCM blocks of ADPCM_RESPONSE_BLOCK bytes."""
+    if adpcm:
+        samples_per_block = (ADPCM_RESPONSE_BLOCK - 4) * 2 + 1
+        fmt = struct.pack("<HHIIHHHH", 0x0011, 1, rate, rate * ADPCM_RESPONSE_BLOCK // samples_per_block,
+                          ADPCM_RESPONSE_BLOCK, 4, 2, samples_per_block)
+    else:
+        fmt = struct.pack("<HHIIHH", 0x0001, 1, rate, rate * 2, 2, 16)
+    return (struct.pack("<4sI4s", b"RIFF", 4 + 8 + len(fmt) + 8 + data_bytes, b"WAVE")
+            + struct.pack("<4sI", b"fmt ", len(fmt)) + fmt
+            + struct.pack("<4sI", b"data", data_bytes))
+
+
+def read_canned(path):
+    with wave.open(path, "rb") as w:
+        if w.getnchannels() != 1 or w.getsampwidth() != 2:
+            raise ValueError("%s: expected mono 16-bit PCM" % path)
+        return w.readframes(w.getnframes()), w.getframerate()
+
+
+def certificate_fingerprint(cert_file):
+    with open(cert_file) as f:
+        der = ssl.PEM_cert_to_DER_cert(f.read())
+    return ":".join("%02X" % b for b in hashlib.sha256(der).digest())
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "TenoriStandIn/1.0"
+
+    def handle(self):
+        if isinstance(self.connection, ssl.SSLSocket):
+            # Handshake here rather than in accept() so a stalled client only blocks its own thread.
+            try:
+                self.connection.do_handshake()
+            except (ssl.SSLError, OSError) as e:
+                print("TLS handshake with %s failed: %s" % (self.client_address[0], e))
+                return
+            print("TLS connection from %s: %s (%s, %s)" % (
+                self.client_address[0],
+                "session resumed" if self.connection.session_reused else "full handshake",
+                self.connection.version(), self.connection.cipher()[0]))
+        super().handle()
+
+    def read_body(self):
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            return read_chunked(self.rfile)
+        length = int(self.headers.get("Content-Length", "0"))
+        return self.rfile.read(length)
+
+    def send_plain(self, code, text):
+        data = text.encode()
+        self.send_response(code)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_POST(self):
+        started = time.monotonic()
+        body = self.read_body()
+        endpoint = self.path.strip("/")
+
+        if endpoint == "initConversation":
+            self.send_plain(200, "ok")
+            return
+        if endpoint not in ("stsWhisper", "stsGoogle"):
+            self.send_plain(404, "unknown endpoint")
+            return
+
+        content_type = self.headers.get("Content-Type", "")
+        try:
+            if content_type.startswith("application/octet-stream"):
+                if self.server.reject_binary:
+                    self.send_plain(415, "binary upload disabled")
+                    return
+                pcm, rate, frames = decode_frames(body)
+                fmt = "binary(%d frames)" % frames
+            else:
+                pcm = base64.b64decode(json.loads(body)["audio"])
+                rate = 16000
+                fmt = "json"
+        except (ValueError, KeyError) as e:
+            self.send_plain(400, "malformed upload: %s" % e)
+            return
+
+        print("%s: %s, %d body bytes, %.2f s of audio, received in %.0f ms" % (
+            endpoint, fmt, len(body), len(pcm) / 2 / rate, (time.monotonic() - started) * 1000))
+
+        if self.server.canned:
+            pcm, rate = self.server.canned
+        wav = "wav" in self.headers.get("X-Accept-Audio-Format", "")
+        response_rate = self.server.response_rate if wav else RESPONSE_SAMPLE_RATE
+        response = resample_linear(pcm, rate, response_rate)
+        adpcm = "ima-adpcm" in self.headers.get("X-Accept-Audio-Codec", "")
+        if adpcm:
+            response = adpcm_encode(response)
+        if wav:
+            response = wav_header(response_rate, len(response), adpcm) + response
+        cache_key = None
+        if self.server.canned and self.headers.get("X-Accept-Audio-Cache") == "1":
+            cache_key = hashlib.sha256(response).hexdigest()[:16]
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        if adpcm:
+            self.send_header("X-Audio-Codec", "ima-adpcm")
+        if cache_key:
+            if cache_key in self.headers.get("X-Audio-Cache-Keys", "").lower().split(","):
+                print("Device has %s cached, sending no audio" % cache_key)
+                self.send_header("X-Audio-Cache-Hit", cache_key)
+                response = b""
+            else:
+                self.send_header("X-Audio-Cache-Key", cache_key)
+        broken = self.server.break_response
+        if self.server.content_length:
+            self.send_header("Content-Length", str(len(response)))
+            self.end_headers()
+            if broken == "truncate":
+                self.wfile.write(response[:len(response) // 2])
+                self.close_connection = True
+                return
+            self.wfile.write(response)
+            return
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+        for pos in range(0, len(response), RESPONSE_CHUNK_BYTES):
+            chunk = response[pos:pos + RESPONSE_CHUNK_BYTES]
+            if broken and pos >= len(response) // 2:
+                if broken == "malformed":
+                    self.wfile.write(b"zz\r\n")
+                self.close_connection = True
+                return
+            self.wfile.write(b"%x\r\n%s\r\n" % (len(chunk), chunk))
+            if self.server.chunk_delay:
+                time.sleep(self.server.chunk_delay)
+        self.wfile.write(b"0\r\n\r\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5050)
+    parser.add_argument("--reject-binary", action="store_true",
+                        help="answer binary uploads with 415 to exercise the JSON fallback")
+    parser.add_argument("--chunk-delay", type=float, default=0.0,
+                        help="seconds to wait between response chunks (simulates streaming synthesis)")
+    parser.add_argument("--keepalive-timeout", type=float, default=0.0,
+                        help="close connections idle for this many seconds (exercises the device's reconnect)")
+    parser.add_argument("--content-length", action="store_true",
+                        help="send the response with Content-Length instead of chunked encoding")
+    parser.add_argument("--break-response", choices=("truncate", "malformed"),
+                        help="cut the response off halfway, or with a malformed chunk header "
+                             "(exercises the device's error reporting)")
+    parser.add_argument("--response-rate", type=int, default=RESPONSE_SAMPLE_RATE,
+                        help="sample rate of WAV responses, for devices that accept them (e.g. 8000 or 16000)")
+    parser.add_argument("--canned", metavar="WAV",
+                        help="answer every turn with this mono 16-bit WAV and let the device cache it")
+    parser.add_argument("--tls-cert", help="PEM certificate; serve HTTPS instead of HTTP")
+    parser.add_argument("--tls-key", help="PEM private key for --tls-cert")
+    args = parser.parse_args()
+    if bool(args.tls_cert) != bool(args.tls_key):
+        parser.error("--tls-cert and --tls-key must be given together")
+
+    if args.keepalive_timeout > 0:
+        Handler.timeout = args.keepalive_timeout
+
+    server = ThreadingHTTPServer((args.host, args.port), Handler)
+    server.reject_binary = args.reject_binary
+    server.chunk_delay = args.chunk_delay
+    server.content_length = args.content_length
+    server.break_response = args.break_response
+    server.response_rate = args.response_rate
+    server.canned = None
+    if args.canned:
+        try:
+            server.canned = read_canned(args.canned)
+        except (ValueError, OSError, wave.Error) as e:
+            parser.error(str(e))
+    scheme = "http"
+    if args.tls_cert:
+        # Session IDs and tickets are on by default, so the device can resume across connections.
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.tls_cert, args.tls_key)
+        server.socket = context.wrap_socket(server.socket, server_side=True, do_handshake_on_connect=False)
+        scheme = "https"
+        print("SERVER_CERT_FINGERPRINT \"%s\"" % certificate_fingerprint(args.tls_cert))
+    print("Stand-in STS server listening on %s://%s:%d" % (scheme, args.host, args.port))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
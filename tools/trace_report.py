@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Aggregate per-turn latency traces from a serial log.
+
+With DEBUG_TURN_TRACE the device prints one line per conversation turn:
+
+  TURN {"turn":3,"trigger":"wake","complete":true,"phases":{"wake":0,...},...}
+
+Phase times are microseconds since the start of the turn (wake word detection,
+or the A button for touch turns). This script reports, across a session:
+
+  phases -> for each phase, time since the previous phase of the same turn
+            (in the order they happen) and since the start of the turn
+  spans  -> the user-visible latencies (end of speech -> first response byte,
+            end of speech -> first audio, ...)
+  screens -> time spent drawing each screen
+  playback -> per-turn playback health: underruns (network starvation),
+              dma_underruns (the I2S writer fell behind), the longest i2s_write
+              and the lowest DMA fill seen while playing, plus how many
+              lip-sync frames were drawn and the longest one
+
+Only complete turns (playback finished) are counted unless --all is given.
+--note selects turns by one of their notes, e.g. to compare turns that reused
+the kept-alive connection with those that had to connect first:
+
+  python3 tools/trace_report.py session.log --note conn_reused=1
+  python3 tools/trace_report.py session.log --note conn_reused=0
+
+Usage:
+  python3 tools/trace_report.py session.log [more.log ...]
+  pio device monitor | tee session.log   # to capture a session
+"""
+
+import argparse
+import json
+import sys
+
+PHASES = [
+    "wake",
+    "record_start",
+    "record_stop",
+    "upload_start",
+    "headers_sent",
+    "body_sent",
+    "response_headers",
+    "first_byte",
+    "last_byte",
+    "playback_start",
+    "first_audio",
+    "playback_end",
+]
+
+SPANS = [
+    ("wake -> record start", "wake", "record_start"),
+    ("recording", "record_start", "record_stop"),
+    ("end of speech -> body sent", "record_stop", "body_sent"),
+    ("end of speech -> first byte", "record_stop", "first_byte"),
+    ("end of speech -> first audio", "record_stop", "first_audio"),
+    ("first byte -> last byte", "first_byte", "last_byte"),
+    ("playback", "playback_start", "playback_end"),
+]
+
+
+# (note, unit) reported in the playback table
+PLAYBACK_NOTES = [
+    ("underruns", "count"),
+    ("dma_underruns", "count"),
+    ("max_write_us", "ms"),
+    ("min_dma_fill", "samples"),
+    ("mouth_frames", "count"),
+    ("mouth_max_draw_us", "ms"),
+]
+
+
+def percentile(values, p):
+    """Nearest-rank percentile."""
+    ordered = sorted(values)
+    rank = max(1, -(-len(ordered) * p // 100))  # ceil
+    return ordered[rank - 1]
+
+
+def read_turns(paths):
+    for path in paths:
+        stream = sys.stdin if path == "-" else open(path, errors="replace")
+        with stream:
+            for line in stream:
+                start = line.find("TURN {")
+                if start < 0:
+                    continue
+                try:
+                    yield json.loads(line[start + len("TURN "):])
+                except ValueError:
+                    print("skipped malformed line: %s" % line.strip(), file=sys.stderr)
+
+
+def print_table(title, rows):
+    print(title)
+    print("  %-32s %5s %9s %9s %9s" % ("", "n", "p50 ms", "p95 ms", "max ms"))
+    for name, values in rows:
+        if not values:
+            continue
+        print("  %-32s %5d %9.1f %9.1f %9.1f" % (
+            name, len(values), percentile(values, 50) / 1000.0,
+            percentile(values, 95) / 1000.0, max(values) / 1000.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("logs", nargs="*", default=["-"], help="serial logs (default: stdin)")
+    parser.add_argument("--all", action="store_true", help="include turns that did not finish playback")
+    parser.add_argument("--trigger", help="only turns with this trigger (wake / touch)")
+    parser.add_argument("--note", action="append", default=[], metavar="KEY=VALUE",
+                        help="only turns whose note KEY equals VALUE (repeatable)")
+    args = parser.parse_args()
+
+    notes = {}
+    for item in args.note:
+        key, _, value = item.partition("=")
+        notes[key] = int(value)
+
+    turns = [t for t in read_turns(args.logs)
+             if (args.all or t.get("complete")) and (not args.trigger or t.get("trigger") == args.trigger)
+             and all(t.get("notes", {}).get(k) == v for k, v in notes.items())]
+    if not turns:
+        print("no turns found")
+        return
+    print("%d turns" % len(turns))
+
+    steps = {name: [] for name in PHASES}
+    offsets = {name: [] for name in PHASES}
+    spans = {name: [] for name, _, _ in SPANS}
+    screens = {}
+    for turn in turns:
+        phases = turn.get("phases", {})
+        previous = None
+        for name in sorted((n for n in phases if n in steps), key=lambda n: phases[n]):
+            offsets[name].append(phases[name])
+            if previous is not None:
+                steps[name].append(phases[name] - phases[previous])
+            previous = name
+        for name, begin, end in SPANS:
+            if begin in phases and end in phases:
+                spans[name].append(phases[end] - phases[begin])
+        for screen in turn.get("screens", []):
+            screens.setdefault(screen["name"], []).append(screen["draw"])
+
+    print_table("phases (since previous phase)", [(n, steps[n]) for n in PHASES])
+    print_table("phases (since start of turn)", [(n, offsets[n]) for n in PHASES])
+    print_table("spans", [(n, spans[n]) for n, _, _ in SPANS])
+    print_table("screen draw time", sorted(screens.items()))
+
+    print("playback")
+    print("  %-32s %5s %9s %9s %9s" % ("", "n", "p50", "p95", "max"))
+    for name, unit in PLAYBACK_NOTES:
+        values = [t["notes"][name] for t in turns if name in t.get("notes", {})]
+        if not values:
+            continue
+        scale = 1000.0 if unit == "ms" else 1.0
+        print("  %-32s %5d %9.1f %9.1f %9.1f" % (
+            "%s (%s)" % (name, unit), len(values), percentile(values, 50) / scale,
+            percentile(values, 95) / scale, max(values) / scale))
+
+
+if __name__ == "__main__":
+    main()